@@ -83,7 +83,6 @@ STUB(int, chroot, (const char *path), -1);
 STUB(int, getrusage, (int who, struct rusage *r_usage), -1);
 STUB(pid_t, setsid, (void), -1);
 STUB(int, ftruncate, (int fildes, off_t length), -1);
-STUB(int, setsockopt, (int socket, int level, int option_name, const void *option_value, socklen_t option_len), -1);
 STUB(int, issetugid, (void), -1);
 STUB(long, sysconf, (int name), -1);
 STUB(int, getrlimit, (int resource, struct rlimit *rlim), -1);
@@ -133,8 +132,6 @@ STUB(int, setlogmask, (int maskpri), -1);
 STUB(void, syslog, (int prio, const char* fmt, ...));
 STUB(int, initgroups, (const char *user, gid_t group), -1);
 STUB(void, sync, (void));
-STUB(int, getsockopt, (int sockfd, int level, int optname, void* optval, socklen_t* optlen), -1);
-STUB(ssize_t, recvmsg, (int sockfd, struct msghdr *msg, int flags), -1);
 STUB(dev_t, makedev, (unsigned int maj, unsigned int min), NULL);
 STUB(int, daemon, (int nochdir, int noclose), -1);
 STUB(int, seteuid, (uid_t euid), -1);
@@ -3,4 +3,10 @@
 #include <sys/_default_fcntl.h>
 
 #define	F_GETPATH	15
+
+#define FALLOC_FL_KEEP_SIZE		0x01
+#define FALLOC_FL_PUNCH_HOLE	0x02
+
+int fallocate(int fd, int mode, off_t offset, off_t len);
+int posix_fallocate(int fd, off_t offset, off_t len);
 #endif
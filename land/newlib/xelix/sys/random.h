@@ -0,0 +1,20 @@
+#ifndef _SYS_RANDOM_H
+#define _SYS_RANDOM_H
+
+#include <sys/types.h>
+
+#define GRND_NONBLOCK	0x01
+#define GRND_RANDOM		0x02
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+ssize_t getrandom(void* buf, size_t buflen, unsigned int flags);
+int getentropy(void* buf, size_t buflen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -69,13 +69,17 @@
 #define MSG_PEEK 32
 #define MSG_TRUNC 64
 #define MSG_WAITALL 128
+#define MSG_DONTWAIT 256
+
+// recvmmsg always returns once at least one message was received
+#define MSG_WAITFORONE 512
 
 #define SHUT_RD 1
 #define SHUT_RDWR 2
 #define SHUT_WR 3
 
 #define SOMAXCONN 128
-#define SCM_RIGHTS -1
+#define SCM_RIGHTS 1
 
 #ifdef __cplusplus
 extern "C" {
@@ -119,6 +123,25 @@ struct cmsghdr {
 	int cmsg_type;
 };
 
+#define CMSG_ALIGN(len) (((len) + sizeof(socklen_t) - 1) & ~(sizeof(socklen_t) - 1))
+#define CMSG_DATA(cmsg) ((unsigned char*)(cmsg) + CMSG_ALIGN(sizeof(struct cmsghdr)))
+#define CMSG_LEN(len) (CMSG_ALIGN(sizeof(struct cmsghdr)) + (len))
+#define CMSG_SPACE(len) (CMSG_ALIGN(sizeof(struct cmsghdr)) + CMSG_ALIGN(len))
+#define CMSG_FIRSTHDR(msg) ((msg)->msg_controllen >= sizeof(struct cmsghdr) \
+	? (struct cmsghdr*)(msg)->msg_control : (struct cmsghdr*)NULL)
+#define CMSG_NXTHDR(msg, cmsg) \
+	(((unsigned char*)(cmsg) + CMSG_ALIGN((cmsg)->cmsg_len) + sizeof(struct cmsghdr) \
+		> (unsigned char*)(msg)->msg_control + (msg)->msg_controllen) \
+	? (struct cmsghdr*)NULL \
+	: (struct cmsghdr*)((unsigned char*)(cmsg) + CMSG_ALIGN((cmsg)->cmsg_len)))
+
+struct mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+};
+
+struct timespec;
+
 struct linger {
 	int l_onoff;
 	int l_linger;
@@ -134,8 +157,10 @@ int listen(int, int);
 ssize_t recv(int, void*, size_t, int);
 ssize_t recvfrom(int, void*, size_t, int, struct sockaddr*, socklen_t*);
 ssize_t recvmsg(int, struct msghdr*, int);
+int recvmmsg(int, struct mmsghdr*, unsigned int, int, struct timespec*);
 ssize_t send(int, const void*, size_t, int);
 ssize_t sendmsg(int, const struct msghdr*, int);
+int sendmmsg(int, struct mmsghdr*, unsigned int, int);
 ssize_t sendto(int, const void*, size_t, int, const struct sockaddr*, socklen_t);
 int setsockopt(int, int, int, const void*, socklen_t);
 int shutdown(int, int);
@@ -29,6 +29,7 @@
 #include <sys/errno.h>
 #include <sys/xelix.h>
 #include <sys/utsname.h>
+#include <sys/random.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -114,6 +115,46 @@ void* mmap(void *addr, size_t len, int prot, int flags,
 	return (void*)syscall(8, &ctx, 0, 0);
 }
 
+int fallocate(int fd, int mode, off_t offset, off_t len) {
+	struct {
+		int fd;
+		int mode;
+		uint64_t offset;
+		uint64_t len;
+	} args = {fd, mode, offset, len};
+
+	return syscall(54, &args, 0, 0);
+}
+
+int posix_fallocate(int fd, off_t offset, off_t len) {
+	if(offset < 0 || len <= 0) {
+		return EINVAL;
+	}
+
+	// Returns the error number instead of setting errno
+	if(fallocate(fd, 0, offset, len) < 0) {
+		return *__errno();
+	}
+	return 0;
+}
+
+ssize_t getrandom(void* buf, size_t buflen, unsigned int flags) {
+	if(!buflen) {
+		return 0;
+	}
+
+	// Same limit as on Linux, larger requests return less
+	return syscall(55, buf, buflen > 0x1ffffff ? 0x1ffffff : buflen, flags);
+}
+
+int getentropy(void* buf, size_t buflen) {
+	if(buflen > 256) {
+		errno = EIO;
+		return -1;
+	}
+	return getrandom(buf, buflen, 0) < 0 ? -1 : 0;
+}
+
 int munmap(void *addr, size_t len) {
 	return 0;
 }
@@ -160,6 +201,14 @@ int bind(int socket, const struct sockaddr *address, socklen_t address_len) {
 	return syscall(25, socket, address, address_len);
 }
 
+int socketpair(int domain, int type, int protocol, int socket_vector[2]) {
+	if(protocol) {
+		errno = EPROTONOSUPPORT;
+		return -1;
+	}
+	return syscall(58, domain, type, socket_vector);
+}
+
 struct _recvfrom_data {
 	int sockfd;
 	void* dest;
@@ -169,9 +218,30 @@ struct _recvfrom_data {
 	socklen_t *addrlen;
 };
 
+ssize_t recvmsg(int socket, struct msghdr *message, int flags) {
+	return syscall(60, socket, message, flags);
+}
+
 ssize_t recvfrom(int socket, void *buffer, size_t length, int flags,
 	struct sockaddr *address, socklen_t *address_len) {
 
+	// The recvfrom syscall doesn't return addresses
+	if(address && address_len) {
+		struct iovec iov = { .iov_base = buffer, .iov_len = length };
+		struct msghdr msg = {
+			.msg_name = address,
+			.msg_namelen = *address_len,
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+		};
+
+		ssize_t r = recvmsg(socket, &msg, flags);
+		if(r >= 0) {
+			*address_len = msg.msg_namelen;
+		}
+		return r;
+	}
+
 	struct _recvfrom_data data = {
 		.sockfd = socket,
 		.dest = buffer,
@@ -187,8 +257,23 @@ ssize_t recv(int socket, void *buffer, size_t length, int flags) {
 	return recvfrom(socket, buffer, length, flags, NULL, NULL);
 }
 
+ssize_t sendmsg(int socket, const struct msghdr *message, int flags) {
+	return syscall(59, socket, message, flags);
+}
+
 ssize_t sendto(int socket, const void *message, size_t length, int flags,
 	const struct sockaddr *dest_addr, socklen_t dest_len) {
+
+	if(dest_addr) {
+		struct iovec iov = { .iov_base = (void*)message, .iov_len = length };
+		struct msghdr msg = {
+			.msg_name = (void*)dest_addr,
+			.msg_namelen = dest_len,
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+		};
+		return sendmsg(socket, &msg, flags);
+	}
 	return syscall(3, socket, message, length);
 }
 
@@ -196,6 +281,86 @@ ssize_t send(int socket, const void *buffer, size_t length, int flags) {
 	return syscall(3, socket, buffer, length);
 }
 
+struct _mmsg_data {
+	int sockfd;
+	struct mmsghdr* msgvec;
+	unsigned int vlen;
+	int flags;
+};
+
+int sendmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags) {
+	struct _mmsg_data data = {
+		.sockfd = socket,
+		.msgvec = msgvec,
+		.vlen = vlen,
+		.flags = flags,
+	};
+	return syscall(61, &data, sizeof(struct _mmsg_data), 0);
+}
+
+/* The kernel returns as soon as at least one message was received, so the
+ * timeout is not needed for that and is ignored.
+ */
+int recvmmsg(int socket, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+	struct timespec *timeout) {
+
+	struct _mmsg_data data = {
+		.sockfd = socket,
+		.msgvec = msgvec,
+		.vlen = vlen,
+		.flags = flags,
+	};
+	return syscall(62, &data, sizeof(struct _mmsg_data), 0);
+}
+
+struct _sockopt_data {
+	int sockfd;
+	int level;
+	int optname;
+	int value;
+};
+
+// The kernel only supports integer options
+int setsockopt(int socket, int level, int option_name, const void *option_value,
+	socklen_t option_len) {
+
+	if(!option_value || option_len < sizeof(int)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct _sockopt_data data = {
+		.sockfd = socket,
+		.level = level,
+		.optname = option_name,
+		.value = *(const int*)option_value,
+	};
+	return syscall(56, &data, sizeof(struct _sockopt_data), 0);
+}
+
+int getsockopt(int socket, int level, int option_name, void* option_value,
+	socklen_t* option_len) {
+
+	if(!option_value || !option_len || *option_len < sizeof(int)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct _sockopt_data data = {
+		.sockfd = socket,
+		.level = level,
+		.optname = option_name,
+	};
+
+	if(syscall(57, &data, sizeof(struct _sockopt_data), 0) < 0) {
+		return -1;
+	}
+
+	*(int*)option_value = data.value;
+	*option_len = sizeof(int);
+	return 0;
+}
+
 int _execve(char *name, char **argv, char **env) {
 	return syscall(32, name, argv, env);
 }
@@ -0,0 +1,199 @@
+/* Copyright © 2020 Lukas Martini
+ *
+ * This file is part of Xelix.
+ *
+ * Xelix is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Xelix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Xelix. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include "util.h"
+#include "argparse.h"
+
+// Not in newlib, see src/fs/vfs.h in the kernel
+#ifndef O_DIRECT
+#define O_DIRECT 0x80000
+#endif
+
+static const char *const usage[] = {
+    "blkbench [options] <device>",
+    NULL,
+};
+
+struct result {
+	uint32_t ios;
+	uint32_t errors;
+	uint64_t lat_total;
+	uint32_t lat_min;
+	uint32_t lat_max;
+};
+
+static int block_size = 4096;
+static int count = 1000;
+static int size_mib = 64;
+static int random_io = 0;
+static int write_io = 0;
+static int direct = 0;
+static int jobs = 1;
+
+static inline uint64_t now_us(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void run_job(const char* path, int job, struct result* res) {
+	memset(res, 0, sizeof(struct result));
+	res->lat_min = UINT32_MAX;
+
+	int fd = open(path, (write_io ? O_WRONLY : O_RDONLY) | (direct ? O_DIRECT : 0));
+	if(fd < 0) {
+		perror("Could not open device");
+		exit(EXIT_FAILURE);
+	}
+
+	// O_DIRECT needs buffers aligned to the block size of the device
+	void* buf = memalign(4096, block_size);
+	if(!buf) {
+		perror("Could not allocate buffer");
+		exit(EXIT_FAILURE);
+	}
+	memset(buf, 0xa5, block_size);
+
+	uint32_t blocks = (uint64_t)size_mib * 1024 * 1024 / block_size;
+	unsigned int seed = getpid();
+
+	// Sequential jobs each get their own slice of the region
+	uint32_t start = (uint64_t)blocks * job / jobs;
+
+	for(int i = 0; i < count; i++) {
+		uint32_t block = random_io ? rand_r(&seed) % blocks : (start + i) % blocks;
+		if(lseek(fd, (off_t)block * block_size, SEEK_SET) < 0) {
+			res->errors++;
+			continue;
+		}
+
+		uint64_t begin = now_us();
+		ssize_t done = write_io ? write(fd, buf, block_size) : read(fd, buf, block_size);
+		uint32_t lat = now_us() - begin;
+
+		if(done != block_size) {
+			res->errors++;
+			continue;
+		}
+
+		res->ios++;
+		res->lat_total += lat;
+		res->lat_min = lat < res->lat_min ? lat : res->lat_min;
+		res->lat_max = lat > res->lat_max ? lat : res->lat_max;
+	}
+
+	free(buf);
+	close(fd);
+}
+
+int main(int argc, const char** argv) {
+	struct argparse_option options[] = {
+		OPT_HELP(),
+		OPT_INTEGER('b', "bs", &block_size, "block size in bytes (default 4096)"),
+		OPT_INTEGER('n', "count", &count, "number of I/Os per job (default 1000)"),
+		OPT_INTEGER('s', "size", &size_mib, "size of the region to use in MiB (default 64)"),
+		OPT_INTEGER('j', "jobs", &jobs, "number of parallel jobs (default 1)"),
+		OPT_BOOLEAN('r', "random", &random_io, "use random instead of sequential offsets"),
+		OPT_BOOLEAN('w', "write", &write_io, "write instead of read, destroys data"),
+		OPT_BOOLEAN('d', "direct", &direct, "bypass the block cache using O_DIRECT"),
+        OPT_END(),
+	};
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usage, 0);
+    argparse_describe(&argparse, "\nMeasure block device performance.",
+    	"\nblkbench issues reads or writes of a fixed size to a block device "
+    	"and reports IOPS, throughput and latency, similar to fio. Every job "
+    	"runs in its own process, so multiple jobs keep multiple requests in "
+    	"flight.\nblkbench is part of xelix-utils. Please report bugs to "
+    	"<hello@lutoma.org>.");
+    argc = argparse_parse(&argparse, argc, argv);
+
+	if(argc != 1 || block_size < 512 || block_size % 512 || count < 1
+		|| size_mib < 1 || jobs < 1 || (uint64_t)size_mib * 1024 * 1024 < block_size) {
+		argparse_usage(&argparse);
+		exit(EXIT_FAILURE);
+	}
+
+	int fds[2];
+	if(pipe(fds) < 0) {
+		perror("Could not create pipe");
+		exit(EXIT_FAILURE);
+	}
+
+	uint64_t begin = now_us();
+	for(int i = 0; i < jobs; i++) {
+		pid_t pid = fork();
+		if(pid < 0) {
+			perror("Could not fork");
+			exit(EXIT_FAILURE);
+		}
+
+		if(!pid) {
+			struct result res;
+			close(fds[0]);
+			run_job(argv[0], i, &res);
+			write(fds[1], &res, sizeof(res));
+			exit(EXIT_SUCCESS);
+		}
+	}
+
+	close(fds[1]);
+	struct result total = { .lat_min = UINT32_MAX };
+	struct result res;
+	while(read(fds[0], &res, sizeof(res)) == sizeof(res)) {
+		total.ios += res.ios;
+		total.errors += res.errors;
+		total.lat_total += res.lat_total;
+		total.lat_min = res.lat_min < total.lat_min ? res.lat_min : total.lat_min;
+		total.lat_max = res.lat_max > total.lat_max ? res.lat_max : total.lat_max;
+	}
+
+	while(wait(NULL) > 0);
+	uint64_t elapsed = now_us() - begin;
+	if(!elapsed) {
+		elapsed = 1;
+	}
+
+	if(!total.ios) {
+		fprintf(stderr, "No I/O completed successfully.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	uint64_t bytes = (uint64_t)total.ios * block_size;
+	printf("%s: %s %s, bs=%d, jobs=%d%s\n", argv[0], random_io ? "random" : "sequential",
+		write_io ? "write" : "read", block_size, jobs, direct ? ", direct" : "");
+	printf("  io=%s, time=%llu ms, errors=%u\n", readable_fs(bytes),
+		elapsed / 1000, total.errors);
+	printf("  iops=%llu, bw=%s/s\n", (uint64_t)total.ios * 1000000 / elapsed,
+		readable_fs(bytes * 1000000 / elapsed));
+	printf("  lat (us): min=%u, avg=%llu, max=%u\n", total.lat_min,
+		total.lat_total / total.ios, total.lat_max);
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,246 @@
+/* Copyright © 2020 Lukas Martini
+ *
+ * This file is part of Xelix.
+ *
+ * Xelix is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Xelix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Xelix. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/time.h>
+#include "argparse.h"
+#include "util.h"
+
+// Keep in sync with VFS_BLOCK_LAT_BUCKETS in the kernel
+#define LAT_BUCKETS 24
+#define MAX_DEVS 32
+
+static const char *const usage[] = {
+    "iostat [options] [interval [count]]",
+    NULL,
+};
+
+struct stats {
+	char name[50];
+	uint32_t ios[2];
+	uint32_t merges[2];
+	uint64_t sectors[2];
+	uint64_t time_ms[2];
+	uint32_t inflight;
+	uint64_t busy_ms;
+	uint64_t queue_ms;
+	uint32_t latency[2][LAT_BUCKETS];
+};
+
+static int read_stats(const char* name, struct stats* st) {
+	char path[300];
+	snprintf(path, 300, "/sys/block/%s/stat", name);
+	FILE* fp = fopen(path, "r");
+	if(!fp) {
+		return -1;
+	}
+
+	memset(st, 0, sizeof(struct stats));
+	strncpy(st->name, name, 49);
+
+	int matched = fscanf(fp, "%u %u %llu %llu %u %u %llu %llu %u %llu %llu\n",
+		&st->ios[0], &st->merges[0], &st->sectors[0], &st->time_ms[0],
+		&st->ios[1], &st->merges[1], &st->sectors[1], &st->time_ms[1],
+		&st->inflight, &st->busy_ms, &st->queue_ms);
+
+	for(int dir = 0; matched == 11 && dir < 2; dir++) {
+		fscanf(fp, dir ? " write_latency_us:" : " read_latency_us:");
+		for(int i = 0; i < LAT_BUCKETS; i++) {
+			fscanf(fp, " %u", &st->latency[dir][i]);
+		}
+	}
+
+	fclose(fp);
+	return matched == 11 ? 0 : -1;
+}
+
+static int read_all(struct stats* devs) {
+	DIR* dir = opendir("/sys/block");
+	if(!dir) {
+		perror("Could not open /sys/block");
+		exit(EXIT_FAILURE);
+	}
+
+	int num = 0;
+	struct dirent* ent;
+	while((ent = readdir(dir)) && num < MAX_DEVS) {
+		if(ent->d_name[0] != '.' && !read_stats(ent->d_name, &devs[num])) {
+			num++;
+		}
+	}
+
+	closedir(dir);
+	return num;
+}
+
+static uint64_t now_ms(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+// Time since boot in ms, used for the first report
+static uint64_t uptime_ms(void) {
+	FILE* fp = fopen("/sys/tick", "r");
+	uint32_t uptime, ticks, rate;
+	if(!fp || fscanf(fp, "%u %u %u", &uptime, &ticks, &rate) != 3 || !rate) {
+		fprintf(stderr, "Could not read /sys/tick.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	fclose(fp);
+	return (uint64_t)ticks * 1000 / rate;
+}
+
+static void print_histogram(struct stats* cur, struct stats* prev) {
+	for(int dir = 0; dir < 2; dir++) {
+		uint32_t max = 0;
+		uint32_t counts[LAT_BUCKETS];
+		for(int i = 0; i < LAT_BUCKETS; i++) {
+			counts[i] = cur->latency[dir][i] - (prev ? prev->latency[dir][i] : 0);
+			max = counts[i] > max ? counts[i] : max;
+		}
+
+		if(!max) {
+			continue;
+		}
+
+		printf("  %s latency:\n", dir ? "write" : "read");
+		for(int i = 0; i < LAT_BUCKETS; i++) {
+			if(!counts[i]) {
+				continue;
+			}
+
+			// Bucket i counts requests below 2^(i+1) us
+			uint32_t limit = 1 << (i + 1);
+			char label[20];
+			if(limit < 1000) {
+				snprintf(label, 20, "%u us", limit);
+			} else if(limit < 1000000) {
+				snprintf(label, 20, "%u ms", limit / 1000);
+			} else {
+				snprintf(label, 20, "%u s", limit / 1000000);
+			}
+
+			char bar[41];
+			int len = (uint64_t)counts[i] * 40 / max;
+			memset(bar, '#', len);
+			bar[len] = 0;
+			printf("    < %-8s %10u |%s\n", label, counts[i], bar);
+		}
+	}
+}
+
+static void report(struct stats* cur, int num, struct stats* prev, int num_prev,
+	uint64_t elapsed_ms, int histogram) {
+
+	if(!elapsed_ms) {
+		elapsed_ms = 1;
+	}
+
+	printf("%-12s %9s %9s %10s %10s %9s %9s %7s %6s\n", "Device", "r/s", "w/s",
+		"rkB/s", "wkB/s", "r_await", "w_await", "aqu-sz", "%util");
+
+	for(int i = 0; i < num; i++) {
+		struct stats* p = NULL;
+		for(int j = 0; j < num_prev; j++) {
+			if(!strcmp(prev[j].name, cur[i].name)) {
+				p = &prev[j];
+			}
+		}
+
+		double ios[2], kb[2], await[2];
+		for(int dir = 0; dir < 2; dir++) {
+			uint32_t d_ios = cur[i].ios[dir] - (p ? p->ios[dir] : 0);
+			uint64_t d_time = cur[i].time_ms[dir] - (p ? p->time_ms[dir] : 0);
+			uint64_t d_sectors = cur[i].sectors[dir] - (p ? p->sectors[dir] : 0);
+
+			ios[dir] = d_ios * 1000.0 / elapsed_ms;
+			kb[dir] = d_sectors * 512.0 / 1024 * 1000 / elapsed_ms;
+			await[dir] = d_ios ? (double)d_time / d_ios : 0;
+		}
+
+		uint64_t d_busy = cur[i].busy_ms - (p ? p->busy_ms : 0);
+		uint64_t d_queue = cur[i].queue_ms - (p ? p->queue_ms : 0);
+		double util = d_busy * 100.0 / elapsed_ms;
+
+		printf("%-12s %9.2f %9.2f %10.2f %10.2f %9.2f %9.2f %7.2f %6.2f\n",
+			cur[i].name, ios[0], ios[1], kb[0], kb[1], await[0], await[1],
+			(double)d_queue / elapsed_ms, util > 100 ? 100 : util);
+
+		if(histogram) {
+			print_histogram(&cur[i], p);
+		}
+	}
+}
+
+int main(int argc, const char** argv) {
+	int histogram = 0;
+	struct argparse_option options[] = {
+		OPT_HELP(),
+		OPT_BOOLEAN('H', "histogram", &histogram, "show latency histograms"),
+        OPT_END(),
+	};
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usage, 0);
+    argparse_describe(&argparse, "\nReport block device I/O statistics.",
+    	"\niostat reads the per-device statistics in /sys/block/<dev>/stat. "
+    	"The first report covers the time since boot. If an interval in "
+    	"seconds is given, further reports cover the time since the previous "
+    	"one, up to count reports.\niostat is part of xelix-utils. Please "
+    	"report bugs to <hello@lutoma.org>.");
+    argc = argparse_parse(&argparse, argc, argv);
+
+	int interval = argc > 0 ? atoi(argv[0]) : 0;
+	int count = argc > 1 ? atoi(argv[1]) : -1;
+	if(argc > 2 || interval < 0) {
+		argparse_usage(&argparse);
+		exit(EXIT_FAILURE);
+	}
+
+	static struct stats bufs[2][MAX_DEVS];
+	struct stats* cur = bufs[0];
+	struct stats* prev = bufs[1];
+	int num_prev = 0;
+
+	uint64_t last = now_ms();
+	int num = read_all(cur);
+	report(cur, num, NULL, 0, uptime_ms(), histogram);
+
+	for(int i = 1; interval && (count < 0 || i < count); i++) {
+		sleep(interval);
+
+		struct stats* tmp = prev;
+		prev = cur;
+		cur = tmp;
+		num_prev = num;
+
+		uint64_t now = now_ms();
+		num = read_all(cur);
+		printf("\n");
+		report(cur, num, prev, num_prev, now - last, histogram);
+		last = now;
+	}
+	exit(EXIT_SUCCESS);
+}
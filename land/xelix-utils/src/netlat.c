@@ -0,0 +1,200 @@
+/* Copyright © 2020 Lukas Martini
+ *
+ * This file is part of Xelix.
+ *
+ * Xelix is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Xelix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Xelix. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "util.h"
+#include "argparse.h"
+
+#define MAX_SIZE 1024
+
+static const char *const usage[] = {
+    "netlat [options]",
+    NULL,
+};
+
+static int count = 1000;
+static int size = 64;
+static int port = 7777;
+static const char* address = NULL;
+static int idle_secs = 0;
+
+static inline uint64_t now_us(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// Reads the time since boot and the time the CPU spent idle, in us
+static void read_idle(uint64_t* uptime, uint64_t* idle) {
+	FILE* fp = fopen("/sys/idle", "r");
+	if(!fp || fscanf(fp, "# uptime_us idle_us\n%llu %llu", uptime, idle) != 2) {
+		fprintf(stderr, "Could not read /sys/idle.\n");
+		exit(EXIT_FAILURE);
+	}
+	fclose(fp);
+}
+
+static int read_full(int fd, char* buf, int len) {
+	for(int done = 0; done < len;) {
+		int r = read(fd, buf + done, len - done);
+		if(r <= 0) {
+			return -1;
+		}
+		done += r;
+	}
+	return len;
+}
+
+static void run_server(int lsock) {
+	int sock = accept(lsock, NULL, NULL);
+	if(sock < 0) {
+		perror("Could not accept connection");
+		exit(EXIT_FAILURE);
+	}
+
+	char buf[MAX_SIZE];
+	while(read_full(sock, buf, size) == size) {
+		if(write(sock, buf, size) != size) {
+			break;
+		}
+	}
+	exit(EXIT_SUCCESS);
+}
+
+int main(int argc, const char** argv) {
+	struct argparse_option options[] = {
+		OPT_HELP(),
+		OPT_INTEGER('n', "count", &count, "number of round trips (default 1000)"),
+		OPT_INTEGER('s', "size", &size, "message size in bytes (default 64)"),
+		OPT_INTEGER('p', "port", &port, "TCP port to use (default 7777)"),
+		OPT_STRING('a', "address", &address, "use the echo server at this address instead of a local one"),
+		OPT_INTEGER('i', "idle", &idle_secs, "only measure idle CPU time for this many seconds"),
+        OPT_END(),
+	};
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usage, 0);
+    argparse_describe(&argparse, "\nMeasure network round trip latency.",
+    	"\nnetlat sends messages over a TCP connection to an echo server and "
+    	"waits for each one to come back, then reports the round trip times "
+    	"and how much of the time the CPU was idle. Unless an address is "
+    	"given, it forks its own echo server on 127.0.0.1.\nnetlat is part of "
+    	"xelix-utils. Please report bugs to <hello@lutoma.org>.");
+    argc = argparse_parse(&argparse, argc, argv);
+
+	if(argc || count < 1 || size < 1 || size > MAX_SIZE || port < 1 || port > 65535
+		|| idle_secs < 0) {
+		argparse_usage(&argparse);
+		exit(EXIT_FAILURE);
+	}
+
+	uint64_t uptime_start, idle_start, uptime_end, idle_end;
+	if(idle_secs) {
+		read_idle(&uptime_start, &idle_start);
+		sleep(idle_secs);
+		read_idle(&uptime_end, &idle_end);
+		printf("idle: %llu%% over %d s\n", (idle_end - idle_start) * 100
+			/ (uptime_end - uptime_start), idle_secs);
+		exit(EXIT_SUCCESS);
+	}
+
+	struct sockaddr_in saddr;
+	memset(&saddr, 0, sizeof(saddr));
+	saddr.sin_family = AF_INET;
+	saddr.sin_port = htons(port);
+	saddr.sin_addr.s_addr = inet_addr(address ? address : "127.0.0.1");
+
+	pid_t server = 0;
+	if(!address) {
+		int lsock = socket(AF_INET, SOCK_STREAM, 0);
+		if(lsock < 0 || bind(lsock, (struct sockaddr*)&saddr, sizeof(saddr)) < 0
+			|| listen(lsock, 1) < 0) {
+			perror("Could not set up echo server");
+			exit(EXIT_FAILURE);
+		}
+
+		server = fork();
+		if(server < 0) {
+			perror("Could not fork");
+			exit(EXIT_FAILURE);
+		}
+
+		if(!server) {
+			run_server(lsock);
+		}
+		close(lsock);
+	}
+
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if(sock < 0 || connect(sock, (struct sockaddr*)&saddr, sizeof(saddr)) < 0) {
+		perror("Could not connect");
+		exit(EXIT_FAILURE);
+	}
+
+	char buf[MAX_SIZE];
+	memset(buf, 0xa5, size);
+
+	uint64_t lat_total = 0;
+	uint32_t lat_min = UINT32_MAX;
+	uint32_t lat_max = 0;
+	int done = 0;
+
+	read_idle(&uptime_start, &idle_start);
+	for(; done < count; done++) {
+		uint64_t begin = now_us();
+		if(write(sock, buf, size) != size || read_full(sock, buf, size) != size) {
+			perror("Round trip failed");
+			break;
+		}
+
+		uint32_t lat = now_us() - begin;
+		lat_total += lat;
+		lat_min = lat < lat_min ? lat : lat_min;
+		lat_max = lat > lat_max ? lat : lat_max;
+	}
+	read_idle(&uptime_end, &idle_end);
+
+	close(sock);
+	if(server > 0) {
+		kill(server, SIGTERM);
+		waitpid(server, NULL, 0);
+	}
+
+	if(!done) {
+		fprintf(stderr, "No round trip completed.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	uint64_t elapsed = uptime_end - uptime_start;
+	printf("%s:%d: %d round trips of %d bytes in %llu ms\n",
+		address ? address : "127.0.0.1", port, done, size, elapsed / 1000);
+	printf("  rtt (us): min=%u, avg=%llu, max=%u\n", lat_min, lat_total / done, lat_max);
+	printf("  cpu idle: %llu%%\n", elapsed ? (idle_end - idle_start) * 100 / elapsed : 0);
+	exit(EXIT_SUCCESS);
+}
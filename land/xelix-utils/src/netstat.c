@@ -0,0 +1,199 @@
+/* Copyright © 2020 Lukas Martini
+ *
+ * This file is part of Xelix.
+ *
+ * Xelix is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Xelix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Xelix. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "argparse.h"
+#include "util.h"
+
+#define MAX_DEVS 16
+
+static const char *const usage[] = {
+    "netstat [options] [interval [count]]",
+    NULL,
+};
+
+struct stats {
+	char name[50];
+	uint32_t rx_packets;
+	uint64_t rx_bytes;
+	uint32_t rx_dropped;
+	uint32_t rx_errors;
+	uint32_t rx_nobuf;
+	uint32_t rx_ring_full;
+	uint32_t tx_packets;
+	uint64_t tx_bytes;
+	uint32_t tx_busy;
+	uint32_t tx_errors;
+};
+
+static int read_stats(const char* name, struct stats* st) {
+	char path[300];
+	snprintf(path, 300, "/sys/net/%s/stats", name);
+	FILE* fp = fopen(path, "r");
+	if(!fp) {
+		return -1;
+	}
+
+	memset(st, 0, sizeof(struct stats));
+	strncpy(st->name, name, 49);
+
+	fscanf(fp, "#%*[^\n]\n");
+	int matched = fscanf(fp, "%u %llu %u %u %u %u %u %llu %u %u",
+		&st->rx_packets, &st->rx_bytes, &st->rx_dropped, &st->rx_errors,
+		&st->rx_nobuf, &st->rx_ring_full, &st->tx_packets, &st->tx_bytes,
+		&st->tx_busy, &st->tx_errors);
+
+	fclose(fp);
+	return matched == 10 ? 0 : -1;
+}
+
+static int read_all(struct stats* devs) {
+	DIR* dir = opendir("/sys/net");
+	if(!dir) {
+		perror("Could not open /sys/net");
+		exit(EXIT_FAILURE);
+	}
+
+	int num = 0;
+	struct dirent* ent;
+	while((ent = readdir(dir)) && num < MAX_DEVS) {
+		if(ent->d_name[0] != '.' && !read_stats(ent->d_name, &devs[num])) {
+			num++;
+		}
+	}
+
+	closedir(dir);
+	return num;
+}
+
+static void report_interfaces(struct stats* cur, int num, struct stats* prev, int num_prev) {
+	printf("%-8s %10s %12s %7s %7s %7s %7s %10s %12s %7s %7s\n", "Iface", "RX-OK",
+		"RX-bytes", "RX-DRP", "RX-ERR", "RX-NBUF", "RX-RING", "TX-OK", "TX-bytes",
+		"TX-BUSY", "TX-ERR");
+
+	for(int i = 0; i < num; i++) {
+		struct stats p;
+		memset(&p, 0, sizeof(struct stats));
+		for(int j = 0; j < num_prev; j++) {
+			if(!strcmp(prev[j].name, cur[i].name)) {
+				p = prev[j];
+			}
+		}
+
+		struct stats* c = &cur[i];
+		printf("%-8s %10u %12llu %7u %7u %7u %7u %10u %12llu %7u %7u\n", c->name,
+			c->rx_packets - p.rx_packets, c->rx_bytes - p.rx_bytes,
+			c->rx_dropped - p.rx_dropped, c->rx_errors - p.rx_errors,
+			c->rx_nobuf - p.rx_nobuf, c->rx_ring_full - p.rx_ring_full,
+			c->tx_packets - p.tx_packets, c->tx_bytes - p.tx_bytes,
+			c->tx_busy - p.tx_busy, c->tx_errors - p.tx_errors);
+	}
+}
+
+/* /sys/net/snmp has a line of counter names followed by a line of values
+ * for every protocol, both starting with the protocol name.
+ */
+static void report_protocols(void) {
+	FILE* fp = fopen("/sys/net/snmp", "r");
+	if(!fp) {
+		perror("Could not open /sys/net/snmp");
+		exit(EXIT_FAILURE);
+	}
+
+	char names[300];
+	char values[300];
+	while(fgets(names, 300, fp) && fgets(values, 300, fp)) {
+		char* name_save;
+		char* value_save;
+		char* proto = strtok_r(names, " \n", &name_save);
+		strtok_r(values, " \n", &value_save);
+		if(!proto) {
+			continue;
+		}
+
+		printf("%s\n", proto);
+		char* name;
+		char* value;
+		while((name = strtok_r(NULL, " \n", &name_save))
+			&& (value = strtok_r(NULL, " \n", &value_save))) {
+			printf("    %10s %s\n", value, name);
+		}
+	}
+	fclose(fp);
+}
+
+int main(int argc, const char** argv) {
+	int interfaces = 0;
+	int protocols = 0;
+	struct argparse_option options[] = {
+		OPT_HELP(),
+		OPT_BOOLEAN('i', "interfaces", &interfaces, "only show interface statistics"),
+		OPT_BOOLEAN('s', "statistics", &protocols, "only show protocol statistics"),
+        OPT_END(),
+	};
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usage, 0);
+    argparse_describe(&argparse, "\nReport network statistics.",
+    	"\nnetstat shows the packet counters of every interface from "
+    	"/sys/net/<dev>/stats and the protocol counters from /sys/net/snmp. "
+    	"If an interval in seconds is given, further interface reports show "
+    	"the changes since the previous one, up to count reports.\nnetstat is "
+    	"part of xelix-utils. Please report bugs to <hello@lutoma.org>.");
+    argc = argparse_parse(&argparse, argc, argv);
+
+	int interval = argc > 0 ? atoi(argv[0]) : 0;
+	int count = argc > 1 ? atoi(argv[1]) : -1;
+	if(argc > 2 || interval < 0 || (interfaces && protocols)) {
+		argparse_usage(&argparse);
+		exit(EXIT_FAILURE);
+	}
+
+	if(protocols || !interfaces) {
+		report_protocols();
+		if(protocols) {
+			exit(EXIT_SUCCESS);
+		}
+		printf("\n");
+	}
+
+	static struct stats bufs[2][MAX_DEVS];
+	struct stats* cur = bufs[0];
+	struct stats* prev = bufs[1];
+	int num = read_all(cur);
+	report_interfaces(cur, num, NULL, 0);
+
+	for(int i = 1; interval && (count < 0 || i < count); i++) {
+		sleep(interval);
+
+		struct stats* tmp = prev;
+		prev = cur;
+		cur = tmp;
+		int num_prev = num;
+
+		num = read_all(cur);
+		printf("\n");
+		report_interfaces(cur, num, prev, num_prev);
+	}
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,173 @@
+/* Copyright © 2020 Lukas Martini
+ *
+ * This file is part of Xelix.
+ *
+ * Xelix is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Xelix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Xelix. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "util.h"
+#include "argparse.h"
+
+#define MAX_BLOCK 0x100000
+
+static const char *const usage[] = {
+    "sockbench [options]",
+    NULL,
+};
+
+static int size_mib = 64;
+static int block = 0x10000;
+static int port = 7778;
+static const char* type = NULL;
+
+static inline uint64_t now_us(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// Returns two connected stream sockets
+static int open_pair(bool tcp, int fds[2]) {
+	if(!tcp) {
+		return socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	}
+
+	struct sockaddr_in saddr;
+	memset(&saddr, 0, sizeof(saddr));
+	saddr.sin_family = AF_INET;
+	saddr.sin_port = htons(port);
+	saddr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+	int lsock = socket(AF_INET, SOCK_STREAM, 0);
+	if(lsock < 0 || bind(lsock, (struct sockaddr*)&saddr, sizeof(saddr)) < 0
+		|| listen(lsock, 1) < 0) {
+		return -1;
+	}
+
+	fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+	if(fds[0] < 0 || connect(fds[0], (struct sockaddr*)&saddr, sizeof(saddr)) < 0) {
+		return -1;
+	}
+
+	fds[1] = accept(lsock, NULL, NULL);
+	close(lsock);
+	return fds[1] < 0 ? -1 : 0;
+}
+
+static void run(bool tcp) {
+	const char* name = tcp ? "tcp" : "unix";
+	int fds[2];
+	if(open_pair(tcp, fds) < 0) {
+		fprintf(stderr, "%s: ", name);
+		perror("Could not set up sockets");
+		exit(EXIT_FAILURE);
+	}
+
+	char* buf = malloc(block);
+	if(!buf) {
+		perror("Could not allocate buffer");
+		exit(EXIT_FAILURE);
+	}
+	memset(buf, 0xa5, block);
+
+	uint64_t total = (uint64_t)size_mib * 1024 * 1024;
+	pid_t writer = fork();
+	if(writer < 0) {
+		perror("Could not fork");
+		exit(EXIT_FAILURE);
+	}
+
+	if(!writer) {
+		close(fds[1]);
+		for(uint64_t done = 0; done < total;) {
+			int w = write(fds[0], buf, total - done < block ? total - done : block);
+			if(w <= 0) {
+				perror("Write failed");
+				exit(EXIT_FAILURE);
+			}
+			done += w;
+		}
+		exit(EXIT_SUCCESS);
+	}
+
+	close(fds[0]);
+	uint64_t start = now_us();
+	uint64_t done = 0;
+	while(done < total) {
+		int r = read(fds[1], buf, block);
+		if(r <= 0) {
+			break;
+		}
+		done += r;
+	}
+	uint64_t elapsed = now_us() - start;
+
+	close(fds[1]);
+	waitpid(writer, NULL, 0);
+	free(buf);
+
+	if(done < total) {
+		fprintf(stderr, "%s: Only received %llu of %llu bytes.\n", name, done, total);
+		exit(EXIT_FAILURE);
+	}
+
+	elapsed = elapsed ? elapsed : 1;
+	printf("%-4s: %d MiB in %d byte blocks in %llu ms, %llu MiB/s\n", name, size_mib,
+		block, elapsed / 1000, total * 1000000 / elapsed / (1024 * 1024));
+}
+
+int main(int argc, const char** argv) {
+	struct argparse_option options[] = {
+		OPT_HELP(),
+		OPT_INTEGER('s', "size", &size_mib, "MiB to transfer (default 64)"),
+		OPT_INTEGER('b', "block", &block, "size of reads and writes in bytes (default 65536)"),
+		OPT_STRING('t', "type", &type, "only test unix or tcp sockets"),
+		OPT_INTEGER('p', "port", &port, "TCP port to use (default 7778)"),
+        OPT_END(),
+	};
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usage, 0);
+    argparse_describe(&argparse, "\nMeasure local socket throughput.",
+    	"\nsockbench streams data from one process to another, once over a unix "
+    	"domain socket pair and once over a TCP connection on 127.0.0.1, and "
+    	"reports the throughput of both.\nsockbench is part of xelix-utils. "
+    	"Please report bugs to <hello@lutoma.org>.");
+    argc = argparse_parse(&argparse, argc, argv);
+
+	if(argc || size_mib < 1 || block < 1 || block > MAX_BLOCK || port < 1 || port > 65535
+		|| (type && strcmp(type, "unix") && strcmp(type, "tcp"))) {
+		argparse_usage(&argparse);
+		exit(EXIT_FAILURE);
+	}
+
+	if(!type || !strcmp(type, "unix")) {
+		run(false);
+	}
+	if(!type || !strcmp(type, "tcp")) {
+		run(true);
+	}
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,216 @@
+/* Copyright © 2020 Lukas Martini
+ *
+ * This file is part of Xelix.
+ *
+ * Xelix is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Xelix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Xelix. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "util.h"
+#include "argparse.h"
+
+#define MAX_SIZE 1472
+#define MAX_BATCH 64
+
+// Sent once all datagrams are out, distinguished from data by its size
+#define END_MARKER "end"
+
+static const char *const usage[] = {
+    "udpbench [options]",
+    NULL,
+};
+
+static int count = 100000;
+static int size = 64;
+static int batch = 32;
+static int port = 7779;
+
+static char bufs[MAX_BATCH][MAX_SIZE];
+static struct iovec iovs[MAX_BATCH];
+static struct mmsghdr msgs[MAX_BATCH];
+
+static inline uint64_t now_us(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void setup_msgs(struct sockaddr_in* dest) {
+	for(int i = 0; i < batch; i++) {
+		memset(bufs[i], 0xa5, size);
+		iovs[i].iov_base = bufs[i];
+		iovs[i].iov_len = size;
+
+		memset(&msgs[i], 0, sizeof(struct mmsghdr));
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = dest;
+		msgs[i].msg_hdr.msg_namelen = dest ? sizeof(struct sockaddr_in) : 0;
+	}
+}
+
+static void run_sender(struct sockaddr_in* saddr) {
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if(sock < 0) {
+		perror("Could not open sender socket");
+		exit(EXIT_FAILURE);
+	}
+
+	setup_msgs(saddr);
+	for(int sent = 0; sent < count;) {
+		int n = count - sent < batch ? count - sent : batch;
+		int r;
+		if(batch > 1) {
+			r = sendmmsg(sock, msgs, n, 0);
+		} else {
+			r = sendto(sock, bufs[0], size, 0, (struct sockaddr*)saddr,
+				sizeof(struct sockaddr_in)) < 0 ? -1 : 1;
+		}
+
+		if(r < 0) {
+			perror("Send failed");
+			exit(EXIT_FAILURE);
+		}
+		sent += r;
+	}
+
+	// Repeated in case it gets dropped, until the receiver kills us
+	while(1) {
+		sendto(sock, END_MARKER, sizeof(END_MARKER), 0, (struct sockaddr*)saddr,
+			sizeof(struct sockaddr_in));
+		usleep(100000);
+	}
+}
+
+int main(int argc, const char** argv) {
+	struct argparse_option options[] = {
+		OPT_HELP(),
+		OPT_INTEGER('n', "count", &count, "number of datagrams to send (default 100000)"),
+		OPT_INTEGER('s', "size", &size, "datagram size in bytes (default 64)"),
+		OPT_INTEGER('b', "batch", &batch, "datagrams per sendmmsg/recvmmsg call, 1 uses sendto/recvfrom (default 32)"),
+		OPT_INTEGER('p', "port", &port, "UDP port to use (default 7779)"),
+        OPT_END(),
+	};
+
+    struct argparse argparse;
+    argparse_init(&argparse, options, usage, 0);
+    argparse_describe(&argparse, "\nMeasure UDP packet rate.",
+    	"\nudpbench forks a sender that sends datagrams to 127.0.0.1 as fast as "
+    	"it can, and reports how many of them were received and at what rate. "
+    	"With a batch size above 1, datagrams are sent and received using "
+    	"sendmmsg and recvmmsg.\nudpbench is part of xelix-utils. Please report "
+    	"bugs to <hello@lutoma.org>.");
+    argc = argparse_parse(&argparse, argc, argv);
+
+	if(argc || count < 1 || size < 1 || size > MAX_SIZE || size == sizeof(END_MARKER)
+		|| batch < 1 || batch > MAX_BATCH || port < 1 || port > 65535) {
+		argparse_usage(&argparse);
+		exit(EXIT_FAILURE);
+	}
+
+	struct sockaddr_in saddr;
+	memset(&saddr, 0, sizeof(saddr));
+	saddr.sin_family = AF_INET;
+	saddr.sin_port = htons(port);
+	saddr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if(sock < 0 || bind(sock, (struct sockaddr*)&saddr, sizeof(saddr)) < 0) {
+		perror("Could not set up receiver");
+		exit(EXIT_FAILURE);
+	}
+
+	pid_t sender = fork();
+	if(sender < 0) {
+		perror("Could not fork");
+		exit(EXIT_FAILURE);
+	}
+
+	if(!sender) {
+		close(sock);
+		run_sender(&saddr);
+	}
+
+	setup_msgs(NULL);
+	for(int i = 0; i < batch; i++) {
+		iovs[i].iov_len = MAX_SIZE;
+	}
+
+	int received = 0;
+	int calls = 0;
+	uint64_t bytes = 0;
+	uint64_t start = 0;
+	bool done = false;
+
+	while(!done) {
+		int r;
+		if(batch > 1) {
+			r = recvmmsg(sock, msgs, batch, 0, NULL);
+		} else {
+			r = recvfrom(sock, bufs[0], MAX_SIZE, 0, NULL, NULL);
+			msgs[0].msg_len = r;
+			r = r < 0 ? -1 : 1;
+		}
+
+		if(r < 0) {
+			perror("Receive failed");
+			break;
+		}
+
+		if(!start) {
+			start = now_us();
+		}
+
+		calls++;
+		for(int i = 0; i < r; i++) {
+			if(msgs[i].msg_len == sizeof(END_MARKER)) {
+				done = true;
+				break;
+			}
+
+			received++;
+			bytes += msgs[i].msg_len;
+		}
+		done |= received >= count;
+	}
+	uint64_t elapsed = now_us() - start;
+
+	kill(sender, SIGTERM);
+	waitpid(sender, NULL, 0);
+	close(sock);
+
+	if(!received) {
+		fprintf(stderr, "No datagrams received.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	elapsed = elapsed ? elapsed : 1;
+	printf("%d of %d datagrams of %d bytes received in %llu ms (%d%% lost)\n",
+		received, count, size, elapsed / 1000, (count - received) * 100 / count);
+	printf("  %llu datagrams/s, %llu KiB/s, %d.%02d datagrams per receive call\n",
+		(uint64_t)received * 1000000 / elapsed, bytes * 1000000 / elapsed / 1024,
+		received / calls, received * 100 / calls % 100);
+	exit(EXIT_SUCCESS);
+}
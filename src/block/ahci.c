@@ -0,0 +1,840 @@
+/* ahci.c: AHCI SATA driver
+ * Copyright © 2020 Lukas Martini
+ *
+ * This file is part of Xelix.
+ *
+ * Xelix is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Xelix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Xelix. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Every port of an AHCI controller has a command list with up to 32 slots,
+ * each pointing to a command table with the command FIS and a PRD table
+ * describing the physical memory of the transfer. Commands are issued by
+ * setting the bit of their slot in PxCI and completed from the interrupt
+ * handler once the HBA clears it.
+ *
+ * If both HBA and drive support native command queueing, all slots can be in
+ * flight at the same time using the FPDMA QUEUED commands, with the drive
+ * reordering them as it sees fit. Otherwise, only a single slot is used.
+ *
+ * Like in the virtio-blk driver, runs from the block queue that don't fit into
+ * a single command are split up. A run_state tracks the completion of all
+ * commands of a run.
+ */
+
+#ifdef CONFIG_ENABLE_AHCI
+
+#include <block/ahci.h>
+#include <block/block.h>
+#include <bsp/i386-pci.h>
+#include <int/int.h>
+#include <mem/vm.h>
+#include <mem/kmalloc.h>
+#include <tasks/task.h>
+#include <tasks/scheduler.h>
+#include <tasks/completion.h>
+#include <string.h>
+#include <time.h>
+#include <log.h>
+
+#define SECTOR_SIZE 512
+#define MAX_SLOTS 32
+
+/* PRD entries per command table. This makes each table exactly 1 KiB, so
+ * they never cross a page boundary.
+ */
+#define PRDT_ENTRIES 56
+
+// Bytes one PRD can describe, and sectors fitting the 16 bit count of a command
+#define PRD_MAX_BYTES 0x400000
+#define CMD_MAX_SECTORS 0xffff
+
+// Generic host control registers, as dword indices
+#define HBA_CAP 0
+#define HBA_GHC 1
+#define HBA_IS 2
+#define HBA_PI 3
+#define HBA_VS 4
+
+#define HBA_CAP_NCS(cap) ((((cap) >> 8) & 0x1f) + 1)
+#define HBA_CAP_SNCQ (1 << 30)
+#define HBA_GHC_IE (1 << 1)
+#define HBA_GHC_AE (1 << 31)
+
+// Port registers, as dword indices relative to the port
+#define PORT_BASE(n) (0x40 + (n) * 0x20)
+#define PORT_CLB 0
+#define PORT_CLBU 1
+#define PORT_FB 2
+#define PORT_FBU 3
+#define PORT_IS 4
+#define PORT_IE 5
+#define PORT_CMD 6
+#define PORT_TFD 8
+#define PORT_SIG 9
+#define PORT_SSTS 10
+#define PORT_SERR 12
+#define PORT_SACT 13
+#define PORT_CI 14
+
+#define PORT_CMD_ST (1 << 0)
+#define PORT_CMD_FRE (1 << 4)
+#define PORT_CMD_FR (1 << 14)
+#define PORT_CMD_CR (1 << 15)
+
+// Device to host register FIS, PIO setup FIS, set device bits FIS, PRD done
+#define PORT_IS_DONE (1 | (1 << 1) | (1 << 3) | (1 << 5))
+// Task file error, host bus fatal error, host bus data error, interface fatal
+#define PORT_IS_ERROR ((1 << 30) | (1 << 29) | (1 << 28) | (1 << 27))
+
+#define PORT_TFD_ERR 0x01
+#define PORT_TFD_DRQ 0x08
+#define PORT_TFD_BSY 0x80
+
+#define SSTS_DET_PRESENT 3
+#define SSTS_IPM_ACTIVE 1
+#define SIG_ATA 0x00000101
+
+#define FIS_TYPE_REG_H2D 0x27
+#define FIS_H2D_COMMAND (1 << 7)
+#define FIS_DEVICE_LBA (1 << 6)
+#define FIS_DEVICE_FUA (1 << 7)
+
+#define CMD_HEADER_WRITE (1 << 6)
+#define PRD_DBC_MASK 0x3fffff
+
+#define ATA_CMD_IDENTIFY 0xec
+#define ATA_CMD_READ_DMA_EXT 0x25
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_READ_FPDMA 0x60
+#define ATA_CMD_WRITE_FPDMA 0x61
+#define ATA_CMD_FLUSH_EXT 0xea
+
+struct cmd_header {
+	// Command FIS length in dwords, write flag and others
+	uint16_t flags;
+	uint16_t prdtl;
+	volatile uint32_t prdbc;
+	uint32_t ctba;
+	uint32_t ctbau;
+	uint32_t reserved[4];
+} __attribute__((packed));
+
+struct prd {
+	uint32_t dba;
+	uint32_t dbau;
+	uint32_t reserved;
+	// Byte count - 1, bit 31 requests an interrupt
+	uint32_t dbc;
+} __attribute__((packed));
+
+struct fis_reg_h2d {
+	uint8_t type;
+	uint8_t flags;
+	uint8_t command;
+	uint8_t feature_low;
+	uint8_t lba0;
+	uint8_t lba1;
+	uint8_t lba2;
+	uint8_t device;
+	uint8_t lba3;
+	uint8_t lba4;
+	uint8_t lba5;
+	uint8_t feature_high;
+	uint8_t count_low;
+	uint8_t count_high;
+	uint8_t icc;
+	uint8_t control;
+	uint32_t reserved;
+} __attribute__((packed));
+
+struct cmd_table {
+	uint8_t cfis[64];
+	uint8_t acmd[16];
+	uint8_t reserved[48];
+	struct prd prdt[PRDT_ENTRIES];
+} __attribute__((packed));
+
+struct run_state {
+	bool used;
+	bool sync;
+	struct vfs_block_request* run;
+	volatile int pending;
+	uint64_t ok_sectors;
+
+	// Set once the FLUSH CACHE EXT following a write run has been issued
+	bool flushed;
+};
+
+struct command {
+	int slot;
+	bool used;
+	struct run_state* state;
+
+	// Offset of this command in the run and its length, in sectors
+	uint64_t offset;
+	uint64_t length;
+};
+
+// Command that is being built
+struct build {
+	struct command* cmd;
+	int num;
+	size_t bytes;
+	uint64_t offset;
+};
+
+struct port {
+	struct port* next;
+	volatile uint32_t* regs;
+	int index;
+
+	struct cmd_header* headers;
+	struct cmd_table* tables;
+	void* fis;
+
+	struct command commands[MAX_SLOTS];
+	struct run_state states[MAX_SLOTS];
+	int num_slots;
+	bool ncq;
+
+	// Slots handed to the HBA that have not been completed yet
+	uint32_t issued;
+
+	uint64_t sectors;
+	uint32_t physical_block_size;
+	struct vfs_block_dev* block_dev;
+};
+
+struct controller {
+	struct controller* next;
+	volatile uint32_t* regs;
+	struct port* ports;
+};
+
+static struct controller* controllers = NULL;
+static int num_disks = 0;
+
+static inline void* phys_addr(void* addr) {
+	return valloc_translate(VM_KERNEL, addr, false);
+}
+
+/* Wait for bits in a port register to clear, up to timeout ticks. Can't be
+ * used in interrupt handlers.
+ */
+static bool wait_clear(volatile uint32_t* reg, uint32_t mask, int timeout) {
+	for(int i = 0; *reg & mask; i++) {
+		if(i >= timeout) {
+			return false;
+		}
+		sleep_ticks(1);
+	}
+	return true;
+}
+
+static bool stop_port(struct port* port) {
+	port->regs[PORT_CMD] &= ~PORT_CMD_ST;
+	if(!wait_clear(&port->regs[PORT_CMD], PORT_CMD_CR, 500)) {
+		return false;
+	}
+
+	port->regs[PORT_CMD] &= ~PORT_CMD_FRE;
+	return wait_clear(&port->regs[PORT_CMD], PORT_CMD_FR, 500);
+}
+
+static void start_port(struct port* port) {
+	wait_clear(&port->regs[PORT_TFD], PORT_TFD_BSY | PORT_TFD_DRQ, 1000);
+	port->regs[PORT_CMD] |= PORT_CMD_FRE;
+	port->regs[PORT_CMD] |= PORT_CMD_ST;
+}
+
+// Needs to be called from task context
+static struct command* alloc_command(struct port* port) {
+	while(1) {
+		int_disable();
+		for(int i = 0; i < port->num_slots; i++) {
+			if(!port->commands[i].used) {
+				struct command* cmd = &port->commands[i];
+				cmd->used = true;
+				int_enable();
+				return cmd;
+			}
+		}
+
+		// Reenables interrupts
+		scheduler_yield();
+	}
+}
+
+static struct run_state* alloc_state(struct port* port) {
+	while(1) {
+		int_disable();
+		for(int i = 0; i < MAX_SLOTS; i++) {
+			if(!port->states[i].used) {
+				struct run_state* state = &port->states[i];
+				state->used = true;
+				int_enable();
+				return state;
+			}
+		}
+		scheduler_yield();
+	}
+}
+
+static void finish(struct run_state* state) {
+	struct vfs_block_request* run = state->run;
+	uint64_t sectors = state->ok_sectors;
+	bool sync = state->sync;
+	state->used = false;
+
+	if(sync) {
+		run->result = MIN(sectors, run->num_blocks);
+		complete(&run->done);
+	} else {
+		vfs_block_complete(run, sectors);
+	}
+}
+
+static void fill_fis(struct port* port, struct command* cmd, uint8_t command,
+	uint64_t lba, uint16_t count);
+static void issue(struct port* port, struct command* cmd, int num_prds, bool write);
+
+/* Drop a reference to a run, with cmd being the command that just completed,
+ * if any. Queued writes are issued with FUA set, so they are on the media once
+ * they complete. Without NCQ, write runs are instead followed by a FLUSH
+ * CACHE EXT. Only a single slot is used then, so the flush can reuse the
+ * command that completed last, or get the slot using alloc_command if this
+ * runs in task context.
+ */
+static void put_state(struct port* port, struct run_state* state, struct command* cmd) {
+	if(__sync_sub_and_fetch(&state->pending, 1)) {
+		if(cmd) {
+			cmd->used = false;
+		}
+		return;
+	}
+
+	if(state->run->write && !port->ncq && !state->flushed && state->ok_sectors) {
+		if(!cmd) {
+			cmd = alloc_command(port);
+		}
+
+		// If the flush fails, nothing of the run can be relied on
+		state->flushed = true;
+		state->pending = 1;
+		cmd->state = state;
+		cmd->offset = 0;
+		cmd->length = 0;
+		fill_fis(port, cmd, ATA_CMD_FLUSH_EXT, 0, 0);
+		issue(port, cmd, 0, false);
+		return;
+	}
+
+	if(cmd) {
+		cmd->used = false;
+	}
+	finish(state);
+}
+
+// Called from the interrupt handler
+static void command_done(struct port* port, struct command* cmd, bool ok) {
+	struct run_state* state = cmd->state;
+	if(!ok) {
+		state->ok_sectors = MIN(state->ok_sectors, cmd->offset);
+	}
+
+	put_state(port, state, cmd);
+}
+
+/* Stop and restart the command engine after an error. This clears PxCI and
+ * PxSACT, so all commands that were in flight are failed. With NCQ, the
+ * failing one could be found using the NCQ error log, but errors are rare
+ * enough that this isn't worth it.
+ */
+static void port_error(struct port* port, uint32_t is) {
+	log(LOG_ERR, "ahci: %s: Error, PxIS %#x, PxTFD %#x, PxSERR %#x\n",
+		port->block_dev ? port->block_dev->name : "port", is,
+		port->regs[PORT_TFD], port->regs[PORT_SERR]);
+
+	// The timer doesn't tick in here, so spin for a bounded time instead
+	port->regs[PORT_CMD] &= ~PORT_CMD_ST;
+	for(int i = 0; i < 1000000 && (port->regs[PORT_CMD] & PORT_CMD_CR); i++);
+
+	port->regs[PORT_SERR] = 0xffffffff;
+	port->regs[PORT_IS] = 0xffffffff;
+	port->regs[PORT_CMD] |= PORT_CMD_ST;
+
+	uint32_t failed = port->issued;
+	port->issued = 0;
+	for(int i = 0; i < port->num_slots; i++) {
+		if(failed & (1 << i)) {
+			command_done(port, &port->commands[i], false);
+		}
+	}
+}
+
+static void port_interrupt(struct port* port) {
+	uint32_t is = port->regs[PORT_IS];
+	port->regs[PORT_IS] = is;
+
+	if(is & PORT_IS_ERROR) {
+		port_error(port, is);
+		return;
+	}
+
+	// Queued commands stay in PxSACT until the drive has completed them
+	uint32_t done = port->issued & ~(port->regs[PORT_CI] | port->regs[PORT_SACT]);
+	port->issued &= ~done;
+
+	for(int i = 0; done; i++) {
+		if(done & (1 << i)) {
+			done &= ~(1 << i);
+			command_done(port, &port->commands[i], true);
+		}
+	}
+}
+
+static void int_handler(task_t* task, isf_t* state, int num) {
+	for(struct controller* ctrl = controllers; ctrl; ctrl = ctrl->next) {
+		uint32_t is = ctrl->regs[HBA_IS];
+		if(!is) {
+			continue;
+		}
+
+		for(struct port* port = ctrl->ports; port; port = port->next) {
+			if(is & (1 << port->index)) {
+				port_interrupt(port);
+			}
+		}
+
+		// Needs to be cleared after the port interrupt status
+		ctrl->regs[HBA_IS] = is;
+	}
+}
+
+static void fill_fis(struct port* port, struct command* cmd, uint8_t command,
+	uint64_t lba, uint16_t count) {
+
+	struct fis_reg_h2d* fis = (struct fis_reg_h2d*)port->tables[cmd->slot].cfis;
+	bzero(fis, sizeof(struct fis_reg_h2d));
+	fis->type = FIS_TYPE_REG_H2D;
+	fis->flags = FIS_H2D_COMMAND;
+	fis->command = command;
+	fis->device = FIS_DEVICE_LBA;
+	fis->lba0 = lba & 0xff;
+	fis->lba1 = (lba >> 8) & 0xff;
+	fis->lba2 = (lba >> 16) & 0xff;
+	fis->lba3 = (lba >> 24) & 0xff;
+	fis->lba4 = (lba >> 32) & 0xff;
+	fis->lba5 = (lba >> 40) & 0xff;
+
+	// FPDMA commands take the sector count in the features, the tag in count
+	if(command == ATA_CMD_READ_FPDMA || command == ATA_CMD_WRITE_FPDMA) {
+		fis->feature_low = count & 0xff;
+		fis->feature_high = count >> 8;
+		fis->count_low = cmd->slot << 3;
+		if(command == ATA_CMD_WRITE_FPDMA) {
+			fis->device |= FIS_DEVICE_FUA;
+		}
+	} else {
+		fis->count_low = count & 0xff;
+		fis->count_high = count >> 8;
+	}
+}
+
+static void issue(struct port* port, struct command* cmd, int num_prds, bool write) {
+	struct cmd_header* header = &port->headers[cmd->slot];
+	header->flags = (sizeof(struct fis_reg_h2d) / 4) | (write ? CMD_HEADER_WRITE : 0);
+	header->prdtl = num_prds;
+	header->prdbc = 0;
+	__sync_synchronize();
+
+	// Also used from the interrupt handler to issue flushes
+	uint32_t bit = 1 << cmd->slot;
+	uint32_t flags = int_save();
+	port->issued |= bit;
+	if(port->ncq) {
+		port->regs[PORT_SACT] = bit;
+	}
+	port->regs[PORT_CI] = bit;
+	int_restore(flags);
+}
+
+static void issue_build(struct port* port, struct run_state* state, struct build* b,
+	uint64_t lba) {
+
+	struct command* cmd = b->cmd;
+	bool write = state->run->write;
+	cmd->state = state;
+	cmd->offset = b->offset;
+	cmd->length = b->bytes / SECTOR_SIZE;
+
+	uint8_t command;
+	if(port->ncq) {
+		command = write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA;
+	} else {
+		command = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+	}
+
+	fill_fis(port, cmd, command, lba + cmd->offset, cmd->length);
+	__sync_add_and_fetch(&state->pending, 1);
+	issue(port, cmd, b->num, write);
+
+	b->offset += cmd->length;
+	b->cmd = NULL;
+	b->num = 0;
+	b->bytes = 0;
+}
+
+/* Add a physically contiguous piece of memory to the command being built,
+ * issuing it whenever its PRD table is full or it has reached
+ * CMD_MAX_SECTORS. Commands always need to end on a sector boundary, so the
+ * last PRD only gets filled up to one.
+ */
+static void add_piece(struct port* port, struct run_state* state, struct build* b,
+	uint64_t lba, uintptr_t phys, size_t len) {
+
+	while(len) {
+		if(!b->cmd) {
+			b->cmd = alloc_command(port);
+		}
+
+		size_t take = MIN(len, CMD_MAX_SECTORS * SECTOR_SIZE - b->bytes);
+		if(b->num >= PRDT_ENTRIES - 1) {
+			size_t rem = b->bytes % SECTOR_SIZE;
+			take = rem ? MIN(take, SECTOR_SIZE - rem) : take - take % SECTOR_SIZE;
+			if(!take) {
+				issue_build(port, state, b, lba);
+				continue;
+			}
+		}
+
+		struct prd* prdt = port->tables[b->cmd->slot].prdt;
+		struct prd* last = b->num ? &prdt[b->num - 1] : NULL;
+		if(last && last->dba + (last->dbc & PRD_DBC_MASK) + 1 == phys
+			&& (last->dbc & PRD_DBC_MASK) + 1 + take <= PRD_MAX_BYTES) {
+			last->dbc += take;
+		} else {
+			prdt[b->num].dba = phys;
+			prdt[b->num].dbau = 0;
+			prdt[b->num].reserved = 0;
+			prdt[b->num].dbc = take - 1;
+			b->num++;
+		}
+
+		b->bytes += take;
+		phys += take;
+		len -= take;
+
+		if(b->bytes == CMD_MAX_SECTORS * SECTOR_SIZE
+			|| (b->num == PRDT_ENTRIES && !(b->bytes % SECTOR_SIZE))) {
+			issue_build(port, state, b, lba);
+		}
+	}
+}
+
+static void submit(struct port* port, struct vfs_block_request* run, bool sync) {
+	struct run_state* state = alloc_state(port);
+	state->run = run;
+	state->sync = sync;
+	state->ok_sectors = run->run_blocks;
+	state->flushed = false;
+
+	// Reference held while commands are being issued
+	state->pending = 1;
+
+	struct build b = {0};
+	uint64_t left = run->run_blocks;
+	for(struct vfs_block_request* req = run; req && left; req = req->merged) {
+		uint64_t req_left = MIN(req->num_blocks, left) * SECTOR_SIZE;
+		left -= MIN(req->num_blocks, left);
+
+		for(int i = 0; i < req->sg_count && req_left; i++) {
+			uint8_t* addr = req->sg[i].addr;
+			size_t seg_left = MIN(req->sg[i].size, req_left);
+			req_left -= seg_left;
+
+			while(seg_left) {
+				size_t len = MIN(seg_left, PAGE_SIZE - (uintptr_t)addr % PAGE_SIZE);
+				uintptr_t phys = (uintptr_t)phys_addr(addr);
+
+				// The HBA can only transfer to word aligned addresses
+				if(!phys || (phys & 1)) {
+					log(LOG_ERR, "ahci: Can't transfer to buffer at %p\n", addr);
+					state->ok_sectors = MIN(state->ok_sectors, b.offset);
+					left = 0;
+					req_left = 0;
+					break;
+				}
+
+				add_piece(port, state, &b, run->lba, phys, len);
+				addr += len;
+				seg_left -= len;
+			}
+		}
+	}
+
+	// Nothing past a mapping error gets issued
+	if(b.num && state->ok_sectors == run->run_blocks) {
+		issue_build(port, state, &b, run->lba);
+	} else if(b.cmd) {
+		b.cmd->used = false;
+	}
+
+	put_state(port, state, NULL);
+}
+
+static void submit_cb(struct vfs_block_dev* block_dev, struct vfs_block_request* run) {
+	submit((struct port*)block_dev->meta, run, false);
+}
+
+// Synchronous interface, used for partition probing
+static uint64_t transfer(struct port* port, uint64_t lba, uint64_t num_blocks,
+	void* buf, bool write) {
+
+	struct vfs_block_sg sg = {
+		.addr = buf,
+		.size = num_blocks * SECTOR_SIZE,
+	};
+
+	struct vfs_block_request req = {
+		.write = write,
+		.lba = lba,
+		.num_blocks = num_blocks,
+		.run_blocks = num_blocks,
+		.sg = &sg,
+		.sg_count = 1,
+	};
+
+	completion_init(&req.done);
+	submit(port, &req, true);
+	completion_wait(&req.done);
+	return req.result ? req.result : -1;
+}
+
+static uint64_t read_cb(struct vfs_block_dev* block_dev, uint64_t lba, uint64_t num_blocks, void* buf) {
+	return transfer((struct port*)block_dev->meta, lba, num_blocks, buf, false);
+}
+
+static uint64_t write_cb(struct vfs_block_dev* block_dev, uint64_t lba, uint64_t num_blocks, void* buf) {
+	return transfer((struct port*)block_dev->meta, lba, num_blocks, buf, true);
+}
+
+/* Runs IDENTIFY DEVICE on slot 0 and polls for completion, since interrupts
+ * are not enabled on the port yet.
+ */
+static int identify(struct port* port, uint16_t* data) {
+	struct command* cmd = &port->commands[0];
+	struct prd* prd = &port->tables[0].prdt[0];
+	prd->dba = (uintptr_t)phys_addr(data);
+	prd->dbau = 0;
+	prd->dbc = SECTOR_SIZE - 1;
+
+	fill_fis(port, cmd, ATA_CMD_IDENTIFY, 0, 0);
+	((struct fis_reg_h2d*)port->tables[0].cfis)->device = 0;
+
+	struct cmd_header* header = &port->headers[0];
+	header->flags = sizeof(struct fis_reg_h2d) / 4;
+	header->prdtl = 1;
+	header->prdbc = 0;
+	__sync_synchronize();
+
+	port->regs[PORT_CI] = 1;
+	if(!wait_clear(&port->regs[PORT_CI], 1, 1000)
+		|| port->regs[PORT_TFD] & PORT_TFD_ERR) {
+		return -1;
+	}
+	return 0;
+}
+
+static void free_port(struct port* port) {
+	stop_port(port);
+	kfree(port->tables);
+	kfree(port->fis);
+	kfree(port->headers);
+	kfree(port);
+}
+
+static struct port* init_port(struct controller* ctrl, int index, uint32_t cap) {
+	volatile uint32_t* regs = ctrl->regs + PORT_BASE(index);
+	uint32_t ssts = regs[PORT_SSTS];
+	if((ssts & 0xf) != SSTS_DET_PRESENT || ((ssts >> 8) & 0xf) != SSTS_IPM_ACTIVE) {
+		return NULL;
+	}
+
+	// ATAPI and port multipliers are not supported
+	if(regs[PORT_SIG] != SIG_ATA) {
+		log(LOG_INFO, "ahci: Port %d: Unsupported device, signature %#x\n",
+			index, regs[PORT_SIG]);
+		return NULL;
+	}
+
+	struct port* port = zmalloc(sizeof(struct port));
+	port->regs = regs;
+	port->index = index;
+
+	if(!stop_port(port)) {
+		log(LOG_ERR, "ahci: Port %d: Could not stop command engine\n", index);
+		kfree(port);
+		return NULL;
+	}
+
+	port->headers = zmalloc_a(sizeof(struct cmd_header) * MAX_SLOTS);
+	port->fis = zmalloc_a(256);
+	port->tables = zmalloc_a(sizeof(struct cmd_table) * MAX_SLOTS);
+
+	for(int i = 0; i < MAX_SLOTS; i++) {
+		port->commands[i].slot = i;
+		port->headers[i].ctba = (uintptr_t)phys_addr(&port->tables[i]);
+		port->headers[i].ctbau = 0;
+	}
+
+	regs[PORT_CLB] = (uintptr_t)phys_addr(port->headers);
+	regs[PORT_CLBU] = 0;
+	regs[PORT_FB] = (uintptr_t)phys_addr(port->fis);
+	regs[PORT_FBU] = 0;
+	regs[PORT_SERR] = 0xffffffff;
+	regs[PORT_IS] = 0xffffffff;
+	regs[PORT_IE] = 0;
+	start_port(port);
+
+	uint16_t* id = zmalloc_a(SECTOR_SIZE);
+	if(identify(port, id) < 0) {
+		log(LOG_ERR, "ahci: Port %d: IDENTIFY DEVICE failed\n", index);
+		kfree(id);
+		free_port(port);
+		return NULL;
+	}
+
+	// Word 83 bit 10: 48-bit addressing, which all commands used here need
+	if(!(id[83] & (1 << 10))) {
+		log(LOG_ERR, "ahci: Port %d: Drive does not support LBA48\n", index);
+		kfree(id);
+		free_port(port);
+		return NULL;
+	}
+
+	/* Word 106 is valid if bit 14 is set and bit 15 clear. Bit 12 indicates
+	 * logical sectors larger than 512 bytes, bit 13 multiple logical sectors
+	 * per physical one, with the exponent in bits 0-3.
+	 */
+	port->physical_block_size = SECTOR_SIZE;
+	if((id[106] & 0xc000) == 0x4000) {
+		if(id[106] & (1 << 12)) {
+			log(LOG_ERR, "ahci: Port %d: Unsupported logical sector size\n", index);
+			kfree(id);
+			free_port(port);
+			return NULL;
+		}
+
+		if(id[106] & (1 << 13)) {
+			port->physical_block_size = SECTOR_SIZE << (id[106] & 0xf);
+		}
+	}
+
+	port->sectors = *(uint64_t*)&id[100];
+
+	// Word 76 bit 8: NCQ, word 75: queue depth - 1
+	port->num_slots = 1;
+	if((cap & HBA_CAP_SNCQ) && (id[76] & (1 << 8))) {
+		port->ncq = true;
+		port->num_slots = MIN(HBA_CAP_NCS(cap), (id[75] & 0x1f) + 1);
+	}
+
+	kfree(id);
+	regs[PORT_IS] = 0xffffffff;
+	regs[PORT_IE] = PORT_IS_DONE | PORT_IS_ERROR;
+	return port;
+}
+
+static int pci_cb(pci_device_t* pci_dev) {
+	// Mass storage, SATA, AHCI 1.0
+	if(pci_dev->class != PCI_CLASS_STORAGE || pci_dev->subclass != 0x06
+		|| pci_dev->prog_if != 0x01) {
+		return 1;
+	}
+
+	volatile uint32_t* regs = pci_map_bar(pci_dev, 5, 0, 0x1100);
+	if(!regs) {
+		log(LOG_ERR, "ahci: %02d:%02d.%d: Could not map ABAR\n",
+			pci_dev->bus, pci_dev->dev, pci_dev->func);
+		return 1;
+	}
+
+	regs[HBA_GHC] |= HBA_GHC_AE;
+	regs[HBA_GHC] &= ~HBA_GHC_IE;
+
+	uint32_t cap = regs[HBA_CAP];
+	uint32_t version = regs[HBA_VS];
+	log(LOG_INFO, "ahci: %02d:%02d.%d: AHCI %d.%d, %d slots%s\n",
+		pci_dev->bus, pci_dev->dev, pci_dev->func, version >> 16,
+		(version >> 8) & 0xff, HBA_CAP_NCS(cap),
+		(cap & HBA_CAP_SNCQ) ? ", NCQ" : "");
+
+	struct controller* ctrl = zmalloc(sizeof(struct controller));
+	ctrl->regs = regs;
+
+	uint32_t implemented = regs[HBA_PI];
+	for(int i = 31; i >= 0; i--) {
+		if(!(implemented & (1 << i))) {
+			continue;
+		}
+
+		struct port* port = init_port(ctrl, i, cap);
+		if(port) {
+			port->next = ctrl->ports;
+			ctrl->ports = port;
+		}
+	}
+
+	if(!ctrl->ports) {
+		kfree(ctrl);
+		return 1;
+	}
+
+	ctrl->next = controllers;
+	controllers = ctrl;
+
+	// Prefer MSI, which is never shared with other devices
+	int vector = int_alloc_vector();
+	if(vector >= 0 && !pci_enable_msi(pci_dev, vector)) {
+		int_register(vector, int_handler, false);
+	} else {
+		int_free_vector(vector);
+		int_register(IRQ(pci_dev->interrupt_line), int_handler, false);
+	}
+
+	pci_set_bus_master(pci_dev);
+	regs[HBA_IS] = 0xffffffff;
+	regs[HBA_GHC] |= HBA_GHC_IE;
+
+	for(struct port* port = ctrl->ports; port; port = port->next) {
+		char name[10];
+		snprintf(name, 10, "ahci%d", ++num_disks);
+
+		log(LOG_INFO, "ahci: %s: Port %d, %u MiB, %u byte physical sectors, %s, %d slots\n",
+			name, port->index, (uint32_t)(port->sectors / 2048), port->physical_block_size,
+			port->ncq ? "NCQ" : "no NCQ", port->num_slots);
+
+		port->block_dev = vfs_block_register_dev_sized(name, 0, SECTOR_SIZE,
+			port->physical_block_size, read_cb, write_cb, port);
+		port->block_dev->queue->submit_cb = submit_cb;
+	}
+	return 1;
+}
+
+void ahci_init(void) {
+	pci_walk(pci_cb);
+}
+
+#endif /* ENABLE_AHCI */
@@ -22,13 +22,18 @@
 #include <mem/kmalloc.h>
 #include <block/i386-ide.h>
 #include <block/virtio.h>
+#include <block/ahci.h>
+#include <block/nvme.h>
 #include <block/part.h>
 #include <block/null.h>
 #include <block/random.h>
+#include <block/ram.h>
 #include <fs/sysfs.h>
 #include <fs/mount.h>
 #include <mem/vm.h>
 #include <panic.h>
+#include <errno.h>
+#include <log.h>
 
 static int num_devs = 0;
 static struct vfs_block_dev* block_devs = NULL;
@@ -48,58 +53,232 @@ struct vfs_block_dev* vfs_block_get_dev(const char* path) {
 	return NULL;
 }
 
+static uint64_t transfer_sg(struct vfs_block_dev* dev, uint64_t start_block,
+	uint64_t num_blocks, struct vfs_block_sg* sg, int sg_count, bool write) {
+
+	if(!dev->queue) {
+		vfs_block_write_cb cb = write ? dev->write_cb : dev->read_cb;
+		uint64_t done = 0;
+		for(int i = 0; i < sg_count && done < num_blocks; i++) {
+			uint64_t n = MIN(sg[i].size / dev->block_size, num_blocks - done);
+			uint64_t r = cb(dev, start_block + dev->start_offset + done, n, sg[i].addr);
+
+			// Drivers return -1 on error
+			if(r > n) {
+				r = 0;
+			}
+
+			done += r;
+			if(r < n) {
+				break;
+			}
+		}
+		return done;
+	}
+
+	struct vfs_block_request req = {
+		.dev = dev,
+		.write = write,
+		.lba = start_block + dev->start_offset,
+		.num_blocks = num_blocks,
+		.sg = sg,
+		.sg_count = sg_count,
+	};
+
+	vfs_block_submit(&req);
+	return vfs_block_wait(&req);
+}
+
+static inline uint64_t transfer(struct vfs_block_dev* dev, uint64_t start_block,
+	uint64_t num_blocks, uint8_t* buf, bool write) {
+
+	struct vfs_block_sg sg = {
+		.addr = buf,
+		.size = num_blocks * dev->block_size,
+	};
+	return transfer_sg(dev, start_block, num_blocks, &sg, 1, write);
+}
+
 uint64_t vfs_block_read(struct vfs_block_dev* dev, uint64_t start_block, uint64_t num_blocks, uint8_t* buf) {
-	return dev->read_cb(dev, start_block + dev->start_offset, num_blocks, buf);
+	return transfer(dev, start_block, num_blocks, buf, false);
 }
 
 uint64_t vfs_block_write(struct vfs_block_dev* dev, uint64_t start_block, uint64_t num_blocks, uint8_t* buf) {
-	return dev->write_cb(dev, start_block + dev->start_offset, num_blocks, buf);
+	return transfer(dev, start_block, num_blocks, buf, true);
+}
+
+/* Unbuffered transfer straight from/to buf, which needs to be aligned to the
+ * device block size. buf may be a vm_map of user memory, in which case it is
+ * not physically contiguous. Drivers that use DMA build their scatter-gather
+ * lists page by page, so the buffer is passed on as-is.
+ */
+uint64_t vfs_block_direct(struct vfs_block_dev* dev, uint64_t start_block,
+	uint64_t num_blocks, uint8_t* buf, bool write) {
+
+	return transfer(dev, start_block, num_blocks, buf, write);
+}
+
+/* Transfer num_blocks blocks from/to the segments of a scatter-gather list as
+ * a single request. Returns the number of blocks transferred.
+ */
+uint64_t vfs_block_transfer_sg(struct vfs_block_dev* dev, uint64_t start_block,
+	uint64_t num_blocks, struct vfs_block_sg* sg, int sg_count, bool write) {
+
+	uint64_t size = 0;
+	for(int i = 0; i < sg_count; i++) {
+		if(sg[i].size % dev->block_size || (uintptr_t)sg[i].addr % VFS_BLOCK_SG_ALIGN) {
+			log(LOG_ERR, "block: %s: Misaligned scatter-gather segment %p, size %u\n",
+				dev->name, sg[i].addr, sg[i].size);
+			return 0;
+		}
+		size += sg[i].size;
+	}
+
+	if(size < num_blocks * dev->block_size) {
+		return 0;
+	}
+	return transfer_sg(dev, start_block, num_blocks, sg, sg_count, write);
+}
+
+/* Byte-granular reads and writes are split into a partial block at the start,
+ * whole blocks in the middle and a partial block at the end. Only the partial
+ * blocks go through bounce buffers, the middle is transferred in place as
+ * part of the same request. This needs the middle of buf to be aligned
+ * enough for the drivers, otherwise everything is bounced.
+ */
+struct split {
+	uint64_t start_block;
+	uint64_t num_blocks;
+	size_t offset;
+	size_t head;
+	size_t middle;
+	size_t tail;
+};
+
+static inline bool split_range(struct vfs_block_dev* dev, uint64_t position,
+	uint64_t size, uint8_t* buf, struct split* sp) {
+
+	int bs = dev->block_size;
+	sp->start_block = position / bs;
+	sp->offset = position % bs;
+	sp->num_blocks = RDIV(sp->offset + size, bs);
+	sp->head = sp->offset ? MIN(bs - sp->offset, size) : 0;
+	sp->tail = (size - sp->head) % bs;
+	sp->middle = size - sp->head - sp->tail;
+	return !sp->middle || !((uintptr_t)(buf + sp->head) % VFS_BLOCK_SG_ALIGN);
+}
+
+static int build_sg(struct vfs_block_dev* dev, struct split* sp, uint8_t* buf,
+	uint8_t* head_buf, uint8_t* tail_buf, struct vfs_block_sg* sg) {
+
+	int num = 0;
+	if(sp->head) {
+		sg[num].addr = head_buf;
+		sg[num++].size = dev->block_size;
+	}
+	if(sp->middle) {
+		sg[num].addr = buf + sp->head;
+		sg[num++].size = sp->middle;
+	}
+	if(sp->tail) {
+		sg[num].addr = tail_buf;
+		sg[num++].size = dev->block_size;
+	}
+	return num;
 }
 
 uint64_t vfs_block_sread(struct vfs_block_dev* dev, uint64_t position, uint64_t size, uint8_t* buf) {
-	int start_block = position / dev->block_size;
-	uint64_t offset = (position % dev->block_size);
-	int num_blocks = (size + offset + dev->block_size - 1) / dev->block_size;
+	struct split sp;
+	bool aligned = split_range(dev, position, size, buf, &sp);
 
-	if(!offset && !(size % dev->block_size)) {
-		return vfs_block_read(dev, start_block, num_blocks, buf) * dev->block_size;
+	if(!sp.offset && !(size % dev->block_size)) {
+		return vfs_block_read(dev, sp.start_block, sp.num_blocks, buf) * dev->block_size;
+	}
+
+	if(aligned) {
+		uint8_t* head_buf = sp.head ? kmalloc(dev->block_size) : NULL;
+		uint8_t* tail_buf = sp.tail ? kmalloc(dev->block_size) : NULL;
+		struct vfs_block_sg sg[3];
+		int sg_count = build_sg(dev, &sp, buf, head_buf, tail_buf, sg);
+
+		bool ok = transfer_sg(dev, sp.start_block, sp.num_blocks, sg, sg_count,
+			false) == sp.num_blocks;
+
+		if(ok && head_buf) {
+			memcpy(buf, head_buf + sp.offset, sp.head);
+		}
+		if(ok && tail_buf) {
+			memcpy(buf + sp.head + sp.middle, tail_buf, sp.tail);
+		}
+
+		kfree(head_buf);
+		kfree(tail_buf);
+		return ok ? size : -1;
 	}
 
 	vm_alloc_t alloc;
-	uint64_t buffer_size = num_blocks * dev->block_size;
+	uint64_t buffer_size = sp.num_blocks * dev->block_size;
 	assert(buffer_size >= size);
 
 	uint8_t* int_buf = vm_alloc(VM_KERNEL, &alloc, RDIV(buffer_size, PAGE_SIZE), NULL, 0);
 
-	if(vfs_block_read(dev, start_block, num_blocks, int_buf) < num_blocks) {
-		kfree(int_buf);
+	if(vfs_block_read(dev, sp.start_block, sp.num_blocks, int_buf) < sp.num_blocks) {
+		vm_free(&alloc);
 		return -1;
 	}
 
-	memcpy(buf, int_buf + offset, size);
+	memcpy(buf, int_buf + sp.offset, size);
 	vm_free(&alloc);
 	return size;
 }
 
 uint64_t vfs_block_swrite(struct vfs_block_dev* dev, uint64_t position, uint64_t size, uint8_t* buf) {
-	int start_block = position / dev->block_size;
-	uint64_t offset = (position % dev->block_size);
-	int num_blocks = (size + offset + dev->block_size - 1) / dev->block_size;
+	struct split sp;
+	bool aligned = split_range(dev, position, size, buf, &sp);
 
-	if(!offset && !(size % dev->block_size)) {
-		return vfs_block_write(dev, start_block, num_blocks, buf) * dev->block_size;
+	if(!sp.offset && !(size % dev->block_size)) {
+		return vfs_block_write(dev, sp.start_block, sp.num_blocks, buf) * dev->block_size;
 	}
 
-	// FIXME Should only read the required parts at the beginning and end
-	uint8_t* int_buf = kmalloc(num_blocks * dev->block_size);
-	if(vfs_block_read(dev, start_block, num_blocks, int_buf) < num_blocks) {
+	if(aligned) {
+		// Read-modify-write of the partial blocks only
+		uint8_t* head_buf = NULL;
+		uint8_t* tail_buf = NULL;
+		bool ok = true;
+
+		if(sp.head) {
+			head_buf = kmalloc(dev->block_size);
+			ok = vfs_block_read(dev, sp.start_block, 1, head_buf) == 1;
+			memcpy(head_buf + sp.offset, buf, sp.head);
+		}
+
+		if(ok && sp.tail) {
+			tail_buf = kmalloc(dev->block_size);
+			ok = vfs_block_read(dev, sp.start_block + sp.num_blocks - 1, 1, tail_buf) == 1;
+			memcpy(tail_buf, buf + sp.head + sp.middle, sp.tail);
+		}
+
+		if(ok) {
+			struct vfs_block_sg sg[3];
+			int sg_count = build_sg(dev, &sp, buf, head_buf, tail_buf, sg);
+			ok = transfer_sg(dev, sp.start_block, sp.num_blocks, sg, sg_count,
+				true) == sp.num_blocks;
+		}
+
+		kfree(head_buf);
+		kfree(tail_buf);
+		return ok ? size : -1;
+	}
+
+	uint8_t* int_buf = kmalloc(sp.num_blocks * dev->block_size);
+	if(vfs_block_read(dev, sp.start_block, sp.num_blocks, int_buf) < sp.num_blocks) {
 		kfree(int_buf);
 		return -1;
 	}
 
-	memcpy(int_buf + offset, buf, size);
+	memcpy(int_buf + sp.offset, buf, size);
 
-	if(vfs_block_write(dev, start_block, num_blocks, int_buf) < num_blocks) {
+	if(vfs_block_write(dev, sp.start_block, sp.num_blocks, int_buf) < sp.num_blocks) {
 		kfree(int_buf);
 		return -1;
 	}
@@ -108,12 +287,38 @@ uint64_t vfs_block_swrite(struct vfs_block_dev* dev, uint64_t position, uint64_t
 	return size;
 }
 
+/* O_DIRECT transfers on the raw device. Like on other systems, offset, size
+ * and buffer all need to be aligned to the block size.
+ */
+static size_t sfs_block_direct(struct vfs_block_dev* dev, uint64_t offset,
+	size_t size, void* buf, bool write) {
+
+	if(offset % dev->block_size || size % dev->block_size
+		|| (uintptr_t)buf % dev->block_size) {
+
+		sc_errno = EINVAL;
+		return -1;
+	}
+
+	uint64_t num_blocks = size / dev->block_size;
+	uint64_t done = vfs_block_direct(dev, offset / dev->block_size, num_blocks, buf, write);
+	if(!done && num_blocks) {
+		sc_errno = EIO;
+		return -1;
+	}
+	return done * dev->block_size;
+}
+
 static size_t sfs_block_read(struct vfs_callback_ctx* ctx, void* dest, size_t size) {
 	struct vfs_block_dev* dev = (struct vfs_block_dev*)ctx->fp->meta;
 	if(!dev) {
 		return -1;
 	}
 
+	if(ctx->fp->flags & O_DIRECT) {
+		return sfs_block_direct(dev, ctx->fp->offset, size, dest, false);
+	}
+
 	if(!vfs_block_sread(dev, ctx->fp->offset, size, dest)) {
 		return -1;
 	}
@@ -126,6 +331,10 @@ static size_t sfs_block_write(struct vfs_callback_ctx* ctx, void* src, size_t si
 		return -1;
 	}
 
+	if(ctx->fp->flags & O_DIRECT) {
+		return sfs_block_direct(dev, ctx->fp->offset, size, src, true);
+	}
+
 	if(!vfs_block_swrite(dev, ctx->fp->offset, size, src)) {
 		return -1;
 	}
@@ -145,7 +354,7 @@ static int sfs_block_stat(struct vfs_callback_ctx* ctx, vfs_stat_t* dest) {
 	dest->st_mode |= S_IWUSR | S_IWGRP | S_IWOTH;
 	dest->st_nlink = 1;
 	dest->st_blocks = 0;
-	dest->st_blksize = dev->block_size;
+	dest->st_blksize = dev->physical_block_size;
 	dest->st_uid = 0;
 	dest->st_gid = 0;
 	dest->st_rdev = 0;
@@ -157,13 +366,73 @@ static int sfs_block_stat(struct vfs_callback_ctx* ctx, vfs_stat_t* dest) {
 	return 0;
 }
 
-void vfs_block_register_dev(char* name, uint64_t start_offset,
-	vfs_block_read_cb read_cb, vfs_block_write_cb write_cb, void* meta) {
+static size_t sfs_stat_read(struct vfs_callback_ctx* ctx, void* dest, size_t size) {
+	struct vfs_block_dev* dev = (struct vfs_block_dev*)ctx->fp->meta;
+	if(ctx->fp->offset) {
+		return 0;
+	}
+
+	struct vfs_block_stats stats;
+	vfs_block_get_stats(dev, &stats);
+
+	/* First line uses the same fields as /sys/block/<dev>/stat on Linux, with
+	 * times in milliseconds and sizes in 512 byte sectors.
+	 */
+	size_t rsize = 0;
+	sysfs_printf("%u %u %llu %llu %u %u %llu %llu %u %llu %llu\n",
+		stats.ios[0], stats.merges[0], stats.sectors[0], stats.time_us[0] / 1000,
+		stats.ios[1], stats.merges[1], stats.sectors[1], stats.time_us[1] / 1000,
+		stats.inflight, stats.busy_us / 1000, stats.queue_us / 1000);
+
+	// Latency histograms, see VFS_BLOCK_LAT_BUCKETS
+	for(int dir = 0; dir < 2; dir++) {
+		sysfs_printf("%s_latency_us:", dir ? "write" : "read");
+		for(int i = 0; i < VFS_BLOCK_LAT_BUCKETS; i++) {
+			sysfs_printf(" %u", stats.latency[dir][i]);
+		}
+		sysfs_printf("\n");
+	}
+	return rsize;
+}
+
+static size_t sfs_block_size_read(struct vfs_callback_ctx* ctx, void* dest, size_t size) {
+	struct vfs_block_dev* dev = (struct vfs_block_dev*)ctx->fp->meta;
+	if(ctx->fp->offset) {
+		return 0;
+	}
+
+	size_t rsize = 0;
+	sysfs_printf("%d %d\n", dev->block_size, dev->physical_block_size);
+	return rsize;
+}
+
+static size_t sfs_alignment_read(struct vfs_callback_ctx* ctx, void* dest, size_t size) {
+	struct vfs_block_dev* dev = (struct vfs_block_dev*)ctx->fp->meta;
+	if(ctx->fp->offset) {
+		return 0;
+	}
+
+	size_t rsize = 0;
+	sysfs_printf("%d\n", dev->alignment_offset);
+	return rsize;
+}
+
+/* Register a block device. block_size is the logical block size in which
+ * LBAs are counted and needs to be a power of two between 512 and PAGE_SIZE.
+ */
+struct vfs_block_dev* vfs_block_register_dev_sized(char* name, uint64_t start_offset,
+	int block_size, int physical_block_size, vfs_block_read_cb read_cb,
+	vfs_block_write_cb write_cb, void* meta) {
 
 	struct vfs_block_dev* dev = zmalloc(sizeof(struct vfs_block_dev));
 	strcpy(dev->name, name);
 	dev->start_offset = start_offset;
-	dev->block_size = 512;
+	dev->block_size = block_size;
+	dev->physical_block_size = MAX(block_size, physical_block_size);
+
+	// start_offset is in blocks of the parent device, which has the same size
+	int misalign = (start_offset * block_size) % dev->physical_block_size;
+	dev->alignment_offset = (dev->physical_block_size - misalign) % dev->physical_block_size;
 	dev->read_cb = read_cb;
 	dev->write_cb = write_cb;
 	dev->meta = meta;
@@ -180,19 +449,63 @@ void vfs_block_register_dev(char* name, uint64_t start_offset,
 	struct sysfs_file* sfp = sysfs_add_dev(name, &sfs_block_cb);
 	sfp->meta = (void*)dev;
 
-	// Probe for partitions unless this is a partition
+	struct vfs_callbacks sfs_stat_cb = {
+		.read = sfs_stat_read,
+	};
+	char stat_path[40];
+	snprintf(stat_path, 40, "block/%s/stat", name);
+	sfp = sysfs_add_file(stat_path, &sfs_stat_cb);
+	sfp->meta = (void*)dev;
+
+	struct vfs_callbacks sfs_size_cb = {
+		.read = sfs_block_size_read,
+	};
+	snprintf(stat_path, 40, "block/%s/block_size", name);
+	sfp = sysfs_add_file(stat_path, &sfs_size_cb);
+	sfp->meta = (void*)dev;
+
+	struct vfs_callbacks sfs_align_cb = {
+		.read = sfs_alignment_read,
+	};
+	snprintf(stat_path, 40, "block/%s/alignment_offset", name);
+	sfp = sysfs_add_file(stat_path, &sfs_align_cb);
+	sfp->meta = (void*)dev;
+
+	// Partitions share the queue of their disk, see vfs_part_probe
 	if(!dev->start_offset) {
+		dev->queue = vfs_block_queue_new(dev);
 		vfs_part_probe(dev);
 	}
+	return dev;
+}
+
+struct vfs_block_dev* vfs_block_register_dev(char* name, uint64_t start_offset,
+	vfs_block_read_cb read_cb, vfs_block_write_cb write_cb, void* meta) {
+
+	return vfs_block_register_dev_sized(name, start_offset, 512, 512, read_cb,
+		write_cb, meta);
 }
 
 void block_init(void) {
+	vfs_block_queue_init();
 	ide_init();
 
 	#ifdef CONFIG_ENABLE_VIRTIO_BLOCK
 	virtio_block_init();
 	#endif
 
+	#ifdef CONFIG_ENABLE_AHCI
+	ahci_init();
+	#endif
+
+	#ifdef CONFIG_ENABLE_NVME
+	nvme_init();
+	#endif
+
+	#ifdef CONFIG_ENABLE_RAMDISK
+	block_ram_init();
+	#endif
+
 	block_null_init();
 	block_random_init();
 }
@@ -19,22 +19,131 @@
  */
 
 #include <stdbool.h>
+#include <spinlock.h>
+#include <tasks/completion.h>
 
 struct vfs_block_dev;
 typedef uint64_t (*vfs_block_read_cb)(struct vfs_block_dev* dev, uint64_t lba, uint64_t num_blocks, void* buf);
 typedef uint64_t (*vfs_block_write_cb)(struct vfs_block_dev* dev, uint64_t lba, uint64_t num_blocks, void* buf);
 
+// Buckets of the latency histograms, bucket n counts requests < 2^(n+1) us
+#define VFS_BLOCK_LAT_BUCKETS 24
+
+/* I/O statistics, indexed by 0 for reads and 1 for writes. Kept for both
+ * partitions and whole disks and exposed in /sys/block/<dev>/stat.
+ */
+struct vfs_block_stats {
+	uint32_t ios[2];
+	uint32_t merges[2];
+	uint64_t sectors[2];
+
+	// Sum of the time from submission to completion of all requests, in us
+	uint64_t time_us[2];
+	uint32_t latency[2][VFS_BLOCK_LAT_BUCKETS];
+
+	uint32_t inflight;
+	// Time with at least one request in flight, and integral of inflight over time
+	uint64_t busy_us;
+	uint64_t queue_us;
+	uint64_t stamp_us;
+};
+
+/* Segment of a scatter-gather list. Segments passed to vfs_block_transfer_sg
+ * need to be a multiple of the logical block size, and their addresses
+ * aligned to VFS_BLOCK_SG_ALIGN.
+ */
+struct vfs_block_sg {
+	void* addr;
+	size_t size;
+};
+
+#define VFS_BLOCK_SG_ALIGN 4
+
+/* A single block I/O request. Requests that are adjacent on disk get merged
+ * into runs while they are queued. The first request of a run is the one
+ * linked in the queue and has run_blocks set, the others hang off its merged
+ * pointer in LBA order.
+ */
+struct vfs_block_request {
+	struct vfs_block_request* next;
+	struct vfs_block_request* merged;
+	struct vfs_block_dev* dev;
+	bool write;
+
+	// Absolute LBA, including the partition offset
+	uint64_t lba;
+	uint64_t num_blocks;
+	struct vfs_block_sg* sg;
+	int sg_count;
+
+	// Timer tick by which the request should be dispatched
+	uint32_t deadline;
+	uint64_t start_us;
+	uint64_t run_blocks;
+
+	// Set once the request has been handed to the driver
+	volatile bool dispatched;
+
+	// result is the number of blocks transferred, valid once done is completed
+	struct completion done;
+	uint64_t result;
+};
+
+/* Optional asynchronous driver interface. Gets passed the head of a run and
+ * needs to call vfs_block_complete once the whole run has been transferred,
+ * usually from an interrupt handler.
+ */
+typedef void (*vfs_block_submit_cb)(struct vfs_block_dev* dev, struct vfs_block_request* run);
+
+// Shared between a disk and its partitions
+struct vfs_block_queue {
+	struct vfs_block_queue* next;
+	struct vfs_block_dev* dev;
+	spinlock_t lock;
+	uint8_t running;
+	int plugged;
+
+	// Pending runs, sorted by LBA
+	struct vfs_block_request* requests;
+	vfs_block_submit_cb submit_cb;
+
+	// LBA following the last dispatched run
+	uint64_t head_pos;
+
+	uint32_t depth;
+	uint32_t max_depth;
+	uint32_t inflight;
+	uint32_t submitted;
+	uint32_t dispatched;
+	uint32_t back_merges;
+	uint32_t front_merges;
+	uint32_t expired;
+};
+
 struct vfs_block_dev {
 	struct vfs_block_dev* next;
 	char name[50];
-	int block_size;
 	bool mounted;
 
+	/* Logical block size, which is the unit of all LBAs and transfers, and
+	 * physical block size. Writes of less than a physical block cause a
+	 * read-modify-write cycle in the device.
+	 */
+	int block_size;
+	int physical_block_size;
+
+	/* Offset in bytes from the start of the device to the first physical
+	 * block boundary. Only non-zero for misaligned partitions.
+	 */
+	int alignment_offset;
+
 	// Used for stat.st_dev
 	int number;
 
 	// Used for partitions
 	uint64_t start_offset;
+	struct vfs_block_queue* queue;
+	struct vfs_block_stats stats;
 
 	vfs_block_read_cb read_cb;
 	vfs_block_read_cb write_cb;
@@ -46,11 +155,29 @@ struct vfs_block_dev {
 uint64_t vfs_block_read(struct vfs_block_dev* dev, uint64_t start_block, uint64_t num_blocks, uint8_t* buf);
 uint64_t vfs_block_write(struct vfs_block_dev* dev, uint64_t start_block, uint64_t num_blocks, uint8_t* buf);
 
+uint64_t vfs_block_direct(struct vfs_block_dev* dev, uint64_t start_block,
+	uint64_t num_blocks, uint8_t* buf, bool write);
+uint64_t vfs_block_transfer_sg(struct vfs_block_dev* dev, uint64_t start_block,
+	uint64_t num_blocks, struct vfs_block_sg* sg, int sg_count, bool write);
+
 uint64_t vfs_block_sread(struct vfs_block_dev* dev, uint64_t offset, uint64_t size, uint8_t* buf);
 uint64_t vfs_block_swrite(struct vfs_block_dev* dev, uint64_t offset, uint64_t size, uint8_t* buf);
 
 struct vfs_block_dev* vfs_block_get_dev(const char* path);
-void vfs_block_register_dev(char* name, uint64_t start_offset,
+struct vfs_block_dev* vfs_block_register_dev(char* name, uint64_t start_offset,
 	vfs_block_read_cb read_cb, vfs_block_write_cb write_cb, void* meta);
+struct vfs_block_dev* vfs_block_register_dev_sized(char* name, uint64_t start_offset,
+	int block_size, int physical_block_size, vfs_block_read_cb read_cb,
+	vfs_block_write_cb write_cb, void* meta);
+
+struct vfs_block_queue* vfs_block_queue_new(struct vfs_block_dev* dev);
+void vfs_block_submit(struct vfs_block_request* req);
+uint64_t vfs_block_wait(struct vfs_block_request* req);
+void vfs_block_complete(struct vfs_block_request* run, uint64_t blocks);
+void vfs_block_run_queue(struct vfs_block_queue* queue);
+void vfs_block_get_stats(struct vfs_block_dev* dev, struct vfs_block_stats* dest);
+void vfs_block_plug(struct vfs_block_dev* dev);
+void vfs_block_unplug(struct vfs_block_dev* dev);
+void vfs_block_queue_init(void);
 
 void block_init(void);
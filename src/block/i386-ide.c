@@ -21,12 +21,44 @@
  * See https://github.com/klange/osdev/blob/strawberry-dev/kernel/devices/ide.c
  */
 
+/* Transfers use PCI bus master DMA if the IDE controller supports it. The
+ * calling task then blocks until the drive raises its interrupt, instead of
+ * copying every sector through the data port. Buffers that can't be mapped
+ * to physical memory and controllers without bus mastering fall back to PIO.
+ */
+
 #include <log.h>
 #include <mem/kmalloc.h>
+#include <mem/vm.h>
 #include <int/int.h>
 #include <portio.h>
 #include <block/i386-ide.h>
 #include <block/block.h>
+#include <bsp/i386-pci.h>
+#include <tasks/task.h>
+#include <tasks/completion.h>
+
+// Bus master IDE registers, relative to the base of the channel
+#define BM_REG_COMMAND 0x0
+#define BM_REG_STATUS 0x2
+#define BM_REG_PRDT 0x4
+
+#define BM_CMD_START 0x01
+// Set for transfers from the drive to memory
+#define BM_CMD_READ 0x08
+
+#define BM_STATUS_ACTIVE 0x01
+#define BM_STATUS_ERROR 0x02
+#define BM_STATUS_INTERRUPT 0x04
+
+// Compatibility mode control register of the primary channel
+#define PRIMARY_CONTROL 0x3f6
+
+#define PRD_EOT 0x8000
+#define PRDT_ENTRIES (PAGE_SIZE / sizeof(struct prd))
+
+// Maximum that fits into the sector count register of 28 bit commands
+#define DMA_MAX_SECTORS 256
 
 struct ata_identify {
 	uint16_t flags;
@@ -48,11 +80,33 @@ struct ata_identify {
 	uint16_t unused7[152];
 };
 
+// Physical region descriptor. Regions must not cross a 64 KiB boundary.
+struct prd {
+	uint32_t addr;
+	uint16_t size;
+	uint16_t flags;
+} __attribute__((packed));
+
 struct ide_dev {
 	uint16_t bus;
 	uint8_t slave;
+
+	bool can_dma;
+
+	// Bus master I/O base of the channel, only set up if DMA is used
+	uint16_t bmide;
+	struct prd* prdt;
+	void* prdt_phys;
+
+	// Command in flight, signalled by the interrupt handler
+	struct completion done;
+	volatile bool pending;
+	volatile uint8_t bm_status;
+	volatile uint8_t ata_status;
 };
 
+static struct ide_dev* primary = NULL;
+
 static void inportsm(unsigned short port, unsigned char * data, unsigned long size) {
 	asm volatile ("rep insw" : "+D" (data), "+c" (size) : "d" (port) : "memory");
 }
@@ -124,6 +178,9 @@ static struct ide_dev* ide_init_device(uint16_t bus) {
 	}
 
 	outb(dev->bus + ATA_REG_CONTROL, 0x02);
+
+	// Capabilities word 49, bit 8
+	dev->can_dma = device.capabilities[0] & (1 << 8);
 	return dev;
 }
 static inline int do_read(struct ide_dev* dev, uint64_t lba, void* buf) {
@@ -158,18 +215,6 @@ try_again:
 
 }
 
-static uint64_t ide_read_cb(struct vfs_block_dev* block_dev, uint64_t lba, uint64_t num_blocks, void* buf) {
-	struct ide_dev* dev = (struct ide_dev*)block_dev->meta;
-
-	for(int i = 0; i < num_blocks; i++) {
-		if(do_read(dev, lba + i, buf + i * 512) < 0) {
-			return i;
-		}
-	}
-
-	return num_blocks;
-}
-
 static inline int do_write(struct ide_dev* dev, uint64_t lba, void* buf) {
 	outb(dev->bus + ATA_REG_CONTROL, 0x02);
 
@@ -192,8 +237,161 @@ static inline int do_write(struct ide_dev* dev, uint64_t lba, void* buf) {
 	return 0;
 }
 
+static void int_handler(task_t* task, isf_t* state, int num) {
+	struct ide_dev* dev = primary;
+	if(!dev || !dev->pending) {
+		return;
+	}
+
+	/* The interrupt bit is also set for PIO transfers and the like, so only
+	 * react to it while a DMA command is pending.
+	 */
+	uint8_t bm_status = inb(dev->bmide + BM_REG_STATUS);
+	if(!(bm_status & BM_STATUS_INTERRUPT)) {
+		return;
+	}
+
+	outb(dev->bmide + BM_REG_COMMAND, 0);
+	outb(dev->bmide + BM_REG_STATUS, BM_STATUS_INTERRUPT | BM_STATUS_ERROR);
+
+	// Reading the status register acknowledges the interrupt on the drive
+	dev->ata_status = inb(dev->bus + ATA_REG_STATUS);
+	dev->bm_status = bm_status;
+	dev->pending = false;
+	complete(&dev->done);
+}
+
+/* Fill the PRD table for a transfer. If part of the buffer can't be
+ * translated to physical memory, only the sectors before it are covered.
+ * Returns the number of sectors in the table.
+ */
+static uint64_t build_prdt(struct ide_dev* dev, uint8_t* buf, uint64_t sectors) {
+	uint8_t* pos = buf;
+	size_t left = sectors * 512;
+	size_t region = 0;
+	int num = 0;
+
+	while(left) {
+		size_t len = MIN(left, PAGE_SIZE - (uintptr_t)pos % PAGE_SIZE);
+		uintptr_t phys = (uintptr_t)valloc_translate(VM_KERNEL, pos, false);
+		if(!phys) {
+			size_t mapped = (sectors * 512 - left) / 512;
+			return mapped ? build_prdt(dev, buf, mapped) : 0;
+		}
+
+		// Extend the last region if adjacent and within the same 64 KiB
+		if(num && dev->prdt[num - 1].addr + region == phys
+			&& (dev->prdt[num - 1].addr >> 16) == ((phys + len - 1) >> 16)) {
+			region += len;
+		} else {
+			dev->prdt[num].addr = phys;
+			dev->prdt[num].flags = 0;
+			num++;
+			region = len;
+		}
+
+		// A size of 0 means 64 KiB
+		dev->prdt[num - 1].size = region & 0xffff;
+		pos += len;
+		left -= len;
+	}
+
+	dev->prdt[num - 1].flags = PRD_EOT;
+	return sectors;
+}
+
+/* Transfer up to DMA_MAX_SECTORS using bus master DMA and block until the
+ * drive interrupts. Returns the number of sectors transferred, or -1 if the
+ * buffer is not suitable for DMA and PIO should be used instead.
+ */
+static int do_dma(struct ide_dev* dev, uint64_t lba, uint64_t sectors, void* buf, bool write) {
+	sectors = build_prdt(dev, buf, MIN(sectors, DMA_MAX_SECTORS));
+	if(!sectors) {
+		return -1;
+	}
+
+	ata_wait_ready(dev);
+
+	uint8_t direction = write ? 0 : BM_CMD_READ;
+	outl(dev->bmide + BM_REG_PRDT, (uintptr_t)dev->prdt_phys);
+	outb(dev->bmide + BM_REG_COMMAND, direction);
+	outb(dev->bmide + BM_REG_STATUS, BM_STATUS_INTERRUPT | BM_STATUS_ERROR);
+
+	completion_init(&dev->done);
+	dev->pending = true;
+
+	outb(dev->bus + ATA_REG_HDDEVSEL, 0xe0 | dev->slave << 4 |
+		(lba & 0x0f000000) >> 24);
+	outb(dev->bus + ATA_REG_FEATURES, 0x00);
+	outb(dev->bus + ATA_REG_SECCOUNT0, sectors & 0xff);
+	outb(dev->bus + ATA_REG_LBA0, (lba & 0x000000ff) >>  0);
+	outb(dev->bus + ATA_REG_LBA1, (lba & 0x0000ff00) >>  8);
+	outb(dev->bus + ATA_REG_LBA2, (lba & 0x00ff0000) >> 16);
+	outb(dev->bus + ATA_REG_COMMAND, write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA);
+	outb(dev->bmide + BM_REG_COMMAND, direction | BM_CMD_START);
+
+	completion_wait(&dev->done);
+
+	if((dev->ata_status & (ATA_SR_ERR | ATA_SR_DF)) || (dev->bm_status & BM_STATUS_ERROR)) {
+		log(LOG_WARN, "ide: DMA %s of %u sectors at lba %u failed, status %#x, bm %#x\n",
+			write ? "write" : "read", (uint32_t)sectors, (uint32_t)lba,
+			dev->ata_status, dev->bm_status);
+		return 0;
+	}
+	return sectors;
+}
+
+/* Transfer num_blocks using DMA where possible. Returns the number of blocks
+ * transferred, which is short if a DMA command has failed.
+ */
+static uint64_t dma_transfer(struct ide_dev* dev, uint64_t lba, uint64_t num_blocks,
+	void* buf, bool write) {
+
+	uint64_t done = 0;
+	while(done < num_blocks) {
+		int r = do_dma(dev, lba + done, num_blocks - done, buf + done * 512, write);
+
+		// Not mappable, use PIO for this sector
+		if(r < 0) {
+			int pio = write ? do_write(dev, lba + done, buf + done * 512)
+				: do_read(dev, lba + done, buf + done * 512);
+			if(pio < 0) {
+				break;
+			}
+			r = 1;
+		}
+
+		if(!r) {
+			break;
+		}
+		done += r;
+	}
+	return done;
+}
+
+static uint64_t ide_read_cb(struct vfs_block_dev* block_dev, uint64_t lba, uint64_t num_blocks, void* buf) {
+	struct ide_dev* dev = (struct ide_dev*)block_dev->meta;
+	if(dev->prdt) {
+		return dma_transfer(dev, lba, num_blocks, buf, false);
+	}
+
+	for(int i = 0; i < num_blocks; i++) {
+		if(do_read(dev, lba + i, buf + i * 512) < 0) {
+			return i;
+		}
+	}
+
+	return num_blocks;
+}
+
 static uint64_t ide_write_cb(struct vfs_block_dev* block_dev, uint64_t lba, uint64_t num_blocks, void* buf) {
 	struct ide_dev* dev = (struct ide_dev*)block_dev->meta;
+	if(dev->prdt) {
+		uint64_t done = dma_transfer(dev, lba, num_blocks, buf, true);
+		outb(dev->bus + ATA_REG_COMMAND, ATA_CMD_CACHE_FLUSH);
+		ata_wait(dev, 0);
+		return done;
+	}
 
 	for(int i = 0; i < num_blocks; i++) {
 		if(do_write(dev, lba + i, buf + i * 512) < 0) {
@@ -204,7 +402,47 @@ static uint64_t ide_write_cb(struct vfs_block_dev* block_dev, uint64_t lba, uint
 	return num_blocks;
 }
 
+/* Look for a bus master capable IDE controller that has its primary channel
+ * in compatibility mode, i.e. at the legacy ports used above.
+ */
+static int pci_cb(pci_device_t* pci_dev) {
+	if(pci_dev->class != PCI_CLASS_STORAGE || pci_dev->subclass != 0x01
+		|| (pci_dev->prog_if & 0x01) || !(pci_dev->prog_if & 0x80)) {
+		return 1;
+	}
+
+	uint32_t bar = pci_get_bar(pci_dev, 4);
+	if(!(bar & 0x1) || !(bar & 0xfffc)) {
+		return 1;
+	}
+
+	struct ide_dev* dev = primary;
+	dev->prdt = zmalloc_a(PAGE_SIZE);
+	dev->prdt_phys = valloc_translate(VM_KERNEL, dev->prdt, false);
+	if(!dev->prdt_phys) {
+		kfree(dev->prdt);
+		dev->prdt = NULL;
+		return 1;
+	}
+
+	dev->bmide = bar & 0xfffc;
+	pci_set_bus_master(pci_dev);
+	int_register(IRQ(14), int_handler, false);
+
+	// Make sure the drive interrupts (nIEN clear)
+	outb(PRIMARY_CONTROL, 0);
+
+	log(LOG_INFO, "ide: Using bus master DMA, registers at %#x\n", dev->bmide);
+	return 0;
+}
+
 void ide_init(void) {
-	struct ide_dev* dev = ide_init_device(0x1F0);
-	vfs_block_register_dev("ide1", 0, ide_read_cb, ide_write_cb, (void*)dev);
+	primary = ide_init_device(0x1F0);
+	if(primary->can_dma) {
+		pci_walk(pci_cb);
+	} else {
+		log(LOG_INFO, "ide: Drive does not support DMA, using PIO\n");
+	}
+
+	vfs_block_register_dev("ide1", 0, ide_read_cb, ide_write_cb, (void*)primary);
 }
@@ -0,0 +1,875 @@
+/* nvme.c: NVM Express driver
+ * Copyright © 2020 Lukas Martini
+ *
+ * This file is part of Xelix.
+ *
+ * Xelix is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Xelix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Xelix. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* NVMe controllers are driven through pairs of submission and completion
+ * queues in host memory. The admin queue is only used during initialization
+ * and polled. After that, up to two I/O queue pairs are created, one for
+ * reads and one for writes, so that reads don't have to wait behind large
+ * writes. Each I/O completion queue gets its own MSI-X vector if possible.
+ *
+ * Data buffers are described using PRPs: The first entry may start anywhere
+ * in a page, all following ones need to be page aligned and all but the last
+ * need to extend to the end of their page. Runs from the block queue that
+ * don't fit these rules or are larger than a single command can transfer are
+ * split up, with a run_state tracking their completion like in the AHCI
+ * driver.
+ *
+ * Every namespace with an LBA size between 512 bytes and 4 KiB is registered
+ * as a block device named nvme<controller>n<namespace id>.
+ */
+
+#ifdef CONFIG_ENABLE_NVME
+
+#include <block/nvme.h>
+#include <block/block.h>
+#include <bsp/i386-pci.h>
+#include <int/int.h>
+#include <mem/vm.h>
+#include <mem/kmalloc.h>
+#include <tasks/task.h>
+#include <tasks/scheduler.h>
+#include <tasks/completion.h>
+#include <string.h>
+#include <time.h>
+#include <log.h>
+
+#define ADMIN_QUEUE_SIZE 16
+
+// Entries per I/O queue. Keeps the submission queue in a single page.
+#define IO_QUEUE_SIZE 64
+#define IO_QUEUE_CMDS 32
+#define MAX_STATES 64
+
+// Entries in the PRP list of a command, plus one in PRP1
+#define PRP_LIST_ENTRIES (PAGE_SIZE / sizeof(uint64_t))
+
+// Controller registers, as byte offsets
+#define REG_CAP 0x0
+#define REG_VS 0x8
+#define REG_CC 0x14
+#define REG_CSTS 0x1c
+#define REG_AQA 0x24
+#define REG_ASQ 0x28
+#define REG_ACQ 0x30
+#define REG_DOORBELLS 0x1000
+
+#define CAP_MQES(cap) (((cap) & 0xffff) + 1)
+#define CAP_TO(cap) (((cap) >> 24) & 0xff)
+#define CAP_DSTRD(cap) (((cap) >> 32) & 0xf)
+#define CAP_MPSMIN(cap) (((cap) >> 48) & 0xf)
+
+#define CC_EN 1
+#define CC_IOSQES (6 << 16)
+#define CC_IOCQES (4 << 20)
+
+#define CSTS_RDY 1
+#define CSTS_CFS (1 << 1)
+
+#define ADMIN_CREATE_SQ 0x01
+#define ADMIN_CREATE_CQ 0x05
+#define ADMIN_IDENTIFY 0x06
+#define ADMIN_SET_FEATURES 0x09
+
+#define IDENTIFY_NS 0
+#define IDENTIFY_CTRL 1
+#define IDENTIFY_NS_LIST 2
+
+#define FEATURE_NUM_QUEUES 0x07
+
+#define IO_WRITE 0x01
+#define IO_READ 0x02
+
+#define QUEUE_PHYS_CONTIG 1
+#define QUEUE_IRQ_ENABLE 2
+
+struct nvme_cmd {
+	uint8_t opcode;
+	uint8_t flags;
+	uint16_t cid;
+	uint32_t nsid;
+	uint64_t reserved;
+	uint64_t mptr;
+	uint64_t prp1;
+	uint64_t prp2;
+	uint32_t cdw10;
+	uint32_t cdw11;
+	uint32_t cdw12;
+	uint32_t cdw13;
+	uint32_t cdw14;
+	uint32_t cdw15;
+} __attribute__((packed));
+
+struct nvme_cpl {
+	uint32_t result;
+	uint32_t reserved;
+	uint16_t sq_head;
+	uint16_t sq_id;
+	uint16_t cid;
+	// Bit 0 is the phase tag, the rest the status field
+	volatile uint16_t status;
+} __attribute__((packed));
+
+struct run_state {
+	bool used;
+	bool sync;
+	struct vfs_block_request* run;
+	volatile int pending;
+	uint64_t ok_sectors;
+};
+
+struct command {
+	uint16_t id;
+	bool used;
+	struct run_state* state;
+
+	// Offset of this command in the run and its length, in sectors
+	uint64_t offset;
+	uint64_t length;
+
+	uint64_t prp1;
+	uint64_t* prp_list;
+	uintptr_t prp_list_phys;
+};
+
+struct queue {
+	int id;
+	int size;
+	struct nvme_cmd* sq;
+	struct nvme_cpl* cq;
+	uint16_t sq_tail;
+	uint16_t cq_head;
+	uint8_t phase;
+	volatile uint32_t* sq_doorbell;
+	volatile uint32_t* cq_doorbell;
+
+	// Interrupt vector, only used to tell queues apart with MSI-X
+	int vector;
+
+	struct command commands[IO_QUEUE_CMDS];
+	int num_commands;
+};
+
+struct namespace {
+	struct namespace* next;
+	struct controller* ctrl;
+	uint32_t id;
+	uint64_t sectors;
+	uint32_t block_size;
+	struct vfs_block_dev* block_dev;
+};
+
+struct controller {
+	struct controller* next;
+	int index;
+	volatile uint8_t* regs;
+	uint32_t doorbell_stride;
+	uint32_t timeout;
+	bool msix;
+
+	struct queue admin;
+	struct queue io[2];
+	int num_io;
+	struct queue* read_queue;
+	struct queue* write_queue;
+
+	// Maximum number of PRP entries per command, including PRP1
+	size_t max_prps;
+
+	struct run_state states[MAX_STATES];
+	struct namespace* namespaces;
+};
+
+// Command that is being built
+struct build {
+	struct command* cmd;
+	size_t num;
+	size_t bytes;
+	uint64_t offset;
+	uintptr_t end;
+};
+
+static struct controller* controllers = NULL;
+static int num_controllers = 0;
+
+static inline void* phys_addr(void* addr) {
+	return valloc_translate(VM_KERNEL, addr, false);
+}
+
+static inline uint32_t reg_read(struct controller* ctrl, int reg) {
+	return *(volatile uint32_t*)(ctrl->regs + reg);
+}
+
+static inline void reg_write(struct controller* ctrl, int reg, uint32_t value) {
+	*(volatile uint32_t*)(ctrl->regs + reg) = value;
+}
+
+static inline void reg_write64(struct controller* ctrl, int reg, uint64_t value) {
+	reg_write(ctrl, reg, value & 0xffffffff);
+	reg_write(ctrl, reg + 4, value >> 32);
+}
+
+static bool wait_ready(struct controller* ctrl, bool ready) {
+	for(uint32_t i = 0; (reg_read(ctrl, REG_CSTS) & CSTS_RDY) != ready; i++) {
+		if(i >= ctrl->timeout || reg_read(ctrl, REG_CSTS) & CSTS_CFS) {
+			return false;
+		}
+		sleep_ticks(1);
+	}
+	return true;
+}
+
+static void init_queue(struct controller* ctrl, struct queue* queue, int id, int size) {
+	queue->id = id;
+	queue->size = size;
+	queue->phase = 1;
+	queue->sq = zmalloc_a(PAGE_SIZE);
+	queue->cq = zmalloc_a(PAGE_SIZE);
+	queue->sq_doorbell = (uint32_t*)(ctrl->regs + REG_DOORBELLS
+		+ (2 * id) * ctrl->doorbell_stride);
+	queue->cq_doorbell = (uint32_t*)(ctrl->regs + REG_DOORBELLS
+		+ (2 * id + 1) * ctrl->doorbell_stride);
+
+	if(!id) {
+		return;
+	}
+
+	queue->num_commands = MIN(IO_QUEUE_CMDS, size - 1);
+	for(int i = 0; i < queue->num_commands; i++) {
+		struct command* cmd = &queue->commands[i];
+		cmd->id = i;
+		cmd->prp_list = zmalloc_a(PAGE_SIZE);
+		cmd->prp_list_phys = (uintptr_t)phys_addr(cmd->prp_list);
+	}
+}
+
+static void free_queue(struct queue* queue) {
+	for(int i = 0; i < queue->num_commands; i++) {
+		kfree(queue->commands[i].prp_list);
+	}
+
+	kfree(queue->sq);
+	kfree(queue->cq);
+	queue->sq = NULL;
+	queue->cq = NULL;
+	queue->num_commands = 0;
+}
+
+static void submit_cmd(struct queue* queue, struct nvme_cmd* cmd) {
+	memcpy(&queue->sq[queue->sq_tail], cmd, sizeof(struct nvme_cmd));
+	queue->sq_tail = (queue->sq_tail + 1) % queue->size;
+	__sync_synchronize();
+	*queue->sq_doorbell = queue->sq_tail;
+}
+
+/* Runs an admin command and polls for its completion, since the admin queue
+ * has no interrupts. Returns the result dword, or -1 on failure.
+ */
+static int64_t admin_cmd(struct controller* ctrl, struct nvme_cmd* cmd) {
+	struct queue* queue = &ctrl->admin;
+	cmd->cid = queue->sq_tail;
+	submit_cmd(queue, cmd);
+
+	struct nvme_cpl* cpl = &queue->cq[queue->cq_head];
+	for(uint32_t i = 0; (cpl->status & 1) != queue->phase; i++) {
+		if(i >= ctrl->timeout) {
+			log(LOG_ERR, "nvme%d: Admin command %#x timed out\n",
+				ctrl->index, cmd->opcode);
+			return -1;
+		}
+		sleep_ticks(1);
+	}
+
+	uint16_t status = cpl->status >> 1;
+	uint32_t result = cpl->result;
+	if(++queue->cq_head == queue->size) {
+		queue->cq_head = 0;
+		queue->phase ^= 1;
+	}
+	*queue->cq_doorbell = queue->cq_head;
+
+	if(status) {
+		log(LOG_ERR, "nvme%d: Admin command %#x failed with status %#x\n",
+			ctrl->index, cmd->opcode, status);
+		return -1;
+	}
+	return result;
+}
+
+static int identify(struct controller* ctrl, uint8_t cns, uint32_t nsid, void* buf) {
+	struct nvme_cmd cmd = {
+		.opcode = ADMIN_IDENTIFY,
+		.nsid = nsid,
+		.prp1 = (uintptr_t)phys_addr(buf),
+		.cdw10 = cns,
+	};
+	return admin_cmd(ctrl, &cmd) < 0 ? -1 : 0;
+}
+
+static int create_io_queue(struct controller* ctrl, struct queue* queue, int iv) {
+	struct nvme_cmd cmd = {
+		.opcode = ADMIN_CREATE_CQ,
+		.prp1 = (uintptr_t)phys_addr(queue->cq),
+		.cdw10 = ((queue->size - 1) << 16) | queue->id,
+		.cdw11 = (iv << 16) | QUEUE_IRQ_ENABLE | QUEUE_PHYS_CONTIG,
+	};
+	if(admin_cmd(ctrl, &cmd) < 0) {
+		return -1;
+	}
+
+	bzero(&cmd, sizeof(cmd));
+	cmd.opcode = ADMIN_CREATE_SQ;
+	cmd.prp1 = (uintptr_t)phys_addr(queue->sq);
+	cmd.cdw10 = ((queue->size - 1) << 16) | queue->id;
+	cmd.cdw11 = (queue->id << 16) | QUEUE_PHYS_CONTIG;
+	return admin_cmd(ctrl, &cmd) < 0 ? -1 : 0;
+}
+
+// Needs to be called from task context
+static struct command* alloc_command(struct queue* queue) {
+	while(1) {
+		int_disable();
+		for(int i = 0; i < queue->num_commands; i++) {
+			if(!queue->commands[i].used) {
+				struct command* cmd = &queue->commands[i];
+				cmd->used = true;
+				int_enable();
+				return cmd;
+			}
+		}
+
+		// Reenables interrupts
+		scheduler_yield();
+	}
+}
+
+static struct run_state* alloc_state(struct controller* ctrl) {
+	while(1) {
+		int_disable();
+		for(int i = 0; i < MAX_STATES; i++) {
+			if(!ctrl->states[i].used) {
+				struct run_state* state = &ctrl->states[i];
+				state->used = true;
+				int_enable();
+				return state;
+			}
+		}
+		scheduler_yield();
+	}
+}
+
+static void finish(struct run_state* state) {
+	struct vfs_block_request* run = state->run;
+	uint64_t sectors = state->ok_sectors;
+	bool sync = state->sync;
+	state->used = false;
+
+	if(sync) {
+		run->result = MIN(sectors, run->num_blocks);
+		complete(&run->done);
+	} else {
+		vfs_block_complete(run, sectors);
+	}
+}
+
+static void put_state(struct run_state* state) {
+	if(!__sync_sub_and_fetch(&state->pending, 1)) {
+		finish(state);
+	}
+}
+
+// Called from the interrupt handler
+static void command_done(struct command* cmd, uint16_t status) {
+	struct run_state* state = cmd->state;
+	if(status) {
+		log(LOG_ERR, "nvme: I/O command failed with status %#x\n", status);
+		state->ok_sectors = MIN(state->ok_sectors, cmd->offset);
+	}
+
+	cmd->used = false;
+	put_state(state);
+}
+
+static void process_queue(struct queue* queue) {
+	bool progress = false;
+	while(1) {
+		struct nvme_cpl* cpl = &queue->cq[queue->cq_head];
+		if((cpl->status & 1) != queue->phase) {
+			break;
+		}
+
+		if(cpl->cid < queue->num_commands) {
+			command_done(&queue->commands[cpl->cid], cpl->status >> 1);
+		}
+
+		if(++queue->cq_head == queue->size) {
+			queue->cq_head = 0;
+			queue->phase ^= 1;
+		}
+		progress = true;
+	}
+
+	if(progress) {
+		*queue->cq_doorbell = queue->cq_head;
+	}
+}
+
+static void int_handler(task_t* task, isf_t* state, int num) {
+	for(struct controller* ctrl = controllers; ctrl; ctrl = ctrl->next) {
+		for(int i = 0; i < ctrl->num_io; i++) {
+			if(ctrl->msix && ctrl->io[i].vector != num) {
+				continue;
+			}
+			process_queue(&ctrl->io[i]);
+		}
+	}
+}
+
+static void issue_build(struct namespace* ns, struct queue* queue,
+	struct run_state* state, struct build* b) {
+
+	struct command* cmd = b->cmd;
+	bool write = state->run->write;
+	cmd->state = state;
+	cmd->offset = b->offset;
+	cmd->length = b->bytes / ns->block_size;
+
+	uint64_t lba = state->run->lba + cmd->offset;
+	struct nvme_cmd sqe = {
+		.opcode = write ? IO_WRITE : IO_READ,
+		.cid = cmd->id,
+		.nsid = ns->id,
+		.prp1 = cmd->prp1,
+		.cdw10 = lba & 0xffffffff,
+		.cdw11 = lba >> 32,
+		.cdw12 = cmd->length - 1,
+	};
+
+	if(b->num == 2) {
+		sqe.prp2 = cmd->prp_list[0];
+	} else if(b->num > 2) {
+		sqe.prp2 = cmd->prp_list_phys;
+	}
+
+	__sync_add_and_fetch(&state->pending, 1);
+
+	// The queue can't overflow as it has more entries than commands
+	int_disable();
+	submit_cmd(queue, &sqe);
+	int_enable();
+
+	b->offset += cmd->length;
+	b->cmd = NULL;
+	b->num = 0;
+	b->bytes = 0;
+}
+
+/* Add a piece of memory within a single page to the command being built.
+ * Starts a new command if the piece can't be described by the PRPs of the
+ * current one. Commands always need to end on a block boundary, so this
+ * fails if a buffer has holes that don't fall on one.
+ */
+static bool add_piece(struct namespace* ns, struct queue* queue,
+	struct run_state* state, struct build* b, uintptr_t phys, size_t len) {
+
+	while(len) {
+		// Continues the last entry within the same page
+		if(b->cmd && b->end == phys && phys % PAGE_SIZE) {
+			b->bytes += len;
+			b->end += len;
+			return true;
+		}
+
+		if(b->cmd && (b->end % PAGE_SIZE || phys % PAGE_SIZE)) {
+			if(b->bytes % ns->block_size) {
+				return false;
+			}
+			issue_build(ns, queue, state, b);
+		}
+
+		size_t take = len;
+		if(!b->cmd) {
+			// PRP1 only needs to be dword aligned
+			if(phys & 3) {
+				return false;
+			}
+
+			b->cmd = alloc_command(queue);
+			b->cmd->prp1 = phys;
+		} else {
+			// The last entry of a command needs to fill it up to a block
+			if(b->num == ns->ctrl->max_prps - 1) {
+				take = len - (b->bytes + len) % ns->block_size;
+				if(!take) {
+					return false;
+				}
+			}
+
+			b->cmd->prp_list[b->num - 1] = phys;
+		}
+
+		b->num++;
+		b->bytes += take;
+		b->end = phys + take;
+		phys += take;
+		len -= take;
+
+		if(b->num >= ns->ctrl->max_prps) {
+			issue_build(ns, queue, state, b);
+		}
+	}
+	return true;
+}
+
+static void submit(struct namespace* ns, struct vfs_block_request* run, bool sync) {
+	struct controller* ctrl = ns->ctrl;
+	struct queue* queue = run->write ? ctrl->write_queue : ctrl->read_queue;
+	struct run_state* state = alloc_state(ctrl);
+	state->run = run;
+	state->sync = sync;
+	state->ok_sectors = run->run_blocks;
+
+	// Reference held while commands are being issued
+	state->pending = 1;
+
+	struct build b = {0};
+	uint64_t left = run->run_blocks;
+	for(struct vfs_block_request* req = run; req && left; req = req->merged) {
+		uint64_t req_left = MIN(req->num_blocks, left) * ns->block_size;
+		left -= MIN(req->num_blocks, left);
+
+		for(int i = 0; i < req->sg_count && req_left; i++) {
+			uint8_t* addr = req->sg[i].addr;
+			size_t seg_left = MIN(req->sg[i].size, req_left);
+			req_left -= seg_left;
+
+			while(seg_left) {
+				size_t len = MIN(seg_left, PAGE_SIZE - (uintptr_t)addr % PAGE_SIZE);
+				uintptr_t phys = (uintptr_t)phys_addr(addr);
+
+				if(!phys || !add_piece(ns, queue, state, &b, phys, len)) {
+					log(LOG_ERR, "nvme: Can't transfer to buffer at %p\n", addr);
+					state->ok_sectors = MIN(state->ok_sectors, b.offset);
+					left = 0;
+					req_left = 0;
+					break;
+				}
+
+				addr += len;
+				seg_left -= len;
+			}
+		}
+	}
+
+	// Nothing past a mapping error gets issued
+	if(b.num && state->ok_sectors == run->run_blocks) {
+		issue_build(ns, queue, state, &b);
+	} else if(b.cmd) {
+		b.cmd->used = false;
+	}
+
+	put_state(state);
+}
+
+static void submit_cb(struct vfs_block_dev* block_dev, struct vfs_block_request* run) {
+	submit((struct namespace*)block_dev->meta, run, false);
+}
+
+// Synchronous interface, used for partition probing
+static uint64_t transfer(struct namespace* ns, uint64_t lba, uint64_t num_blocks,
+	void* buf, bool write) {
+
+	struct vfs_block_sg sg = {
+		.addr = buf,
+		.size = num_blocks * ns->block_size,
+	};
+
+	struct vfs_block_request req = {
+		.write = write,
+		.lba = lba,
+		.num_blocks = num_blocks,
+		.run_blocks = num_blocks,
+		.sg = &sg,
+		.sg_count = 1,
+	};
+
+	completion_init(&req.done);
+	submit(ns, &req, true);
+	completion_wait(&req.done);
+	return req.result ? req.result : -1;
+}
+
+static uint64_t read_cb(struct vfs_block_dev* block_dev, uint64_t lba, uint64_t num_blocks, void* buf) {
+	return transfer((struct namespace*)block_dev->meta, lba, num_blocks, buf, false);
+}
+
+static uint64_t write_cb(struct vfs_block_dev* block_dev, uint64_t lba, uint64_t num_blocks, void* buf) {
+	return transfer((struct namespace*)block_dev->meta, lba, num_blocks, buf, true);
+}
+
+static void free_controller(struct controller* ctrl) {
+	reg_write(ctrl, REG_CC, 0);
+	for(int i = 0; i < ctrl->num_io; i++) {
+		free_queue(&ctrl->io[i]);
+	}
+	free_queue(&ctrl->admin);
+	kfree(ctrl);
+}
+
+static bool reset(struct controller* ctrl) {
+	reg_write(ctrl, REG_CC, reg_read(ctrl, REG_CC) & ~CC_EN);
+	if(!wait_ready(ctrl, false)) {
+		log(LOG_ERR, "nvme%d: Controller did not reset\n", ctrl->index);
+		return false;
+	}
+
+	init_queue(ctrl, &ctrl->admin, 0, ADMIN_QUEUE_SIZE);
+	reg_write(ctrl, REG_AQA, ((ADMIN_QUEUE_SIZE - 1) << 16) | (ADMIN_QUEUE_SIZE - 1));
+	reg_write64(ctrl, REG_ASQ, (uintptr_t)phys_addr(ctrl->admin.sq));
+	reg_write64(ctrl, REG_ACQ, (uintptr_t)phys_addr(ctrl->admin.cq));
+
+	// Round robin arbitration, NVM command set, 4 KiB pages
+	reg_write(ctrl, REG_CC, CC_IOSQES | CC_IOCQES | CC_EN);
+	if(!wait_ready(ctrl, true)) {
+		log(LOG_ERR, "nvme%d: Controller did not become ready, CSTS %#x\n",
+			ctrl->index, reg_read(ctrl, REG_CSTS));
+		return false;
+	}
+	return true;
+}
+
+/* Set up the I/O queues and their interrupts. Prefers one MSI-X vector per
+ * completion queue, then a shared MSI, then the legacy interrupt line.
+ */
+static bool setup_io_queues(struct controller* ctrl, pci_device_t* pci_dev, int mqes) {
+	// Zero-based counts of submission and completion queues
+	struct nvme_cmd cmd = {
+		.opcode = ADMIN_SET_FEATURES,
+		.cdw10 = FEATURE_NUM_QUEUES,
+		.cdw11 = 1 | (1 << 16),
+	};
+	int64_t granted = admin_cmd(ctrl, &cmd);
+	if(granted < 0) {
+		return false;
+	}
+
+	ctrl->num_io = MIN(2, MIN(granted & 0xffff, granted >> 16) + 1);
+	int size = MIN(IO_QUEUE_SIZE, mqes);
+
+	uint8_t vectors[2];
+	int num_vectors;
+	for(num_vectors = 0; num_vectors < ctrl->num_io; num_vectors++) {
+		int vector = int_alloc_vector();
+		if(vector < 0) {
+			break;
+		}
+		vectors[num_vectors] = vector;
+	}
+	ctrl->msix = num_vectors == ctrl->num_io
+		&& !pci_enable_msix(pci_dev, vectors, ctrl->num_io);
+
+	int shared_vector = -1;
+	if(!ctrl->msix) {
+		for(int i = 0; i < num_vectors; i++) {
+			int_free_vector(vectors[i]);
+		}
+
+		shared_vector = int_alloc_vector();
+		if(shared_vector < 0 || pci_enable_msi(pci_dev, shared_vector) < 0) {
+			int_free_vector(shared_vector);
+			shared_vector = IRQ(pci_dev->interrupt_line);
+		}
+		int_register(shared_vector, int_handler, false);
+	}
+
+	for(int i = 0; i < ctrl->num_io; i++) {
+		struct queue* queue = &ctrl->io[i];
+		init_queue(ctrl, queue, i + 1, size);
+		queue->vector = ctrl->msix ? vectors[i] : shared_vector;
+		if(ctrl->msix) {
+			int_register(queue->vector, int_handler, false);
+		}
+
+		if(create_io_queue(ctrl, queue, ctrl->msix ? i : 0) < 0) {
+			log(LOG_ERR, "nvme%d: Could not create I/O queue %d\n",
+				ctrl->index, queue->id);
+
+			// Release this queue and the vectors of the ones not set up
+			free_queue(queue);
+			for(int j = i; ctrl->msix && j < ctrl->num_io; j++) {
+				int_free_vector(vectors[j]);
+			}
+			ctrl->num_io = i;
+			break;
+		}
+	}
+
+	if(!ctrl->num_io) {
+		if(ctrl->msix) {
+			pci_disable_msix(pci_dev);
+		} else {
+			int_free_vector(shared_vector);
+		}
+		return false;
+	}
+
+	ctrl->read_queue = &ctrl->io[0];
+	ctrl->write_queue = &ctrl->io[ctrl->num_io - 1];
+	return true;
+}
+
+static void add_namespace(struct controller* ctrl, uint32_t nsid, uint8_t* data) {
+	if(identify(ctrl, IDENTIFY_NS, nsid, data) < 0) {
+		return;
+	}
+
+	uint64_t sectors = *(uint64_t*)data;
+	uint8_t format = data[26] & 0xf;
+	uint8_t lbads = data[128 + format * 4 + 2];
+	if(!sectors) {
+		return;
+	}
+
+	// Blocks larger than a page would break the PRP handling in add_piece
+	if(lbads < 9 || lbads > 12) {
+		log(LOG_WARN, "nvme%d: Namespace %d has unsupported LBA size %d\n",
+			ctrl->index, nsid, 1 << lbads);
+		return;
+	}
+
+	/* Preferred write granularity, if the namespace reports optimal I/O
+	 * parameters (NSFEAT bit 4). Writes smaller than this get
+	 * read-modify-written internally by the device.
+	 */
+	uint32_t block_size = 1 << lbads;
+	uint32_t physical_block_size = block_size;
+	if(data[24] & (1 << 4)) {
+		physical_block_size = (*(uint16_t*)(data + 64) + 1) * block_size;
+	}
+
+	struct namespace* ns = zmalloc(sizeof(struct namespace));
+	ns->ctrl = ctrl;
+	ns->id = nsid;
+	ns->sectors = sectors;
+	ns->block_size = block_size;
+	ns->next = ctrl->namespaces;
+	ctrl->namespaces = ns;
+
+	char name[20];
+	snprintf(name, 20, "nvme%dn%d", ctrl->index, nsid);
+	log(LOG_INFO, "nvme: %s: %u MiB, %u/%u byte blocks\n", name,
+		(uint32_t)(sectors * block_size / 1024 / 1024), block_size, physical_block_size);
+
+	ns->block_dev = vfs_block_register_dev_sized(name, 0, block_size,
+		physical_block_size, read_cb, write_cb, ns);
+	ns->block_dev->queue->submit_cb = submit_cb;
+}
+
+static int pci_cb(pci_device_t* pci_dev) {
+	// Mass storage, non-volatile memory controller, NVM Express
+	if(pci_dev->class != PCI_CLASS_STORAGE || pci_dev->subclass != 0x08
+		|| pci_dev->prog_if != 0x02) {
+		return 1;
+	}
+
+	// Registers and the doorbells of the admin and two I/O queue pairs
+	volatile uint8_t* regs = pci_map_bar(pci_dev, 0, 0, 0x2000);
+	if(!regs) {
+		log(LOG_ERR, "nvme: %02d:%02d.%d: Could not map BAR 0\n",
+			pci_dev->bus, pci_dev->dev, pci_dev->func);
+		return 1;
+	}
+
+	struct controller* ctrl = zmalloc(sizeof(struct controller));
+	ctrl->index = num_controllers + 1;
+	ctrl->regs = regs;
+
+	uint64_t cap = *(volatile uint64_t*)(regs + REG_CAP);
+	uint32_t version = reg_read(ctrl, REG_VS);
+	ctrl->doorbell_stride = 4 << CAP_DSTRD(cap);
+	ctrl->timeout = MAX(1, CAP_TO(cap) * timer_rate / 2);
+
+	log(LOG_INFO, "nvme%d: %02d:%02d.%d: NVMe %d.%d, max queue size %d\n",
+		ctrl->index, pci_dev->bus, pci_dev->dev, pci_dev->func, version >> 16,
+		(version >> 8) & 0xff, CAP_MQES(cap));
+
+	if(CAP_MPSMIN(cap) || REG_DOORBELLS + 6 * ctrl->doorbell_stride > 0x2000) {
+		log(LOG_ERR, "nvme%d: Unsupported page size or doorbell stride\n", ctrl->index);
+		kfree(ctrl);
+		return 1;
+	}
+
+	pci_set_bus_master(pci_dev);
+	if(!reset(ctrl)) {
+		free_controller(ctrl);
+		return 1;
+	}
+
+	uint8_t* data = zmalloc_a(PAGE_SIZE);
+	if(identify(ctrl, IDENTIFY_CTRL, 0, data) < 0) {
+		kfree(data);
+		free_controller(ctrl);
+		return 1;
+	}
+
+	// MDTS is a power of two in units of the minimum page size, 0 means no limit
+	uint8_t mdts = data[77];
+	ctrl->max_prps = PRP_LIST_ENTRIES + 1;
+	if(mdts && mdts < 10) {
+		ctrl->max_prps = 1UL << mdts;
+	}
+
+	char model[41];
+	memcpy(model, data + 24, 40);
+	model[40] = 0;
+	for(int i = 39; i >= 0 && model[i] == ' '; i--) {
+		model[i] = 0;
+	}
+
+	if(!setup_io_queues(ctrl, pci_dev, CAP_MQES(cap))) {
+		log(LOG_ERR, "nvme%d: Could not set up I/O queues\n", ctrl->index);
+		kfree(data);
+		free_controller(ctrl);
+		return 1;
+	}
+
+	log(LOG_INFO, "nvme%d: %s, %d I/O queue%s, %s\n",
+		ctrl->index, model, ctrl->num_io, ctrl->num_io > 1 ? "s" : "",
+		ctrl->msix ? "MSI-X" : "shared interrupt");
+
+	num_controllers++;
+	ctrl->next = controllers;
+	controllers = ctrl;
+
+	uint32_t* ns_list = zmalloc_a(PAGE_SIZE);
+	if(identify(ctrl, IDENTIFY_NS_LIST, 0, ns_list) == 0) {
+		for(size_t i = 0; i < PAGE_SIZE / sizeof(uint32_t) && ns_list[i]; i++) {
+			add_namespace(ctrl, ns_list[i], data);
+		}
+	}
+
+	kfree(ns_list);
+	kfree(data);
+	return 1;
+}
+
+void nvme_init(void) {
+	pci_walk(pci_cb);
+}
+
+#endif /* ENABLE_NVME */
@@ -1,5 +1,5 @@
-/* part.c: MBR partition support
- * Copyright © 2018-2019 Lukas Martini
+/* part.c: MBR and GPT partition support
+ * Copyright © 2018-2020 Lukas Martini
  *
  * This file is part of Xelix.
  *
@@ -20,10 +20,17 @@
 #include <block/part.h>
 #include <string.h>
 #include <log.h>
+#include <crc32.h>
 #include <mem/kmalloc.h>
 #include <block/i386-ide.h>
 #include <block/block.h>
 
+#define MBR_TYPE_GPT_PROTECTIVE 0xee
+#define GPT_SIGNATURE "EFI PART"
+
+// Upper limit for the size of the GPT entry array, the default is 16 KiB
+#define GPT_MAX_ENTRIES_SIZE (1024 * 1024)
+
 struct mbr_partition {
 	uint8_t bootable;
 	uint8_t unused[3];
@@ -31,28 +38,183 @@ struct mbr_partition {
 	uint8_t unused2[3];
 	uint32_t start;
 	uint32_t size;
-};
+} __attribute__((packed));
+
+struct gpt_header {
+	char signature[8];
+	uint32_t revision;
+	uint32_t header_size;
+	uint32_t header_crc;
+	uint32_t reserved;
+	uint64_t current_lba;
+	uint64_t backup_lba;
+	uint64_t first_usable_lba;
+	uint64_t last_usable_lba;
+	uint8_t disk_guid[16];
+	uint64_t entries_lba;
+	uint32_t num_entries;
+	uint32_t entry_size;
+	uint32_t entries_crc;
+} __attribute__((packed));
+
+struct gpt_entry {
+	uint8_t type_guid[16];
+	uint8_t unique_guid[16];
+	uint64_t first_lba;
+	uint64_t last_lba;
+	uint64_t attributes;
+	uint16_t name[36];
+} __attribute__((packed));
+
+static void add_partition(struct vfs_block_dev* dev, int num, uint64_t start,
+	uint64_t size, const char* type) {
+
+	char pname[50];
+	snprintf(pname, 50, "%sp%d", dev->name, num);
+	struct vfs_block_dev* pdev = vfs_block_register_dev_sized(pname, start,
+		dev->block_size, dev->physical_block_size, dev->read_cb, dev->write_cb,
+		dev->meta);
+	pdev->queue = dev->queue;
+
+	log(LOG_INFO, "part: /dev/%s: %s part %d /dev/%s start %#llx size %#llx\n",
+		dev->name, type, num, pname, start, size);
+
+	if(pdev->alignment_offset) {
+		log(LOG_WARN, "part: /dev/%s does not start on a physical block boundary "
+			"of /dev/%s (%d bytes off). Writes to it will be slower.\n",
+			pname, dev->name, dev->physical_block_size - pdev->alignment_offset);
+	}
+}
+
+/* Read and validate the GPT header at lba and its entry array. Returns the
+ * entry array, which needs to be freed by the caller, or NULL if the header or
+ * the entries are invalid.
+ */
+static uint8_t* read_gpt(struct vfs_block_dev* dev, uint64_t lba, struct gpt_header* hdr) {
+	uint8_t* buf = kmalloc(dev->block_size);
+	if(dev->read_cb(dev, lba, 1, buf) != 1) {
+		kfree(buf);
+		return NULL;
+	}
+
+	memcpy(hdr, buf, sizeof(struct gpt_header));
+	if(memcmp(hdr->signature, GPT_SIGNATURE, 8) || hdr->current_lba != lba
+		|| hdr->header_size < sizeof(struct gpt_header)
+		|| hdr->header_size > dev->block_size) {
+		kfree(buf);
+		return NULL;
+	}
+
+	// The checksum covers the header with the checksum field set to zero
+	uint32_t header_crc = hdr->header_crc;
+	((struct gpt_header*)buf)->header_crc = 0;
+	uint32_t crc = crc32(0, buf, hdr->header_size);
+	kfree(buf);
+
+	if(crc != header_crc) {
+		log(LOG_WARN, "part: /dev/%s: GPT header at LBA %llu has invalid checksum\n",
+			dev->name, lba);
+		return NULL;
+	}
+
+	uint64_t entries_size = (uint64_t)hdr->num_entries * hdr->entry_size;
+	if(hdr->entry_size < sizeof(struct gpt_entry) || hdr->entry_size % 8
+		|| !entries_size || entries_size > GPT_MAX_ENTRIES_SIZE) {
+		return NULL;
+	}
+
+	uint64_t num_blocks = RDIV(entries_size, dev->block_size);
+	uint8_t* entries = kmalloc(num_blocks * dev->block_size);
+	if(dev->read_cb(dev, hdr->entries_lba, num_blocks, entries) != num_blocks) {
+		kfree(entries);
+		return NULL;
+	}
+
+	if(crc32(0, entries, entries_size) != hdr->entries_crc) {
+		log(LOG_WARN, "part: /dev/%s: GPT entries of header at LBA %llu have "
+			"invalid checksum\n", dev->name, lba);
+		kfree(entries);
+		return NULL;
+	}
+	return entries;
+}
+
+/* Parse the GPT. If the primary header or its entries are damaged, the backup
+ * at the end of the disk is used instead. The protective MBR partition covers
+ * the whole disk, so it tells where to find the backup if the primary header
+ * is unusable.
+ */
+static void probe_gpt(struct vfs_block_dev* dev, struct mbr_partition* protective) {
+	struct gpt_header hdr;
+	uint8_t* entries = read_gpt(dev, 1, &hdr);
+
+	if(!entries && protective->size != 0xffffffff) {
+		uint64_t backup_lba = (uint64_t)protective->start + protective->size - 1;
+		entries = read_gpt(dev, backup_lba, &hdr);
+		if(entries) {
+			log(LOG_WARN, "part: /dev/%s: Primary GPT is damaged, using backup\n",
+				dev->name);
+		}
+	}
+
+	if(!entries) {
+		log(LOG_ERR, "part: /dev/%s: No valid GPT found\n", dev->name);
+		return;
+	}
+
+	for(uint32_t i = 0; i < hdr.num_entries; i++) {
+		struct gpt_entry* entry = (struct gpt_entry*)(entries + i * hdr.entry_size);
+
+		// Unused entries have an all-zero type GUID
+		bool used = false;
+		for(int j = 0; j < 16; j++) {
+			used |= entry->type_guid[j];
+		}
+
+		if(!used || entry->last_lba < entry->first_lba
+			|| entry->first_lba < hdr.first_usable_lba
+			|| entry->last_lba > hdr.last_usable_lba) {
+			continue;
+		}
+
+		add_partition(dev, i + 1, entry->first_lba,
+			entry->last_lba - entry->first_lba + 1, "GPT");
+	}
+
+	kfree(entries);
+}
 
 void vfs_part_probe(struct vfs_block_dev* dev) {
-	uint8_t* buf = kmalloc(512);
+	// The MBR is in the first logical block, whatever its size
+	uint8_t* buf = kmalloc(dev->block_size);
 	if(dev->read_cb(dev, 0, 1, buf) < 1) {
 		kfree(buf);
 		return;
 	}
 
-	char* pname = kmalloc(strlen(dev->name) + 3);
+	if(buf[510] != 0x55 || buf[511] != 0xaa) {
+		kfree(buf);
+		return;
+	}
+
 	struct mbr_partition* part = (struct mbr_partition*)(buf + 0x01BE);
+	for(int i = 0; i < 4; i++) {
+		if(part[i].type == MBR_TYPE_GPT_PROTECTIVE) {
+			probe_gpt(dev, &part[i]);
+			kfree(buf);
+			return;
+		}
+	}
+
 	for(int i = 1; i <= 4; i++, part++) {
 		if(!part->type || !part->size || !part->start) {
 			continue;
 		}
 
-		sprintf(pname, "%sp%d", dev->name, i);
-		vfs_block_register_dev(pname, part->start, dev->read_cb, dev->write_cb, dev->meta);
-		log(LOG_INFO, "part: /dev/%s: MBR part %d /dev/%s type %x size %#x\n",
-			dev->name, i, pname, part->type, part->size);
+		char type[10];
+		snprintf(type, 10, "MBR %x", part->type);
+		add_partition(dev, i, part->start, part->size, type);
 	}
 
-	kfree(pname);
 	kfree(buf);
 }
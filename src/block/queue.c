@@ -0,0 +1,419 @@
+/* queue.c: Block request queues and I/O scheduling
+ * Copyright © 2020 Lukas Martini
+ *
+ * This file is part of Xelix.
+ *
+ * Xelix is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Xelix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Xelix.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Requests are kept sorted by LBA and dispatched in C-LOOK order starting
+ * from the current head position, which keeps seeks short on rotating media.
+ * To avoid starving requests far away from the head, each request also gets
+ * a deadline (short for reads, which usually block a task, longer for
+ * writes). Expired requests are dispatched first.
+ *
+ * Requests that are directly adjacent on disk are merged into runs. Callers
+ * can plug the queue while submitting a batch of requests so they get a
+ * chance to merge before anything is dispatched.
+ */
+
+#include <block/block.h>
+#include <mem/kmalloc.h>
+#include <tasks/scheduler.h>
+#include <bsp/timer.h>
+#include <int/int.h>
+#include <fs/sysfs.h>
+#include <string.h>
+
+// Upper limit on the size of merged runs
+#define MAX_RUN_BLOCKS 1024
+#define READ_EXPIRE_MS 50
+#define WRITE_EXPIRE_MS 500
+
+static struct vfs_block_queue* queues = NULL;
+
+struct vfs_block_queue* vfs_block_queue_new(struct vfs_block_dev* dev) {
+	struct vfs_block_queue* queue = zmalloc(sizeof(struct vfs_block_queue));
+	queue->dev = dev;
+	queue->next = queues;
+	queues = queue;
+	return queue;
+}
+
+// Accumulate busy and queue time up to now. Needs interrupts disabled.
+static void stats_update(struct vfs_block_stats* stats, uint64_t now) {
+	if(stats->inflight) {
+		stats->busy_us += now - stats->stamp_us;
+		stats->queue_us += stats->inflight * (now - stats->stamp_us);
+	}
+	stats->stamp_us = now;
+}
+
+static void stats_start(struct vfs_block_stats* stats, uint64_t now) {
+	stats_update(stats, now);
+	stats->inflight++;
+}
+
+static void stats_done(struct vfs_block_stats* stats, struct vfs_block_request* req,
+	uint64_t now) {
+
+	int dir = req->write;
+	uint64_t latency = now - req->start_us;
+	stats_update(stats, now);
+	stats->inflight--;
+	stats->ios[dir]++;
+	stats->sectors[dir] += req->result * req->dev->block_size / 512;
+	stats->time_us[dir] += latency;
+
+	int bucket = 0;
+	if(latency > 1) {
+		bucket = 63 - __builtin_clzll(latency);
+	}
+	stats->latency[dir][MIN(bucket, VFS_BLOCK_LAT_BUCKETS - 1)]++;
+}
+
+/* Requests are accounted both to the device they were submitted to and, if
+ * that is a partition, the disk it is on.
+ */
+static void account_start(struct vfs_block_request* req) {
+	struct vfs_block_dev* disk = req->dev->queue->dev;
+	uint32_t flags = int_save();
+	req->start_us = timer_get_us();
+	stats_start(&req->dev->stats, req->start_us);
+	if(disk != req->dev) {
+		stats_start(&disk->stats, req->start_us);
+	}
+	int_restore(flags);
+}
+
+static void account_done(struct vfs_block_request* req, uint64_t now) {
+	struct vfs_block_dev* disk = req->dev->queue->dev;
+	uint32_t flags = int_save();
+	stats_done(&req->dev->stats, req, now);
+	if(disk != req->dev) {
+		stats_done(&disk->stats, req, now);
+	}
+	int_restore(flags);
+}
+
+static inline void account_merge(struct vfs_block_request* req) {
+	req->dev->stats.merges[req->write]++;
+	if(req->dev->queue->dev != req->dev) {
+		req->dev->queue->dev->stats.merges[req->write]++;
+	}
+}
+
+/* Copy the statistics of a device, with busy and queue time brought up to
+ * date.
+ */
+void vfs_block_get_stats(struct vfs_block_dev* dev, struct vfs_block_stats* dest) {
+	uint32_t flags = int_save();
+	memcpy(dest, &dev->stats, sizeof(struct vfs_block_stats));
+	int_restore(flags);
+	stats_update(dest, timer_get_us());
+}
+
+static inline struct vfs_block_request* run_tail(struct vfs_block_request* req) {
+	while(req->merged) {
+		req = req->merged;
+	}
+	return req;
+}
+
+// Try to attach req to an existing run. Needs to be called with queue lock held.
+static bool try_merge(struct vfs_block_queue* queue, struct vfs_block_request* req) {
+	struct vfs_block_request* prev = NULL;
+	for(struct vfs_block_request* run = queue->requests; run; prev = run, run = run->next) {
+		if(run->write != req->write || run->run_blocks + req->num_blocks > MAX_RUN_BLOCKS) {
+			continue;
+		}
+
+		// Back merge: req continues where the run ends
+		if(run->lba + run->run_blocks == req->lba) {
+			run_tail(run)->merged = req;
+			run->run_blocks += req->num_blocks;
+			run->deadline = MIN(run->deadline, req->deadline);
+			queue->back_merges++;
+			account_merge(req);
+			return true;
+		}
+
+		// Front merge: req ends where the run starts and becomes its new head
+		if(req->lba + req->num_blocks == run->lba) {
+			req->merged = run;
+			req->next = run->next;
+			req->run_blocks = run->run_blocks + req->num_blocks;
+			req->deadline = MIN(run->deadline, req->deadline);
+
+			if(prev) {
+				prev->next = req;
+			} else {
+				queue->requests = req;
+			}
+			queue->front_merges++;
+			account_merge(req);
+			return true;
+		}
+	}
+	return false;
+}
+
+static void insert_sorted(struct vfs_block_queue* queue, struct vfs_block_request* req) {
+	struct vfs_block_request** pos = &queue->requests;
+	while(*pos && (*pos)->lba <= req->lba) {
+		pos = &(*pos)->next;
+	}
+
+	req->next = *pos;
+	*pos = req;
+	queue->depth++;
+	queue->max_depth = MAX(queue->max_depth, queue->depth);
+}
+
+/* Remove the next run to dispatch from the queue. Needs to be called with
+ * queue lock held.
+ */
+static struct vfs_block_request* pick_next(struct vfs_block_queue* queue) {
+	if(!queue->requests) {
+		return NULL;
+	}
+
+	struct vfs_block_request** pick = NULL;
+	struct vfs_block_request** pos = &queue->requests;
+	uint32_t tick = timer_tick;
+
+	// Oldest expired run first
+	for(; *pos; pos = &(*pos)->next) {
+		if((int32_t)(tick - (*pos)->deadline) >= 0
+			&& (!pick || (int32_t)((*pos)->deadline - (*pick)->deadline) < 0)) {
+			pick = pos;
+		}
+	}
+
+	if(pick) {
+		queue->expired++;
+	} else {
+		// C-LOOK: First run at or past the head, else wrap around to the lowest LBA
+		for(pos = &queue->requests; *pos; pos = &(*pos)->next) {
+			if((*pos)->lba >= queue->head_pos) {
+				pick = pos;
+				break;
+			}
+		}
+
+		if(!pick) {
+			pick = &queue->requests;
+		}
+	}
+
+	struct vfs_block_request* req = *pick;
+	*pick = req->next;
+	req->next = NULL;
+	queue->depth--;
+	return req;
+}
+
+static uint64_t dispatch_one(struct vfs_block_request* req) {
+	struct vfs_block_dev* dev = req->dev;
+	uint64_t lba = req->lba;
+	uint64_t done = 0;
+
+	for(int i = 0; i < req->sg_count && done < req->num_blocks; i++) {
+		uint64_t n = MIN(req->sg[i].size / dev->block_size, req->num_blocks - done);
+		if(!n) {
+			break;
+		}
+
+		uint64_t r;
+		if(req->write) {
+			r = dev->write_cb(dev, lba + done, n, req->sg[i].addr);
+		} else {
+			r = dev->read_cb(dev, lba + done, n, req->sg[i].addr);
+		}
+
+		// Drivers return -1 on error
+		if(r > n) {
+			r = 0;
+		}
+
+		done += r;
+		if(r < n) {
+			break;
+		}
+	}
+	return done;
+}
+
+/* Complete all requests of a run, of which the first blocks were transferred
+ * successfully. Can be called from interrupt handlers.
+ */
+void vfs_block_complete(struct vfs_block_request* run, uint64_t blocks) {
+	struct vfs_block_queue* queue = run->dev->queue;
+	__sync_fetch_and_sub(&queue->inflight, 1);
+	uint64_t now = timer_get_us();
+
+	while(run) {
+		/* Requests are usually on the stack of the waiting task and may be
+		 * gone as soon as they are completed, so read the link first.
+		 */
+		struct vfs_block_request* next = run->merged;
+		run->result = MIN(blocks, run->num_blocks);
+		blocks -= run->result;
+		account_done(run, now);
+		complete(&run->done);
+		run = next;
+	}
+}
+
+static void dispatch(struct vfs_block_queue* queue, struct vfs_block_request* run) {
+	for(struct vfs_block_request* req = run; req; req = req->merged) {
+		req->dispatched = true;
+	}
+
+	__sync_fetch_and_add(&queue->inflight, 1);
+	if(queue->submit_cb) {
+		queue->submit_cb(run->dev, run);
+		return;
+	}
+
+	// Synchronous driver, transfer one request after the other
+	uint64_t blocks = 0;
+	for(struct vfs_block_request* req = run; req; req = req->merged) {
+		uint64_t result = dispatch_one(req);
+		blocks += result;
+		if(result < req->num_blocks) {
+			break;
+		}
+	}
+	vfs_block_complete(run, blocks);
+}
+
+void vfs_block_run_queue(struct vfs_block_queue* queue) {
+	// Only one task at a time gets to feed the driver
+	if(__sync_lock_test_and_set(&queue->running, 1)) {
+		return;
+	}
+
+	while(1) {
+		if(!spinlock_get(&queue->lock, -1)) {
+			break;
+		}
+
+		struct vfs_block_request* req = NULL;
+		if(!queue->plugged) {
+			req = pick_next(queue);
+		}
+
+		if(req) {
+			queue->head_pos = req->lba + req->run_blocks;
+			queue->dispatched++;
+		}
+		spinlock_release(&queue->lock);
+
+		if(!req) {
+			break;
+		}
+		dispatch(queue, req);
+	}
+
+	__sync_lock_release(&queue->running);
+}
+
+void vfs_block_submit(struct vfs_block_request* req) {
+	struct vfs_block_queue* queue = req->dev->queue;
+	req->next = NULL;
+	req->merged = NULL;
+	req->dispatched = false;
+	req->result = 0;
+	completion_init(&req->done);
+	req->run_blocks = req->num_blocks;
+	req->deadline = timer_tick + (req->write ? WRITE_EXPIRE_MS : READ_EXPIRE_MS)
+		* timer_rate / 1000;
+	account_start(req);
+
+	spinlock_get(&queue->lock, -1);
+	queue->submitted++;
+	if(!try_merge(queue, req)) {
+		insert_sorted(queue, req);
+	}
+
+	bool plugged = queue->plugged;
+	spinlock_release(&queue->lock);
+
+	if(!plugged) {
+		vfs_block_run_queue(queue);
+	}
+}
+
+uint64_t vfs_block_wait(struct vfs_block_request* req) {
+	while(!req->dispatched) {
+		vfs_block_run_queue(req->dev->queue);
+		if(!req->dispatched) {
+			scheduler_yield();
+		}
+	}
+
+	completion_wait(&req->done);
+	return req->result;
+}
+
+/* Hold back dispatching while a batch of requests is submitted. Plugs nest,
+ * the queue is run once the last one is removed.
+ */
+void vfs_block_plug(struct vfs_block_dev* dev) {
+	if(!dev->queue) {
+		return;
+	}
+
+	spinlock_get(&dev->queue->lock, -1);
+	dev->queue->plugged++;
+	spinlock_release(&dev->queue->lock);
+}
+
+void vfs_block_unplug(struct vfs_block_dev* dev) {
+	if(!dev->queue) {
+		return;
+	}
+
+	spinlock_get(&dev->queue->lock, -1);
+	bool run = !--dev->queue->plugged;
+	spinlock_release(&dev->queue->lock);
+
+	if(run) {
+		vfs_block_run_queue(dev->queue);
+	}
+}
+
+static size_t sfs_read(struct vfs_callback_ctx* ctx, void* dest, size_t size) {
+	if(ctx->fp->offset) {
+		return 0;
+	}
+
+	size_t rsize = 0;
+	sysfs_printf("# dev depth max_depth inflight submitted dispatched back_merges front_merges expired\n");
+
+	for(struct vfs_block_queue* queue = queues; queue; queue = queue->next) {
+		sysfs_printf("%s %u %u %u %u %u %u %u %u\n", queue->dev->name, queue->depth,
+			queue->max_depth, queue->inflight, queue->submitted, queue->dispatched,
+			queue->back_merges, queue->front_merges, queue->expired);
+	}
+	return rsize;
+}
+
+void vfs_block_queue_init(void) {
+	struct vfs_callbacks sfs_cb = {
+		.read = sfs_read,
+	};
+	sysfs_add_file("block_queues", &sfs_cb);
+}
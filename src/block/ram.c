@@ -0,0 +1,87 @@
+/* ram.c: RAM disks backed by multiboot modules
+ * Copyright © 2020 Lukas Martini
+ *
+ * This file is part of Xelix.
+ *
+ * Xelix is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Xelix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Xelix.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Each multiboot module passed by the bootloader (GRUB: module2) is exposed
+ * as /dev/ramN. With an ext2 image as module, the system can boot with
+ * root=/dev/ram0 and run early userspace without touching disk drivers. The
+ * module memory is reserved and 1:1 mapped in paging_init.
+ */
+
+#ifdef CONFIG_ENABLE_RAMDISK
+
+#include <block/ram.h>
+#include <block/block.h>
+#include <boot/multiboot.h>
+#include <mem/paging.h>
+#include <string.h>
+#include <printf.h>
+#include <log.h>
+
+#define RAM_BLOCK_SIZE 512
+
+static uint64_t ram_read(struct vfs_block_dev* dev, uint64_t lba, uint64_t num_blocks, void* buf) {
+	struct multiboot_module* mod = dev->meta;
+	uint64_t max_blocks = mod->size / RAM_BLOCK_SIZE;
+	if(lba >= max_blocks) {
+		return 0;
+	}
+
+	num_blocks = MIN(num_blocks, max_blocks - lba);
+	memcpy(buf, mod->start + lba * RAM_BLOCK_SIZE, num_blocks * RAM_BLOCK_SIZE);
+	return num_blocks;
+}
+
+static uint64_t ram_write(struct vfs_block_dev* dev, uint64_t lba, uint64_t num_blocks, void* buf) {
+	struct multiboot_module* mod = dev->meta;
+	uint64_t max_blocks = mod->size / RAM_BLOCK_SIZE;
+	if(lba >= max_blocks) {
+		return 0;
+	}
+
+	num_blocks = MIN(num_blocks, max_blocks - lba);
+	memcpy(mod->start + lba * RAM_BLOCK_SIZE, buf, num_blocks * RAM_BLOCK_SIZE);
+	return num_blocks;
+}
+
+void block_ram_init(void) {
+	size_t num_modules;
+	struct multiboot_module* modules = multiboot_get_modules(&num_modules);
+
+	for(int i = 0; i < num_modules; i++) {
+		struct multiboot_module* mod = &modules[i];
+		if(mod->start + mod->size > paging_alloc_end) {
+			log(LOG_WARN, "ram: Module %d at %p is not mapped, ignoring\n", i, mod->start);
+			continue;
+		}
+
+		// There is no tmpfs to unpack archives into
+		if(!memcmp(mod->start, "070701", 6) || !memcmp(mod->start, "070707", 6)) {
+			log(LOG_WARN, "ram: Module %d is a cpio archive, which is not supported. "
+				"Please use a file system image instead.\n", i);
+			continue;
+		}
+
+		char name[10];
+		snprintf(name, 10, "ram%d", i);
+		log(LOG_INFO, "ram: /dev/%s: %s, %u kb\n", name, mod->cmdline, mod->size / 1024);
+		vfs_block_register_dev(name, 0, ram_read, ram_write, mod);
+	}
+}
+
+#endif /* CONFIG_ENABLE_RAMDISK */
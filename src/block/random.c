@@ -1,5 +1,5 @@
 /* random.c: Random number generation
- * Copyright © 2019 Lukas Martini
+ * Copyright © 2019-2020 Lukas Martini
  *
  * This file is part of Xelix.
  *
@@ -17,83 +17,217 @@
  * along with Xelix.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/* Output is generated by ChaCha20 in counter mode. After every request, the
+ * key is replaced by fresh output of the old one (fast key erasure), so
+ * earlier output can't be reconstructed from the state.
+ *
+ * Interrupt timings and other events are mixed into a small entropy pool,
+ * which gets folded into the key at most once a second, once enough events
+ * have accumulated. RDSEED/RDRAND output is mixed in on every reseed if the
+ * CPU supports it.
+ */
+
 #include <block/random.h>
 #include <fs/sysfs.h>
+#include <int/int.h>
+#include <bsp/timer.h>
+#include <string.h>
+#include <spinlock.h>
+#include <errno.h>
+#include <log.h>
+#include <prof.h>
+
+#define POOL_WORDS 8
+#define RESEED_EVENTS 64
+
+// Output generated between two key changes, limits the lock hold time
+#define CHUNK_SIZE 0x10000
+
+#define GRND_NONBLOCK 1
+#define GRND_RANDOM 2
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QR(a, b, c, d) \
+	a += b; d ^= a; d = ROTL(d, 16); \
+	c += d; b ^= c; b = ROTL(b, 12); \
+	a += b; d ^= a; d = ROTL(d, 8); \
+	c += d; b ^= c; b = ROTL(b, 7);
+
+static uint32_t key[8];
+static spinlock_t lock;
+static uint64_t last_reseed;
+static bool seeded = false;
+static bool have_rdrand = false;
+static bool have_rdseed = false;
+
+// Written from interrupt context, only accessed with interrupts disabled
+static uint32_t pool[POOL_WORDS];
+static uint32_t pool_pos;
+static uint32_t pool_events;
+
+// Generate one 64 byte block of ChaCha20 output with an all-zero nonce
+static void chacha20_block(uint32_t* out, uint64_t counter) {
+	uint32_t x[16] = {
+		0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+		key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+		(uint32_t)counter, (uint32_t)(counter >> 32), 0, 0
+	};
 
-#define UPPER_MASK 0x80000000
-#define LOWER_MASK 0x7fffffff
-#define TEMPERING_MASK_B 0x9d2c5680
-#define TEMPERING_MASK_C 0xefc60000
-#define STATE_VECTOR_LENGTH 624
-#define STATE_VECTOR_M 397
-
-static uint64_t mt[STATE_VECTOR_LENGTH];
-static int index;
+	uint32_t in[16];
+	memcpy(in, x, sizeof(x));
+
+	for(int i = 0; i < 10; i++) {
+		QR(x[0], x[4], x[8], x[12]);
+		QR(x[1], x[5], x[9], x[13]);
+		QR(x[2], x[6], x[10], x[14]);
+		QR(x[3], x[7], x[11], x[15]);
+		QR(x[0], x[5], x[10], x[15]);
+		QR(x[1], x[6], x[11], x[12]);
+		QR(x[2], x[7], x[8], x[13]);
+		QR(x[3], x[4], x[9], x[14]);
+	}
 
-void block_random_seed(uint64_t seed) {
-	mt[0] = seed & 0xffffffff;
-	for(index=1; index<STATE_VECTOR_LENGTH; index++) {
-		mt[index] = (6069 * mt[index-1]) & 0xffffffff;
+	for(int i = 0; i < 16; i++) {
+		out[i] = x[i] + in[i];
 	}
 }
 
-static inline uint64_t getnum(void) {
-	uint64_t y;
-	// mag[x] = x * 0x9908b0df for x = 0,1
-	static uint64_t mag[2] = {0x0, 0x9908b0df};
-
-	if(index >= STATE_VECTOR_LENGTH || index < 0) {
-		// generate STATE_VECTOR_LENGTH words at a time
-		int kk;
-		if(index >= STATE_VECTOR_LENGTH+1 || index < 0) {
-			block_random_seed(4357);
+static inline bool hw_random(uint32_t* out) {
+	for(int i = 0; i < 10; i++) {
+		uint8_t ok;
+		if(have_rdseed) {
+			asm volatile("rdseed %0; setc %1" : "=r"(*out), "=qm"(ok));
+			if(ok) {
+				return true;
+			}
 		}
 
-		for(kk=0; kk<STATE_VECTOR_LENGTH - STATE_VECTOR_M; kk++) {
-			y = (mt[kk] & UPPER_MASK) | (mt[kk + 1] & LOWER_MASK);
-			mt[kk] = mt[kk + STATE_VECTOR_M] ^ (y >> 1) ^ mag[y & 0x1];
+		if(have_rdrand) {
+			asm volatile("rdrand %0; setc %1" : "=r"(*out), "=qm"(ok));
+			if(ok) {
+				return true;
+			}
 		}
+	}
+	return false;
+}
 
-		for(; kk<STATE_VECTOR_LENGTH - 1; kk++) {
-			y = (mt[kk] & UPPER_MASK) | (mt[kk + 1] & LOWER_MASK);
-			mt[kk] = mt[kk+(STATE_VECTOR_M-STATE_VECTOR_LENGTH)] ^ (y >> 1) ^ mag[y & 0x1];
-		}
+/* Mix a value into the entropy pool along with the current TSC. Cheap enough
+ * to be called for every interrupt.
+ */
+void block_random_add_entropy(uint32_t value) {
+	uint32_t tsc = (uint32_t)profile_read_rdtsc();
+	uint32_t flags = int_save();
+	uint32_t i = pool_pos++ % POOL_WORDS;
+	pool[i] = ROTL(pool[i], 7) ^ pool[(i + 1) % POOL_WORDS] ^ value ^ tsc;
+	pool_events++;
+	int_restore(flags);
+}
 
-		y = (mt[STATE_VECTOR_LENGTH - 1] & UPPER_MASK) | (mt[0] & LOWER_MASK);
-		mt[STATE_VECTOR_LENGTH - 1] = mt[STATE_VECTOR_M - 1] ^ (y >> 1) ^ mag[y & 0x1];
-		index = 0;
+void block_random_seed(uint64_t seed) {
+	block_random_add_entropy(seed);
+	block_random_add_entropy(seed >> 32);
+}
+
+// Needs to be called with the lock held
+static void reseed(void) {
+	uint32_t flags = int_save();
+	for(int i = 0; i < 8; i++) {
+		key[i] ^= pool[i];
+	}
+	pool_events = 0;
+	int_restore(flags);
+
+	uint32_t hw;
+	for(int i = 0; i < 8 && hw_random(&hw); i++) {
+		key[i] ^= hw;
 	}
+	key[0] ^= (uint32_t)profile_read_rdtsc();
+
+	// Don't leave the pool contents in the key
+	uint32_t block[16];
+	chacha20_block(block, UINT64_MAX);
+	memcpy(key, block, sizeof(key));
+	bzero(block, sizeof(block));
 
-	y = mt[index++];
-	y ^= (y >> 11);
-	y ^= (y << 7) & TEMPERING_MASK_B;
-	y ^= (y << 15) & TEMPERING_MASK_C;
-	y ^= (y >> 18);
-	return y;
+	last_reseed = timer_tick;
+	seeded = true;
 }
 
-static size_t sfs_read(struct vfs_callback_ctx* ctx, void* dest, size_t size) {
-	uint64_t rval = 0;
-	uint8_t* rdat = (uint8_t*)&rval;
+static void generate(uint8_t* dest, size_t size) {
+	spinlock_get(&lock, -1);
+	if(!seeded || (pool_events >= RESEED_EVENTS && timer_tick - last_reseed >= timer_rate)) {
+		reseed();
+	}
+
+	uint64_t counter = 0;
+	uint32_t block[16];
 
-	for(int i = 0; i < size; i++) {
-		int boff = i % sizeof(uint64_t);
-		if(!boff) {
-			rval = getnum();
+	// Whole blocks go straight into the destination if it is word-aligned
+	if(!((uintptr_t)dest % sizeof(uint32_t))) {
+		for(; size >= sizeof(block); size -= sizeof(block), dest += sizeof(block)) {
+			chacha20_block((uint32_t*)dest, counter++);
 		}
+	}
+
+	for(; size; dest += MIN(size, sizeof(block)), size -= MIN(size, sizeof(block))) {
+		chacha20_block(block, counter++);
+		memcpy(dest, block, MIN(size, sizeof(block)));
+	}
+
+	chacha20_block(block, counter);
+	memcpy(key, block, sizeof(key));
+	bzero(block, sizeof(block));
+	spinlock_release(&lock);
+}
 
-		((uint8_t*)dest)[i] = rdat[boff];
+void block_random_get(void* dest, size_t size) {
+	for(size_t done = 0; done < size; done += CHUNK_SIZE) {
+		generate((uint8_t*)dest + done, MIN(size - done, CHUNK_SIZE));
 	}
+}
 
+// getrandom() syscall. The generator is seeded at boot, so this never blocks.
+int block_random_getrandom(task_t* task, void* dest, size_t size, unsigned int flags) {
+	if(flags & ~(GRND_NONBLOCK | GRND_RANDOM)) {
+		sc_errno = EINVAL;
+		return -1;
+	}
+
+	block_random_get(dest, size);
+	return size;
+}
+
+static size_t sfs_read(struct vfs_callback_ctx* ctx, void* dest, size_t size) {
+	block_random_get(dest, size);
 	return size;
 }
 
 void block_random_init(void) {
+	uint32_t eax = 1, ebx, ecx, edx;
+	asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+	have_rdrand = ecx & (1 << 30);
+
+	eax = 0;
+	asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+	if(eax >= 7) {
+		eax = 7;
+		ecx = 0;
+		asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+		have_rdseed = ebx & (1 << 18);
+	}
+
+	log(LOG_INFO, "random: ChaCha20 generator, RDRAND %s, RDSEED %s\n",
+		have_rdrand ? "yes" : "no", have_rdseed ? "yes" : "no");
+
+	spinlock_get(&lock, -1);
+	reseed();
+	spinlock_release(&lock);
+
 	struct vfs_callbacks sfs_cb = {
 		.read = sfs_read,
 	};
 
-	// FIXME /dev/random should be blocking and not rely on the RNG
 	sysfs_add_dev("random", &sfs_cb);
 	sysfs_add_dev("urandom", &sfs_cb);
 }
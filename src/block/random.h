@@ -18,5 +18,12 @@
  * along with Xelix. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdint.h>
+#include <stddef.h>
+#include <tasks/task.h>
+
+void block_random_add_entropy(uint32_t value);
 void block_random_seed(uint64_t seed);
+void block_random_get(void* dest, size_t size);
+int block_random_getrandom(task_t* task, void* dest, size_t size, unsigned int flags);
 void block_random_init(void);
@@ -31,6 +31,8 @@
 #include <mem/vm.h>
 #include <mem/kmalloc.h>
 #include <tasks/task.h>
+#include <tasks/scheduler.h>
+#include <tasks/completion.h>
 
 #define VIRTIO_BLK_F_SIZE_MAX (1 << 1)
 #define VIRTIO_BLK_F_SEG_MAX (1 << 2)
@@ -49,90 +51,347 @@
 #define VIRTIO_BLK_S_IOERR 1
 #define VIRTIO_BLK_S_UNSUPP 2
 
+// Offsets in the device configuration
+#define VIRTIO_BLK_CFG_SEG_MAX 12
+#define VIRTIO_BLK_CFG_BLK_SIZE 20
+#define VIRTIO_BLK_CFG_PHYSICAL_BLOCK_EXP 24
+
+// Unit of the sector field in request headers, independent of the block size
+#define SECTOR_SIZE 512
+
+#define FEATURES_WANT (VIRTIO_BLK_F_RO | VIRTIO_BLK_F_SEG_MAX \
+	| VIRTIO_BLK_F_BLK_SIZE | VIRTIO_BLK_F_TOPOLOGY \
+	| VIRTIO_RING_F_INDIRECT_DESC | VIRTIO_RING_F_EVENT_IDX)
+
+/* Entries per indirect descriptor table. 128 entries take up 2 KiB, so tables
+ * never cross a page boundary, and leave room for runs of 504 KiB even if no
+ * two pages of the buffer are physically adjacent.
+ */
+#define INDIRECT_TABLE_SIZE 128
+#define MAX_COMMANDS 64
+
 struct virtio_blk_req {
 	uint32_t type;
 	uint32_t reserved;
 	uint64_t sector;
 };
 
+/* One descriptor chain in flight. Runs that don't fit into a single chain
+ * are split up, the first command then tracks the completion of all of them.
+ * Aligned so header and status never cross a page boundary.
+ */
+struct command {
+	struct virtio_blk_req hdr;
+	volatile uint8_t status;
+	bool used;
+	bool sync;
+
+	struct command* first;
+	struct vfs_block_request* run;
+
+	// Indirect descriptor table, if negotiated
+	struct virtq_desc* table;
+
+	// Offset of this chain in the run and its length, in blocks
+	uint64_t offset;
+	uint64_t length;
+
+	// Only used in first
+	volatile int pending;
+	uint64_t ok_sectors;
+} __aligned(64);
+
+/* Chain that is being built. Data descriptors start at index 1, the first
+ * and last slot are filled with header and status on submission.
+ */
+struct chain {
+	void** buffers;
+	size_t* lengths;
+	int* flags;
+	int num;
+	size_t bytes;
+	uint64_t offset;
+};
+
 static struct virtio_dev* dev = NULL;
+static struct command* commands;
+static size_t num_commands;
+
+// Maximum number of data descriptors in a chain
+static int max_data_descs;
+static uint32_t block_size = SECTOR_SIZE;
+
 static uint32_t vendor_device_combos[][2] = {
 	{0x1AF4, 0x1001}, {0x1AF4, 0x1042}, {(uint32_t)NULL}
 };
 
-static void int_handler(task_t* task, isf_t* state, int num) {
-	inb(dev->pci_dev->iobase + 0x13);
+// Needs to be called from task context
+static struct command* alloc_command(void) {
+	while(1) {
+		int_disable();
+		for(size_t i = 0; i < num_commands; i++) {
+			if(!commands[i].used) {
+				struct command* cmd = &commands[i];
+				cmd->used = true;
+				int_enable();
+				return cmd;
+			}
+		}
+
+		// Reenables interrupts
+		scheduler_yield();
+	}
 }
 
-static uint64_t send_request(struct virtio_dev* rdev, int type, uint64_t lba, uint64_t num_blocks, void* buf) {
-	if(num_blocks < 1) {
-		return -1;
+static void finish(struct command* first) {
+	struct vfs_block_request* run = first->run;
+	uint64_t sectors = first->ok_sectors;
+	bool sync = first->sync;
+	first->used = false;
+
+	if(sync) {
+		run->result = MIN(sectors, run->num_blocks);
+		complete(&run->done);
+	} else {
+		vfs_block_complete(run, sectors);
 	}
+}
 
-	if(!(rdev->status & VIRTIO_PCI_STATUS_DRIVER_OK)) {
-		return -1;
+static void put_first(struct command* first) {
+	if(!__sync_sub_and_fetch(&first->pending, 1)) {
+		finish(first);
 	}
+}
 
-	struct virtio_blk_req hdr = {
-		.type = type,
-		.reserved = 0,
-		.sector = lba
-	};
+// Called from the interrupt handler once the device has used a chain
+static void command_done(struct command* cmd) {
+	struct command* first = cmd->first;
 
-	volatile uint8_t status = 0xff;
-	void* buffers[] = {
-		valloc_translate(VM_KERNEL, &hdr, false),
-		valloc_translate(VM_KERNEL, buf, false),
-		valloc_translate(VM_KERNEL, (void*)&status, false),
-	};
+	if(cmd->status != VIRTIO_BLK_S_OK) {
+		log(LOG_ERR, "virtio_block: Request type %d, sector %d failed with status %d\n",
+			cmd->hdr.type, (uint32_t)cmd->hdr.sector, cmd->status);
+		first->ok_sectors = MIN(first->ok_sectors, cmd->offset);
+	}
 
-	if(!(buffers[0] && buffers[1] && buffers[2])) {
-		log(LOG_ERR, "virtio_block: Could not map buffers to phys mem in send_request\n");
-		return -1;
+	if(cmd != first) {
+		cmd->used = false;
 	}
+	put_first(first);
+}
 
-	size_t lengths[] = {sizeof(struct virtio_blk_req), num_blocks * 512, sizeof(uint8_t)};
+static void int_handler(task_t* task, isf_t* state, int num) {
+	if(!dev->msix) {
+		virtio_read_isr(dev);
+	}
+
+	struct virtqueue* queue = &dev->queues[0];
+	virtio_disable_cb(dev, queue);
+
+	do {
+		for(; (uint16_t)queue->used_index != queue->used->idx; queue->used_index++) {
+			struct virtq_used_elem* el = &queue->used->ring[queue->used_index % queue->size];
+			struct command* cmd = queue->data[el->id];
+			queue->data[el->id] = NULL;
+			virtio_free_chain(queue, el->id);
 
-	int user_buffer_flag = (type == VIRTIO_BLK_T_IN) ? VIRTQ_DESC_F_WRITE : 0;
-	int flags[] = {0, user_buffer_flag, VIRTQ_DESC_F_WRITE};
+			if(cmd) {
+				command_done(cmd);
+			}
+		}
+	} while(virtio_enable_cb(dev, queue));
+}
 
-	if(virtio_write(rdev, 0, 3, buffers, lengths, flags) < 0) {
-		return -1;
+static void submit_chain(struct command* first, struct chain* chain, uint64_t lba) {
+	struct command* cmd = (chain->offset == 0) ? first : alloc_command();
+	cmd->hdr.type = first->run->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+	cmd->hdr.reserved = 0;
+	cmd->hdr.sector = (lba + chain->offset) * (block_size / SECTOR_SIZE);
+	cmd->status = 0xff;
+	cmd->first = first;
+	cmd->offset = chain->offset;
+	cmd->length = chain->bytes / block_size;
+
+	int num = chain->num + 2;
+	chain->buffers[0] = valloc_translate(VM_KERNEL, &cmd->hdr, false);
+	chain->lengths[0] = sizeof(struct virtio_blk_req);
+	chain->flags[0] = 0;
+
+	int data_flag = first->run->write ? 0 : VIRTQ_DESC_F_WRITE;
+	for(int i = 1; i <= chain->num; i++) {
+		chain->flags[i] = data_flag;
 	}
 
-	while(status == 0xff) {
+	chain->buffers[num - 1] = valloc_translate(VM_KERNEL, (void*)&cmd->status, false);
+	chain->lengths[num - 1] = sizeof(uint8_t);
+	chain->flags[num - 1] = VIRTQ_DESC_F_WRITE;
+
+	__sync_add_and_fetch(&first->pending, 1);
+
+	// Wait for in-flight chains to free up descriptors if the ring is full
+	while(1) {
+		int head;
+		if(cmd->table) {
+			head = virtio_write_indirect(dev, 0, cmd->table, num, chain->buffers,
+				chain->lengths, chain->flags, cmd);
+		} else {
+			head = virtio_write(dev, 0, num, chain->buffers, chain->lengths,
+				chain->flags, cmd);
+		}
+
+		if(head >= 0) {
+			break;
+		}
 		scheduler_yield();
 	}
 
-	if(status != VIRTIO_BLK_S_OK) {
-		log(LOG_ERR, "virtio_block: Request type %d, lba %d failed (align %d)\n", type, lba, (uintptr_t)buf % 0x1000);
-		return -1;
+	chain->offset += cmd->length;
+	chain->num = 0;
+	chain->bytes = 0;
+}
+
+/* Add a physically contiguous piece of memory to the chain, submitting the
+ * chain whenever it is full. Chains always need to end on a block boundary,
+ * so the last descriptor slot only gets filled up to one.
+ */
+static void add_piece(struct command* first, struct chain* chain, uint64_t lba,
+	uint8_t* phys, size_t len) {
+
+	while(len) {
+		size_t take = len;
+		if(chain->num >= max_data_descs - 1) {
+			size_t rem = chain->bytes % block_size;
+			take = rem ? MIN(len, block_size - rem) : len - len % block_size;
+			if(!take) {
+				submit_chain(first, chain, lba);
+				continue;
+			}
+		}
+
+		if(chain->num && chain->buffers[chain->num]
+			+ chain->lengths[chain->num] == phys) {
+			chain->lengths[chain->num] += take;
+		} else {
+			chain->num++;
+			chain->buffers[chain->num] = phys;
+			chain->lengths[chain->num] = take;
+		}
+
+		chain->bytes += take;
+		phys += take;
+		len -= take;
+
+		if(chain->num == max_data_descs && !(chain->bytes % block_size)) {
+			submit_chain(first, chain, lba);
+		}
 	}
+}
 
-	return num_blocks;
+static void fail(struct vfs_block_request* run, bool sync) {
+	if(sync) {
+		run->result = 0;
+		complete(&run->done);
+	} else {
+		vfs_block_complete(run, 0);
+	}
 }
 
-static uint64_t read_cb(struct vfs_block_dev* block_dev, uint64_t lba, uint64_t num_blocks, void* buf) {
-	if(num_blocks < 16) {
-		return send_request(dev, VIRTIO_BLK_T_IN, lba, num_blocks, buf);
+/* Submit a run of requests. Memory is handed to the device page by page, with
+ * physically adjacent pages sharing a descriptor, so buffers don't need to be
+ * physically contiguous. Completion is signalled from the interrupt handler.
+ */
+static void submit(struct vfs_block_request* run, bool sync) {
+	uint64_t sectors = run->run_blocks;
+	if(!(dev->status & VIRTIO_PCI_STATUS_DRIVER_OK) || !sectors
+		|| (run->write && dev->features & VIRTIO_BLK_F_RO)) {
+		fail(run, sync);
+		return;
 	}
 
-	for(uint64_t i = 0; i < num_blocks; i++) {
-		if(send_request(dev, VIRTIO_BLK_T_IN, lba + i, 1, buf + (uint32_t)i * 512) == -1) {
-			return i;
+	struct command* first = alloc_command();
+	first->sync = sync;
+	first->run = run;
+	first->ok_sectors = sectors;
+
+	// Reference held while chains are being submitted
+	first->pending = 1;
+
+	struct chain chain = {
+		.buffers = kmalloc(sizeof(void*) * (max_data_descs + 2)),
+		.lengths = kmalloc(sizeof(size_t) * (max_data_descs + 2)),
+		.flags = kmalloc(sizeof(int) * (max_data_descs + 2)),
+	};
+
+	uint64_t left = sectors;
+	for(struct vfs_block_request* req = run; req && left; req = req->merged) {
+		uint64_t req_left = MIN(req->num_blocks, left) * block_size;
+		left -= MIN(req->num_blocks, left);
+
+		for(int i = 0; i < req->sg_count && req_left; i++) {
+			uint8_t* addr = req->sg[i].addr;
+			size_t seg_left = MIN(req->sg[i].size, req_left);
+			req_left -= seg_left;
+
+			while(seg_left) {
+				size_t len = MIN(seg_left, PAGE_SIZE - (uintptr_t)addr % PAGE_SIZE);
+				uint8_t* phys = valloc_translate(VM_KERNEL, addr, false);
+				if(!phys) {
+					log(LOG_ERR, "virtio_block: Could not map buffer %p to phys mem\n", addr);
+					first->ok_sectors = MIN(first->ok_sectors, chain.offset);
+					left = 0;
+					req_left = 0;
+					break;
+				}
+
+				add_piece(first, &chain, run->lba, phys, len);
+				addr += len;
+				seg_left -= len;
+			}
 		}
 	}
 
-	return num_blocks;
+	// Nothing past a mapping error gets submitted
+	if(chain.num && first->ok_sectors == sectors) {
+		submit_chain(first, &chain, run->lba);
+	}
+
+	kfree(chain.flags);
+	kfree(chain.lengths);
+	kfree(chain.buffers);
+	put_first(first);
 }
 
-static uint64_t write_cb(struct vfs_block_dev* block_dev, uint64_t lba, uint64_t num_blocks, void* buf) {
-	if(dev->features & VIRTIO_BLK_F_RO) {
-		return -1;
-	}
+static void submit_cb(struct vfs_block_dev* block_dev, struct vfs_block_request* run) {
+	submit(run, false);
+}
 
-	//log(LOG_DEBUG, "virtio write_cb lba %d buf %#x\n", lba, buf);
-	return send_request(dev, VIRTIO_BLK_T_OUT, lba, num_blocks, buf);
+// Synchronous interface, used for partition probing
+static uint64_t transfer(uint64_t lba, uint64_t num_blocks, void* buf, bool write) {
+	struct vfs_block_sg sg = {
+		.addr = buf,
+		.size = num_blocks * block_size,
+	};
+
+	struct vfs_block_request req = {
+		.write = write,
+		.lba = lba,
+		.num_blocks = num_blocks,
+		.run_blocks = num_blocks,
+		.sg = &sg,
+		.sg_count = 1,
+	};
+
+	completion_init(&req.done);
+	submit(&req, true);
+	completion_wait(&req.done);
+	return req.result ? req.result : -1;
+}
+
+static uint64_t read_cb(struct vfs_block_dev* block_dev, uint64_t lba, uint64_t num_blocks, void* buf) {
+	return transfer(lba, num_blocks, buf, false);
+}
+
+static uint64_t write_cb(struct vfs_block_dev* block_dev, uint64_t lba, uint64_t num_blocks, void* buf) {
+	return transfer(lba, num_blocks, buf, true);
 }
 
 static int pci_cb(pci_device_t* pci_dev) {
@@ -142,7 +401,7 @@ static int pci_cb(pci_device_t* pci_dev) {
 
 	log(LOG_INFO, "virtio_block: Discovered device %p\n", pci_dev);
 
-	dev = virtio_init_dev(pci_dev, 0, 1);
+	dev = virtio_init_dev(pci_dev, FEATURES_WANT, NULL, 1);
 	if(!dev) {
 		return 1;
 	}
@@ -151,14 +410,67 @@ static int pci_cb(pci_device_t* pci_dev) {
 		log(LOG_INFO, "virtio_block: Device is read-only\n");
 	}
 
-	dev->queues[0].available->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
-	dev->queues[0].used->flags = VIRTQ_USED_F_NO_NOTIFY;
-	int_register(IRQ(dev->pci_dev->interrupt_line), int_handler, false);
+	uint32_t physical_block_size = block_size;
+	if(dev->features & VIRTIO_BLK_F_BLK_SIZE) {
+		uint32_t size = virtio_cfg_read32(dev, VIRTIO_BLK_CFG_BLK_SIZE);
+		if(size >= SECTOR_SIZE && size <= PAGE_SIZE && !(size & (size - 1))) {
+			block_size = size;
+			physical_block_size = size;
+		}
+	}
+
+	if(dev->features & VIRTIO_BLK_F_TOPOLOGY) {
+		uint8_t exp = virtio_cfg_read8(dev, VIRTIO_BLK_CFG_PHYSICAL_BLOCK_EXP);
+		if(exp < 8) {
+			physical_block_size = block_size << exp;
+		}
+	}
+
+	log(LOG_INFO, "virtio_block: Block size %u, physical block size %u\n",
+		block_size, physical_block_size);
+
+	// Each chain needs a header and a status descriptor besides the data
+	struct virtqueue* queue = &dev->queues[0];
+	max_data_descs = queue->size - 2;
+	if(dev->features & VIRTIO_BLK_F_SEG_MAX) {
+		uint32_t seg_max = virtio_cfg_read32(dev, VIRTIO_BLK_CFG_SEG_MAX);
+		if(seg_max >= 2) {
+			max_data_descs = MIN(max_data_descs, seg_max);
+		}
+	}
+
+	/* With indirect descriptors, every chain only takes up a single slot in
+	 * the ring, otherwise at least three.
+	 */
+	if(dev->features & VIRTIO_RING_F_INDIRECT_DESC) {
+		max_data_descs = MIN(max_data_descs, INDIRECT_TABLE_SIZE - 2);
+		num_commands = MIN(queue->size, MAX_COMMANDS);
+	} else {
+		num_commands = MIN(queue->size / 3, MAX_COMMANDS);
+	}
+
+	commands = zmalloc_a(sizeof(struct command) * num_commands);
+	if(dev->features & VIRTIO_RING_F_INDIRECT_DESC) {
+		struct virtq_desc* tables = zmalloc_a(sizeof(struct virtq_desc)
+			* INDIRECT_TABLE_SIZE * num_commands);
+
+		for(int i = 0; i < num_commands; i++) {
+			commands[i].table = tables + i * INDIRECT_TABLE_SIZE;
+		}
+	}
+
+	log(LOG_INFO, "virtio_block: Queue size %d, %d commands with up to %d data segments%s\n",
+		queue->size, num_commands, max_data_descs,
+		(dev->features & VIRTIO_RING_F_INDIRECT_DESC) ? " (indirect)" : "");
+
+	virtio_setup_irq(dev, int_handler);
 
 	dev->status |= VIRTIO_PCI_STATUS_DRIVER_OK;
 	virtio_write_status(dev);
 
-	vfs_block_register_dev("vioblk1", (uint64_t)0, read_cb, write_cb, NULL);
+	struct vfs_block_dev* block_dev = vfs_block_register_dev_sized("vioblk1",
+		(uint64_t)0, block_size, physical_block_size, read_cb, write_cb, NULL);
+	block_dev->queue->submit_cb = submit_cb;
 	return 0;
 }
 
@@ -41,6 +41,12 @@ static char symtab[SYMTAB_BSIZE];
 static char strtab[SYMTAB_BSIZE];
 size_t symtab_len = 0;
 size_t strtab_len = 0;
+static struct multiboot_module modules[MULTIBOOT_MAX_MODULES];
+static size_t num_modules = 0;
+
+// ACPI 2.0 RSDPs are 36 bytes, 1.0 ones 20
+static uint8_t acpi_rsdp[36];
+static bool have_acpi_rsdp = false;
 
 static char* tag_type_names[] = {
 	NULL,
@@ -93,6 +99,27 @@ char* multiboot_get_cmdline(void) {
 	return cmdline;
 }
 
+struct multiboot_module* multiboot_get_modules(size_t* num) {
+	*num = num_modules;
+	return modules;
+}
+
+/* End of the last module in physical memory. Used by paging_init to not place
+ * the early page tables on top of the modules, which bootloaders usually load
+ * right after the kernel.
+ */
+void* multiboot_get_modules_end(void) {
+	void* end = NULL;
+	for(int i = 0; i < num_modules; i++) {
+		end = MAX(end, modules[i].start + modules[i].size);
+	}
+	return end;
+}
+
+void* multiboot_get_acpi_rsdp(void) {
+	return have_acpi_rsdp ? acpi_rsdp : NULL;
+}
+
 static int extract_symtab(struct multiboot_tag_elf_sections* multiboot_tag) {
 	int r = -2;
 	struct elf_section* elf_section = (struct elf_section*)multiboot_tag->sections;
@@ -169,6 +196,25 @@ void multiboot_init(void) {
 			case MULTIBOOT_TAG_TYPE_FRAMEBUFFER:
 				memcpy(&framebuffer_info, tag, sizeof(framebuffer_info));
 				break;
+			case MULTIBOOT_TAG_TYPE_MODULE:
+				if(num_modules < MULTIBOOT_MAX_MODULES) {
+					struct multiboot_tag_module* mtag = (struct multiboot_tag_module*)tag;
+					struct multiboot_module* mod = &modules[num_modules++];
+					mod->start = (void*)mtag->mod_start;
+					mod->size = mtag->mod_end - mtag->mod_start;
+					strlcpy(mod->cmdline, mtag->cmdline, ARRAY_SIZE(mod->cmdline));
+					snprintf(strrep, 150, "%p - %p %s", mod->start, mod->start + mod->size, mod->cmdline);
+				}
+				break;
+			case MULTIBOOT_TAG_TYPE_ACPI_OLD:
+			case MULTIBOOT_TAG_TYPE_ACPI_NEW:
+				// Prefer the ACPI 2.0 RSDP if both are passed
+				if(!have_acpi_rsdp || tag->type == MULTIBOOT_TAG_TYPE_ACPI_NEW) {
+					memcpy(acpi_rsdp, (uint8_t*)(tag + 1), MIN(sizeof(acpi_rsdp),
+						tag->size - sizeof(struct multiboot_tag)));
+					have_acpi_rsdp = true;
+				}
+				break;
 		}
 
 		log(LOG_INFO, "  %#p size %-4d %-18s %s\n", tag, tag->size, tag_type_names[tag->type], strrep);
@@ -27,6 +27,7 @@
 #include <libgen.h>
 #include <tty/serial.h>
 #include <int/int.h>
+#include <int/i386-apic.h>
 #include <bsp/timer.h>
 #include <fs/vfs.h>
 #include <tasks/scheduler.h>
@@ -59,7 +60,7 @@ void (*boot_sequence[])(void) = {
      */
 
 	serial_init,  multiboot_init, gdt_init, mem_init, paging_init, int_init, task_exception_init,
-	timer_init, mem_late_init, cmdline_init, gfx_init, term_init, time_init, pci_init,
+	timer_init, mem_late_init, cmdline_init, apic_init, gfx_init, term_init, time_init, pci_init,
 	block_init, vfs_init, timer_init2, task_init
 #endif
 };
@@ -88,7 +89,8 @@ void xelix_main(void) {
 		init_path = CONFIG_INIT_PATH;
 	}
 
-	log(LOG_INFO, "Starting %s\n", init_path);
+	log(LOG_INFO, "Starting %s, %u ms after timer initialization\n", init_path,
+		timer_tick * 1000 / timer_rate);
 
 	char* __env[] = { NULL };
 	char* __argv[] = { basename(init_path), NULL };
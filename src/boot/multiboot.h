@@ -351,6 +351,15 @@ struct multiboot_tag_load_base_addr
 
 #endif /* ! ASM_FILE */
 
+#define MULTIBOOT_MAX_MODULES 8
+
+// Copy of a module tag, as the multiboot header gets overwritten after boot
+struct multiboot_module {
+	void* start;
+	size_t size;
+	char cmdline[100];
+};
+
 void multiboot_init(void);
 struct multiboot_tag_mmap* multiboot_get_mmap(void);
 struct multiboot_tag_basic_meminfo* multiboot_get_meminfo(void);
@@ -358,6 +367,9 @@ struct multiboot_tag_framebuffer* multiboot_get_framebuffer(void);
 struct elf_sym* multiboot_get_symtab(size_t* length);
 char* multiboot_get_strtab(size_t* length);
 char* multiboot_get_cmdline(void);
+struct multiboot_module* multiboot_get_modules(size_t* num);
+void* multiboot_get_modules_end(void);
+void* multiboot_get_acpi_rsdp(void);
 
 #endif /* ! MULTIBOOT_HEADER */
 
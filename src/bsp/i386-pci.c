@@ -19,7 +19,10 @@
 
 #include <bsp/i386-pci.h>
 #include <mem/kmalloc.h>
+#include <mem/vm.h>
+#include <mem/mem.h>
 #include <fs/sysfs.h>
+#include <int/i386-apic.h>
 #include <string.h>
 #include <panic.h>
 #include <portio.h>
@@ -29,14 +32,31 @@
 #define PORT_CONFIG_DATA  0x0CFC
 
 #define CONFIG_HEADER_DEVICE   2
+#define CONFIG_HEADER_COMMAND  4
+#define CONFIG_HEADER_STATUS   6
 #define CONFIG_HEADER_REVISION 8
 #define CONFIG_HEADER_PROG_IF  9
 #define CONFIG_HEADER_SUBCLASS 10
 #define CONFIG_HEADER_CLASS    11
 #define CONFIG_HEADER_TYPE     15
+#define CONFIG_HEADER_CAP_PTR  0x34
 #define CONFIG_HEADER_INT_LINE 0x3c
 #define CONFIG_HEADER_INT_PIN  0x3d
 
+#define COMMAND_MEMORY (1 << 1)
+#define COMMAND_BUS_MASTER (1 << 2)
+#define COMMAND_INTX_DISABLE (1 << 10)
+#define STATUS_CAP_LIST (1 << 4)
+
+// MSI/MSI-X message control, as part of the first dword of the capability
+#define MSI_CONTROL_ENABLE (1 << 16)
+#define MSI_CONTROL_64BIT (1 << 23)
+#define MSI_CONTROL_MME (7 << 20)
+#define MSIX_CONTROL_TABLE_SIZE(x) ((((x) >> 16) & 0x7ff) + 1)
+#define MSIX_CONTROL_MASK (1 << 30)
+#define MSIX_CONTROL_ENABLE (1 << 31)
+#define MSIX_ENTRY_MASKED 1
+
 #define get_address(bus, dev, func, offset) (0x80000000 | (bus << 16) | \
 	(dev << 11) | (func << 8) | (offset & 0xFC))
 
@@ -76,6 +96,171 @@ uint32_t pci_get_bar(pci_device_t* device, uint8_t bar) {
 	return pci_config_read(device, _register, 4);
 }
 
+/* Map part of a memory BAR into the kernel address space. Only BARs below
+ * 4 GiB are supported. Also enables memory decoding and bus mastering.
+ */
+void* pci_map_bar(pci_device_t* dev, uint8_t bar, size_t offset, size_t size) {
+	uint32_t value = pci_get_bar(dev, bar);
+	if(value & 0x1) {
+		return NULL;
+	}
+
+	// 64-bit BAR, upper half is in the next one
+	if((value & 0x6) == 0x4 && (bar >= 5 || pci_get_bar(dev, bar + 1))) {
+		log(LOG_WARN, "pci: %02d:%02d.%d: BAR %d is above 4 GiB\n",
+			dev->bus, dev->dev, dev->func, bar);
+		return NULL;
+	}
+
+	uintptr_t phys = (value & 0xfffffff0) + offset;
+	if(!(value & 0xfffffff0)) {
+		return NULL;
+	}
+
+	// Status bits in the upper half are write-1-to-clear, so they stay as is
+	uint16_t command = pci_config_read(dev, CONFIG_HEADER_COMMAND, 2);
+	pci_config_write(dev, CONFIG_HEADER_COMMAND, command | COMMAND_MEMORY
+		| COMMAND_BUS_MASTER);
+
+	void* page = (void*)ALIGN_DOWN(phys, PAGE_SIZE);
+	size_t pages = RDIV(phys + size - (uintptr_t)page, PAGE_SIZE);
+
+	// FIXME use proper APIs, see gfx_init
+	mem_page_alloc_at(&mem_phys_alloc_ctx, page, pages);
+
+	vm_alloc_t alloc;
+	if(!vm_alloc(VM_KERNEL, &alloc, pages, page, VM_RW)) {
+		return NULL;
+	}
+	return alloc.addr + (phys - (uintptr_t)page);
+}
+
+// Allow the device to initiate DMA, needed for I/O BARs
+void pci_set_bus_master(pci_device_t* dev) {
+	uint16_t command = pci_config_read(dev, CONFIG_HEADER_COMMAND, 2);
+	pci_config_write(dev, CONFIG_HEADER_COMMAND, command | COMMAND_BUS_MASTER);
+}
+
+/* Returns the config space offset of the next capability with the given id
+ * after start, or 0 if there is none. Use a start of 0 for the first one.
+ */
+uint8_t pci_find_cap(pci_device_t* dev, uint8_t id, uint8_t start) {
+	if(dev->header_type != 0 ||
+		!(pci_config_read(dev, CONFIG_HEADER_STATUS, 2) & STATUS_CAP_LIST)) {
+		return 0;
+	}
+
+	uint8_t offset;
+	if(start) {
+		offset = pci_config_read(dev, start + 1, 1);
+	} else {
+		offset = pci_config_read(dev, CONFIG_HEADER_CAP_PTR, 1);
+	}
+
+	// Bound the walk in case of loops
+	for(int i = 0; offset && i < 48; i++) {
+		offset &= 0xfc;
+		if(pci_config_read(dev, offset, 1) == id) {
+			return offset;
+		}
+		offset = pci_config_read(dev, offset + 1, 1);
+	}
+	return 0;
+}
+
+// Messages target the local APIC of the CPU, fixed delivery, edge triggered
+static inline void msi_message(uint32_t* address, uint32_t* data, uint8_t vector) {
+	*address = APIC_MSI_ADDRESS | ((uint32_t)lapic_get_id() << 12);
+	*data = vector;
+}
+
+// Messages are memory writes, so they need bus mastering as well
+static inline void disable_intx(pci_device_t* dev) {
+	uint16_t command = pci_config_read(dev, CONFIG_HEADER_COMMAND, 2);
+	pci_config_write(dev, CONFIG_HEADER_COMMAND, command | COMMAND_INTX_DISABLE
+		| COMMAND_BUS_MASTER);
+}
+
+/* Make the device signal interrupts using MSI with a single vector instead of
+ * its INTx pin. Only works with the APIC enabled. Config space is written in
+ * dwords here, which also covers the read-only capability ID and next pointer.
+ */
+int pci_enable_msi(pci_device_t* dev, uint8_t vector) {
+	uint8_t cap = pci_find_cap(dev, PCI_CAP_MSI, 0);
+	if(!apic_active || !cap) {
+		return -1;
+	}
+
+	uint32_t address, data;
+	msi_message(&address, &data, vector);
+
+	uint32_t control = pci_config_read(dev, cap, 4);
+	pci_config_write(dev, cap + 4, address);
+	if(control & MSI_CONTROL_64BIT) {
+		pci_config_write(dev, cap + 8, 0);
+		pci_config_write(dev, cap + 12, data);
+	} else {
+		pci_config_write(dev, cap + 8, data);
+	}
+
+	pci_config_write(dev, cap, (control & ~MSI_CONTROL_MME) | MSI_CONTROL_ENABLE);
+	disable_intx(dev);
+	return 0;
+}
+
+/* Enable MSI-X and point the first num entries of the table to vectors.
+ * Returns -1 if the device doesn't support MSI-X or has fewer entries.
+ */
+int pci_enable_msix(pci_device_t* dev, uint8_t* vectors, int num) {
+	uint8_t cap = pci_find_cap(dev, PCI_CAP_MSIX, 0);
+	if(!apic_active || !cap) {
+		return -1;
+	}
+
+	uint32_t control = pci_config_read(dev, cap, 4);
+	if(num < 1 || num > MSIX_CONTROL_TABLE_SIZE(control)) {
+		return -1;
+	}
+
+	uint32_t table_info = pci_config_read(dev, cap + 4, 4);
+	volatile uint32_t* table = pci_map_bar(dev, table_info & 0x7,
+		table_info & ~0x7, num * 16);
+	if(!table) {
+		return -1;
+	}
+
+	// Keep all vectors masked while the table is set up
+	pci_config_write(dev, cap, control | MSIX_CONTROL_ENABLE | MSIX_CONTROL_MASK);
+
+	for(int i = 0; i < num; i++) {
+		uint32_t address, data;
+		msi_message(&address, &data, vectors[i]);
+
+		volatile uint32_t* entry = table + i * 4;
+		entry[0] = address;
+		entry[1] = 0;
+		entry[2] = data;
+		entry[3] &= ~MSIX_ENTRY_MASKED;
+	}
+
+	pci_config_write(dev, cap, (control | MSIX_CONTROL_ENABLE) & ~MSIX_CONTROL_MASK);
+	disable_intx(dev);
+	return 0;
+}
+
+void pci_disable_msix(pci_device_t* dev) {
+	uint8_t cap = pci_find_cap(dev, PCI_CAP_MSIX, 0);
+	if(!cap) {
+		return;
+	}
+
+	uint32_t control = pci_config_read(dev, cap, 4);
+	pci_config_write(dev, cap, control & ~MSIX_CONTROL_ENABLE);
+
+	uint16_t command = pci_config_read(dev, CONFIG_HEADER_COMMAND, 2);
+	pci_config_write(dev, CONFIG_HEADER_COMMAND, command & ~COMMAND_INTX_DISABLE);
+}
+
 static inline void try_load_device(uint8_t bus, uint8_t dev, uint8_t func) {
 	outl(PORT_CONFIG_ADDR, get_address(bus, dev, func, 0));
 	uint16_t vendor = inw(PORT_CONFIG_DATA);
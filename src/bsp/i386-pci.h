@@ -73,11 +73,22 @@ typedef struct pci_device {
 	struct pci_device* next;
 } pci_device_t;
 
+// Capability IDs
+#define PCI_CAP_MSI 0x05
+#define PCI_CAP_VENDOR 0x09
+#define PCI_CAP_MSIX 0x11
+
 uint32_t pci_config_read(pci_device_t* dev, uint8_t offset, int size);
 void pci_config_write(pci_device_t* dev, uint8_t offset, uint32_t val);
 
 int pci_walk(int (*callback)(pci_device_t* dev));
 int pci_check_vendor(pci_device_t* dev, const uint32_t combos[][2]);
 uint32_t pci_get_bar(pci_device_t* device, uint8_t bar);
+void* pci_map_bar(pci_device_t* dev, uint8_t bar, size_t offset, size_t size);
+void pci_set_bus_master(pci_device_t* dev);
+uint8_t pci_find_cap(pci_device_t* dev, uint8_t id, uint8_t start);
+int pci_enable_msi(pci_device_t* dev, uint8_t vector);
+int pci_enable_msix(pci_device_t* dev, uint8_t* vectors, int num);
+void pci_disable_msix(pci_device_t* dev);
 void pci_init(void);
 
@@ -23,10 +23,15 @@
 #include <tasks/task.h>
 #include <portio.h>
 #include <time.h>
+#include <prof.h>
 
-static uint32_t tick = 0;
+static volatile uint32_t tick = 0;
 static uint32_t rate = 1;
 
+// TSC cycles per microsecond and TSC at calibration, see timer_get_us
+static uint32_t tsc_per_us = 0;
+static uint64_t tsc_start = 0;
+
 // The timer callback. Gets called every time the PIT fires.
 static void timer_callback(task_t* task, isf_t* state, int num) {
 	tick++;
@@ -40,6 +45,30 @@ uint32_t timer_get_rate(void) {
 	return rate;
 }
 
+/* Microseconds since timer initialization. Uses the TSC if it could be
+ * calibrated, otherwise falls back to tick granularity.
+ */
+uint64_t timer_get_us(void) {
+	if(!tsc_per_us) {
+		return (uint64_t)tick * 1000000 / rate;
+	}
+	return (profile_read_rdtsc() - tsc_start) / tsc_per_us;
+}
+
+// Measure the TSC frequency over 10 ticks of the PIT
+static void calibrate_tsc(void) {
+	uint32_t start = tick;
+	while(tick == start);
+
+	uint64_t tsc = profile_read_rdtsc();
+	start = tick;
+	while(tick - start < 10);
+
+	uint64_t cycles = profile_read_rdtsc() - tsc;
+	tsc_per_us = cycles * rate / (10 * 1000000);
+	tsc_start = profile_read_rdtsc() - (uint64_t)tick * 1000000 / rate * tsc_per_us;
+}
+
 static size_t sfs_read(struct vfs_callback_ctx* ctx, void* dest, size_t size) {
 	if(ctx->fp->offset) {
 		return 0;
@@ -71,7 +100,8 @@ void timer_init(void) {
 	outb(0x40, l);
 	outb(0x40, h);
 
-	log(LOG_DEBUG, "pit: Timer frequency %d\n", rate);
+	calibrate_tsc();
+	log(LOG_DEBUG, "pit: Timer frequency %d, %u TSC cycles per us\n", rate, tsc_per_us);
 }
 
 void timer_init2(void) {
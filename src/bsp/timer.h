@@ -27,3 +27,4 @@ void timer_init(void);
 void timer_init2(void);
 uint32_t timer_get_tick(void);
 uint32_t timer_get_rate(void);
+uint64_t timer_get_us(void);
@@ -21,9 +21,11 @@
 #include <bsp/i386-pci.h>
 #include <mem/kmalloc.h>
 #include <mem/paging.h>
+#include <mem/vm.h>
 #include <portio.h>
 #include <time.h>
 #include <log.h>
+#include <int/int.h>
 
 #define ioutw(pin, val) outw(dev->pci_dev->iobase + (pin), val)
 #define ioutl(pin, val) outl(dev->pci_dev->iobase + (pin), val)
@@ -31,84 +33,333 @@
 #define iinw(pin) inw(dev->pci_dev->iobase + (pin))
 #define iinl(pin) inl(dev->pci_dev->iobase + (pin))
 
-static inline int negotiate_features(struct virtio_dev* dev, uint32_t want_cap) {
+// Larger queues are shrunk on the modern transport
+#define MAX_QUEUE_SIZE 256
+
+static inline uint8_t read_status(struct virtio_dev* dev) {
+	if(dev->modern) {
+		return dev->common->device_status;
+	}
+	return iinb(VIRTIO_IO_STATUS);
+}
+
+static inline int negotiate_features(struct virtio_dev* dev, uint64_t want_cap,
+	virtio_features_cb_t* features_cb) {
+
 	// Get device supported features, pick out the ones we want and confirm
-	uint32_t dev_features = iinl(VIRTIO_IO_DEV_FEATURE);
-	dev->features = dev_features & want_cap;
-	ioutl(VIRTIO_IO_DRV_FEATURE, dev->features);
+	if(dev->modern) {
+		volatile struct virtio_pci_common_cfg* common = dev->common;
+		common->device_feature_select = 0;
+		uint64_t dev_features = common->device_feature;
+		common->device_feature_select = 1;
+		dev_features |= (uint64_t)common->device_feature << 32;
+
+		dev->features = dev_features & (want_cap | VIRTIO_F_VERSION_1);
+		if(features_cb) {
+			dev->features = features_cb(dev->features);
+		}
+		if(!(dev->features & VIRTIO_F_VERSION_1)) {
+			return -1;
+		}
+
+		common->driver_feature_select = 0;
+		common->driver_feature = dev->features & 0xffffffff;
+		common->driver_feature_select = 1;
+		common->driver_feature = dev->features >> 32;
+	} else {
+		// The legacy interface only has the lower 32 feature bits
+		uint32_t dev_features = iinl(VIRTIO_IO_DEV_FEATURE);
+		dev->features = dev_features & want_cap & 0xffffffff;
+		if(features_cb) {
+			dev->features = features_cb(dev->features) & 0xffffffff;
+		}
+		ioutl(VIRTIO_IO_DRV_FEATURE, dev->features);
+	}
+
 	dev->status |= VIRTIO_PCI_STATUS_FEATURES_OK;
 	virtio_write_status(dev);
 
 	// Check if device is happy
 	sleep_ticks(10);
-	if(!(iinb(VIRTIO_IO_STATUS) & VIRTIO_PCI_STATUS_FEATURES_OK)) {
+	if(!(read_status(dev) & VIRTIO_PCI_STATUS_FEATURES_OK)) {
 		return -1;
 	}
 
 	return 0;
 }
 
+/* Look for the virtio 1.0 vendor capabilities and map the structures they
+ * point to. Returns -1 if the device only supports the legacy interface.
+ */
+static int find_modern(struct virtio_dev* dev) {
+	pci_device_t* pdev = dev->pci_dev;
+	uint8_t cap = 0;
+
+	while((cap = pci_find_cap(pdev, PCI_CAP_VENDOR, cap))) {
+		uint8_t type = pci_config_read(pdev, cap + 3, 1);
+		uint8_t bar = pci_config_read(pdev, cap + 4, 1);
+		uint32_t offset = pci_config_read(pdev, cap + 8, 4);
+		uint32_t length = pci_config_read(pdev, cap + 12, 4);
+
+		if(bar > 5) {
+			continue;
+		}
+
+		// Only the first capability of each type is used
+		switch(type) {
+			case VIRTIO_PCI_CAP_COMMON_CFG:
+				if(!dev->common) {
+					dev->common = pci_map_bar(pdev, bar, offset, length);
+				}
+				break;
+			case VIRTIO_PCI_CAP_NOTIFY_CFG:
+				if(!dev->notify_base) {
+					dev->notify_base = pci_map_bar(pdev, bar, offset, length);
+					dev->notify_multiplier = pci_config_read(pdev, cap + 16, 4);
+				}
+				break;
+			case VIRTIO_PCI_CAP_ISR_CFG:
+				if(!dev->isr) {
+					dev->isr = pci_map_bar(pdev, bar, offset, length);
+				}
+				break;
+			case VIRTIO_PCI_CAP_DEVICE_CFG:
+				if(!dev->device_cfg) {
+					dev->device_cfg = pci_map_bar(pdev, bar, offset, length);
+				}
+				break;
+		}
+	}
+
+	if(!dev->common || !dev->notify_base || !dev->isr) {
+		return -1;
+	}
+	return 0;
+}
+
+/* Builds a descriptor chain from the free list. Returns the index of the
+ * head descriptor, or -1 if there are not enough free descriptors. Needs to be
+ * called with interrupts disabled since used chains are returned to the free
+ * list from interrupt handlers.
+ */
 static inline int write_desc_chain(struct virtqueue* queue, int num_buffers,
 	void** buffers, size_t* lengths, int* flags) {
 
-	size_t desc_head = queue->desc_index;
+	if(num_buffers < 1 || queue->num_free < num_buffers) {
+		return -1;
+	}
+
+	uint16_t desc_head = queue->free_head;
+	uint16_t index = desc_head;
 
 	for(int i = 0; i < num_buffers; i++) {
-		struct virtq_desc* desc = &queue->descriptors[queue->desc_index];
-		queue->desc_index = (queue->desc_index + 1) % queue->size;
+		struct virtq_desc* desc = &queue->descriptors[index];
+		uint16_t next_free = desc->next;
 
 		desc->len = lengths[i];
 		desc->addr = (uint64_t)(uintptr_t)buffers[i];
 		desc->flags = 0;
-		desc->next = 0;
 
 		if(flags) {
 			desc->flags |= flags[i];
 		}
 
+		// The next free descriptor becomes the next one in the chain
 		if(i < num_buffers - 1) {
 			desc->flags |= VIRTQ_DESC_F_NEXT;
-			desc->next = queue->desc_index;
 		}
+		index = next_free;
 	}
 
+	queue->free_head = index;
+	queue->num_free -= num_buffers;
 	return desc_head;
 }
 
+/* Queue a descriptor chain for the device. data is stored in queue->data for
+ * the interrupt handler to find once the chain has been used. Returns -1 if
+ * the ring is full. Can be called from interrupt handlers.
+ */
 int virtio_write(struct virtio_dev* dev, uint8_t queue_id, int num_buffers,
-	void** buffers, size_t* lengths, int* flags) {
+	void** buffers, size_t* lengths, int* flags, void* data) {
 
 	struct virtqueue* queue = &dev->queues[queue_id];
-	size_t desc_head = write_desc_chain(queue, num_buffers, buffers, lengths, flags);
-	virtio_write_avail(dev, queue, desc_head);
+	uint32_t int_flags = int_save();
+	int desc_head = write_desc_chain(queue, num_buffers, buffers, lengths, flags);
+	if(desc_head >= 0) {
+		queue->data[desc_head] = data;
+		virtio_write_avail(dev, queue, desc_head);
+	}
+	int_restore(int_flags);
 	return desc_head;
 }
 
-void virtio_provide_descs(struct virtio_dev* dev, uint8_t queue_id, int num, size_t size) {
-	struct virtqueue* queue = &dev->queues[queue_id];
+/* Like virtio_write, but puts the chain into an indirect descriptor table so
+ * it only takes up a single descriptor in the ring. Requires
+ * VIRTIO_RING_F_INDIRECT_DESC. The table needs to be physically contiguous and
+ * stay untouched until the device has used the chain.
+ */
+int virtio_write_indirect(struct virtio_dev* dev, uint8_t queue_id,
+	struct virtq_desc* table, int num_buffers, void** buffers, size_t* lengths,
+	int* flags, void* data) {
 
-	for(int i = 0; i < num; i++) {
-		void* buf = kmalloc(size);
+	for(int i = 0; i < num_buffers; i++) {
+		table[i].addr = (uint64_t)(uintptr_t)buffers[i];
+		table[i].len = lengths[i];
+		table[i].flags = flags ? flags[i] : 0;
+		table[i].next = 0;
 
-		int flags[] = {VIRTQ_DESC_F_WRITE};
-		int desc = write_desc_chain(queue, 1, &buf, &size, flags);
+		if(i < num_buffers - 1) {
+			table[i].flags |= VIRTQ_DESC_F_NEXT;
+			table[i].next = i + 1;
+		}
+	}
 
-		size_t av_index = (queue->available->idx + i) % queue->size;
-		queue->available->ring[av_index] = desc;
+	void* table_phys = valloc_translate(VM_KERNEL, table, false);
+	if(!table_phys) {
+		return -1;
 	}
 
 	__sync_synchronize();
-	queue->available->idx += num;
-	ioutw(0x10, queue_id);
+	size_t table_len = sizeof(struct virtq_desc) * num_buffers;
+	int table_flags = VIRTQ_DESC_F_INDIRECT;
+	return virtio_write(dev, queue_id, 1, &table_phys, &table_len, &table_flags, data);
 }
 
-static inline int setup_virtqueue(struct virtio_dev* dev, uint8_t queue_id) {
+// Return a used descriptor chain to the free list
+void virtio_free_chain(struct virtqueue* queue, uint16_t head) {
+	uint16_t index = head;
+	size_t num = 1;
+
+	while(queue->descriptors[index].flags & VIRTQ_DESC_F_NEXT) {
+		index = queue->descriptors[index].next;
+		num++;
+	}
+
+	queue->descriptors[index].next = queue->free_head;
+	queue->free_head = head;
+	queue->num_free += num;
+}
+
+/* Ask the device not to interrupt for this queue, while the interrupt handler
+ * is working through the used ring. With EVENT_IDX, that is already the case
+ * until virtio_enable_cb moves the used event forward.
+ */
+void virtio_disable_cb(struct virtio_dev* dev, struct virtqueue* queue) {
+	if(!(dev->features & VIRTIO_RING_F_EVENT_IDX)) {
+		queue->available->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+	}
+}
+
+/* Reenable interrupts for the next used buffer. Returns true if more buffers
+ * have been used in the meantime, in which case the caller needs to process
+ * them since there may not be another interrupt for them.
+ */
+bool virtio_enable_cb(struct virtio_dev* dev, struct virtqueue* queue) {
+	if(dev->features & VIRTIO_RING_F_EVENT_IDX) {
+		*virtq_used_event(queue) = queue->used_index;
+	} else {
+		queue->available->flags = 0;
+	}
+
+	__sync_synchronize();
+	return (uint16_t)queue->used_index != queue->used->idx;
+}
+
+// Assign an MSI-X table entry to a queue, returns what the device accepted
+static inline uint16_t set_queue_vector(struct virtio_dev* dev, uint8_t queue_id, uint16_t entry) {
+	if(dev->modern) {
+		dev->common->queue_select = queue_id;
+		dev->common->queue_msix_vector = entry;
+		return dev->common->queue_msix_vector;
+	}
+
 	ioutw(VIRTIO_IO_QUEUE_SELECT, queue_id);
+	ioutw(VIRTIO_IO_MSI_QUEUE_VECTOR, entry);
+	return iinw(VIRTIO_IO_MSI_QUEUE_VECTOR);
+}
+
+static inline bool setup_msix(struct virtio_dev* dev, uint8_t* vectors) {
+	for(int i = 0; i < dev->num_queues; i++) {
+		int vector = int_alloc_vector();
+		if(vector < 0) {
+			return false;
+		}
+		vectors[i] = vector;
+	}
+
+	if(pci_enable_msix(dev->pci_dev, vectors, dev->num_queues) < 0) {
+		return false;
+	}
+
+	// Config change interrupts are not used
+	dev->msix = true;
+	if(dev->modern) {
+		dev->common->msix_config = VIRTIO_MSI_NO_VECTOR;
+	} else {
+		ioutw(VIRTIO_IO_MSI_CONFIG_VECTOR, VIRTIO_MSI_NO_VECTOR);
+	}
+
+	// Table entry i belongs to queue i
+	for(int i = 0; i < dev->num_queues; i++) {
+		if(set_queue_vector(dev, i, i) != i) {
+			for(int j = 0; j < i; j++) {
+				set_queue_vector(dev, j, VIRTIO_MSI_NO_VECTOR);
+			}
+
+			pci_disable_msix(dev->pci_dev);
+			dev->msix = false;
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Register the interrupt handler of a driver. If MSI-X is available, every
+ * queue gets its own vector, and handlers can tell the queues apart by
+ * comparing the interrupt number to queue->vector. Otherwise, all queues share
+ * the INTx line of the device, and the handler needs to acknowledge it using
+ * virtio_read_isr. Needs to be called before setting DRIVER_OK.
+ */
+void virtio_setup_irq(struct virtio_dev* dev, interrupt_handler_t handler) {
+	uint8_t vectors[dev->num_queues];
+
+	// Vectors are not returned if this fails, but there are plenty
+	if(setup_msix(dev, vectors)) {
+		for(int i = 0; i < dev->num_queues; i++) {
+			dev->queues[i].vector = vectors[i];
+			int_register(vectors[i], handler, false);
+		}
+
+		log(LOG_INFO, "virtio: %02d:%02d.%d: Using MSI-X, vectors %#x - %#x\n",
+			dev->pci_dev->bus, dev->pci_dev->dev, dev->pci_dev->func,
+			vectors[0], vectors[dev->num_queues - 1]);
+		return;
+	}
+
+	for(int i = 0; i < dev->num_queues; i++) {
+		dev->queues[i].vector = -1;
+	}
+	int_register(IRQ(dev->pci_dev->interrupt_line), handler, false);
+}
+
+static inline int setup_virtqueue(struct virtio_dev* dev, uint8_t queue_id) {
 	struct virtqueue* queue = &dev->queues[queue_id];
 	queue->id = queue_id;
 
 	// Check if this vq is actually supported by the card
-	queue->size = iinw(VIRTIO_IO_QUEUE_SIZE);
+	if(dev->modern) {
+		dev->common->queue_select = queue_id;
+		queue->size = dev->common->queue_size;
+		if(queue->size > MAX_QUEUE_SIZE) {
+			queue->size = MAX_QUEUE_SIZE;
+			dev->common->queue_size = queue->size;
+		}
+	} else {
+		ioutw(VIRTIO_IO_QUEUE_SELECT, queue_id);
+		queue->size = iinw(VIRTIO_IO_QUEUE_SIZE);
+	}
+
 	if(queue->size < 1) {
 		return -1;
 	}
@@ -124,45 +375,91 @@ static inline int setup_virtqueue(struct virtio_dev* dev, uint8_t queue_id) {
 	queue->available = buf + desc_size;
 	queue->used = buf + desc_size + available_size;
 
+	for(int i = 0; i < queue->size; i++) {
+		queue->descriptors[i].next = i + 1;
+	}
+	queue->free_head = 0;
+	queue->num_free = queue->size;
+	queue->data = zmalloc(sizeof(void*) * queue->size);
 	__sync_synchronize();
-	ioutl(VIRTIO_IO_QUEUE_PFN, (uintptr_t)buf >> 12);
+
+	if(!dev->modern) {
+		ioutl(VIRTIO_IO_QUEUE_PFN, (uintptr_t)valloc_translate(VM_KERNEL, buf, false) >> 12);
+		return 0;
+	}
+
+	volatile struct virtio_pci_common_cfg* common = dev->common;
+	common->queue_desc_lo = (uintptr_t)valloc_translate(VM_KERNEL, queue->descriptors, false);
+	common->queue_desc_hi = 0;
+	common->queue_driver_lo = (uintptr_t)valloc_translate(VM_KERNEL, queue->available, false);
+	common->queue_driver_hi = 0;
+	common->queue_device_lo = (uintptr_t)valloc_translate(VM_KERNEL, queue->used, false);
+	common->queue_device_hi = 0;
+
+	queue->notify = (volatile uint16_t*)(dev->notify_base
+		+ common->queue_notify_off * dev->notify_multiplier);
+	common->queue_enable = 1;
 	return 0;
 }
 
-struct virtio_dev* virtio_init_dev(pci_device_t* pci_dev, uint32_t cap, int queues) {
+static void fail(struct virtio_dev* dev) {
+	dev->status = VIRTIO_PCI_STATUS_FAILED;
+	virtio_write_status(dev);
+	kfree(dev);
+}
+
+/* Set up a virtio device and its virtqueues. Uses the virtio 1.0 transport if
+ * the device offers it, the legacy I/O port interface otherwise. cap is the
+ * set of feature bits the driver supports, the negotiated ones end up in
+ * dev->features. If given, features_cb can drop features from the ones both
+ * sides support, for ones that only work in combination.
+ */
+struct virtio_dev* virtio_init_dev(pci_device_t* pci_dev, uint64_t cap,
+	virtio_features_cb_t* features_cb, int queues) {
 	struct virtio_dev* dev = zmalloc(sizeof(struct virtio_dev) + sizeof(struct virtqueue) * queues);
 	dev->pci_dev = pci_dev;
 	dev->num_queues = queues;
 
+	dev->modern = !find_modern(dev);
+	if(!dev->modern && !pci_dev->iobase) {
+		log(LOG_ERR, "virtio: Device has neither modern nor legacy interface\n");
+		kfree(dev);
+		return NULL;
+	}
+
 	dev->status = VIRTIO_PCI_STATUS_RESET;
 	virtio_write_status(dev);
 
-	if(iinb(VIRTIO_IO_STATUS) != 0) {
-		log(LOG_ERR, "virtio: Device reset failed.\n");
-		kfree(dev);
-		return NULL;
+	// Modern devices may take a moment to finish the reset
+	for(int i = 0; read_status(dev) != 0; i++) {
+		if(i == 10) {
+			log(LOG_ERR, "virtio: Device reset failed.\n");
+			kfree(dev);
+			return NULL;
+		}
+		sleep_ticks(1);
 	}
 
 	dev->status = VIRTIO_PCI_STATUS_ACKNOWLEDGE | VIRTIO_PCI_STATUS_DRIVER;
 	virtio_write_status(dev);
 
-	if(negotiate_features(dev, cap) < 0) {
+	if(negotiate_features(dev, cap, features_cb) < 0) {
 		log(LOG_ERR, "virtio: Feature negotiation failed\n");
-		dev->status = VIRTIO_PCI_STATUS_FAILED;
-		virtio_write_status(dev);
-		kfree(dev);
+		fail(dev);
 		return NULL;
 	}
 
 	for(int i = 0; i < queues; i++) {
 		if(setup_virtqueue(dev, i) < 0) {
 			log(LOG_ERR, "virtio: Could not set up queue %d\n", i);
-			dev->status = VIRTIO_PCI_STATUS_FAILED;
-			virtio_write_status(dev);
-			kfree(dev);
+			fail(dev);
 			return NULL;
 		}
 	}
 
+	log(LOG_INFO, "virtio: %02d:%02d.%d: %s transport, features %#x:%08x\n",
+		pci_dev->bus, pci_dev->dev, pci_dev->func,
+		dev->modern ? "modern" : "legacy",
+		(uint32_t)(dev->features >> 32), (uint32_t)dev->features);
 	return dev;
 }
@@ -19,6 +19,7 @@
  */
 
 #include <bsp/i386-pci.h>
+#include <int/int.h>
 #include <portio.h>
 
 /* Virtio product id (subsystem) */
@@ -35,6 +36,22 @@
 #define VIRTIO_IO_QUEUE_SELECT 14
 #define VIRTIO_IO_QUEUE_SIZE 12
 #define VIRTIO_IO_QUEUE_PFN 8
+#define VIRTIO_IO_QUEUE_NOTIFY 16
+#define VIRTIO_IO_ISR 19
+#define VIRTIO_IO_MSI_CONFIG_VECTOR 20
+#define VIRTIO_IO_MSI_QUEUE_VECTOR 22
+
+// The legacy device config moves back when MSI-X is enabled
+#define VIRTIO_IO_DEVICE_CFG 20
+#define VIRTIO_IO_DEVICE_CFG_MSIX 24
+
+#define VIRTIO_MSI_NO_VECTOR 0xffff
+
+// Modern (virtio 1.0) PCI capability types
+#define VIRTIO_PCI_CAP_COMMON_CFG 1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG 2
+#define VIRTIO_PCI_CAP_ISR_CFG 3
+#define VIRTIO_PCI_CAP_DEVICE_CFG 4
 
 #define VIRTIO_PCI_STATUS_RESET 0x00
 #define VIRTIO_PCI_STATUS_ACKNOWLEDGE 0x01
@@ -43,6 +60,11 @@
 #define VIRTIO_PCI_STATUS_FEATURES_OK 0x8
 #define VIRTIO_PCI_STATUS_FAILED 0x80
 
+// Ring feature bits, negotiated along with the device-specific ones
+#define VIRTIO_RING_F_INDIRECT_DESC (1 << 28)
+#define VIRTIO_RING_F_EVENT_IDX (1 << 29)
+#define VIRTIO_F_VERSION_1 (1ULL << 32)
+
 // This marks a buffer as continuing via the next field.
 #define VIRTQ_DESC_F_NEXT 1
 // This marks a buffer as device write-only (otherwise device read-only).
@@ -87,31 +109,158 @@ struct virtqueue {
 	struct virtq_used* used;
 	int id;
 	size_t size;
-	size_t desc_index;
 	size_t used_index;
+
+	// Unused descriptors are linked through their next field
+	uint16_t free_head;
+	size_t num_free;
+
+	// Driver data for in-flight chains, indexed by head descriptor
+	void** data;
+
+	// Modern transport only
+	volatile uint16_t* notify;
+
+	// Interrupt vector of the queue if MSI-X is used, -1 otherwise
+	int vector;
 };
 
+struct virtio_pci_common_cfg {
+	uint32_t device_feature_select;
+	uint32_t device_feature;
+	uint32_t driver_feature_select;
+	uint32_t driver_feature;
+	uint16_t msix_config;
+	uint16_t num_queues;
+	uint8_t device_status;
+	uint8_t config_generation;
+
+	uint16_t queue_select;
+	uint16_t queue_size;
+	uint16_t queue_msix_vector;
+	uint16_t queue_enable;
+	uint16_t queue_notify_off;
+	uint32_t queue_desc_lo;
+	uint32_t queue_desc_hi;
+	uint32_t queue_driver_lo;
+	uint32_t queue_driver_hi;
+	uint32_t queue_device_lo;
+	uint32_t queue_device_hi;
+} __attribute__((packed));
+
+// Gets the features both sides support, returns the ones to negotiate
+typedef uint64_t (virtio_features_cb_t)(uint64_t features);
+
 struct virtio_dev {
 	pci_device_t* pci_dev;
-	uint32_t features;
+	uint64_t features;
 	uint32_t status;
+
+	/* Set if the device uses the virtio 1.0 transport, in which case the
+	 * registers are memory-mapped through the structures below instead of
+	 * using the legacy I/O port interface.
+	 */
+	bool modern;
+	volatile struct virtio_pci_common_cfg* common;
+	volatile uint8_t* isr;
+	volatile uint8_t* device_cfg;
+	volatile uint8_t* notify_base;
+	uint32_t notify_multiplier;
+
+	// Set if every queue has its own MSI-X vector, see virtio_setup_irq
+	bool msix;
+
 	size_t num_queues;
 	struct virtqueue queues[];
 };
 
+/* With VIRTIO_RING_F_EVENT_IDX, these live behind the available and used
+ * rings respectively.
+ */
+#define virtq_used_event(queue) ((volatile uint16_t*)((uint8_t*)(queue)->available \
+	+ sizeof(struct virtq_avail) + sizeof(uint16_t) * (queue)->size))
+#define virtq_avail_event(queue) ((volatile uint16_t*)((uint8_t*)(queue)->used \
+	+ sizeof(struct virtq_used) + sizeof(struct virtq_used_elem) * (queue)->size))
+
 static inline void virtio_write_status(struct virtio_dev* dev) {
-	outb(dev->pci_dev->iobase + VIRTIO_IO_STATUS, dev->status);
+	if(dev->modern) {
+		dev->common->device_status = dev->status;
+	} else {
+		outb(dev->pci_dev->iobase + VIRTIO_IO_STATUS, dev->status);
+	}
 }
 
+// Reading the ISR status acknowledges INTx interrupts
+static inline uint8_t virtio_read_isr(struct virtio_dev* dev) {
+	if(dev->modern) {
+		return *dev->isr;
+	}
+	return inb(dev->pci_dev->iobase + VIRTIO_IO_ISR);
+}
+
+static inline uint16_t virtio_legacy_cfg(struct virtio_dev* dev) {
+	return dev->pci_dev->iobase + (dev->msix ? VIRTIO_IO_DEVICE_CFG_MSIX
+		: VIRTIO_IO_DEVICE_CFG);
+}
+
+static inline uint8_t virtio_cfg_read8(struct virtio_dev* dev, size_t offset) {
+	if(dev->modern) {
+		return dev->device_cfg[offset];
+	}
+	return inb(virtio_legacy_cfg(dev) + offset);
+}
+
+static inline uint32_t virtio_cfg_read32(struct virtio_dev* dev, size_t offset) {
+	if(dev->modern) {
+		return *(volatile uint32_t*)(dev->device_cfg + offset);
+	}
+	return inl(virtio_legacy_cfg(dev) + offset);
+}
+
+static inline bool vring_need_event(uint16_t event_idx, uint16_t new_idx, uint16_t old_idx) {
+	return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+static inline void virtio_notify(struct virtio_dev* dev, struct virtqueue* queue) {
+	if(dev->modern) {
+		*queue->notify = queue->id;
+	} else {
+		outw(dev->pci_dev->iobase + VIRTIO_IO_QUEUE_NOTIFY, queue->id);
+	}
+}
+
+/* Make a chain available to the device, and notify it unless it has asked not
+ * to be. With EVENT_IDX, the device tells us up to which index it is going to
+ * look at the ring on its own anyway.
+ */
 static inline void virtio_write_avail(struct virtio_dev* dev, struct virtqueue* queue, int desc_no) {
-	queue->available->ring[queue->available->idx % queue->size] = desc_no;
+	uint16_t old_idx = queue->available->idx;
+	queue->available->ring[old_idx % queue->size] = desc_no;
+	__sync_synchronize();
+	queue->available->idx = old_idx + 1;
 	__sync_synchronize();
-	queue->available->idx++;
-	outw(dev->pci_dev->iobase + 0x10, queue->id);
+
+	bool kick;
+	if(dev->features & VIRTIO_RING_F_EVENT_IDX) {
+		kick = vring_need_event(*virtq_avail_event(queue), old_idx + 1, old_idx);
+	} else {
+		kick = !(queue->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+	}
+
+	if(kick) {
+		virtio_notify(dev, queue);
+	}
 }
 
 int virtio_write(struct virtio_dev* dev, uint8_t queue_id, int num_buffers,
-	void** buffers, size_t* lengths, int* flags);
+	void** buffers, size_t* lengths, int* flags, void* data);
+int virtio_write_indirect(struct virtio_dev* dev, uint8_t queue_id,
+	struct virtq_desc* table, int num_buffers, void** buffers, size_t* lengths,
+	int* flags, void* data);
+void virtio_free_chain(struct virtqueue* queue, uint16_t head);
+void virtio_disable_cb(struct virtio_dev* dev, struct virtqueue* queue);
+bool virtio_enable_cb(struct virtio_dev* dev, struct virtqueue* queue);
 
-void virtio_provide_descs(struct virtio_dev* dev, uint8_t queue_id, int num, size_t size);
-struct virtio_dev* virtio_init_dev(pci_device_t* dev, uint32_t cap, int queues);
+void virtio_setup_irq(struct virtio_dev* dev, interrupt_handler_t handler);
+struct virtio_dev* virtio_init_dev(pci_device_t* dev, uint64_t cap,
+	virtio_features_cb_t* features_cb, int queues);
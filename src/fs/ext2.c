@@ -121,7 +121,7 @@ static int ext2_stat(struct vfs_callback_ctx* ctx, vfs_stat_t* dest) {
 	dest->st_atime = inode->atime;
 	dest->st_mtime = inode->mtime;
 	dest->st_ctime = inode->ctime;
-	dest->st_blksize = bl_off(1);
+	dest->st_blksize = MAX(bl_off(1), fs->dev->physical_block_size);
 	dest->st_blocks = inode->block_count;
 
 	kfree(dirent);
@@ -329,26 +329,12 @@ static int do_unlink(struct ext2_fs* fs, char* path, bool is_dir, task_t* task)
 
 		// Free data blocks
 		struct blockgroup* blockgroup = fs->blockgroup_table + inode_to_blockgroup(dirent->inode);
-		struct ext2_blocknum_resolver_cache* res_cache = zmalloc(sizeof(struct ext2_blocknum_resolver_cache));
-
-		for(int i = 0; true; i++) {
-			uint32_t num = ext2_resolve_blocknum(fs, inode, i, res_cache);
-			if(!num) {
-				break;
-			}
+		ext2_inode_free_blocks(fs, inode);
 
-			ext2_bitmap_free(fs, blockgroup->block_bitmap, num % fs->superblock->blocks_per_group);
-		}
-
-		ext2_free_blocknum_resolver_cache(res_cache);
 		ext2_bitmap_free(fs, blockgroup->inode_bitmap, (dirent->inode - 1) % fs->superblock->inodes_per_group);
 		fs->superblock->free_inodes++;
 		blockgroup->free_inodes++;
 
-		// inode->block_count counts IDE blocks, free_blocks counts ext2 blocks.
-		fs->superblock->free_blocks += inode->block_count / 8;
-		blockgroup->free_blocks += inode->block_count / 8;
-
 		if(is_dir) {
 			blockgroup->used_directories--;
 
@@ -499,6 +485,12 @@ static int ext2_readlink(struct vfs_callback_ctx* ctx, char* buf, size_t size) {
 }
 
 
+// O_DIRECT requires offset, size and buffer to be aligned to the device block size
+static inline bool direct_aligned(struct ext2_fs* fs, uint64_t offset, size_t size, void* buf) {
+	int bs = fs->dev->block_size;
+	return !(offset % bs) && !(size % bs) && !((uintptr_t)buf % bs);
+}
+
 static size_t ext2_read(struct vfs_callback_ctx* ctx, void* dest, size_t size) {
 	struct ext2_fs* fs = ctx->mp->instance;
 	if(!ctx->fp || !ctx->fp->inode || !fs) {
@@ -509,6 +501,12 @@ static size_t ext2_read(struct vfs_callback_ctx* ctx, void* dest, size_t size) {
 
 	debug("ext2_read_file for %s, off %d, size %d\n", ctx->fp->mount_path, ctx->fp->offset, size);
 
+	bool direct = ctx->fp->flags & O_DIRECT;
+	if(direct && !direct_aligned(fs, ctx->fp->offset, size, dest)) {
+		sc_errno = EINVAL;
+		return -1;
+	}
+
 	struct inode* inode = kmalloc(fs->superblock->inode_size);
 	if(!ext2_inode_read(fs, inode, ctx->fp->inode)) {
 		kfree(inode);
@@ -547,7 +545,14 @@ static size_t ext2_read(struct vfs_callback_ctx* ctx, void* dest, size_t size) {
 		debug("ext2: Capping read size to 0x%x\n", size);
 	}
 
-	uint8_t* read = ext2_inode_read_data(fs, inode, ctx->fp->offset, size, dest);
+	uint8_t* read;
+	if(direct) {
+		// Buffer is large enough for the aligned size since the request was aligned
+		read = ext2_inode_data_direct(fs, inode, 0, ctx->fp->offset,
+			ALIGN(size, fs->dev->block_size), dest);
+	} else {
+		read = ext2_inode_read_data(fs, inode, ctx->fp->offset, size, dest);
+	}
 	kfree(inode);
 
 	if(!read) {
@@ -566,6 +571,12 @@ static size_t ext2_write(struct vfs_callback_ctx* ctx, void* source, size_t size
 
 	debug("ext2_write_file for %s, off %d, size %d\n", ctx->fp->mount_path, ctx->fp->offset, size);
 
+	bool direct = ctx->fp->flags & O_DIRECT;
+	if(direct && !direct_aligned(fs, ctx->fp->offset, size, source)) {
+		sc_errno = EINVAL;
+		return -1;
+	}
+
 	struct inode* inode = kmalloc(fs->superblock->inode_size);
 	if(!ext2_inode_read(fs, inode, ctx->fp->inode)) {
 		kfree(inode);
@@ -593,18 +604,125 @@ static size_t ext2_write(struct vfs_callback_ctx* ctx, void* source, size_t size
 		return -1;
 	}
 
-	if(!ext2_inode_write_data(fs, inode, ctx->fp->inode, ctx->fp->offset, size, source)) {
+	uint8_t* written;
+	if(direct) {
+		written = ext2_inode_data_direct(fs, inode, ctx->fp->inode, ctx->fp->offset, size, source);
+	} else {
+		written = ext2_inode_write_data(fs, inode, ctx->fp->inode, ctx->fp->offset, size, source);
+	}
+
+	if(!written) {
 		kfree(inode);
 		return -1;
 	}
 
-	inode->size = ctx->fp->offset + size;
+	if(ctx->fp->offset + size > inode->size) {
+		inode->size = ctx->fp->offset + size;
+	}
 	inode->mtime = time_get();
 	ext2_inode_write(fs, inode, ctx->fp->inode);
 	kfree(inode);
 	return size;
 }
 
+static int ext2_fallocate(struct vfs_callback_ctx* ctx, int mode, uint64_t offset, uint64_t len) {
+	struct ext2_fs* fs = ctx->mp->instance;
+	if(!ctx->fp || !ctx->fp->inode) {
+		sc_errno = EBADF;
+		return -1;
+	}
+
+	debug("ext2_fallocate for %s, mode %d, off %d, len %d\n", ctx->fp->mount_path, mode, offset, len);
+
+	// inode->size is only 32 bits
+	if(offset > UINT32_MAX || len > UINT32_MAX - offset) {
+		sc_errno = EFBIG;
+		return -1;
+	}
+
+	struct inode* inode = kmalloc(fs->superblock->inode_size);
+	if(!ext2_inode_read(fs, inode, ctx->fp->inode)) {
+		kfree(inode);
+		sc_errno = EBADF;
+		return -1;
+	}
+
+	if(ext2_inode_check_perm(PERM_CHECK_WRITE, inode, ctx->task) < 0) {
+		kfree(inode);
+		sc_errno = EACCES;
+		return -1;
+	}
+
+	if(vfs_mode_to_filetype(inode->mode) != FT_IFREG) {
+		kfree(inode);
+		sc_errno = ENODEV;
+		return -1;
+	}
+
+	uint64_t end = offset + len;
+	if(mode & FALLOC_FL_PUNCH_HOLE) {
+		// Free fully covered blocks, zero partially covered ones
+		uint32_t first = bl_size(offset + bl_off(1) - 1);
+		uint32_t last = bl_size(end);
+		if(first < last) {
+			ext2_inode_free_range(fs, inode, ctx->fp->inode, first, last);
+		}
+
+		uint64_t head_end = MIN(end, bl_off(first));
+		uint64_t tail_start = MAX(offset, bl_off(last));
+		if(first > last) {
+			// Hole is within a single block
+			head_end = end;
+			tail_start = end;
+		}
+
+		struct ext2_blocknum_resolver_cache* res_cache = zmalloc(sizeof(struct ext2_blocknum_resolver_cache));
+		uint8_t* zero = zmalloc(bl_off(1));
+		uint64_t ranges[2][2] = {{offset, head_end}, {tail_start, end}};
+		bool failed = false;
+		for(int i = 0; i < 2 && !failed; i++) {
+			uint64_t start = ranges[i][0];
+			if(start >= ranges[i][1]) {
+				continue;
+			}
+
+			uint32_t block_num = ext2_resolve_blocknum(fs, inode, bl_size(start), res_cache);
+			if(block_num && vfs_block_swrite(fs->dev, bl_off(block_num) + bl_mod(start),
+				ranges[i][1] - start, zero) != ranges[i][1] - start) {
+				failed = true;
+			}
+		}
+
+		kfree(zero);
+		ext2_free_blocknum_resolver_cache(res_cache);
+
+		// Keep track of the blocks that did get freed
+		if(failed) {
+			ext2_inode_write(fs, inode, ctx->fp->inode);
+			kfree(inode);
+			sc_errno = EIO;
+			return -1;
+		}
+	} else {
+		if(ext2_inode_alloc_range(fs, inode, ctx->fp->inode, bl_size(offset),
+			bl_size(end + bl_off(1) - 1)) < 0) {
+
+			// Keep track of the blocks that did get allocated
+			ext2_inode_write(fs, inode, ctx->fp->inode);
+			kfree(inode);
+			return -1;
+		}
+
+		if(!(mode & FALLOC_FL_KEEP_SIZE) && end > inode->size) {
+			inode->size = end;
+		}
+	}
+
+	inode->mtime = time_get();
+	ext2_inode_write(fs, inode, ctx->fp->inode);
+	kfree(inode);
+	return 0;
+}
 
 static size_t ext2_getdents(struct vfs_callback_ctx* ctx, void* buf, size_t size) {
 	struct ext2_fs* fs = ctx->mp->instance;
@@ -797,6 +915,7 @@ struct vfs_callbacks cb = {
 	.stat = ext2_stat,
 	.read = ext2_read,
 	.write = ext2_write,
+	.fallocate = ext2_fallocate,
 	.getdents = ext2_getdents,
 	.unlink = ext2_unlink,
 	.chmod = ext2_chmod,
@@ -817,7 +936,7 @@ int ext2_mount(struct vfs_block_dev* dev, const char* path) {
 
 	// Main superblock always has an offset of 1024
 	fs->superblock = (struct superblock*)kmalloc(1024);
-	if(vfs_block_read(fs->dev, 2, 2, (uint8_t*)fs->superblock) < 0 ||
+	if(vfs_block_sread(fs->dev, 1024, 1024, (uint8_t*)fs->superblock) != 1024 ||
 		fs->superblock->magic != SUPERBLOCK_MAGIC) {
 		log(LOG_ERR, "ext2: Invalid magic\n");
 
@@ -850,6 +969,15 @@ int ext2_mount(struct vfs_block_dev* dev, const char* path) {
 		return -1;
 	}
 
+	fs->align_blocks = 1;
+	if(dev->alignment_offset % bl_off(1)) {
+		log(LOG_WARN, "ext2: Blocks of /dev/%s straddle physical blocks of the "
+			"device. Please realign the partition.\n", dev->name);
+	} else if(dev->physical_block_size > bl_off(1)) {
+		fs->align_blocks = dev->physical_block_size / bl_off(1);
+		fs->align_phase = (dev->alignment_offset / bl_off(1)) % fs->align_blocks;
+	}
+
 	// TODO Compare superblocks to each other?
 
 	fs->blockgroup_table = kmalloc(bl_off(blockgroup_table_size));
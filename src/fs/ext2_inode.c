@@ -23,6 +23,7 @@
 #include "ext2_misc.h"
 #include "ext2_inode.h"
 #include <log.h>
+#include <errno.h>
 #include <string.h>
 #include <time.h>
 #include <mem/kmalloc.h>
@@ -160,7 +161,7 @@ uint32_t ext2_resolve_blocknum(struct ext2_fs* fs, struct inode* inode, uint32_t
 		}
 
 		real_block_num = cache->indirect_table[block_num - 12];
-	} else if(block_num < entries_per_block * entries_per_block + 12) {
+	} else if(block_num < entries_per_block * entries_per_block + entries_per_block + 12) {
 		if(!inode->blocks[13]) {
 			return 0;
 		}
@@ -192,8 +193,296 @@ uint32_t ext2_resolve_blocknum(struct ext2_fs* fs, struct inode* inode, uint32_t
 	return real_block_num;
 }
 
+// Allocates and zeroes an indirect block table unless table is already set.
+static uint32_t get_table(struct ext2_fs* fs, struct inode* inode, uint32_t inode_num, uint32_t table) {
+	if(table) {
+		return table;
+	}
+
+	uint32_t block_num = ext2_block_new(fs, inode_num);
+	if(!block_num) {
+		return 0;
+	}
+
+	uint8_t* zero = zmalloc(bl_off(1));
+	uint64_t written = vfs_block_swrite(fs->dev, bl_off(block_num), bl_off(1), zero);
+	kfree(zero);
+	if(written != bl_off(1)) {
+		ext2_block_free(fs, block_num);
+		write_superblock();
+		write_blockgroup_table();
+		return 0;
+	}
+
+	inode->block_count += bl_sectors(1);
+	return block_num;
+}
+
+/* Sets the disk block for the file block block_index, allocating indirect
+ * block tables as needed. Tables already loaded into the resolver cache are
+ * updated as well. Does not write the inode.
+ */
+bool ext2_inode_set_blocknum(struct ext2_fs* fs, struct inode* inode, uint32_t inode_num,
+	uint32_t block_index, uint32_t block_num, struct ext2_blocknum_resolver_cache* cache) {
+
+	const uint32_t entries_per_block = bl_off(1) / sizeof(uint32_t);
+	uint64_t entry_off;
+
+	if(block_index < 12) {
+		inode->blocks[block_index] = block_num;
+		return true;
+	}
+
+	block_index -= 12;
+	if(block_index < entries_per_block) {
+		uint32_t table = get_table(fs, inode, inode_num, inode->blocks[12]);
+		inode->blocks[12] = table;
+		if(!table) {
+			return false;
+		}
+
+		entry_off = bl_off(table) + block_index * sizeof(uint32_t);
+		if(cache && cache->indirect_table) {
+			cache->indirect_table[block_index] = block_num;
+		}
+	} else {
+		block_index -= entries_per_block;
+		uint32_t first = block_index / entries_per_block;
+		uint32_t second = block_index % entries_per_block;
+		if(first >= entries_per_block) {
+			log(LOG_ERR, "ext2: Triply-indirect blocks are not supported.\n");
+			return false;
+		}
+
+		uint32_t double_table = get_table(fs, inode, inode_num, inode->blocks[13]);
+		inode->blocks[13] = double_table;
+		if(!double_table) {
+			return false;
+		}
+
+		uint64_t double_off = bl_off(double_table) + first * sizeof(uint32_t);
+		uint32_t table;
+		if(vfs_block_sread(fs->dev, double_off, sizeof(uint32_t), (uint8_t*)&table) != sizeof(uint32_t)) {
+			return false;
+		}
+
+		if(!table) {
+			table = get_table(fs, inode, inode_num, 0);
+			if(!table) {
+				return false;
+			}
+
+			vfs_block_swrite(fs->dev, double_off, sizeof(uint32_t), (uint8_t*)&table);
+			if(cache && cache->double_table) {
+				cache->double_table[first] = table;
+			}
+		}
+
+		entry_off = bl_off(table) + second * sizeof(uint32_t);
+		if(cache && cache->double_second_table && cache->double_second_block == table) {
+			cache->double_second_table[second] = block_num;
+		}
+	}
+
+	return vfs_block_swrite(fs->dev, entry_off, sizeof(uint32_t), (uint8_t*)&block_num) == sizeof(uint32_t);
+}
+
+/* Resolves the disk block backing the file block block_index. If
+ * write_inode_num is set and the block is not allocated yet, allocate it.
+ */
+static uint32_t get_block(struct ext2_fs* fs, struct inode* inode, uint32_t write_inode_num,
+	uint32_t block_index, struct ext2_blocknum_resolver_cache* res_cache) {
+
+	uint32_t block_num = ext2_resolve_blocknum(fs, inode, block_index, res_cache);
+	if(block_num || !write_inode_num) {
+		return block_num;
+	}
+
+	// Try to place the block right behind the previous one of the file
+	uint32_t goal = 0;
+	if(block_index) {
+		goal = ext2_resolve_blocknum(fs, inode, block_index - 1, res_cache);
+		goal = goal ? goal + 1 : 0;
+	}
+
+	uint32_t count;
+	block_num = ext2_block_new_run(fs, write_inode_num, goal, 1, &count);
+	if(!block_num) {
+		return 0;
+	}
+
+	if(!ext2_inode_set_blocknum(fs, inode, write_inode_num, block_index, block_num, res_cache)) {
+		ext2_block_free(fs, block_num);
+		write_superblock();
+		write_blockgroup_table();
+		return 0;
+	}
+
+	inode->block_count += bl_sectors(1);
+	ext2_inode_write(fs, inode, write_inode_num);
+	return block_num;
+}
+
+/* Preallocates disk blocks for the file blocks [start, end). Missing blocks
+ * are allocated in runs that are consecutive on disk and zeroed, since ext2
+ * has no way to mark blocks as unwritten. Does not write the inode.
+ */
+int ext2_inode_alloc_range(struct ext2_fs* fs, struct inode* inode, uint32_t inode_num,
+	uint32_t start, uint32_t end) {
+
+	struct ext2_blocknum_resolver_cache* res_cache = zmalloc(sizeof(struct ext2_blocknum_resolver_cache));
+	uint8_t* zero = zmalloc(bl_off(16));
+	uint32_t goal = 0;
+	int ret = 0;
+
+	if(start) {
+		goal = ext2_resolve_blocknum(fs, inode, start - 1, res_cache);
+		goal = goal ? goal + 1 : 0;
+	}
+
+	for(uint32_t i = start; i < end;) {
+		uint32_t existing = ext2_resolve_blocknum(fs, inode, i, res_cache);
+		if(existing) {
+			goal = existing + 1;
+			i++;
+			continue;
+		}
+
+		uint32_t want = 1;
+		while(i + want < end && want < fs->superblock->blocks_per_group
+			&& !ext2_resolve_blocknum(fs, inode, i + want, res_cache)) {
+			want++;
+		}
+
+		uint32_t count;
+		uint32_t block_num = ext2_block_new_run(fs, inode_num, goal, want, &count);
+		if(!block_num) {
+			sc_errno = ENOSPC;
+			ret = -1;
+			break;
+		}
+
+		for(uint32_t j = 0; j < count; j += 16) {
+			uint32_t chunk = MIN(16, count - j);
+			vfs_block_swrite(fs->dev, bl_off(block_num + j), bl_off(chunk), zero);
+		}
+
+		for(uint32_t j = 0; j < count; j++) {
+			if(!ext2_inode_set_blocknum(fs, inode, inode_num, i + j, block_num + j, res_cache)) {
+				for(uint32_t k = j; k < count; k++) {
+					ext2_block_free(fs, block_num + k);
+				}
+
+				inode->block_count += bl_sectors(j);
+				write_superblock();
+				write_blockgroup_table();
+				sc_errno = EFBIG;
+				ret = -1;
+				goto out;
+			}
+		}
+
+		inode->block_count += bl_sectors(count);
+		goal = block_num + count;
+		i += count;
+	}
+
+out:
+	kfree(zero);
+	ext2_free_blocknum_resolver_cache(res_cache);
+	return ret;
+}
+
+/* Frees the disk blocks of file blocks [start, end), leaving a hole. Empty
+ * indirect block tables are kept. Does not write the inode.
+ */
+void ext2_inode_free_range(struct ext2_fs* fs, struct inode* inode, uint32_t inode_num,
+	uint32_t start, uint32_t end) {
+
+	struct ext2_blocknum_resolver_cache* res_cache = zmalloc(sizeof(struct ext2_blocknum_resolver_cache));
+	for(uint32_t i = start; i < end; i++) {
+		uint32_t block_num = ext2_resolve_blocknum(fs, inode, i, res_cache);
+		if(!block_num) {
+			continue;
+		}
+
+		if(ext2_inode_set_blocknum(fs, inode, inode_num, i, 0, res_cache)) {
+			ext2_block_free(fs, block_num);
+			inode->block_count -= bl_sectors(1);
+		}
+	}
+
+	ext2_free_blocknum_resolver_cache(res_cache);
+	write_superblock();
+	write_blockgroup_table();
+}
+
+static void free_table(struct ext2_fs* fs, uint32_t table_block, int depth) {
+	uint32_t* table = kmalloc(bl_off(1));
+	if(vfs_block_sread(fs->dev, bl_off(table_block), bl_off(1), (uint8_t*)table) == bl_off(1)) {
+		for(uint32_t i = 0; i < bl_off(1) / sizeof(uint32_t); i++) {
+			if(!table[i]) {
+				continue;
+			}
+
+			if(depth) {
+				free_table(fs, table[i], depth - 1);
+			} else {
+				ext2_block_free(fs, table[i]);
+			}
+		}
+	}
+
+	kfree(table);
+	ext2_block_free(fs, table_block);
+}
+
+// Frees all data blocks and indirect block tables of an inode.
+void ext2_inode_free_blocks(struct ext2_fs* fs, struct inode* inode) {
+	// Fast symlinks store their target in the blocks array
+	if(!inode->block_count) {
+		return;
+	}
+
+	for(int i = 0; i < 12; i++) {
+		if(inode->blocks[i]) {
+			ext2_block_free(fs, inode->blocks[i]);
+		}
+	}
+
+	if(inode->blocks[12]) {
+		free_table(fs, inode->blocks[12], 0);
+	}
+
+	if(inode->blocks[13]) {
+		free_table(fs, inode->blocks[13], 1);
+	}
+
+	bzero(inode->blocks, sizeof(inode->blocks));
+	inode->block_count = 0;
+	write_superblock();
+	write_blockgroup_table();
+}
+
+static inline bool flush_run(struct ext2_fs* fs, uint64_t run_offset, uint64_t run_size,
+	uint8_t* buf, bool write) {
+
+	if(!run_size) {
+		return true;
+	}
+
+	if(write) {
+		return vfs_block_swrite(fs->dev, run_offset, run_size, buf) == run_size;
+	}
+	return vfs_block_sread(fs->dev, run_offset, run_size, buf) == run_size;
+}
+
 /* Will write if write_inode_num is set, otherwise read. Use
  * exta_inode_read_data/exta_inode_write_data macros instead.
+ *
+ * File system blocks that are consecutive on disk are transferred as a single
+ * run. The block layer only bounces the partial device blocks at its ends, so
+ * most data goes straight between buf and the disk.
  */
 uint8_t* ext2_inode_data_rw(struct ext2_fs* fs, struct inode* inode, uint32_t write_inode_num,
 	uint64_t offset, size_t length, uint8_t* buf) {
@@ -208,67 +497,138 @@ uint8_t* ext2_inode_data_rw(struct ext2_fs* fs, struct inode* inode, uint32_t wr
 	}
 
 	uint32_t buf_offset = 0;
+	uint64_t run_offset = 0;
+	uint64_t run_size = 0;
+	uint32_t run_start = 0;
+
 	struct ext2_blocknum_resolver_cache* res_cache = zmalloc(sizeof(struct ext2_blocknum_resolver_cache));
 	for(int i = 0; i < num_blocks; i++) {
-		uint32_t block_num = ext2_resolve_blocknum(fs, inode, i + bl_size(offset), res_cache);
+		uint32_t block_num = get_block(fs, inode, write_inode_num, i + bl_size(offset), res_cache);
+		uint64_t wr_offset = bl_off(block_num);
+		uint64_t wr_size = bl_off(1);
+
+		// Handle remainder of offset if first block
+		if(i == 0) {
+			wr_offset += bl_mod(offset);
+			wr_size -= bl_mod(offset);
+		}
+
+		if(wr_size > length - buf_offset) {
+			wr_size = length - buf_offset;
+		}
 
 		if(!block_num) {
-			if(!write_inode_num) {
-				return NULL;
+			if(write_inode_num) {
+				goto fail;
 			}
 
-			block_num = ext2_block_new(fs, write_inode_num);
-			if(!block_num) {
-				ext2_free_blocknum_resolver_cache(res_cache);
-				return NULL;
+			// Sparse block
+			if(!flush_run(fs, run_offset, run_size, buf + run_start, false)) {
+				goto fail;
 			}
 
-			// Counts 512-byte ide blocks, not ext2 blocks, so 8.
-			// FIXME Properly calculate from block size rather than hardcoding
-			inode->block_count += 8;
+			run_size = 0;
+			bzero(buf + buf_offset, wr_size);
+			buf_offset += wr_size;
+			continue;
+		}
 
-			if(i < 12) {
-				inode->blocks[i] = block_num;
-			} else {
-				// TODO
-				log(LOG_ERR, "ext2: Indirect block writes not supported atm.\n");
-				ext2_free_blocknum_resolver_cache(res_cache);
-				return NULL;
+		if(run_size && wr_offset == run_offset + run_size) {
+			run_size += wr_size;
+		} else {
+			if(!flush_run(fs, run_offset, run_size, buf + run_start, write_inode_num)) {
+				goto fail;
 			}
 
-			ext2_inode_write(fs, inode, write_inode_num);
+			run_offset = wr_offset;
+			run_size = wr_size;
+			run_start = buf_offset;
 		}
+		buf_offset += wr_size;
+	}
 
-		uint64_t wr_offset = bl_off(block_num);
-		uint64_t wr_size = bl_off(1);
+	if(!flush_run(fs, run_offset, run_size, buf + run_start, write_inode_num)) {
+		goto fail;
+	}
 
-		// Handle remainder of offset if first block
-		if(i == 0) {
-			wr_offset += bl_mod(offset);
-			wr_size -= bl_mod(offset);
-		}
+	ext2_free_blocknum_resolver_cache(res_cache);
+	return buf;
 
-		if(wr_size > length - buf_offset) {
-			wr_size = length - buf_offset;
+fail:
+	ext2_free_blocknum_resolver_cache(res_cache);
+	return NULL;
+}
+
+static inline bool direct_submit(struct ext2_fs* fs, uint64_t lba, uint64_t num_blocks,
+	uint8_t* buf, bool write) {
+
+	if(!num_blocks) {
+		return true;
+	}
+	return vfs_block_direct(fs->dev, lba, num_blocks, buf, write) == num_blocks;
+}
+
+/* O_DIRECT version of ext2_inode_data_rw. offset, length and buf need to be
+ * aligned to the device block size. Data goes straight between buf and the
+ * disk without bounce buffers, and file system blocks that are consecutive
+ * on disk are merged into one request.
+ */
+uint8_t* ext2_inode_data_direct(struct ext2_fs* fs, struct inode* inode, uint32_t write_inode_num,
+	uint64_t offset, size_t length, uint8_t* buf) {
+
+	const int dev_bs = fs->dev->block_size;
+	struct ext2_blocknum_resolver_cache* res_cache = zmalloc(sizeof(struct ext2_blocknum_resolver_cache));
+	uint64_t run_lba = 0;
+	uint64_t run_blocks = 0;
+	size_t run_start = 0;
+	size_t buf_offset = 0;
+
+	while(buf_offset < length) {
+		uint64_t pos = offset + buf_offset;
+		size_t chunk = MIN(bl_off(1) - bl_mod(pos), length - buf_offset);
+		uint32_t block_num = get_block(fs, inode, write_inode_num, bl_size(pos), res_cache);
+
+		if(!block_num) {
+			if(write_inode_num) {
+				goto fail;
+			}
+
+			// Sparse block
+			if(!direct_submit(fs, run_lba, run_blocks, buf + run_start, false)) {
+				goto fail;
+			}
+
+			bzero(buf + buf_offset, chunk);
+			run_blocks = 0;
+			buf_offset += chunk;
+			continue;
 		}
 
-		int nread = -1;
-		if(write_inode_num) {
-			nread = vfs_block_swrite(fs->dev, wr_offset, wr_size, buf + buf_offset);
+		uint64_t lba = (bl_off(block_num) + bl_mod(pos)) / dev_bs;
+		if(run_blocks && lba == run_lba + run_blocks) {
+			run_blocks += chunk / dev_bs;
 		} else {
-			nread = vfs_block_sread(fs->dev, wr_offset, wr_size, buf + buf_offset);
-		}
+			if(!direct_submit(fs, run_lba, run_blocks, buf + run_start, write_inode_num)) {
+				goto fail;
+			}
 
-		if(nread < wr_size) {
-			ext2_free_blocknum_resolver_cache(res_cache);
-			return NULL;
+			run_lba = lba;
+			run_blocks = chunk / dev_bs;
+			run_start = buf_offset;
 		}
+		buf_offset += chunk;
+	}
 
-		buf_offset += wr_size;
+	if(!direct_submit(fs, run_lba, run_blocks, buf + run_start, write_inode_num)) {
+		goto fail;
 	}
 
 	ext2_free_blocknum_resolver_cache(res_cache);
 	return buf;
+
+fail:
+	ext2_free_blocknum_resolver_cache(res_cache);
+	return NULL;
 }
 
 int ext2_inode_check_perm(enum inode_check_op op, struct inode* inode, task_t* task) {
@@ -59,8 +59,17 @@ bool ext2_inode_read(struct ext2_fs* fs, struct inode* buf, uint32_t inode_num);
 uint32_t ext2_inode_new(struct ext2_fs* fs, struct inode* inode, uint16_t mode);
 uint32_t ext2_resolve_blocknum(struct ext2_fs* fs, struct inode* inode, uint32_t block_num, struct ext2_blocknum_resolver_cache* cache);
 void ext2_free_blocknum_resolver_cache(struct ext2_blocknum_resolver_cache* cache);
+bool ext2_inode_set_blocknum(struct ext2_fs* fs, struct inode* inode, uint32_t inode_num,
+	uint32_t block_index, uint32_t block_num, struct ext2_blocknum_resolver_cache* cache);
+int ext2_inode_alloc_range(struct ext2_fs* fs, struct inode* inode, uint32_t inode_num,
+	uint32_t start, uint32_t end);
+void ext2_inode_free_range(struct ext2_fs* fs, struct inode* inode, uint32_t inode_num,
+	uint32_t start, uint32_t end);
+void ext2_inode_free_blocks(struct ext2_fs* fs, struct inode* inode);
 uint8_t* ext2_inode_data_rw(struct ext2_fs* fs, struct inode* inode, uint32_t write_inode_num,
 	uint64_t offset, size_t length, uint8_t* buf);
+uint8_t* ext2_inode_data_direct(struct ext2_fs* fs, struct inode* inode, uint32_t write_inode_num,
+	uint64_t offset, size_t length, uint8_t* buf);
 
 
 uint32_t ext2_resolve_inode(const char* path, uint32_t* parent_ino);
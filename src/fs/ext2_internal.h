@@ -94,6 +94,12 @@ struct ext2_fs {
 	struct inode* root_inode;
 	struct vfs_callbacks* callbacks;
 
+	/* Number of file system blocks per physical block of the device, and the
+	 * first block number that is aligned to one, modulo align_blocks.
+	 */
+	uint32_t align_blocks;
+	uint32_t align_phase;
+
 	struct inode_cache_entry inode_cache[INODE_CACHE_MAX];
 	uint32_t inode_cache_end;
 };
@@ -112,6 +118,9 @@ struct ext2_fs {
 #define bl_size(block) (uint64_t)((uint64_t)(block) / _block_size(fs))
 #define bl_mod(block) (uint64_t)((uint64_t)(block) % _block_size(fs))
 
+// inode->block_count counts 512-byte sectors rather than file system blocks
+#define bl_sectors(block) (uint32_t)(bl_off(block) / 512)
+
 /* Blockgroup table is located in the block following the superblock. This
  * is usually the second block, but with a 1k block size, the superblock
  * takes up two blocks and the blockgroup table thus starts in block 3.
@@ -132,3 +141,6 @@ struct ext2_fs {
 	bl_off(blockgroup_table_size), (uint8_t*)fs->blockgroup_table)
 
 uint32_t ext2_block_new(struct ext2_fs* fs, uint32_t neighbor);
+uint32_t ext2_block_new_run(struct ext2_fs* fs, uint32_t neighbor, uint32_t goal,
+	uint32_t want, uint32_t* count);
+void ext2_block_free(struct ext2_fs* fs, uint32_t block_num);
@@ -24,6 +24,7 @@
 #include <mem/kmalloc.h>
 #include <block/block.h>
 #include <bitmap.h>
+#include <log.h>
 
 uint32_t ext2_bitmap_search_and_claim(struct ext2_fs* fs, uint32_t bitmap_block) {
 	// Todo check blockgroup->free_blocks to see if any blocks are free and otherwise switch block group
@@ -63,27 +64,147 @@ void ext2_bitmap_free(struct ext2_fs* fs, uint32_t bitmap_block, uint32_t bit) {
 	kfree(bitmap);
 }
 
-uint32_t ext2_block_new(struct ext2_fs* fs, uint32_t neighbor) {
-	uint32_t pref_blockgroup = inode_to_blockgroup(neighbor);
+/* Looks for a run of want free bits, starting the search at hint. If there is
+ * no run that long, returns the longest one found. The run length is stored in
+ * len, which is 0 if the bitmap is full. If align is larger than 1, only runs
+ * starting at bits where (bit + phase) % align is 0 are considered, unless
+ * there are none.
+ */
+static uint32_t find_free_run(uint8_t* bitmap, uint32_t nbits, uint32_t hint,
+	uint32_t want, uint32_t align, uint32_t phase, uint32_t* len) {
 
-	struct blockgroup* blockgroup = fs->blockgroup_table + pref_blockgroup;
-	if(!blockgroup || !blockgroup->inode_table) {
-		log(LOG_ERR, "ext2: Could not locate entry %d in blockgroup table\n", pref_blockgroup);
-		return 0;
+	uint32_t best = 0;
+	uint32_t best_len = 0;
+
+	for(uint32_t n = 0; n < nbits; n++) {
+		uint32_t i = (hint + n) % nbits;
+		if(bit_get(bitmap[i / 8], i % 8) || (i + phase) % align) {
+			continue;
+		}
+
+		uint32_t run = 1;
+		while(run < want && i + run < nbits
+			&& !bit_get(bitmap[(i + run) / 8], (i + run) % 8)) {
+			run++;
+		}
+
+		if(run > best_len) {
+			best = i;
+			best_len = run;
+		}
+
+		if(run >= want) {
+			break;
+		}
+		n += run - 1;
 	}
 
-	uint32_t block_num = ext2_bitmap_search_and_claim(fs, blockgroup->block_bitmap);
-	if(!block_num) {
-		log(LOG_ERR, "ext2: Could not find free block in preferred blockgroup %d.\n", pref_blockgroup);
+	if(!best_len && align > 1) {
+		return find_free_run(bitmap, nbits, hint, want, 1, 0, len);
+	}
+
+	*len = best_len;
+	return best;
+}
+
+/* Allocates up to want blocks that are consecutive on disk. Allocation starts
+ * at the goal block if set (usually the block following the previous block of
+ * the file), otherwise in the blockgroup of the neighbor inode. Returns the
+ * first block number and stores the number of allocated blocks in count.
+ *
+ * If align is set and there is no goal, the run starts on a physical block of
+ * the device where possible, so that the device doesn't have to
+ * read-modify-write when the file is written.
+ */
+static uint32_t new_run(struct ext2_fs* fs, uint32_t neighbor, uint32_t goal,
+	uint32_t want, uint32_t* count, bool align) {
+
+	const uint32_t bpg = fs->superblock->blocks_per_group;
+	const uint32_t first = fs->superblock->first_data_block;
+	uint32_t num_groups = RDIV(fs->superblock->block_count - first, bpg);
+	uint32_t start_group = inode_to_blockgroup(neighbor);
+	uint32_t goal_bit = 0;
+
+	if(goal > first && goal < fs->superblock->block_count) {
+		start_group = (goal - first) / bpg;
+		goal_bit = (goal - first) % bpg;
+	}
+
+	*count = 0;
+	if(!want || start_group >= num_groups) {
 		return 0;
 	}
 
-	fs->superblock->free_blocks--;
-	blockgroup->free_blocks--;
-	write_superblock();
-	write_blockgroup_table();
-	return block_num;
+	uint8_t* bitmap = kmalloc(bl_off(1));
+	for(uint32_t i = 0; i < num_groups; i++) {
+		uint32_t group = (start_group + i) % num_groups;
+		struct blockgroup* blockgroup = fs->blockgroup_table + group;
+		if(!blockgroup->free_blocks) {
+			continue;
+		}
+
+		if(vfs_block_sread(fs->dev, bl_off(blockgroup->block_bitmap), bl_off(1), bitmap) != bl_off(1)) {
+			continue;
+		}
+
+		// The last blockgroup can be smaller
+		uint32_t nbits = MIN(bpg, fs->superblock->block_count - first - group * bpg);
+		uint32_t align_blocks = 1;
+		uint32_t phase = 0;
+		if(align && !goal) {
+			align_blocks = fs->align_blocks;
+			phase = (first + group * bpg + align_blocks - fs->align_phase) % align_blocks;
+		}
+
+		uint32_t len;
+		uint32_t bit = find_free_run(bitmap, MIN(nbits, bl_off(1) * 8),
+			i ? 0 : goal_bit, MIN(want, blockgroup->free_blocks), align_blocks,
+			phase, &len);
+
+		if(!len) {
+			continue;
+		}
+
+		for(uint32_t j = bit; j < bit + len; j++) {
+			bitmap[j / 8] = bit_set(bitmap[j / 8], j % 8);
+		}
+
+		vfs_block_swrite(fs->dev, bl_off(blockgroup->block_bitmap), bl_off(1), bitmap);
+		kfree(bitmap);
+
+		fs->superblock->free_blocks -= len;
+		blockgroup->free_blocks -= len;
+		write_superblock();
+		write_blockgroup_table();
+
+		*count = len;
+		return group * bpg + first + bit;
+	}
+
+	kfree(bitmap);
+	log(LOG_ERR, "ext2: Could not find free blocks.\n");
+	return 0;
+}
+
+uint32_t ext2_block_new_run(struct ext2_fs* fs, uint32_t neighbor, uint32_t goal,
+	uint32_t want, uint32_t* count) {
+	return new_run(fs, neighbor, goal, want, count, true);
+}
+
+// Metadata blocks are small, so there's no point in aligning them
+uint32_t ext2_block_new(struct ext2_fs* fs, uint32_t neighbor) {
+	uint32_t count;
+	return new_run(fs, neighbor, 0, 1, &count, false);
+}
+
+void ext2_block_free(struct ext2_fs* fs, uint32_t block_num) {
+	uint32_t block = block_num - fs->superblock->first_data_block;
+	struct blockgroup* blockgroup = fs->blockgroup_table
+		+ block / fs->superblock->blocks_per_group;
 
+	ext2_bitmap_free(fs, blockgroup->block_bitmap, block % fs->superblock->blocks_per_group);
+	fs->superblock->free_blocks++;
+	blockgroup->free_blocks++;
 }
 
 #endif /* CONFIG_ENABLE_EXT2 */
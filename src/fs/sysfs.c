@@ -70,10 +70,59 @@ static struct sysfs_file* get_file(const char* path, struct sysfs_file* first) {
 	return NULL;
 }
 
+/* Return the name of the entry in the directory prefix (without leading or
+ * trailing slash, empty for the root) that file is in or below, or NULL.
+ */
+static const char* child_name(struct sysfs_file* file, const char* prefix,
+	size_t prefix_len, size_t* len) {
+
+	const char* name = file->name;
+	if(prefix_len) {
+		if(strncmp(name, prefix, prefix_len) || name[prefix_len] != '/') {
+			return NULL;
+		}
+		name += prefix_len + 1;
+	}
+
+	char* slash = strchr(name, '/');
+	*len = slash ? slash - name : strlen(name);
+	return name;
+}
+
+/* Directories are implicit: Files can be registered with names like
+ * block/ide1/stat, and every prefix of them is a directory.
+ */
+static bool is_dir(const char* path, struct sysfs_file* first) {
+	if(!strncmp(path, "/", 2)) {
+		return true;
+	}
+
+	if(*path == '/') {
+		path++;
+	}
+
+	// Paths like block/ may end in a slash
+	size_t len = strlen(path);
+	while(len && path[len - 1] == '/') {
+		len--;
+	}
+
+	if(!len) {
+		return true;
+	}
+
+	for(struct sysfs_file* file = first; file; file = file->next) {
+		if(!strncmp(file->name, path, len) && file->name[len] == '/') {
+			return true;
+		}
+	}
+	return false;
+}
+
 int sysfs_build_path_tree(struct vfs_callback_ctx* ctx) {
-	bool is_root = !strncmp(ctx->path, "/", 2);
+	bool is_directory = is_dir(ctx->path, *(struct sysfs_file**)ctx->mp->instance);
 	struct sysfs_file* file = get_file(ctx->path, *(struct sysfs_file**)ctx->mp->instance);
-	if(!is_root && !file) {
+	if(!is_directory && !file) {
 		sc_errno = ENOENT;
 		return -1;
 	}
@@ -86,7 +135,7 @@ int sysfs_build_path_tree(struct vfs_callback_ctx* ctx) {
 	} else {
 		stat.st_dev = 2;
 		stat.st_ino = 1;
-		if(!file || is_root) {
+		if(!file || is_directory) {
 			stat.st_mode = FT_IFDIR | S_IXUSR | S_IRUSR | S_IXGRP | S_IRGRP | S_IXOTH | S_IROTH;
 		} else {
 			stat.st_mode = file ? file->type : FT_IFDIR;
@@ -118,9 +167,9 @@ int sysfs_build_path_tree(struct vfs_callback_ctx* ctx) {
 
 
 int sysfs_stat(struct vfs_callback_ctx* ctx, vfs_stat_t* dest) {
-	bool is_root = !strncmp(ctx->path, "/", 2);
+	bool is_directory = is_dir(ctx->path, *(struct sysfs_file**)ctx->mp->instance);
 	struct sysfs_file* file = get_file(ctx->path, *(struct sysfs_file**)ctx->mp->instance);
-	if(!is_root && !file) {
+	if(!is_directory && !file) {
 		sc_errno = ENOENT;
 		return -1;
 	}
@@ -132,7 +181,7 @@ int sysfs_stat(struct vfs_callback_ctx* ctx, vfs_stat_t* dest) {
 
 	dest->st_dev = 2;
 	dest->st_ino = 1;
-	if(!file || is_root) {
+	if(!file || is_directory) {
 		dest->st_mode = FT_IFDIR | S_IXUSR | S_IRUSR | S_IXGRP | S_IRGRP | S_IXOTH | S_IROTH;
 	} else {
 		dest->st_mode = file ? file->type : FT_IFDIR;
@@ -157,11 +206,11 @@ int sysfs_stat(struct vfs_callback_ctx* ctx, vfs_stat_t* dest) {
 }
 
 int sysfs_access(struct vfs_callback_ctx* ctx, uint32_t amode) {
-	if(!strncmp(ctx->path, "/", 2)) {
+	if(is_dir(ctx->path, *(struct sysfs_file**)ctx->mp->instance)) {
 		return 0;
 	}
 
-	// Only root dir has exec perm
+	// Only directories have exec perm
 	if(amode & X_OK) {
 		sc_errno = EACCES;
 		return -1;
@@ -190,31 +239,56 @@ int sysfs_readlink(struct vfs_callback_ctx* ctx, char* buf, size_t size) {
 }
 
 size_t sysfs_getdents(struct vfs_callback_ctx* ctx, void* dest, size_t size) {
-	struct sysfs_file* file = *(struct sysfs_file**)ctx->mp->instance;
+	struct sysfs_file* first = *(struct sysfs_file**)ctx->mp->instance;
 
-	if(!file || ctx->fp->offset) {
+	if(!first || ctx->fp->offset) {
 		return 0;
 	}
 
+	const char* prefix = ctx->path;
+	while(*prefix == '/') {
+		prefix++;
+	}
+	size_t prefix_len = strlen(prefix);
+	if(prefix_len && prefix[prefix_len - 1] == '/') {
+		prefix_len--;
+	}
+
 	vfs_dirent_t* dir = (vfs_dirent_t*)dest;
 	size_t total_length = 0;
 
-	for(int i = 2; file; i++) {
-		uint32_t name_len = strlen(file->name);
+	int i = 2;
+	for(struct sysfs_file* file = first; file; file = file->next) {
+		size_t name_len;
+		const char* name = child_name(file, prefix, prefix_len, &name_len);
+		if(!name) {
+			continue;
+		}
+
+		// Subdirectories are listed once, for the first file in them
+		bool seen = false;
+		for(struct sysfs_file* prev = first; prev != file && !seen; prev = prev->next) {
+			size_t prev_len;
+			const char* prev_name = child_name(prev, prefix, prefix_len, &prev_len);
+			seen = prev_name && prev_len == name_len && !strncmp(prev_name, name, name_len);
+		}
+		if(seen) {
+			continue;
+		}
+
 		uint32_t rec_len = sizeof(vfs_dirent_t) + name_len + 1;
 		if(total_length + rec_len > size) {
 			break;
 		}
 
-		memcpy(dir->d_name, file->name, name_len);
+		memcpy(dir->d_name, name, name_len);
 		dir->d_name[name_len] = 0;
-		dir->d_ino = i;
+		dir->d_ino = i++;
 		dir->d_reclen = rec_len;
 
 		total_length += rec_len;
 		ctx->fp->offset++;
 		dir = (vfs_dirent_t*)((intptr_t)dir + dir->d_reclen);
-		file = file->next;
 	}
 
 	return total_length;
@@ -222,8 +296,8 @@ size_t sysfs_getdents(struct vfs_callback_ctx* ctx, void* dest, size_t size) {
 
 vfs_file_t* sysfs_open(struct vfs_callback_ctx* ctx, uint32_t flags) {
 	struct sysfs_file* file = get_file(ctx->path, *(struct sysfs_file**)ctx->mp->instance);
-	bool is_root = !strncmp(ctx->path, "/", 2);
-	if(!(file || is_root)) {
+	bool is_directory = is_dir(ctx->path, *(struct sysfs_file**)ctx->mp->instance);
+	if(!(file || is_directory)) {
 		sc_errno = ENOENT;
 		return NULL;
 	}
@@ -240,7 +314,7 @@ vfs_file_t* sysfs_open(struct vfs_callback_ctx* ctx, uint32_t flags) {
 
 	fp->inode = 1;
 
-	if(is_root) {
+	if(is_directory) {
 		fp->type = FT_IFDIR;
 		memcpy(&fp->callbacks, &callbacks, sizeof(struct vfs_callbacks));
 		fp->callbacks.getdents = sysfs_getdents;
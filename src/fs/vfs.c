@@ -295,6 +295,45 @@ size_t vfs_write(task_t* task, int fd, void* source, size_t size) {
 	return written;
 }
 
+int vfs_fallocate(task_t* task, struct vfs_fallocate_ctx* args) {
+	// Negative off_t values from userland arrive as huge unsigned ones
+	if(!args->len || args->offset > INT64_MAX || args->len > INT64_MAX) {
+		sc_errno = EINVAL;
+		return -1;
+	}
+
+	// Like on Linux, punching holes always keeps the file size
+	int mode = args->mode;
+	if(mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE) ||
+		(mode & FALLOC_FL_PUNCH_HOLE && !(mode & FALLOC_FL_KEEP_SIZE))) {
+
+		sc_errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	struct vfs_callback_ctx* ctx = vfs_context_from_fd(args->fd, task);
+	if(!ctx || !ctx->fp) {
+		sc_errno = EBADF;
+		return -1;
+	}
+
+	if(!(ctx->fp->flags & (O_WRONLY | O_RDWR))) {
+		vfs_free_context(ctx);
+		sc_errno = EBADF;
+		return -1;
+	}
+
+	if(!ctx->fp->callbacks.fallocate) {
+		vfs_free_context(ctx);
+		sc_errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	int r = ctx->fp->callbacks.fallocate(ctx, mode, args->offset, args->len);
+	vfs_free_context(ctx);
+	return r;
+}
+
 size_t vfs_getdents(task_t* task, int fd, void* dest, size_t size) {
 	struct vfs_callback_ctx* ctx = vfs_context_from_fd(fd, task);
 	if(!ctx || !ctx->fp) {
@@ -362,14 +401,12 @@ int vfs_fcntl(task_t* task, int fd, int cmd, int arg3) {
 	} else if(cmd == F_GETFL) {
 		return fp->flags;
 	} else if(cmd == F_SETFL) {
-		if(arg3 & O_NONBLOCK) {
-			fp->flags |= O_NONBLOCK;
-		} else {
-			fp->flags &= ~O_NONBLOCK;
-		}
+		// Only these status flags can be changed after open
+		fp->flags &= ~(O_NONBLOCK | O_DIRECT);
+		fp->flags |= arg3 & (O_NONBLOCK | O_DIRECT);
 		return 0;
 	} else if(cmd == F_GETFD) {
-		return fp->flags & O_CLOEXEC;
+		return (fp->flags & O_CLOEXEC) ? 1 : 0;
 	} else if(cmd == F_SETFD) {
 		/* Only one fd flag defined so far, FD_CLOEXEC (1), so just merge this
 		 * into the file status flags.
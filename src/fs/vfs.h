@@ -65,7 +65,12 @@
 #define O_SYNC		0x2000
 #define O_NONBLOCK	0x4000
 #define O_NOCTTY	0x8000
-#define O_CLOEXEC	02000000
+#define O_CLOEXEC	0x40000
+#define O_DIRECT	0x80000
+
+// fallocate modes, keep in sync with newlib sys/fcntl.h
+#define FALLOC_FL_KEEP_SIZE		0x01
+#define FALLOC_FL_PUNCH_HOLE	0x02
 
 // access() flags
 #define	F_OK	0
@@ -155,6 +160,7 @@ struct vfs_callbacks {
 	int (*rmdir)(struct vfs_callback_ctx* ctx);
 	int (*ioctl)(struct vfs_callback_ctx* ctx, int request, void* arg);
 	int (*poll)(struct vfs_callback_ctx* ctx, int events);
+	int (*fallocate)(struct vfs_callback_ctx* ctx, int mode, uint64_t offset, uint64_t len);
 	int (*build_path_tree)(struct vfs_callback_ctx* ctx);
 
 };
@@ -179,6 +185,14 @@ typedef struct vfs_file {
 	uint32_t meta;
 } vfs_file_t;
 
+// Arguments to the fallocate syscall
+struct vfs_fallocate_ctx {
+	int fd;
+	int mode;
+	uint64_t offset;
+	uint64_t len;
+};
+
 // Keep in sync with newlib
 typedef struct {
 	uint32_t d_ino;
@@ -198,6 +212,7 @@ struct vfs_callback_ctx* vfs_context_from_path(const char* path, struct task* ta
 int vfs_open(struct task* task, const char* orig_path, uint32_t flags);
 size_t vfs_read(struct task* task, int fd, void* dest, size_t size);
 size_t vfs_write(struct task* task, int fd, void* source, size_t size);
+int vfs_fallocate(struct task* task, struct vfs_fallocate_ctx* args);
 size_t vfs_getdents(struct task* task, int fd, void* dest, size_t size);
 int vfs_seek(struct task* task, int fd, size_t offset, int origin);
 int vfs_close(struct task* task, int fd);
@@ -0,0 +1,383 @@
+/* i386-apic.c: Local APIC and I/O APIC
+ * Copyright © 2020 Lukas Martini
+ *
+ * This file is part of Xelix.
+ *
+ * Xelix is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Xelix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Xelix.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The 8259 PICs are replaced by the local APIC of the (only) CPU and the
+ * first I/O APIC. ISA interrupts keep their vectors at IRQ(0) - IRQ(15), so
+ * drivers don't have to care about which controller is in use. The I/O APIC
+ * address and the ISA interrupt overrides are taken from the ACPI MADT.
+ *
+ * With the APIC in place, PCI devices can also use message signaled
+ * interrupts (see pci_enable_msi/pci_enable_msix) with vectors from
+ * int_alloc_vector.
+ */
+
+#include <int/i386-apic.h>
+#include <int/int.h>
+#include <boot/multiboot.h>
+#include <mem/vm.h>
+#include <mem/mem.h>
+#include <tasks/task.h>
+#include <cmdline.h>
+#include <portio.h>
+#include <string.h>
+#include <log.h>
+
+#define MSR_APIC_BASE 0x1b
+#define MSR_APIC_BASE_ENABLE (1 << 11)
+
+// Local APIC registers
+#define LAPIC_ID 0x20
+#define LAPIC_TPR 0x80
+#define LAPIC_EOI 0xb0
+#define LAPIC_SVR 0xf0
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_LVT_LINT0 0x350
+#define LAPIC_LVT_LINT1 0x360
+#define LAPIC_LVT_ERROR 0x370
+
+#define LAPIC_SVR_ENABLE (1 << 8)
+#define LAPIC_LVT_MASKED (1 << 16)
+#define LAPIC_LVT_NMI (4 << 8)
+
+// I/O APIC registers, accessed indirectly through IOREGSEL/IOWIN
+#define IOAPIC_IOREGSEL 0x00
+#define IOAPIC_IOWIN 0x10
+#define IOAPIC_VER 0x01
+#define IOAPIC_REDTBL(n) (0x10 + 2 * (n))
+
+#define IOAPIC_ACTIVE_LOW (1 << 13)
+#define IOAPIC_LEVEL (1 << 15)
+#define IOAPIC_MASKED (1 << 16)
+
+// MADT entry types
+#define MADT_IOAPIC 1
+#define MADT_ISO 2
+
+// Polarity and trigger mode fields of MADT interrupt source overrides
+#define MPS_POLARITY_MASK 0x3
+#define MPS_POLARITY_LOW 0x3
+#define MPS_TRIGGER_MASK 0xc
+#define MPS_TRIGGER_LEVEL 0xc
+
+#define DEFAULT_LAPIC_ADDR 0xfee00000
+#define DEFAULT_IOAPIC_ADDR 0xfec00000
+
+struct acpi_rsdp {
+	char signature[8];
+	uint8_t checksum;
+	char oem_id[6];
+	uint8_t revision;
+	uint32_t rsdt_address;
+} __attribute__((packed));
+
+struct acpi_header {
+	char signature[4];
+	uint32_t length;
+	uint8_t revision;
+	uint8_t checksum;
+	char oem_id[6];
+	char oem_table_id[8];
+	uint32_t oem_revision;
+	uint32_t creator_id;
+	uint32_t creator_revision;
+} __attribute__((packed));
+
+struct madt {
+	struct acpi_header header;
+	uint32_t lapic_address;
+	uint32_t flags;
+	uint8_t entries[];
+} __attribute__((packed));
+
+struct madt_entry {
+	uint8_t type;
+	uint8_t length;
+
+	union {
+		struct {
+			uint8_t id;
+			uint8_t reserved;
+			uint32_t address;
+			uint32_t gsi_base;
+		} __attribute__((packed)) ioapic;
+
+		struct {
+			uint8_t bus;
+			uint8_t source;
+			uint32_t gsi;
+			uint16_t flags;
+		} __attribute__((packed)) iso;
+	};
+} __attribute__((packed));
+
+struct isa_irq {
+	uint32_t gsi;
+	uint16_t flags;
+};
+
+uint8_t apic_active UL_VISIBLE("data") = 0;
+
+static volatile uint8_t* lapic = NULL;
+static volatile uint8_t* ioapic = NULL;
+static uint32_t ioapic_gsi_base = 0;
+static uintptr_t ioapic_phys = DEFAULT_IOAPIC_ADDR;
+
+// ISA IRQ to global system interrupt mapping, identity unless overridden
+static struct isa_irq isa_irqs[16];
+
+static inline uint64_t rdmsr(uint32_t msr) {
+	uint32_t low, high;
+	asm volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+	return ((uint64_t)high << 32) | low;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+	asm volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value),
+		"d"((uint32_t)(value >> 32)));
+}
+
+static inline bool have_apic(void) {
+	uint32_t eax = 1, ebx, ecx, edx;
+	asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+	return edx & (1 << 9);
+}
+
+static inline uint32_t lapic_read(uint32_t reg) {
+	return *(volatile uint32_t*)(lapic + reg);
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+	*(volatile uint32_t*)(lapic + reg) = value;
+}
+
+static inline uint32_t ioapic_read(uint8_t reg) {
+	*(volatile uint32_t*)(ioapic + IOAPIC_IOREGSEL) = reg;
+	return *(volatile uint32_t*)(ioapic + IOAPIC_IOWIN);
+}
+
+static inline void ioapic_write(uint8_t reg, uint32_t value) {
+	*(volatile uint32_t*)(ioapic + IOAPIC_IOREGSEL) = reg;
+	*(volatile uint32_t*)(ioapic + IOAPIC_IOWIN) = value;
+}
+
+void lapic_eoi(void) {
+	lapic_write(LAPIC_EOI, 0);
+}
+
+uint8_t lapic_get_id(void) {
+	if(!lapic) {
+		return 0;
+	}
+	return lapic_read(LAPIC_ID) >> 24;
+}
+
+/* Map physical memory that is not managed by the page allocator (ACPI tables,
+ * MMIO registers) into kernel memory.
+ */
+static void* map_phys(uintptr_t phys, size_t size, vm_alloc_t* alloc) {
+	void* page = (void*)ALIGN_DOWN(phys, PAGE_SIZE);
+	size_t pages = RDIV(phys + size - (uintptr_t)page, PAGE_SIZE);
+
+	if(!vm_alloc(VM_KERNEL, alloc, pages, page, VM_RW)) {
+		return NULL;
+	}
+	return alloc->addr + (phys - (uintptr_t)page);
+}
+
+static inline bool checksum_ok(void* data, size_t length) {
+	uint8_t sum = 0;
+	for(size_t i = 0; i < length; i++) {
+		sum += ((uint8_t*)data)[i];
+	}
+	return !sum;
+}
+
+static void parse_madt(struct madt* madt) {
+	uint8_t* end = (uint8_t*)madt + madt->header.length;
+	bool have_ioapic = false;
+
+	for(uint8_t* pos = madt->entries; pos + 2 <= end;) {
+		struct madt_entry* entry = (struct madt_entry*)pos;
+		if(entry->length < 2) {
+			break;
+		}
+
+		// Only the first I/O APIC is used, usually there is just one anyway
+		if(entry->type == MADT_IOAPIC && !have_ioapic) {
+			ioapic_phys = entry->ioapic.address;
+			ioapic_gsi_base = entry->ioapic.gsi_base;
+			have_ioapic = true;
+		}
+
+		if(entry->type == MADT_ISO && entry->iso.bus == 0 && entry->iso.source < 16) {
+			isa_irqs[entry->iso.source].gsi = entry->iso.gsi;
+			isa_irqs[entry->iso.source].flags = entry->iso.flags;
+		}
+
+		pos += entry->length;
+	}
+}
+
+// Map a complete ACPI table, the length is only known once the header is mapped
+static struct acpi_header* map_table(uintptr_t phys, vm_alloc_t* alloc) {
+	struct acpi_header* header = map_phys(phys, sizeof(struct acpi_header), alloc);
+	if(!header) {
+		return NULL;
+	}
+
+	size_t length = header->length;
+	vm_free(alloc);
+
+	header = map_phys(phys, length, alloc);
+	if(header && !checksum_ok(header, length)) {
+		log(LOG_WARN, "apic: Checksum mismatch in ACPI table at %#x\n", phys);
+		vm_free(alloc);
+		return NULL;
+	}
+	return header;
+}
+
+/* Find the MADT using the RSDP passed by the bootloader. If there is none,
+ * the defaults (I/O APIC at 0xfec00000, no overrides) are used.
+ */
+static void find_madt(void) {
+	struct acpi_rsdp* rsdp = multiboot_get_acpi_rsdp();
+	if(!rsdp || !checksum_ok(rsdp, sizeof(struct acpi_rsdp))) {
+		log(LOG_WARN, "apic: No ACPI RSDP, using default I/O APIC address\n");
+		return;
+	}
+
+	vm_alloc_t rsdt_alloc;
+	struct acpi_header* rsdt = map_table(rsdp->rsdt_address, &rsdt_alloc);
+	if(!rsdt) {
+		return;
+	}
+
+	size_t num_tables = (rsdt->length - sizeof(struct acpi_header)) / 4;
+	uint32_t* tables = (uint32_t*)(rsdt + 1);
+
+	for(int i = 0; i < num_tables; i++) {
+		vm_alloc_t alloc;
+		struct acpi_header* header = map_table(tables[i], &alloc);
+		if(!header) {
+			continue;
+		}
+
+		bool found = !strncmp(header->signature, "APIC", 4);
+		if(found) {
+			parse_madt((struct madt*)header);
+		}
+
+		vm_free(&alloc);
+		if(found) {
+			break;
+		}
+	}
+
+	vm_free(&rsdt_alloc);
+}
+
+static void ioapic_route(uint32_t gsi, uint8_t vector, uint16_t flags) {
+	uint32_t pin = gsi - ioapic_gsi_base;
+	uint32_t low = vector;
+
+	// ISA interrupts are active high and edge triggered unless overridden
+	if((flags & MPS_POLARITY_MASK) == MPS_POLARITY_LOW) {
+		low |= IOAPIC_ACTIVE_LOW;
+	}
+	if((flags & MPS_TRIGGER_MASK) == MPS_TRIGGER_LEVEL) {
+		low |= IOAPIC_LEVEL;
+	}
+
+	ioapic_write(IOAPIC_REDTBL(pin) + 1, (uint32_t)lapic_get_id() << 24);
+	ioapic_write(IOAPIC_REDTBL(pin), low);
+}
+
+static void spurious_handler(task_t* task, isf_t* state, int num) {}
+
+void apic_init(void) {
+	if(cmdline_get_bool("noapic")) {
+		log(LOG_INFO, "apic: Disabled on command line, using PIC\n");
+		return;
+	}
+
+	if(!have_apic()) {
+		log(LOG_INFO, "apic: CPU has no local APIC, using PIC\n");
+		return;
+	}
+
+	for(int i = 0; i < 16; i++) {
+		isa_irqs[i].gsi = i;
+		isa_irqs[i].flags = 0;
+	}
+	find_madt();
+
+	uint64_t apic_base = rdmsr(MSR_APIC_BASE);
+	uintptr_t lapic_phys = apic_base & 0xfffff000;
+	if(!lapic_phys) {
+		lapic_phys = DEFAULT_LAPIC_ADDR;
+	}
+
+	vm_alloc_t lapic_alloc, ioapic_alloc;
+	// FIXME use proper APIs, see gfx_init
+	mem_page_alloc_at(&mem_phys_alloc_ctx, (void*)ALIGN_DOWN(lapic_phys, PAGE_SIZE), 1);
+	mem_page_alloc_at(&mem_phys_alloc_ctx, (void*)ALIGN_DOWN(ioapic_phys, PAGE_SIZE), 1);
+	lapic = map_phys(lapic_phys, PAGE_SIZE, &lapic_alloc);
+	ioapic = map_phys(ioapic_phys, PAGE_SIZE, &ioapic_alloc);
+	if(!lapic || !ioapic) {
+		log(LOG_ERR, "apic: Could not map registers, using PIC\n");
+		lapic = NULL;
+		return;
+	}
+
+	uint32_t num_pins = ((ioapic_read(IOAPIC_VER) >> 16) & 0xff) + 1;
+	int_register(APIC_SPURIOUS_VECTOR, spurious_handler, false);
+	int_disable();
+
+	// Mask everything on both PICs, the I/O APIC takes over from here
+	outb(0x21, 0xff);
+	outb(0xa1, 0xff);
+
+	wrmsr(MSR_APIC_BASE, apic_base | MSR_APIC_BASE_ENABLE);
+	lapic_write(LAPIC_TPR, 0);
+	lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+	lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED);
+	lapic_write(LAPIC_LVT_LINT1, LAPIC_LVT_NMI);
+	lapic_write(LAPIC_LVT_ERROR, LAPIC_LVT_MASKED);
+	lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
+
+	for(int i = 0; i < num_pins; i++) {
+		ioapic_write(IOAPIC_REDTBL(i), IOAPIC_MASKED);
+	}
+
+	for(int i = 0; i < 16; i++) {
+		// IRQ 2 is the PIC cascade and never fires
+		if(i == 2 || isa_irqs[i].gsi < ioapic_gsi_base
+			|| isa_irqs[i].gsi >= ioapic_gsi_base + num_pins) {
+			continue;
+		}
+		ioapic_route(isa_irqs[i].gsi, IRQ(i), isa_irqs[i].flags);
+	}
+
+	apic_active = 1;
+	int_enable();
+
+	log(LOG_INFO, "apic: Local APIC %d at %#x, I/O APIC at %#x with %d pins\n",
+		lapic_get_id(), lapic_phys, ioapic_phys, num_pins);
+}
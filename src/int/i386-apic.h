@@ -0,0 +1,34 @@
+#pragma once
+
+/* Copyright © 2020 Lukas Martini
+ *
+ * This file is part of Xelix.
+ *
+ * Xelix is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Xelix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Xelix.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define APIC_SPURIOUS_VECTOR 0xff
+
+// Physical address MSIs need to be written to, see pci_enable_msi
+#define APIC_MSI_ADDRESS 0xfee00000
+
+// Set once the local APIC and I/O APIC have taken over from the PIC
+extern uint8_t apic_active;
+
+void lapic_eoi(void);
+uint8_t lapic_get_id(void);
+void apic_init(void);
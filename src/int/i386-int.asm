@@ -19,6 +19,7 @@
 [EXTERN int_dispatch]
 [EXTERN paging_kernel_ctx]
 [EXTERN sse_state]
+[EXTERN apic_active]
 
 %define PIT_MASTER	0x20
 %define PIT_SLAVE	0xA0
@@ -31,6 +32,10 @@
 ; Acknowledges interrupts to PIC where necessary. Expects interrupt number in
 ; ebx. Returns 1 in eax if the interrupt was spurious, 0 otherwise.
 handle_eoi:
+	; With the APIC, int_dispatch sends the EOI once the handlers are done
+	cmp byte [apic_active], 0
+	jne .return
+
 	; Is this a spurious interrupt on the master PIC? If yes, return
 	cmp ebx, IRQ7
 	je .spurious
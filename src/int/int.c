@@ -20,15 +20,25 @@
 #include <int/int.h>
 #include <string.h>
 #include <int/i386-idt.h>
+#include <int/i386-apic.h>
+#include <tasks/syscall.h>
 #include <tasks/scheduler.h>
 #include <mem/paging.h>
 #include <mem/i386-gdt.h>
+#include <block/random.h>
 
 #define debug(args...) log(LOG_DEBUG, "interrupts: " args)
 
 isf_t* __fastcall int_dispatch(uint32_t intr, isf_t* state);
 
+/* Vectors handed out by int_alloc_vector, e.g. for MSIs. SYSCALL_INTERRUPT
+ * is in the middle of the range and gets skipped.
+ */
+#define DYNAMIC_VECTORS_START 0x40
+#define DYNAMIC_VECTORS_END 0xef
+
 struct interrupt_reg int_handlers[512][10];
+static uint32_t used_vectors[256 / 32];
 uint8_t sse_state[512] __aligned(16) UL_VISIBLE("bss");
 uint8_t* int_sse_target UL_VISIBLE("data") = sse_state;
 
@@ -47,6 +57,11 @@ isf_t* __fastcall int_dispatch(uint32_t intr, isf_t* state) {
 
 	int_disable();
 
+	// The arrival times of device interrupts feed the entropy pool
+	if(intr > IRQ(0) && intr != 0x31 && intr != SYSCALL_INTERRUPT) {
+		block_random_add_entropy(intr);
+	}
+
 	for(int i = 0; i < 10; i++) {
 		if(!reg[i].handler) {
 			break;
@@ -59,8 +74,20 @@ isf_t* __fastcall int_dispatch(uint32_t intr, isf_t* state) {
 		reg[i].handler((task_t*)task, state, intr);
 	}
 
-	// Run scheduler every tick, or when task yields
-	if(intr == IRQ(0) || intr == 0x31 || (task && task->interrupt_yield)) {
+	/* The PIC gets its EOI in assembly before the handlers are run. The local
+	 * APIC is only acknowledged now so level triggered interrupts don't fire
+	 * again before the handlers have dealt with them.
+	 */
+	if(apic_active && intr >= IRQ(0) && intr != 0x31 && intr != SYSCALL_INTERRUPT
+		&& intr != APIC_SPURIOUS_VECTOR) {
+		int_disable();
+		lapic_eoi();
+	}
+
+	/* Run scheduler every tick, when task yields, or when a handler has woken
+	 * up a worker while the CPU was idle.
+	 */
+	if(intr == IRQ(0) || intr == 0x31 || scheduler_resched || (task && task->interrupt_yield)) {
 		if((task && task->interrupt_yield)) {
 			task->interrupt_yield = false;
 		}
@@ -85,6 +112,39 @@ isf_t* __fastcall int_dispatch(uint32_t intr, isf_t* state) {
 	return state;
 }
 
+/* Allocate an interrupt vector that is not tied to an ISA IRQ. Returns -1 if
+ * they have run out.
+ */
+int int_alloc_vector(void) {
+	uint32_t flags = int_save();
+	for(int vector = DYNAMIC_VECTORS_START; vector <= DYNAMIC_VECTORS_END; vector++) {
+		if(vector == SYSCALL_INTERRUPT || used_vectors[vector / 32] & (1 << vector % 32)) {
+			continue;
+		}
+
+		used_vectors[vector / 32] |= 1 << vector % 32;
+		int_restore(flags);
+		return vector;
+	}
+
+	int_restore(flags);
+	return -1;
+}
+
+/* Return a vector from int_alloc_vector, along with the handlers registered
+ * for it. The device must not raise it anymore.
+ */
+void int_free_vector(int vector) {
+	if(vector < DYNAMIC_VECTORS_START || vector > DYNAMIC_VECTORS_END) {
+		return;
+	}
+
+	uint32_t flags = int_save();
+	bzero(int_handlers[vector], sizeof(int_handlers[vector]));
+	used_vectors[vector / 32] &= ~(1 << vector % 32);
+	int_restore(flags);
+}
+
 void int_init(void) {
 	idt_init();
 	bzero(int_handlers, sizeof(int_handlers));
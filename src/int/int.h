@@ -27,6 +27,21 @@
 
 	#define int_disable() asm volatile("cli")
 	#define int_enable() asm volatile("sti")
+
+	/* Disable interrupts and return the previous flags, for code that can be
+	 * called both from interrupt handlers and with interrupts enabled.
+	 */
+	static inline uint32_t int_save(void) {
+		uint32_t eflags;
+		asm volatile("pushf; pop %0; cli" : "=r"(eflags) :: "memory");
+		return eflags;
+	}
+
+	static inline void int_restore(uint32_t eflags) {
+		if(eflags & EFLAGS_IF) {
+			int_enable();
+		}
+	}
 #endif
 
 struct task;
@@ -99,4 +114,6 @@ static inline void dump_isf(uint32_t level, isf_t* state) {
 	log(level, "  ESI=0x%-10x EDI=0x%-10x EBP=0x%-10x ESP=0x%-10x\n", state->esi, state->edi, state->ebp, state->esp);
 }
 
+int int_alloc_vector(void);
+void int_free_vector(int vector);
 void int_init(void);
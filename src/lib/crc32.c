@@ -0,0 +1,49 @@
+/* crc32.c: CRC-32 (IEEE 802.3, reflected polynomial 0xedb88320)
+ * Copyright © 2020 Lukas Martini
+ *
+ * This file is part of Xelix.
+ *
+ * Xelix is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Xelix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Xelix. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "crc32.h"
+#include <stdbool.h>
+
+static uint32_t table[256];
+static bool table_ready = false;
+
+// Filling the table twice is harmless, so this needs no locking
+static void init_table(void) {
+	for(uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for(int j = 0; j < 8; j++) {
+			c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		}
+		table[i] = c;
+	}
+	table_ready = true;
+}
+
+uint32_t crc32(uint32_t crc, const void* buf, size_t len) {
+	if(!table_ready) {
+		init_table();
+	}
+
+	const uint8_t* p = buf;
+	crc = ~crc;
+	while(len--) {
+		crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
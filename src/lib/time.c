@@ -36,6 +36,10 @@ int century_register = 0x00;
 time_t last_timestamp = 0;
 uint64_t last_tick = 0;
 
+// RTC time and timer_get_us at boot, used for gettimeofday
+static time_t boot_timestamp = 0;
+static uint64_t boot_us = 0;
+
 static int in_progress(void) {
 	outb(0x70, 0x0A);
 	return (inb(0x71) & 0x80);
@@ -166,8 +170,9 @@ uint32_t time_get(void) {
 }
 
 int time_get_timeval(task_t* task, struct timeval* tv) {
-	tv->tv_sec = time_get();
-	tv->tv_usec = 0;
+	uint64_t us = timer_get_us() - boot_us;
+	tv->tv_sec = boot_timestamp + us / 1000000;
+	tv->tv_usec = us % 1000000;
 	return 0;
 }
 
@@ -184,6 +189,8 @@ static size_t sfs_read(struct vfs_callback_ctx* ctx, void* dest, size_t size) {
 void time_init(void) {
 	last_timestamp = read_rtc();
 	last_tick = timer_tick;
+	boot_timestamp = last_timestamp;
+	boot_us = timer_get_us();
 	log(LOG_INFO, "time: Initial last_timestamp is %u at tick %llu\n", last_timestamp, last_tick);
 	block_random_seed(last_timestamp + last_tick);
 
@@ -23,6 +23,7 @@
 #include <string.h>
 #include <panic.h>
 #include <int/int.h>
+#include <boot/multiboot.h>
 
 // Used in interrupt handlers to return to kernel paging context
 struct paging_context* paging_kernel_ctx UL_VISIBLE("bss");
@@ -128,7 +129,8 @@ void paging_rm_context(struct paging_context* ctx) {
 }
 
 void paging_init(void) {
-	paging_kernel_ctx = ALIGN(KERNEL_END, PAGE_SIZE);
+	// Multiboot modules get reserved and 1:1 mapped along with the kernel
+	paging_kernel_ctx = ALIGN(MAX(KERNEL_END, multiboot_get_modules_end()), PAGE_SIZE);
 	bzero(paging_kernel_ctx, sizeof(struct paging_context));
 	paging_alloc_end = (void*)paging_kernel_ctx + sizeof(struct paging_context);
 
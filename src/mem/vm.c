@@ -370,6 +370,7 @@ void* vm_map(struct vm_ctx* ctx, vm_alloc_t* vmem, struct vm_ctx* src_ctx,
 
 		struct vm_alloc_shard* shard = kmalloc(sizeof(struct vm_alloc_shard));
 		shard->addr = virt + pages_offset;
+		shard->size = PAGE_SIZE;
 		shard->phys = src_range->phys + ALIGN_DOWN(src_addr - src_range->addr, PAGE_SIZE) + pages_offset;
 		shard->next = range->shards;
 		range->shards = shard;
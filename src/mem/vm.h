@@ -135,5 +135,16 @@ static inline void* valloc_translate(struct vm_ctx* ctx, void* raddress, bool ph
 	if(!range) {
 		return 0;
 	}
+
+	// Ranges set up by vm_map are not physically contiguous
+	if(!phys && range->shards) {
+		struct vm_alloc_shard* shard = range->shards;
+		for(; shard; shard = shard->next) {
+			if(raddress >= shard->addr && raddress < shard->addr + shard->size) {
+				return shard->phys + (raddress - shard->addr);
+			}
+		}
+		return 0;
+	}
 	return valloc_translate_ptr(range, raddress, phys);
 }
@@ -140,34 +140,59 @@ static void pdma_read(int addr, void* data, size_t len) {
 	}
 }
 
-static void receive(void) {
-	// Mask receipt interrupts
-	ioutb(R_IMR, 0x3a);
-
+// Needs to be called with interrupts disabled since it switches pages
+static inline uint8_t read_curr(void) {
 	ioutb(R_CR, CR_PAGE1);
 	uint8_t curr = iinb(R_CURR);
 	ioutb(R_CR, 0);
+	return curr;
+}
 
-	// Clear intr
-	ioutb(R_ISR, 0x1);
-
-	while(next_receive_page != curr) {
-		uint32_t index = next_receive_page * 0x100;
+static void receive(void) {
+	uint32_t index = next_receive_page * 0x100;
+
+	// Get packet header
+	struct recv_frame_header hdr;
+	pdma_read(index, &hdr, sizeof(hdr));
+
+	// The byte count includes the receive header itself
+	size_t len = hdr.len - sizeof(hdr);
+	struct netbuf* nb = netbuf_alloc();
+	if(nb && hdr.len > sizeof(hdr) && len <= netbuf_tailroom(nb)) {
+		pdma_read(index + sizeof(hdr), nb->data, len);
+		nb->len = len;
+		net_receive(net_dev, nb);
+	} else if(nb) {
+		net_dev->stats.rx_errors++;
+		netbuf_put(nb);
+	} else {
+		net_dev->stats.rx_alloc_failures++;
+	}
 
-		// Get packet header
-		struct recv_frame_header hdr;
-		pdma_read(index, &hdr, sizeof(hdr));
+	next_receive_page = hdr.next;
+	ioutb(R_BNRY, next_receive_page == PAGE_RECEIVE ? PAGE_END - 1 : next_receive_page - 1);
+}
 
-		void* buf = kmalloc(hdr.len);
-		pdma_read(index + 4, buf, hdr.len);
-		net_receive(net_dev, buf, hdr.len);
-		kfree(buf);
+static int poll(struct net_device* ndev, int budget) {
+	int done = 0;
+	while(done < budget) {
+		/* Acknowledge before checking for frames, so one that arrives
+		 * afterwards raises an interrupt as soon as it is unmasked.
+		 */
+		uint32_t flags = int_save();
+		ioutb(R_ISR, 0x1);
+		if(next_receive_page == read_curr()) {
+			net_poll_complete(ndev);
+			ioutb(R_IMR, 0x3f);
+			int_restore(flags);
+			break;
+		}
+		int_restore(flags);
 
-		next_receive_page = hdr.next;
+		receive();
+		done++;
 	}
-
-	ioutb(R_BNRY, curr - 1);
-	ioutb(R_IMR, 0x3f);
+	return done;
 }
 
 static int send(struct pico_device* pdev, void* data, int len) {
@@ -188,14 +213,18 @@ static void int_handler(task_t* task, isf_t* state, int num) {
 	if(bit_get(isr, 0)) {
 		if(unlikely(bit_get(isr, 2))) {
 			log(LOG_ERR, "ne2k: Packet receive error\n");
-		} else {
-			receive();
+			net_dev->stats.rx_errors++;
 		}
+
+		// Mask receipt interrupts until poll has emptied the ring
+		ioutb(R_IMR, 0x3a);
+		net_schedule_poll(net_dev);
 	}
 
 	if(bit_get(isr, 1)) {
 		if(unlikely(bit_get(isr, 3))) {
 			log(LOG_ERR, "ne2k: Packet transmit error\n");
+			net_dev->stats.tx_errors++;
 		}
 
 		spinlock_release(&send_lock);
@@ -203,6 +232,7 @@ static void int_handler(task_t* task, isf_t* state, int num) {
 
 	if(unlikely(bit_get(isr, 4))) {
 		log(LOG_ERR, "ne2k: Overwrite warning\n");
+		net_dev->stats.rx_ring_full++;
 	}
 
 	if(unlikely(bit_get(isr, 5))) {
@@ -259,14 +289,18 @@ static int pci_cb(pci_device_t* _dev) {
 
 	// Do this here since we're in page 1 anyway
 	ioutb(R_CURR, PAGE_RECEIVE + 1);
+
+	// Needs to exist before the first interrupt can schedule a poll
+	net_dev = net_add_device("ne2k", nmac, send, poll);
+	if(!net_dev) {
+		return 1;
+	}
 	int_register(IRQ(dev->interrupt_line), int_handler, false);
 
 	ioutb(R_CR, CR_STOP);	// Reset page
 	ioutb(R_IMR, 0xff);		// Unmask all interrupts
 	ioutb(R_CR, CR_START);
 
-	net_dev = net_add_device("ne2k", nmac, send);
-
 	return 0;
 }
 
@@ -18,8 +18,7 @@
  */
 
 #include "net.h"
-#include <buffer.h>
-#include <spinlock.h>
+#include <int/int.h>
 #include <pico_stack.h>
 #include <pico_ipv4.h>
 #include <pico_device.h>
@@ -32,11 +31,18 @@
 #include <tasks/worker.h>
 #include <tasks/scheduler.h>
 #include <time.h>
+#include <bsp/timer.h>
+#include <string.h>
+#include <mem/kmalloc.h>
+#include <fs/sysfs.h>
+#include <printf.h>
 
 #ifdef CONFIG_ENABLE_PICOTCP
 
-spinlock_t net_pico_lock;
+struct mutex net_pico_lock;
+static struct mutex_stats pico_lock_stats;
 static bool initialized = false;
+static worker_t* net_worker = NULL;
 static uint32_t dhcp_xid;
 
 static void dhcp_cb(void* cli, int code) {
@@ -51,75 +57,361 @@ static void dhcp_cb(void* cli, int code) {
 	log(LOG_INFO, "net: DHCP done, IP %s\n", ip);
 }
 
+// Maximum number of received frames waiting for knetworkd per device
+#define RECV_QUEUE_MAX 128
+
+// Maximum number of frames a driver receives in one poll pass
+#define POLL_BUDGET 64
+
+/* PicoTCP doesn't export when its next timer expires, so knetworkd wakes up at
+ * least this often to run them.
+ */
+#define TIMER_INTERVAL_MS 10
+
+// Ticks knetworkd keeps running after an event before it goes back to sleep
+#define BUSY_TICKS 4
+
+// Called by PicoTCP once it has discarded a frame received using pico_dsr_cb
+static void pico_free_cb(uint8_t* buf) {
+	netbuf_put(netbuf_from_data(buf));
+}
+
+// Set while a linear copy is handed to PicoTCP, see recv_linear
+static uint8_t* linear_pending = NULL;
+
+static void linear_free_cb(uint8_t* buf) {
+	if(buf == linear_pending) {
+		linear_pending = NULL;
+	}
+	kfree(buf);
+}
+
+// Internet checksum of buf, with the field itself holding the initial sum
+static void complete_csum(uint8_t* buf, size_t len, uint16_t offset) {
+	uint32_t sum = 0;
+	for(size_t i = 0; i + 1 < len; i += 2) {
+		sum += *(uint16_t*)(buf + i);
+	}
+	if(len & 1) {
+		sum += buf[len - 1];
+	}
+
+	while(sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	*(uint16_t*)(buf + offset) = ~sum;
+}
+
+/* Frames spread over multiple buffers, such as large segments the host has
+ * merged, get copied into one contiguous buffer for PicoTCP. Frames whose
+ * checksum was left to the guest get it filled in here, as PicoTCP verifies
+ * it on every frame.
+ */
+static void recv_linear(struct net_device* dev, struct netbuf* nb) {
+	size_t len = 0;
+	for(struct netbuf* frag = nb; frag; frag = frag->frag) {
+		len += frag->len;
+	}
+
+	uint8_t* buf = kmalloc(len);
+	if(!buf) {
+		dev->stats.rx_alloc_failures++;
+		netbuf_put(nb);
+		return;
+	}
+
+	size_t offset = 0;
+	for(struct netbuf* frag = nb; frag; frag = frag->frag) {
+		memcpy(buf + offset, frag->data, frag->len);
+		offset += frag->len;
+	}
+
+	if((nb->flags & NETBUF_F_CSUM_PARTIAL) && nb->csum_start < len
+		&& nb->csum_offset + 2 <= len - nb->csum_start) {
+		complete_csum(buf + nb->csum_start, len - nb->csum_start, nb->csum_offset);
+	}
+	netbuf_put(nb);
+	net_stats_frame(buf, len, true, false);
+
+	/* If PicoTCP fails before it has set up the frame, the callback never
+	 * happens and the buffer is still ours.
+	 */
+	linear_pending = buf;
+	if(pico_stack_recv_zerocopy_ext_buffer_notify(&dev->pico_dev, buf, len,
+		linear_free_cb) < 0) {
+		dev->stats.rx_dropped++;
+		if(linear_pending == buf) {
+			kfree(buf);
+		}
+	} else {
+		dev->stats.rx_packets++;
+		dev->stats.rx_bytes += len;
+	}
+	linear_pending = NULL;
+}
+
 static int pico_dsr_cb(struct pico_device* pico_dev, int loop_score) {
 	struct net_device* dev = (struct net_device*)pico_dev;
 
-	size_t sz = buffer_size(dev->recv_buf);
-	if(likely(sz)) {
-		void* buf = kmalloc(sz);
-		buffer_pop(dev->recv_buf, buf, sz);
-		pico_stack_recv_zerocopy(pico_dev, buf, sz);
+	if(dev->poll_scheduled) {
+		dev->polls++;
+		dev->polled_frames += dev->poll(dev, MIN(loop_score, POLL_BUDGET));
+	}
+
+	while(loop_score > 0) {
+		uint32_t flags = int_save();
+		struct netbuf* nb = dev->recv_head;
+		if(nb) {
+			dev->recv_head = nb->next;
+			dev->recv_len--;
+		}
+		if(!dev->recv_head) {
+			dev->recv_tail = NULL;
+			if(!dev->poll_scheduled) {
+				pico_dev->__serving_interrupt = 0;
+			}
+		}
+		int_restore(flags);
+
+		if(!nb) {
+			break;
+		}
+
+		if(nb->frag || (nb->flags & NETBUF_F_CSUM_PARTIAL)) {
+			recv_linear(dev, nb);
+			loop_score--;
+			continue;
+		}
+
+		net_stats_frame(nb->data, nb->len, true, false);
+
+		/* The frame is passed by reference and keeps the buffer alive until
+		 * PicoTCP calls pico_free_cb. If PicoTCP fails before it has set up
+		 * the frame, the callback never happens, which is the case if our
+		 * reference is the only one left afterwards.
+		 */
+		netbuf_get(nb);
+		if(pico_stack_recv_zerocopy_ext_buffer_notify(pico_dev, nb->data, nb->len,
+			pico_free_cb) < 0) {
+			dev->stats.rx_dropped++;
+			if(nb->refs == 2) {
+				netbuf_put(nb);
+			}
+		} else {
+			dev->stats.rx_packets++;
+			dev->stats.rx_bytes += nb->len;
+		}
+		netbuf_put(nb);
 		loop_score--;
 	}
 
-	pico_dev->__serving_interrupt = 0;
+	// Frames are left over, make sure knetworkd comes back for them
+	if(pico_dev->__serving_interrupt) {
+		net_wake();
+	}
 	return loop_score;
 }
 
-// Receive data from device
-void net_receive(struct net_device* dev, void* data, size_t len) {
-	if(unlikely(!initialized)) {
+/* Receive a frame from a device. Takes over the reference to the buffer.
+ * Called from interrupt handlers or poll callbacks, the frame is handed to
+ * PicoTCP by knetworkd later.
+ */
+void net_receive(struct net_device* dev, struct netbuf* nb) {
+	uint32_t flags = int_save();
+	if(unlikely(!initialized || dev->recv_len >= RECV_QUEUE_MAX)) {
+		dev->stats.rx_dropped++;
+		int_restore(flags);
+		netbuf_put(nb);
 		return;
 	}
 
-	if(buffer_write(dev->recv_buf, data, len) < len) {
-		log(LOG_WARN, "net: Receive buffer overflow, discarding incoming packets\n");
+	nb->next = NULL;
+	if(dev->recv_tail) {
+		dev->recv_tail->next = nb;
+	} else {
+		dev->recv_head = nb;
 	}
+	dev->recv_tail = nb;
+	dev->recv_len++;
+	dev->pico_dev.__serving_interrupt = 1;
+	int_restore(flags);
+	net_wake();
+}
 
+// Called from the interrupt handler of a driver once it has masked its receive interrupt
+void net_schedule_poll(struct net_device* dev) {
+	uint32_t flags = int_save();
+	if(!dev->poll_scheduled) {
+		dev->rx_interrupts++;
+	}
+	dev->poll_scheduled = true;
 	dev->pico_dev.__serving_interrupt = 1;
+	int_restore(flags);
+	net_wake();
 }
 
-struct net_device* net_add_device(char* name, uint8_t mac[6], net_send_callback_t* send_cb) {
+void net_poll_complete(struct net_device* dev) {
+	dev->poll_scheduled = false;
+}
+
+/* Returning 0 from a send callback makes PicoTCP keep the frame and retry it
+ * later, which drivers do when the device has no room for it.
+ */
+static int pico_send_cb(struct pico_device* pico_dev, void* data, int len) {
+	struct net_device* dev = (struct net_device*)pico_dev;
+	int ret = dev->send(pico_dev, data, len);
+	if(ret > 0) {
+		dev->stats.tx_packets++;
+		dev->stats.tx_bytes += len;
+		net_stats_frame(data, len, true, true);
+	} else if(!ret) {
+		dev->stats.tx_busy++;
+	} else {
+		dev->stats.tx_errors++;
+	}
+	return ret;
+}
+
+static struct net_stats lo_stats;
+static net_send_callback_t* lo_send = NULL;
+
+/* Everything the loopback device sends comes right back in, so it gets
+ * counted in both directions here.
+ */
+static int lo_send_cb(struct pico_device* lo, void* data, int len) {
+	int ret = lo_send(lo, data, len);
+	if(ret > 0) {
+		lo_stats.tx_packets++;
+		lo_stats.tx_bytes += len;
+		lo_stats.rx_packets++;
+		lo_stats.rx_bytes += len;
+		net_stats_frame(data, len, false, true);
+		net_stats_frame(data, len, false, false);
+	} else if(!ret) {
+		lo_stats.tx_busy++;
+	} else {
+		lo_stats.tx_errors++;
+	}
+	return ret;
+}
+
+static size_t sfs_poll_read(struct vfs_callback_ctx* ctx, void* dest, size_t size) {
+	struct net_device* dev = (struct net_device*)ctx->fp->meta;
+	if(ctx->fp->offset) {
+		return 0;
+	}
+
+	// Without polling, every frame would have taken an interrupt
+	uint32_t saved = dev->polled_frames > dev->rx_interrupts ?
+		dev->polled_frames - dev->rx_interrupts : 0;
+
+	size_t rsize = 0;
+	sysfs_printf("# interrupts polls frames interrupts_saved\n");
+	sysfs_printf("%u %u %u %u\n", dev->rx_interrupts, dev->polls,
+		dev->polled_frames, saved);
+	return rsize;
+}
+
+static size_t sfs_locks_read(struct vfs_callback_ctx* ctx, void* dest, size_t size) {
+	if(ctx->fp->offset) {
+		return 0;
+	}
+
+	size_t rsize = 0;
+	sysfs_printf("# lock acquisitions contended wait_us max_wait_us\n");
+	sysfs_printf("pico %u %u %llu %llu\n", pico_lock_stats.acquisitions,
+		pico_lock_stats.contended, pico_lock_stats.wait_us,
+		pico_lock_stats.max_wait_us);
+	sysfs_printf("socket %u %u %llu %llu\n", net_socket_lock_stats.acquisitions,
+		net_socket_lock_stats.contended, net_socket_lock_stats.wait_us,
+		net_socket_lock_stats.max_wait_us);
+	return rsize;
+}
+
+struct net_device* net_add_device(char* name, uint8_t mac[6], net_send_callback_t* send_cb,
+	net_poll_callback_t* poll_cb) {
+
 	struct net_device* dev = zmalloc(sizeof(struct net_device));
 	struct pico_ethdev* eth = zmalloc(sizeof(struct pico_ethdev));
 	if(!dev || !eth) {
 		return NULL;
 	}
 
+	mutex_lock(&net_pico_lock);
 	if(pico_device_init(&dev->pico_dev, name, NULL)) {
+		mutex_unlock(&net_pico_lock);
 		return NULL;
 	}
 
 	memcpy(eth->mac.addr, mac, sizeof(uint8_t) * 6);
-	dev->recv_buf = buffer_new(40);
-	if(!dev->recv_buf) {
-		return NULL;
-	}
-
 	dev->pico_dev.eth = eth;
-	dev->pico_dev.send = send_cb;
+	dev->send = send_cb;
+	dev->pico_dev.send = pico_send_cb;
 	dev->pico_dev.dsr = pico_dsr_cb;
+	dev->poll = poll_cb;
+	net_stats_add_file(name, &dev->stats);
+
+	if(poll_cb) {
+		struct vfs_callbacks sfs_cb = {
+			.read = sfs_poll_read,
+		};
+		char path[40];
+		snprintf(path, 40, "net/%s/poll", name);
+		struct sysfs_file* sfp = sysfs_add_file(path, &sfs_cb);
+		sfp->meta = (void*)dev;
+	}
 
 	log(LOG_INFO, "net: New device %s mac %02x:%02x:%02x:%02x:%02x:%02x\n",
 		name, mac[0], mac[1], mac[2], mac[3],
 		mac[4], mac[5]);
 
 	pico_dhcp_initiate_negotiation(&dev->pico_dev, &dhcp_cb, &dhcp_xid);
+	mutex_unlock(&net_pico_lock);
 	return dev;
 }
 
+/* Wake up knetworkd so PicoTCP gets to process new work. Needs to be called
+ * whenever frames arrive or sockets have queued data, can be called from
+ * interrupt handlers.
+ */
+void net_wake(void) {
+	if(net_worker) {
+		worker_wake(net_worker);
+	}
+}
+
+/* Processing an event usually takes PicoTCP more than one tick, for example
+ * to pass a frame through the loopback device or to send the segments queued
+ * by a socket write. After being woken up, knetworkd therefore keeps ticking
+ * for a little while before it goes back to sleep until the next event or
+ * the next round of PicoTCP timers.
+ */
 static void __attribute__((fastcall, noreturn)) net_worker_entry(worker_t* worker) {
+	int busy = 0;
 	while(1) {
-		if(likely(initialized)) {
-			pico_stack_tick();
+		mutex_lock(&net_pico_lock);
+		pico_stack_tick();
+		mutex_unlock(&net_pico_lock);
+
+		if(busy) {
+			busy--;
+			scheduler_yield();
+			continue;
+		}
+
+		uint32_t timeout = MAX(1, TIMER_INTERVAL_MS * timer_rate / 1000);
+		if(worker_sleep(worker, timer_tick + timeout)) {
+			busy = BUSY_TICKS;
 		}
-		scheduler_yield();
 	}
 }
 
 void net_init() {
 	log(LOG_INFO, "net: Initializing PicoTCP\n");
+	mutex_init(&net_pico_lock, &pico_lock_stats);
 	pico_stack_init();
+	netbuf_init();
+	net_stats_init();
 	initialized = true;
 
 	uint32_t ilo_addr;
@@ -135,6 +427,9 @@ void net_init() {
 	struct pico_ip4 subnet = {.addr = isubnet};
 
 	struct pico_device* lo = pico_loop_create();
+	lo_send = lo->send;
+	lo->send = lo_send_cb;
+	net_stats_add_file(lo->name, &lo_stats);
 	pico_ipv4_link_add(lo, lo_addr, netmask);
 	pico_ipv4_route_add(subnet, netmask, lo_addr, 1000, NULL);
 
@@ -152,7 +447,12 @@ void net_init() {
 	rtl8139_init();
 	#endif
 
-	worker_t* net_worker = worker_new("knetworkd", net_worker_entry);
+	struct vfs_callbacks sfs_cb = {
+		.read = sfs_locks_read,
+	};
+	sysfs_add_file("net/locks", &sfs_cb);
+
+	net_worker = worker_new("knetworkd", net_worker_entry);
 	scheduler_add_worker(net_worker);
 }
 
@@ -19,18 +19,53 @@
  */
 
 #include <pico_device.h>
-#include <buffer.h>
 #include <spinlock.h>
+#include <tasks/mutex.h>
+#include <net/netbuf.h>
+#include <net/stats.h>
+
+struct net_device;
+typedef int (net_send_callback_t)(struct pico_device* pico_dev, void* data, int size);
+typedef int (net_poll_callback_t)(struct net_device* dev, int budget);
 
 struct net_device {
 	struct pico_device pico_dev;
-	struct buffer* recv_buf;
+
+	// Send callback of the driver, called through pico_send_cb in net.c
+	net_send_callback_t* send;
+	struct net_stats stats;
+
+	// Received frames waiting for knetworkd, linked through netbuf->next
+	struct netbuf* recv_head;
+	struct netbuf* recv_tail;
+	uint32_t recv_len;
+
+	/* Drivers with a poll callback mask their receive interrupt and call
+	 * net_schedule_poll instead of receiving frames in the interrupt handler.
+	 * knetworkd then calls poll, which receives at most budget frames using
+	 * net_receive. Once the device has no frames left, the driver calls
+	 * net_poll_complete and unmasks the interrupt again.
+	 */
+	net_poll_callback_t* poll;
+	bool poll_scheduled;
+
+	// Receive interrupts taken, poll passes and frames received in them
+	uint32_t rx_interrupts;
+	uint32_t polls;
+	uint32_t polled_frames;
 };
 
-typedef int (net_send_callback_t)(struct pico_device* pico_dev, void* data, int size);
-extern spinlock_t net_pico_lock;
+/* PicoTCP is not reentrant, so all calls into it need to hold net_pico_lock.
+ * Socket callbacks run with it held. Per-socket locks nest inside of it.
+ */
+extern struct mutex net_pico_lock;
+extern struct mutex_stats net_socket_lock_stats;
 
-void net_receive(struct net_device* dev, void* data, size_t len);
-struct net_device* net_add_device(char* name, uint8_t mac[6], net_send_callback_t* write_cb);
+void net_receive(struct net_device* dev, struct netbuf* nb);
+void net_wake(void);
+void net_schedule_poll(struct net_device* dev);
+void net_poll_complete(struct net_device* dev);
+struct net_device* net_add_device(char* name, uint8_t mac[6],
+	net_send_callback_t* write_cb, net_poll_callback_t* poll_cb);
 
 void net_init(void);
@@ -0,0 +1,125 @@
+/* netbuf.c: Preallocated packet buffers
+ * Copyright © 2020 Lukas Martini
+ *
+ * This file is part of Xelix.
+ *
+ * Xelix is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Xelix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Xelix.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Received frames are read by the drivers straight into buffers from this
+ * pool and then passed to PicoTCP by reference, which drops the reference
+ * once it is done with the frame. Since buffers get allocated and freed from
+ * interrupt handlers, the free list is only touched with interrupts disabled.
+ */
+
+#include "netbuf.h"
+#include <mem/kmalloc.h>
+#include <int/int.h>
+#include <fs/sysfs.h>
+#include <string.h>
+#include <log.h>
+#include <panic.h>
+
+#ifdef CONFIG_ENABLE_PICOTCP
+
+static struct netbuf* bufs;
+static uint8_t* storage;
+static struct netbuf* free_list = NULL;
+
+static uint32_t num_free;
+static uint32_t min_free;
+static uint32_t allocs;
+static uint32_t failures;
+
+struct netbuf* netbuf_alloc(void) {
+	uint32_t flags = int_save();
+	struct netbuf* nb = free_list;
+	if(unlikely(!nb)) {
+		failures++;
+		int_restore(flags);
+		return NULL;
+	}
+
+	free_list = nb->next;
+	allocs++;
+	min_free = MIN(min_free, --num_free);
+	int_restore(flags);
+
+	nb->next = NULL;
+	nb->frag = NULL;
+	nb->flags = 0;
+	nb->data = nb->head + NETBUF_HEADROOM;
+	nb->len = 0;
+	nb->refs = 1;
+	return nb;
+}
+
+// Find the buffer a data pointer points into
+struct netbuf* netbuf_from_data(void* data) {
+	size_t index = ((uint8_t*)data - storage) / NETBUF_SIZE;
+	assert(index < CONFIG_NETBUF_POOL_SIZE);
+	return &bufs[index];
+}
+
+void netbuf_put(struct netbuf* nb) {
+	if(__sync_sub_and_fetch(&nb->refs, 1)) {
+		return;
+	}
+
+	struct netbuf* frag = nb->frag;
+	uint32_t flags = int_save();
+	nb->next = free_list;
+	free_list = nb;
+	num_free++;
+	int_restore(flags);
+
+	if(frag) {
+		netbuf_put(frag);
+	}
+}
+
+static size_t sfs_read(struct vfs_callback_ctx* ctx, void* dest, size_t size) {
+	if(ctx->fp->offset) {
+		return 0;
+	}
+
+	size_t rsize = 0;
+	sysfs_printf("# total free min_free allocs failures\n");
+	sysfs_printf("%u %u %u %u %u\n", CONFIG_NETBUF_POOL_SIZE, num_free, min_free,
+		allocs, failures);
+	return rsize;
+}
+
+void netbuf_init(void) {
+	bufs = zmalloc(sizeof(struct netbuf) * CONFIG_NETBUF_POOL_SIZE);
+	storage = kmalloc_a(NETBUF_SIZE * CONFIG_NETBUF_POOL_SIZE);
+
+	for(int i = CONFIG_NETBUF_POOL_SIZE - 1; i >= 0; i--) {
+		bufs[i].head = storage + i * NETBUF_SIZE;
+		bufs[i].next = free_list;
+		free_list = &bufs[i];
+	}
+
+	num_free = CONFIG_NETBUF_POOL_SIZE;
+	min_free = num_free;
+	log(LOG_INFO, "netbuf: %d buffers of %d bytes at %p\n",
+		CONFIG_NETBUF_POOL_SIZE, NETBUF_SIZE, storage);
+
+	struct vfs_callbacks sfs_cb = {
+		.read = sfs_read,
+	};
+	sysfs_add_file("netbuf", &sfs_cb);
+}
+
+#endif /* ENABLE_PICOTCP */
@@ -0,0 +1,71 @@
+#pragma once
+
+/* Copyright © 2020 Lukas Martini
+ *
+ * This file is part of Xelix.
+ *
+ * Xelix is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Xelix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Xelix.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Size of the storage of each buffer, and space reserved in front of the data
+#define NETBUF_SIZE 2048
+#define NETBUF_HEADROOM 64
+
+// The transport checksum still needs to be computed, see csum_start
+#define NETBUF_F_CSUM_PARTIAL 1
+
+/* Packet buffer from the preallocated pool. Buffers are identity mapped, so
+ * data can be handed to devices for DMA as is. Buffers are reference counted
+ * and return to the pool once the last reference is dropped using
+ * netbuf_put.
+ */
+struct netbuf {
+	// Used by whoever currently owns the buffer, e.g. for receive queues
+	struct netbuf* next;
+
+	/* Frames that don't fit a single buffer continue in the buffers chained
+	 * here, which get dropped along with the first one.
+	 */
+	struct netbuf* frag;
+
+	uint8_t* head;
+	uint8_t* data;
+	size_t len;
+	uint32_t refs;
+
+	/* With NETBUF_F_CSUM_PARTIAL, the checksum over everything from
+	 * csum_start to the end of the frame goes to csum_start + csum_offset.
+	 */
+	uint32_t flags;
+	uint16_t csum_start;
+	uint16_t csum_offset;
+};
+
+struct netbuf* netbuf_alloc(void);
+struct netbuf* netbuf_from_data(void* data);
+void netbuf_put(struct netbuf* nb);
+void netbuf_init(void);
+
+static inline void netbuf_get(struct netbuf* nb) {
+	__sync_add_and_fetch(&nb->refs, 1);
+}
+
+// Space available behind the data pointer
+static inline size_t netbuf_tailroom(struct netbuf* nb) {
+	return nb->head + NETBUF_SIZE - nb->data;
+}
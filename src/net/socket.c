@@ -18,10 +18,12 @@
  */
 
 #include "socket.h"
+#include "unix.h"
 #include <net/net.h>
 #include <net/conv.h>
 #include <pico_stack.h>
 #include <pico_socket.h>
+#include <pico_queue.h>
 #include <pico_dhcp_client.h>
 #include <pico_dns_client.h>
 #include <tasks/task.h>
@@ -30,10 +32,17 @@
 #include <fs/poll.h>
 #include <errno.h>
 #include <endian.h>
-#include <spinlock.h>
+#include <int/int.h>
+#include <tasks/mutex.h>
+#include <tasks/waitqueue.h>
+#include <mem/kmalloc.h>
 
 #ifdef CONFIG_ENABLE_PICOTCP
-#define READ_BUFFER_SIZE 0x5000
+
+// Default size of the receive ring buffer, and limits for SO_RCVBUF/SO_SNDBUF
+#define RCVBUF_DEFAULT 0x5000
+#define SOCKBUF_MIN 0x800
+#define SOCKBUF_MAX 0x100000
 
 #ifdef CONFIG_SOCKET_DEBUG
  #define debug(args...) log(LOG_DEBUG, "socket: " args)
@@ -41,12 +50,37 @@
  #define debug(args...)
 #endif
 
+struct mutex_stats net_socket_lock_stats;
+
 struct socket {
 	struct pico_socket* pico_socket;
+
+	/* Protects the socket state and the ring buffer. When both are needed,
+	 * net_pico_lock has to be taken first. Never held while waiting.
+	 */
+	struct mutex lock;
 	int conn_requests;
 	bool can_write;
-	char read_buffer[READ_BUFFER_SIZE];
-	size_t read_buffer_length;
+
+	/* Received data is copied from PicoTCP into this ring buffer. Once it is
+	 * full, data stays queued in PicoTCP, which shrinks the TCP window
+	 * accordingly. Reads refill the ring from PicoTCP.
+	 */
+	uint8_t* rbuf;
+	size_t rbuf_size;
+	size_t rbuf_start;
+	size_t rbuf_len;
+	size_t sndbuf;
+
+	/* UDP sockets don't use the ring buffer, datagrams are taken from the
+	 * PicoTCP queue one at a time to keep their boundaries. dgram_ready is
+	 * set by read events and cleared once the queue is empty.
+	 */
+	bool dgram;
+	bool dgram_ready;
+
+	struct waitqueue read_wait;
+	struct waitqueue write_wait;
 
 	enum {
 		SOCK_OPEN,
@@ -59,7 +93,7 @@ struct socket {
 	} state;
 };
 
-static inline struct socket* get_socket(task_t* task, int sockfd) {
+static inline vfs_file_t* get_file(task_t* task, int sockfd) {
 	vfs_file_t* fp = vfs_get_from_id(sockfd, task);
 	if(unlikely(!fp)) {
 		sc_errno = EBADF;
@@ -70,19 +104,74 @@ static inline struct socket* get_socket(task_t* task, int sockfd) {
 		sc_errno = ENOTSOCK;
 		return NULL;
 	}
+	return fp;
+}
+
+/* Map user memory the syscall code can't map by itself, such as sockaddrs,
+ * whose length is passed in a pointer.
+ */
+static void* map_user(task_t* task, vm_alloc_t* alloc, void* uaddr, size_t size) {
+	void* addr = vm_map(VM_KERNEL, alloc, &task->vmem, uaddr, size,
+		VM_MAP_USER_ONLY | VM_RW);
+
+	if(!addr) {
+		task_signal(task, NULL, SIGSEGV);
+		sc_errno = EFAULT;
+	}
+	return addr;
+}
 
-	return (struct socket*)fp->mount_instance;
+/* Release the socket lock and wait for the socket callback to signal a
+ * change. Interrupts stay disabled in between, so knetworkd can't run the
+ * callback before the task is queued. Returns with the lock held again.
+ */
+static void socket_wait(struct socket* sock, struct waitqueue* wq) {
+	uint32_t flags = int_save();
+	mutex_unlock(&sock->lock);
+	waitqueue_wait(wq);
+	int_restore(flags);
+	mutex_lock(&sock->lock);
 }
 
-static void socket_cb(uint16_t ev, struct pico_socket* pico_sock) {
-	int_disable();
+// Move as much data as fits from PicoTCP into the ring buffer
+static void fill_rbuf(struct socket* sock) {
+	while(sock->rbuf_len < sock->rbuf_size) {
+		size_t end = (sock->rbuf_start + sock->rbuf_len) % sock->rbuf_size;
+		size_t space = MIN(sock->rbuf_size - sock->rbuf_len, sock->rbuf_size - end);
+
+		int read = pico_socket_read(sock->pico_socket, sock->rbuf + end, space);
+		if(read <= 0) {
+			break;
+		}
+
+		sock->rbuf_len += read;
+		if(read < space) {
+			break;
+		}
+	}
+}
 
+static size_t drain_rbuf(struct socket* sock, void* dest, size_t size, bool peek) {
+	size = MIN(size, sock->rbuf_len);
+	size_t first = MIN(size, sock->rbuf_size - sock->rbuf_start);
+	memcpy(dest, sock->rbuf + sock->rbuf_start, first);
+	memcpy((uint8_t*)dest + first, sock->rbuf, size - first);
+
+	if(!peek) {
+		sock->rbuf_start = (sock->rbuf_start + size) % sock->rbuf_size;
+		sock->rbuf_len -= size;
+	}
+	return size;
+}
+
+// Called from within PicoTCP, so net_pico_lock is already held
+static void socket_cb(uint16_t ev, struct pico_socket* pico_sock) {
 	struct socket* sock = (struct socket*)pico_sock->priv;
 	if(unlikely(!sock)) {
-		//log(LOG_WARN, "net: socket_cb called without socket\n");
 		return;
 	}
 
+	mutex_lock(&sock->lock);
 	if(ev & PICO_SOCK_EV_CONN) {
 		if(sock->state == SOCK_LISTEN) {
 			debug("New client connection\n");
@@ -103,26 +192,22 @@ static void socket_cb(uint16_t ev, struct pico_socket* pico_sock) {
 		sock->state = SOCK_CLOSED;
 	}
 
-	sock->can_write = (ev & PICO_SOCK_EV_WR);
-
-	if((ev & PICO_SOCK_EV_RD) && spinlock_get(&net_pico_lock, 200)) {
-			debug("cb sock %#x pico %#x\n", pico_sock->priv, pico_sock);
-
-		debug("Socket read\n");
-		int free_bytes = READ_BUFFER_SIZE - sock->read_buffer_length;
+	if(ev & PICO_SOCK_EV_WR) {
+		sock->can_write = true;
+	}
 
-		if(free_bytes) {
-			sock->read_buffer_length += pico_socket_read(sock->pico_socket,
-				(void*)sock->read_buffer + sock->read_buffer_length, free_bytes);
+	if(ev & PICO_SOCK_EV_RD) {
+		if(sock->dgram) {
+			sock->dgram_ready = true;
 		} else {
-			log(LOG_WARN, "net: Socket %#x read buffer exhausted\n", sock);
+			fill_rbuf(sock);
+			debug("Read done, buffer size %#x\n", sock->rbuf_len);
 		}
-
-		spinlock_release(&net_pico_lock);
-		sock->can_write = true;
-		debug("Read done, buffer size %#x\n", sock->read_buffer_length);
 	}
-	int_enable();
+
+	mutex_unlock(&sock->lock);
+	waitqueue_wake(&sock->read_wait);
+	waitqueue_wake(&sock->write_wait);
 }
 
 // Only does recv() functionality for now
@@ -130,48 +215,243 @@ static size_t do_recvfrom(struct socket* sock, void* dest, size_t size,
 	int fp_flags, int recv_flags, struct sockaddr* src_addr,
 	socklen_t* addrlen) {
 
-	if(sock->state == SOCK_CLOSED) {
-		sc_errno = ENOTCONN;
-		return -1;
+	mutex_lock(&sock->lock);
+	while(!sock->rbuf_len) {
+		int err = 0;
+		if(sock->state == SOCK_CLOSED) {
+			err = ENOTCONN;
+		} else if(sock->state == SOCK_RESET_BY_PEER) {
+			err = ECONNRESET;
+		} else if(fp_flags & O_NONBLOCK) {
+			err = EAGAIN;
+		}
+
+		if(err) {
+			mutex_unlock(&sock->lock);
+			sc_errno = err;
+			return -1;
+		}
+
+		socket_wait(sock, &sock->read_wait);
 	}
-	if(sock->state == SOCK_RESET_BY_PEER) {
-		sc_errno = ECONNRESET;
-		return -1;
+
+	size = drain_rbuf(sock, dest, size, recv_flags & MSG_PEEK);
+	mutex_unlock(&sock->lock);
+
+	/* Data PicoTCP couldn't hand over while the ring was full doesn't cause
+	 * another read event, so pull it in now. This also lets PicoTCP open the
+	 * TCP window again.
+	 */
+	if(!(recv_flags & MSG_PEEK)) {
+		mutex_lock(&net_pico_lock);
+		mutex_lock(&sock->lock);
+		fill_rbuf(sock);
+		mutex_unlock(&sock->lock);
+		mutex_unlock(&net_pico_lock);
+		net_wake();
 	}
+	return size;
+}
 
-	if(!sock->read_buffer_length && fp_flags & O_NONBLOCK) {
+static size_t iov_total(struct msghdr* msg) {
+	size_t total = 0;
+	for(int i = 0; i < msg->msg_iovlen; i++) {
+		total += msg->msg_iov[i].iov_len;
+	}
+	return total;
+}
+
+// Copy len bytes between buf and the iovecs of msg
+static void copy_iov(struct msghdr* msg, uint8_t* buf, size_t len, bool to_iov) {
+	for(int i = 0; i < msg->msg_iovlen && len; i++) {
+		size_t n = MIN(len, msg->msg_iov[i].iov_len);
+		if(to_iov) {
+			memcpy(msg->msg_iov[i].iov_base, buf, n);
+		} else {
+			memcpy(buf, msg->msg_iov[i].iov_base, n);
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+/* Take one datagram from the PicoTCP queue. Needs to be called with
+ * net_pico_lock held. Returns -1 with EAGAIN set if the queue is empty.
+ */
+static size_t recv_dgram(struct socket* sock, struct msghdr* msg, int flags) {
+	struct pico_frame* f = pico_queue_peek(&sock->pico_socket->q_in);
+	if(!f) {
+		mutex_lock(&sock->lock);
+		sock->dgram_ready = false;
+		mutex_unlock(&sock->lock);
 		sc_errno = EAGAIN;
 		return -1;
 	}
 
-	int_enable();
-	while(!sock->read_buffer_length) {
-		if(sock->state == SOCK_CLOSED) {
-			sc_errno = ENOTCONN;
+	size_t len = f->payload_len;
+	size_t want = iov_total(msg);
+	msg->msg_flags = len > want ? MSG_TRUNC : 0;
+	msg->msg_controllen = 0;
+
+	// The sender address is only available once the datagram is dequeued
+	if(flags & MSG_PEEK) {
+		copy_iov(msg, f->payload, MIN(len, want), true);
+		msg->msg_namelen = 0;
+		return MIN(len, want);
+	}
+
+	// PicoTCP would leave the rest of a truncated datagram in the queue
+	uint8_t scratch;
+	uint8_t* buf = NULL;
+	void* dest = &scratch;
+	if(msg->msg_iovlen == 1 && want >= len && len) {
+		dest = msg->msg_iov[0].iov_base;
+	} else if(len) {
+		buf = kmalloc(len);
+		if(!buf) {
+			sc_errno = ENOMEM;
+			return -1;
+		}
+		dest = buf;
+	}
+
+	union pico_address addr;
+	uint16_t port;
+	int read = pico_socket_recvfrom(sock->pico_socket, dest, MAX(len, 1), &addr, &port);
+	if(read < 0) {
+		if(buf) {
+			kfree(buf);
+		}
+		sc_errno = pico_err;
+		return -1;
+	}
+
+	if(buf) {
+		copy_iov(msg, buf, MIN(read, want), true);
+		kfree(buf);
+	}
+
+	if(msg->msg_name) {
+		struct sockaddr_in sin;
+		net_conv_pico2bsd((struct sockaddr*)&sin, SOCKSIZE, &addr, port);
+		memcpy(msg->msg_name, &sin, MIN(msg->msg_namelen, SOCKSIZE));
+		msg->msg_namelen = SOCKSIZE;
+	}
+
+	if(!pico_queue_peek(&sock->pico_socket->q_in)) {
+		mutex_lock(&sock->lock);
+		sock->dgram_ready = false;
+		mutex_unlock(&sock->lock);
+	}
+	return MIN(read, want);
+}
+
+/* Receive up to num datagrams into msgs, and their lengths into lens. Waits
+ * for the first one unless the socket is nonblocking, then takes what is
+ * queued, all under one acquisition of net_pico_lock. Returns the number of
+ * datagrams received.
+ */
+static int recv_dgrams(struct socket* sock, struct msghdr** msgs, size_t* lens,
+	int num, int flags, int fp_flags) {
+
+	int done = 0;
+	while(!done) {
+		mutex_lock(&sock->lock);
+		while(!sock->dgram_ready) {
+			if(fp_flags & O_NONBLOCK || flags & MSG_DONTWAIT) {
+				mutex_unlock(&sock->lock);
+				sc_errno = EAGAIN;
+				return -1;
+			}
+			socket_wait(sock, &sock->read_wait);
+		}
+		mutex_unlock(&sock->lock);
+
+		mutex_lock(&net_pico_lock);
+		for(; done < num; done++) {
+			lens[done] = recv_dgram(sock, msgs[done], flags);
+			if(lens[done] == -1 || flags & MSG_PEEK) {
+				break;
+			}
+		}
+		mutex_unlock(&net_pico_lock);
+
+		// recv_dgram fails with EAGAIN once the queue is empty
+		if(done < num && lens[done] != -1) {
+			done++;
+		} else if(done < num && sc_errno != EAGAIN) {
+			return done ? done : -1;
+		}
+	}
+
+	net_wake();
+	sc_errno = 0;
+	return done;
+}
+
+// Needs to be called with net_pico_lock held
+static size_t send_dgram(struct socket* sock, struct msghdr* msg) {
+	size_t len = iov_total(msg);
+	uint8_t* buf = NULL;
+	void* src = msg->msg_iovlen ? msg->msg_iov[0].iov_base : NULL;
+	if(msg->msg_iovlen > 1) {
+		buf = kmalloc(len);
+		if(!buf) {
+			sc_errno = ENOMEM;
 			return -1;
 		}
-		if(sock->state == SOCK_RESET_BY_PEER) {
-			sc_errno = ECONNRESET;
+		copy_iov(msg, buf, len, false);
+		src = buf;
+	}
+
+	int written;
+	if(msg->msg_name) {
+		union pico_address addr = { .ip4 = { 0 } };
+		if(net_bsd_to_pico_addr(&addr, msg->msg_name, msg->msg_namelen) < 0) {
+			if(buf) {
+				kfree(buf);
+			}
+			sc_errno = EINVAL;
 			return -1;
 		}
 
-		scheduler_yield();
+		uint16_t port = net_bsd_to_pico_port(msg->msg_name, msg->msg_namelen);
+		written = pico_socket_sendto(sock->pico_socket, src, len, &addr, port);
+	} else {
+		written = pico_socket_write(sock->pico_socket, src, len);
 	}
-	int_disable();
 
-	if(size > sock->read_buffer_length) {
-		size = sock->read_buffer_length;
+	if(buf) {
+		kfree(buf);
 	}
-	memcpy(dest, sock->read_buffer, size);
 
-	if(!(recv_flags & MSG_PEEK)) {
-		sock->read_buffer_length -= size;
-		if(sock->read_buffer_length) {
-			memmove(sock->read_buffer, sock->read_buffer + size, sock->read_buffer_length);
+	if(written < 0) {
+		sc_errno = pico_err;
+		return -1;
+	}
+	return written;
+}
+
+/* Send num datagrams under one acquisition of net_pico_lock. Returns the
+ * number of datagrams sent, with their lengths in lens.
+ */
+static int send_dgrams(struct socket* sock, struct msghdr** msgs, size_t* lens, int num) {
+	int done = 0;
+	mutex_lock(&net_pico_lock);
+	for(; done < num; done++) {
+		lens[done] = send_dgram(sock, msgs[done]);
+		if(lens[done] == -1) {
+			break;
 		}
 	}
+	mutex_unlock(&net_pico_lock);
+	net_wake();
 
-	return size;
+	if(!done) {
+		return -1;
+	}
+	sc_errno = 0;
+	return done;
 }
 
 static size_t vfs_read_cb(struct vfs_callback_ctx* ctx, void* dest, size_t size) {
@@ -181,60 +461,106 @@ static size_t vfs_read_cb(struct vfs_callback_ctx* ctx, void* dest, size_t size)
 		return -1;
 	}
 
+	if(sock->dgram) {
+		struct iovec iov = { .iov_base = dest, .iov_len = size };
+		struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+		struct msghdr* msgs[1] = { &msg };
+		size_t len;
+		return recv_dgrams(sock, msgs, &len, 1, 0, ctx->fp->flags) < 0 ? -1 : len;
+	}
 	return do_recvfrom(sock, dest, size, ctx->fp->flags, 0, NULL, NULL);
 }
 
+// Addresses are only returned by recvmsg(), which newlib uses when asked for one
 int net_recvfrom(task_t* task, struct recvfrom_data* data, int struct_size) {
-	struct socket* sock = get_socket(task, data->sockfd);
-	if(!sock) {
+	vfs_file_t* fp = get_file(task, data->sockfd);
+	if(!fp) {
 		return -1;
 	}
 
 	vm_alloc_t alloc;
-	void* dest = vm_map(VM_KERNEL, &alloc, &task->vmem, data->dest,
-		data->size, VM_MAP_USER_ONLY | VM_RW);
-
+	void* dest = map_user(task, &alloc, data->dest, data->size);
 	if(!dest) {
-		task_signal(task, NULL, SIGSEGV);
-		sc_errno = EFAULT;
 		return -1;
 	}
 
-	size_t read = do_recvfrom(sock, dest, data->size,
-		0, data->flags, data->src_addr, data->addrlen);
+	size_t read;
+	struct socket* sock = (struct socket*)fp->mount_instance;
+	struct iovec iov = { .iov_base = dest, .iov_len = data->size };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	if(unix_is_socket(fp)) {
+		read = unix_recvmsg(task, fp, &msg, data->flags);
+	} else if(sock->dgram) {
+		struct msghdr* msgs[1] = { &msg };
+		if(recv_dgrams(sock, msgs, &read, 1, data->flags, fp->flags) < 0) {
+			read = -1;
+		}
+	} else {
+		read = do_recvfrom(sock, dest, data->size, fp->flags, data->flags, NULL, NULL);
+	}
 
-	// FIXME
-	//vm_free(&alloc);
+	vm_free(&alloc);
 	return read;
 }
 
-static size_t vfs_write_cb(struct vfs_callback_ctx* ctx, void* source, size_t size) {
-	struct socket* sock = (struct socket*)(ctx->fp->mount_instance);
-
-	int_enable();
-	while(!sock->can_write) {
-		if(sock->state == SOCK_CLOSED) {
-			sc_errno = ENOTCONN;
-			return -1;
+static size_t do_send(struct socket* sock, void* source, size_t size, int fp_flags) {
+	size_t done = 0;
+	while(done < size) {
+		mutex_lock(&sock->lock);
+		while(!sock->can_write) {
+			int err = 0;
+			if(sock->state == SOCK_CLOSED) {
+				err = ENOTCONN;
+			} else if(sock->state == SOCK_RESET_BY_PEER) {
+				err = ECONNRESET;
+			} else if(fp_flags & O_NONBLOCK) {
+				err = EAGAIN;
+			}
+
+			if(err) {
+				mutex_unlock(&sock->lock);
+				sc_errno = err;
+				return done ? done : -1;
+			}
+
+			socket_wait(sock, &sock->write_wait);
 		}
-		if(sock->state == SOCK_RESET_BY_PEER) {
-			sc_errno = ECONNRESET;
-			return -1;
+		mutex_unlock(&sock->lock);
+
+		mutex_lock(&net_pico_lock);
+		int written = pico_socket_write(sock->pico_socket, source + done, size - done);
+		if(written < 0) {
+			mutex_unlock(&net_pico_lock);
+			sc_errno = pico_err;
+			return done ? done : -1;
 		}
 
-		scheduler_yield();
-	}
-	int_disable();
+		/* The send queue is full, wait for PicoTCP to signal space. Done
+		 * before dropping net_pico_lock so a write event can't be missed.
+		 */
+		if(written < size - done) {
+			mutex_lock(&sock->lock);
+			sock->can_write = false;
+			mutex_unlock(&sock->lock);
+		}
+		mutex_unlock(&net_pico_lock);
 
-	if(!spinlock_get(&net_pico_lock, 200)) {
-		sc_errno = EAGAIN;
-		return -1;
+		done += written;
+		net_wake();
 	}
-	size_t written = pico_socket_write(sock->pico_socket, source, size);
-	spinlock_release(&net_pico_lock);
+	return done;
+}
 
-	sc_errno = pico_err;
-	return written;
+static size_t vfs_write_cb(struct vfs_callback_ctx* ctx, void* source, size_t size) {
+	struct socket* sock = (struct socket*)ctx->fp->mount_instance;
+	if(sock->dgram) {
+		struct iovec iov = { .iov_base = source, .iov_len = size };
+		struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+		struct msghdr* msgs[1] = { &msg };
+		size_t len;
+		return send_dgrams(sock, msgs, &len, 1) < 0 ? -1 : len;
+	}
+	return do_send(sock, source, size, ctx->fp->flags);
 }
 
 void* lp = 0;
@@ -249,13 +575,10 @@ static int vfs_poll_cb(struct vfs_callback_ctx* ctx, int events) {
 	//}
 
 	//debug("poll %#x pico %#x\n", sock, sock->pico_socket);
-	if(!spinlock_get(&net_pico_lock, 200)) {
-		sc_errno = EAGAIN;
-		return -1;
-	}
+	mutex_lock(&sock->lock);
 
-	if(events & POLLIN && (sock->conn_requests || sock->read_buffer_length)) {
-		debug("POLLIN %#x\n", sock->read_buffer_length);
+	if(events & POLLIN && (sock->conn_requests || sock->rbuf_len || sock->dgram_ready)) {
+		debug("POLLIN %#x\n", sock->rbuf_len);
 		ret |= POLLIN;
 	}
 	if(events & POLLOUT && sock->can_write) {
@@ -263,27 +586,27 @@ static int vfs_poll_cb(struct vfs_callback_ctx* ctx, int events) {
 		ret |= POLLOUT;
 	}
 
-	spinlock_release(&net_pico_lock);
+	mutex_unlock(&sock->lock);
 	return ret;
 }
 
 int net_vfs_close_cb(vfs_file_t* fp) {
+	if(unix_is_socket(fp)) {
+		return unix_close(fp);
+	}
+
 	// Not as simple as that – may still be open in fork. Need to do
 	// refcounting with VFS layer tools
 /*	struct socket* sock = (struct socket*)(fp->mount_instance);
 
-	if(!spinlock_get(&net_pico_lock, 200)) {
-		sc_errno = EAGAIN;
-		return -1;
-	}
-
+	mutex_lock(&net_pico_lock);
 	if(pico_socket_close(sock->pico_socket) < 0) {
-		spinlock_release(&net_pico_lock);
+		mutex_unlock(&net_pico_lock);
 		sc_errno = pico_err;
 		return -1;
 	}
 
-	spinlock_release(&net_pico_lock);
+	mutex_unlock(&net_pico_lock);
 
 	// FIXME Should this actually be set here or via the callback afterwards
 	sock->state = SOCK_CLOSED;
@@ -291,10 +614,91 @@ int net_vfs_close_cb(vfs_file_t* fp) {
 	return 0;
 }
 
-static vfs_file_t* new_socket_fd(task_t* task, struct pico_socket* pico_sock, int state) {
+// Called for sockets in the file table of a new fork
+void net_vfs_fork_cb(vfs_file_t* fp) {
+	if(unix_is_socket(fp)) {
+		unix_fork(fp);
+	}
+}
+
+/* Called by the scheduler for the sockets of exiting tasks, so this can't
+ * take mutexes or free memory.
+ */
+void net_vfs_exit_cb(vfs_file_t* fp) {
+	if(unix_is_socket(fp)) {
+		unix_exit(fp);
+	}
+}
+
+// Needs to be called with net_pico_lock held
+static int set_bufsize(struct socket* sock, int option, uint32_t size) {
+	if(size < SOCKBUF_MIN || size > SOCKBUF_MAX) {
+		sc_errno = EINVAL;
+		return -1;
+	}
+
+	if(option == SO_SNDBUF) {
+		if(pico_socket_setoption(sock->pico_socket, PICO_SOCKET_OPT_SNDBUF, &size) < 0) {
+			sc_errno = pico_err;
+			return -1;
+		}
+		sock->sndbuf = size;
+		return 0;
+	}
+
+	if(sock->dgram) {
+		sock->rbuf_size = size;
+		pico_socket_setoption(sock->pico_socket, PICO_SOCKET_OPT_RCVBUF, &size);
+		return 0;
+	}
+
+	mutex_lock(&sock->lock);
+
+	// Doesn't shrink the ring below what it currently holds
+	size = MAX(size, sock->rbuf_len);
+	uint8_t* rbuf = kmalloc(size);
+	if(!rbuf) {
+		mutex_unlock(&sock->lock);
+		sc_errno = ENOMEM;
+		return -1;
+	}
+
+	if(sock->rbuf) {
+		drain_rbuf(sock, rbuf, sock->rbuf_len, true);
+		kfree(sock->rbuf);
+	}
+
+	sock->rbuf = rbuf;
+	sock->rbuf_size = size;
+	sock->rbuf_start = 0;
+	mutex_unlock(&sock->lock);
+
+	// Also limits the queue in PicoTCP and with it the TCP window
+	pico_socket_setoption(sock->pico_socket, PICO_SOCKET_OPT_RCVBUF, &size);
+	return 0;
+}
+
+// Needs to be called with net_pico_lock held
+static vfs_file_t* new_socket_fd(task_t* task, struct pico_socket* pico_sock, bool dgram,
+	int state, size_t rcvbuf, size_t sndbuf) {
+
 	struct socket* sock = (struct socket*)zmalloc(sizeof(struct socket));
 	sock->pico_socket = pico_sock;
 	sock->state = state;
+	sock->dgram = dgram;
+
+	// PicoTCP doesn't signal write events for UDP
+	sock->can_write = dgram;
+	mutex_init(&sock->lock, &net_socket_lock_stats);
+	waitqueue_init(&sock->read_wait);
+	waitqueue_init(&sock->write_wait);
+	if(set_bufsize(sock, SO_RCVBUF, rcvbuf) < 0) {
+		kfree(sock);
+		return NULL;
+	}
+	if(sndbuf) {
+		set_bufsize(sock, SO_SNDBUF, sndbuf);
+	}
 	pico_sock->priv = (void*)sock;
 
 	vfs_file_t* fd = vfs_alloc_fileno(task, 3);
@@ -304,6 +708,7 @@ static vfs_file_t* new_socket_fd(task_t* task, struct pico_socket* pico_sock, in
 
 	fd->type = FT_IFSOCK;
 	fd->flags = O_RDWR;
+	fd->meta = AF_INET;
 	fd->callbacks.read = vfs_read_cb;
 	fd->callbacks.write = vfs_write_cb;
 	fd->callbacks.poll = vfs_poll_cb;
@@ -314,6 +719,7 @@ static vfs_file_t* new_socket_fd(task_t* task, struct pico_socket* pico_sock, in
 
 int net_socket(task_t* task, int domain, int type, int protocol) {
 	switch(domain) {
+		case AF_UNIX: return unix_socket(task, type);
 		case AF_INET: domain = PICO_PROTO_IPV4; break;
 		case AF_INET6: domain = PICO_PROTO_IPV6; break;
 		default:
@@ -329,19 +735,17 @@ int net_socket(task_t* task, int domain, int type, int protocol) {
 			return -1;
 	}
 
-	if(!spinlock_get(&net_pico_lock, 200)) {
-		sc_errno = EAGAIN;
-		return -1;
-	}
-
+	mutex_lock(&net_pico_lock);
 	struct pico_socket* pico_sock = pico_socket_open(domain, type, &socket_cb);
 	if(!pico_sock) {
+		mutex_unlock(&net_pico_lock);
 		sc_errno = pico_err;
 		return -1;
 	}
 
-	spinlock_release(&net_pico_lock);
-	vfs_file_t* fd = new_socket_fd(task, pico_sock, SOCK_OPEN);
+	vfs_file_t* fd = new_socket_fd(task, pico_sock, type == PICO_PROTO_UDP, SOCK_OPEN,
+		RCVBUF_DEFAULT, 0);
+	mutex_unlock(&net_pico_lock);
 	if(!fd) {
 		return -1;
 	}
@@ -349,13 +753,27 @@ int net_socket(task_t* task, int domain, int type, int protocol) {
 	return fd->num;
 }
 
+int net_socketpair(task_t* task, int domain, int type, int fds[2]) {
+	if(domain != AF_UNIX) {
+		sc_errno = EOPNOTSUPP;
+		return -1;
+	}
+	return unix_socketpair(task, type, fds);
+}
+
 int net_bind(task_t* task, int sockfd, const struct sockaddr* addr,
 	socklen_t addrlen) {
-	struct socket* sock = get_socket(task, sockfd);
-	if(!sock) {
+	vfs_file_t* fp = get_file(task, sockfd);
+	if(!fp) {
 		return -1;
 	}
 
+	if(unix_is_socket(fp)) {
+		return unix_bind(task, fp, addr, addrlen);
+	}
+
+	struct socket* sock = (struct socket*)fp->mount_instance;
+
 	uint16_t port = net_bsd_to_pico_port(addr, addrlen);
 	if(endian_swap16(port) <= 1024 && task->euid) {
 		sc_errno = EACCES;
@@ -368,56 +786,73 @@ int net_bind(task_t* task, int sockfd, const struct sockaddr* addr,
 		return -1;
 	}
 
-	if(!spinlock_get(&net_pico_lock, 200)) {
-		sc_errno = EAGAIN;
-		return -1;
-	}
-
+	mutex_lock(&net_pico_lock);
 	if(pico_socket_bind(sock->pico_socket, &pico_addr, &port) < 0) {
-		spinlock_release(&net_pico_lock);
+		mutex_unlock(&net_pico_lock);
 		sc_errno = pico_err;
 		return -1;
 	}
 
-	spinlock_release(&net_pico_lock);
+	mutex_lock(&sock->lock);
 	sock->state = SOCK_BOUND;
+	mutex_unlock(&sock->lock);
+	mutex_unlock(&net_pico_lock);
 	return 0;
 }
 
 int net_listen(task_t* task, int sockfd, int backlog) {
-	struct socket* sock = get_socket(task, sockfd);
-	if(!sock) {
+	vfs_file_t* fp = get_file(task, sockfd);
+	if(!fp) {
 		return -1;
 	}
 
-	if(backlog < 4) {
-		backlog = 4;
+	if(unix_is_socket(fp)) {
+		return unix_listen(fp, backlog);
 	}
 
-	if(!spinlock_get(&net_pico_lock, 200)) {
-		sc_errno = EAGAIN;
-		return -1;
+	struct socket* sock = (struct socket*)fp->mount_instance;
+
+	if(backlog < 4) {
+		backlog = 4;
 	}
 
+	mutex_lock(&net_pico_lock);
 	if(pico_socket_listen(sock->pico_socket, backlog) < 0) {
-		spinlock_release(&net_pico_lock);
+		mutex_unlock(&net_pico_lock);
 		sc_errno = pico_err;
 		return -1;
 	}
 
-	spinlock_release(&net_pico_lock);
+	mutex_lock(&sock->lock);
 	sock->state = SOCK_LISTEN;
+	mutex_unlock(&sock->lock);
+	mutex_unlock(&net_pico_lock);
 	return 0;
 }
 
 int net_accept(task_t* task, int sockfd, struct sockaddr* oaddr,
 	socklen_t* addrlen) {
 
-	struct socket* sock = get_socket(task, sockfd);
-	if(!sock) {
+	vfs_file_t* fp = get_file(task, sockfd);
+	if(!fp) {
 		return -1;
 	}
 
+	if(unix_is_socket(fp)) {
+		vm_alloc_t alloc;
+		struct sockaddr* addr = NULL;
+		if(oaddr && addrlen && !(addr = map_user(task, &alloc, oaddr, *addrlen))) {
+			return -1;
+		}
+
+		int r = unix_accept(task, fp, addr, addrlen);
+		if(addr) {
+			vm_free(&alloc);
+		}
+		return r;
+	}
+
+	struct socket* sock = (struct socket*)fp->mount_instance;
 	if(sock->state == SOCK_CONNECTED) {
 		sc_errno = EBADF;
 		return -1;
@@ -439,24 +874,28 @@ int net_accept(task_t* task, int sockfd, struct sockaddr* oaddr,
 		}
 	}
 
-	int_enable();
+	mutex_lock(&sock->lock);
 	while(!sock->conn_requests) {
-		asm("hlt\n");
+		socket_wait(sock, &sock->read_wait);
 	}
-	int_disable();
+	mutex_unlock(&sock->lock);
 
-	if(!spinlock_get(&net_pico_lock, 200)) {
+	mutex_lock(&net_pico_lock);
+	union pico_address pico_addr;
+	uint16_t port;
+	struct pico_socket* pico_sock = pico_socket_accept(sock->pico_socket, &pico_addr, &port);
+	if(!pico_sock) {
+		mutex_unlock(&net_pico_lock);
+		debug("accept done, but no pico sock\n");
 		// FIXME
 		//vm_free(&alloc);
-
-		sc_errno = EAGAIN;
+		sc_errno = pico_err;
 		return -1;
 	}
 
-	union pico_address pico_addr;
-	uint16_t port;
-	struct pico_socket* pico_sock = pico_socket_accept(sock->pico_socket, &pico_addr, &port);
-	spinlock_release(&net_pico_lock);
+	mutex_lock(&sock->lock);
+	sock->conn_requests--;
+	mutex_unlock(&sock->lock);
 
 	if(addr) {
 		net_conv_pico2bsd(addr, SOCKSIZE, &pico_addr, port);
@@ -466,35 +905,57 @@ int net_accept(task_t* task, int sockfd, struct sockaddr* oaddr,
 	int yes = 1;
 	pico_socket_setoption(pico_sock, PICO_TCP_NODELAY, &yes);
 
-	if(!pico_sock) {
-		debug("accept done, but no pico sock\n");
-		// FIXME
-		//vm_free(&alloc);
-		sc_errno = pico_err;
-		return -1;
-	}
-
-	vfs_file_t* new_fd = new_socket_fd(task, pico_sock, SOCK_CONNECTED);
+	// Connections inherit the buffer sizes of the listening socket
+	vfs_file_t* new_fd = new_socket_fd(task, pico_sock, false, SOCK_CONNECTED,
+		sock->rbuf_size, sock->sndbuf);
 	if(!new_fd) {
+		mutex_unlock(&net_pico_lock);
 		return -1;
 	}
 
+	// Data may have arrived before the socket was set up
+	struct socket* new_sock = (struct socket*)new_fd->mount_instance;
+	mutex_lock(&new_sock->lock);
+	fill_rbuf(new_sock);
+	mutex_unlock(&new_sock->lock);
+	mutex_unlock(&net_pico_lock);
+
 	debug("accept %#x, pico %#x\n", pico_sock->priv, pico_sock);
-	sock->conn_requests--;
 
 	// FIXME
 	//vm_free(&alloc);
 	return new_fd->num;
 }
 
+// Returns the name of a unix socket or its peer
+static int get_unix_name(task_t* task, vfs_file_t* fp, bool peer, struct sockaddr* oaddr,
+	socklen_t* addrlen) {
+
+	vm_alloc_t alloc;
+	struct sockaddr* addr = map_user(task, &alloc, oaddr, *addrlen);
+	if(!addr) {
+		return -1;
+	}
+
+	int r = unix_getname(fp, peer, addr, addrlen);
+	vm_free(&alloc);
+	return r;
+}
+
 int net_getpeername(task_t* task, int sockfd, struct sockaddr* osa,
 	socklen_t* addrlen) {
 
-	struct socket* sock = get_socket(task, sockfd);
-	if(!sock) {
+	vfs_file_t* fp = get_file(task, sockfd);
+	if(!fp) {
 		return -1;
 	}
 
+	if(unix_is_socket(fp)) {
+		return get_unix_name(task, fp, true, osa, addrlen);
+	}
+
+	struct socket* sock = (struct socket*)fp->mount_instance;
+
 	if(*addrlen < SOCKSIZE) {
 		sc_errno = ENOBUFS;
 		return -1;
@@ -516,10 +977,13 @@ int net_getpeername(task_t* task, int sockfd, struct sockaddr* osa,
 	union pico_address addr;
 	uint16_t port;
 	uint16_t proto;
+	mutex_lock(&net_pico_lock);
 	if(pico_socket_getpeername(sock->pico_socket, &addr, &port, &proto) < 0) {
+		mutex_unlock(&net_pico_lock);
 		sc_errno = pico_err;
 		return -1;
 	}
+	mutex_unlock(&net_pico_lock);
 
 	int r = net_conv_pico2bsd(sa, SOCKSIZE, &addr, port);
 
@@ -531,11 +995,17 @@ int net_getpeername(task_t* task, int sockfd, struct sockaddr* osa,
 int net_getsockname(task_t* task, int sockfd, struct sockaddr* oaddr,
 	socklen_t* addrlen) {
 
-	struct socket* sock = get_socket(task, sockfd);
-	if(!sock) {
+	vfs_file_t* fp = get_file(task, sockfd);
+	if(!fp) {
 		return -1;
 	}
 
+	if(unix_is_socket(fp)) {
+		return get_unix_name(task, fp, false, oaddr, addrlen);
+	}
+
+	struct socket* sock = (struct socket*)fp->mount_instance;
+
 	/* Since sockaddr is variable length and the length is passed in a pointer,
 	 * we can't use the syscall system's automagic kernel memory mapping.
 	 */
@@ -549,8 +1019,10 @@ int net_getsockname(task_t* task, int sockfd, struct sockaddr* oaddr,
 		return -1;
 	}
 
+	mutex_lock(&net_pico_lock);
 	int r = net_conv_pico2bsd(addr, SOCKSIZE, &sock->pico_socket->local_addr,
 		sock->pico_socket->local_port);
+	mutex_unlock(&net_pico_lock);
 
 	// FIXME
 	//vm_free(&alloc);
@@ -587,10 +1059,14 @@ static int do_resolve(task_t* task, const char* data, char* result, int result_l
 	state->dest = result;
 	state->dest_len = result_len;
 
+	mutex_lock(&net_pico_lock);
 	if((mode ? pico_dns_client_getaddr : pico_dns_client_getname)(data, dns_cb, state) != 0) {
+		mutex_unlock(&net_pico_lock);
 		sc_errno = pico_err;
 		return -1;
 	}
+	mutex_unlock(&net_pico_lock);
+	net_wake();
 
 	uint32_t end_tick = timer_tick + (5 * timer_rate);
 	int_enable();
@@ -625,11 +1101,17 @@ int net_getname(task_t* task, const char* ip, char* result, int result_len) {
 }
 
 int net_connect(task_t* task, int sockfd, const struct sockaddr* sa, uint32_t addrlen) {
-	struct socket* sock = get_socket(task, sockfd);
-	if(!sock) {
+	vfs_file_t* fp = get_file(task, sockfd);
+	if(!fp) {
 		return -1;
 	}
 
+	if(unix_is_socket(fp)) {
+		return unix_connect(task, fp, sa, addrlen);
+	}
+
+	struct socket* sock = (struct socket*)fp->mount_instance;
+
 	if(sa->sa_family != AF_INET || addrlen != sizeof(struct sockaddr_in)) {
 		sc_errno = EAFNOSUPPORT;
 		return -1;
@@ -647,20 +1129,435 @@ int net_connect(task_t* task, int sockfd, const struct sockaddr* sa, uint32_t ad
 		return -1;
 	}
 
-	if(!spinlock_get(&net_pico_lock, 200)) {
-		sc_errno = EAGAIN;
-		return -1;
-	}
-
+	mutex_lock(&net_pico_lock);
 	if(pico_socket_connect(sock->pico_socket, &pico_addr, port) < 0) {
-		spinlock_release(&net_pico_lock);
+		mutex_unlock(&net_pico_lock);
 		sc_errno = pico_err;
 		return -1;
 	}
 
-	spinlock_release(&net_pico_lock);
+	mutex_lock(&sock->lock);
 	sock->state = SOCK_CONNECTED;
+	mutex_unlock(&sock->lock);
+	mutex_unlock(&net_pico_lock);
+	net_wake();
 	return 0;
 }
 
+int net_setsockopt(task_t* task, struct sockopt_data* data, int struct_size) {
+	vfs_file_t* fp = get_file(task, data->sockfd);
+	if(!fp) {
+		return -1;
+	}
+
+	if(unix_is_socket(fp)) {
+		return unix_setsockopt(fp, data);
+	}
+
+	struct socket* sock = (struct socket*)fp->mount_instance;
+
+	if(data->level != SOL_SOCKET) {
+		sc_errno = ENOPROTOOPT;
+		return -1;
+	}
+
+	switch(data->optname) {
+		case SO_RCVBUF:
+		case SO_SNDBUF: {
+			mutex_lock(&net_pico_lock);
+			int r = set_bufsize(sock, data->optname, data->value);
+			mutex_unlock(&net_pico_lock);
+			return r;
+		}
+		default:
+			sc_errno = ENOPROTOOPT;
+			return -1;
+	}
+}
+
+int net_getsockopt(task_t* task, struct sockopt_data* data, int struct_size) {
+	vfs_file_t* fp = get_file(task, data->sockfd);
+	if(!fp) {
+		return -1;
+	}
+
+	if(unix_is_socket(fp)) {
+		return unix_getsockopt(fp, data);
+	}
+
+	struct socket* sock = (struct socket*)fp->mount_instance;
+
+	if(data->level != SOL_SOCKET) {
+		sc_errno = ENOPROTOOPT;
+		return -1;
+	}
+
+	switch(data->optname) {
+		case SO_RCVBUF:
+			data->value = sock->rbuf_size;
+			return 0;
+		case SO_SNDBUF:
+			if(!sock->sndbuf) {
+				uint32_t size = 0;
+				mutex_lock(&net_pico_lock);
+				pico_socket_getoption(sock->pico_socket, PICO_SOCKET_OPT_SNDBUF, &size);
+				mutex_unlock(&net_pico_lock);
+				data->value = size;
+			} else {
+				data->value = sock->sndbuf;
+			}
+			return 0;
+		default:
+			sc_errno = ENOPROTOOPT;
+			return -1;
+	}
+}
+
+// A msghdr from userland with its buffers mapped into kernel memory
+struct mapped_msg {
+	struct msghdr msg;
+	struct iovec* iov;
+	int num_allocs;
+	vm_alloc_t allocs[];
+};
+
+static void unmap_msg(struct mapped_msg* map) {
+	for(int i = 0; i < map->num_allocs; i++) {
+		vm_free(&map->allocs[i]);
+	}
+	kfree(map);
+}
+
+static void* map_msg_buf(task_t* task, struct mapped_msg* map, void* uaddr, size_t size) {
+	if(!uaddr || !size) {
+		return NULL;
+	}
+	return map_user(task, &map->allocs[map->num_allocs++], uaddr, size);
+}
+
+static struct mapped_msg* map_msg(task_t* task, struct msghdr* umsg) {
+	int iovlen = umsg->msg_iovlen;
+	if(iovlen < 0 || iovlen > MSG_IOV_MAX) {
+		sc_errno = EMSGSIZE;
+		return NULL;
+	}
+
+	// One mapping for each iovec, the iovec array, the name and control data
+	size_t allocs_size = sizeof(vm_alloc_t) * (iovlen + 3);
+	struct mapped_msg* map = kmalloc(sizeof(struct mapped_msg) + allocs_size
+		+ sizeof(struct iovec) * iovlen);
+	if(!map) {
+		sc_errno = ENOMEM;
+		return NULL;
+	}
+
+	map->num_allocs = 0;
+	map->iov = (struct iovec*)((uint8_t*)map->allocs + allocs_size);
+	memcpy(&map->msg, umsg, sizeof(struct msghdr));
+	map->msg.msg_iov = map->iov;
+	map->msg.msg_flags = 0;
+
+	struct iovec* uiov = NULL;
+	if(iovlen) {
+		uiov = map_msg_buf(task, map, umsg->msg_iov, sizeof(struct iovec) * iovlen);
+		if(!uiov) {
+			goto fail;
+		}
+	}
+
+	for(int i = 0; i < iovlen; i++) {
+		map->iov[i].iov_len = uiov[i].iov_len;
+		map->iov[i].iov_base = map_msg_buf(task, map, uiov[i].iov_base, uiov[i].iov_len);
+		if(!map->iov[i].iov_base && uiov[i].iov_len) {
+			goto fail;
+		}
+	}
+
+	map->msg.msg_name = map_msg_buf(task, map, umsg->msg_name, umsg->msg_namelen);
+	if(!map->msg.msg_name) {
+		if(umsg->msg_name && umsg->msg_namelen) {
+			goto fail;
+		}
+		map->msg.msg_namelen = 0;
+	}
+
+	map->msg.msg_control = map_msg_buf(task, map, umsg->msg_control, umsg->msg_controllen);
+	if(!map->msg.msg_control) {
+		if(umsg->msg_control && umsg->msg_controllen) {
+			goto fail;
+		}
+		map->msg.msg_controllen = 0;
+	}
+	return map;
+
+fail:
+	unmap_msg(map);
+	return NULL;
+}
+
+// Update the fields of the userland msghdr that recvmsg returns
+static void put_msg(struct msghdr* umsg, struct msghdr* msg) {
+	umsg->msg_namelen = msg->msg_namelen;
+	umsg->msg_controllen = msg->msg_controllen;
+	umsg->msg_flags = msg->msg_flags;
+}
+
+// Send one message on a unix or TCP socket
+static size_t send_msg(task_t* task, vfs_file_t* fp, struct msghdr* msg, int flags) {
+	if(unix_is_socket(fp)) {
+		return unix_sendmsg(task, fp, msg, flags);
+	}
+
+	struct socket* sock = (struct socket*)fp->mount_instance;
+	int fp_flags = fp->flags | (flags & MSG_DONTWAIT ? O_NONBLOCK : 0);
+	size_t done = 0;
+	for(int i = 0; i < msg->msg_iovlen; i++) {
+		size_t len = msg->msg_iov[i].iov_len;
+		size_t written = do_send(sock, msg->msg_iov[i].iov_base, len, fp_flags);
+		if(written == -1) {
+			return done ? done : -1;
+		}
+
+		done += written;
+		if(written < len) {
+			break;
+		}
+	}
+	return done;
+}
+
+// Receive one message on a unix or TCP socket
+static size_t recv_msg(task_t* task, vfs_file_t* fp, struct msghdr* msg, int flags) {
+	if(unix_is_socket(fp)) {
+		return unix_recvmsg(task, fp, msg, flags);
+	}
+
+	struct socket* sock = (struct socket*)fp->mount_instance;
+	msg->msg_namelen = 0;
+	msg->msg_controllen = 0;
+
+	// Only waits for the first chunk, then takes what is there
+	int fp_flags = fp->flags | (flags & MSG_DONTWAIT ? O_NONBLOCK : 0);
+	size_t done = 0;
+	for(int i = 0; i < msg->msg_iovlen; i++) {
+		size_t len = msg->msg_iov[i].iov_len;
+		if(!len) {
+			continue;
+		}
+
+		size_t read = do_recvfrom(sock, msg->msg_iov[i].iov_base, len,
+			fp_flags, flags, NULL, NULL);
+		if(read == -1) {
+			if(!done) {
+				return -1;
+			}
+			sc_errno = 0;
+			break;
+		}
+
+		done += read;
+		fp_flags |= O_NONBLOCK;
+		if(read < len || flags & MSG_PEEK) {
+			break;
+		}
+	}
+	return done;
+}
+
+int net_sendmsg(task_t* task, int sockfd, struct msghdr* umsg, int flags) {
+	vfs_file_t* fp = get_file(task, sockfd);
+	if(!fp) {
+		return -1;
+	}
+
+	struct mapped_msg* map = map_msg(task, umsg);
+	if(!map) {
+		return -1;
+	}
+
+	size_t done;
+	struct socket* sock = (struct socket*)fp->mount_instance;
+	if(!unix_is_socket(fp) && sock->dgram) {
+		struct msghdr* msgs[1] = { &map->msg };
+		if(send_dgrams(sock, msgs, &done, 1) < 0) {
+			done = -1;
+		}
+	} else {
+		done = send_msg(task, fp, &map->msg, flags);
+	}
+
+	unmap_msg(map);
+	return done;
+}
+
+int net_recvmsg(task_t* task, int sockfd, struct msghdr* umsg, int flags) {
+	vfs_file_t* fp = get_file(task, sockfd);
+	if(!fp) {
+		return -1;
+	}
+
+	struct mapped_msg* map = map_msg(task, umsg);
+	if(!map) {
+		return -1;
+	}
+
+	size_t done;
+	struct socket* sock = (struct socket*)fp->mount_instance;
+	if(!unix_is_socket(fp) && sock->dgram) {
+		struct msghdr* msgs[1] = { &map->msg };
+		if(recv_dgrams(sock, msgs, &done, 1, flags, fp->flags) < 0) {
+			done = -1;
+		}
+	} else {
+		done = recv_msg(task, fp, &map->msg, flags);
+	}
+
+	if(done != -1) {
+		put_msg(umsg, &map->msg);
+	}
+
+	unmap_msg(map);
+	return done;
+}
+
+/* Map the messages of a sendmmsg/recvmmsg call. Returns the number of
+ * messages that could be mapped, and maps the message array into vec_alloc.
+ */
+static int map_mmsg(task_t* task, struct mmsg_data* data, vm_alloc_t* vec_alloc,
+	struct mmsghdr** vec, struct mapped_msg** maps, struct msghdr** msgs) {
+
+	int num = MIN(data->vlen, MMSG_MAX);
+	*vec = map_user(task, vec_alloc, data->msgvec, sizeof(struct mmsghdr) * num);
+	if(!*vec) {
+		return -1;
+	}
+
+	for(int i = 0; i < num; i++) {
+		maps[i] = map_msg(task, &(*vec)[i].msg_hdr);
+		if(!maps[i]) {
+			if(!i) {
+				vm_free(vec_alloc);
+				return -1;
+			}
+			return i;
+		}
+		msgs[i] = &maps[i]->msg;
+	}
+	return num;
+}
+
+static void unmap_mmsg(vm_alloc_t* vec_alloc, struct mapped_msg** maps, int num) {
+	for(int i = 0; i < num; i++) {
+		unmap_msg(maps[i]);
+	}
+	vm_free(vec_alloc);
+}
+
+/* Send multiple messages in one syscall. For UDP sockets, all datagrams are
+ * passed to PicoTCP under one acquisition of net_pico_lock.
+ */
+int net_sendmmsg(task_t* task, struct mmsg_data* data, int struct_size) {
+	vfs_file_t* fp = get_file(task, data->sockfd);
+	if(!fp) {
+		return -1;
+	}
+
+	if(!data->vlen) {
+		return 0;
+	}
+
+	vm_alloc_t vec_alloc;
+	struct mmsghdr* vec;
+	struct mapped_msg* maps[MMSG_MAX];
+	struct msghdr* msgs[MMSG_MAX];
+	size_t lens[MMSG_MAX];
+	int num = map_mmsg(task, data, &vec_alloc, &vec, maps, msgs);
+	if(num < 0) {
+		return -1;
+	}
+
+	int done = 0;
+	struct socket* sock = (struct socket*)fp->mount_instance;
+	if(!unix_is_socket(fp) && sock->dgram) {
+		done = send_dgrams(sock, msgs, lens, num);
+	} else {
+		for(; done < num; done++) {
+			lens[done] = send_msg(task, fp, msgs[done], data->flags);
+			if(lens[done] == -1) {
+				break;
+			}
+		}
+	}
+
+	for(int i = 0; i < done; i++) {
+		vec[i].msg_len = lens[i];
+	}
+
+	unmap_mmsg(&vec_alloc, maps, num);
+	if(done > 0) {
+		sc_errno = 0;
+		return done;
+	}
+	return -1;
+}
+
+/* Receive multiple messages in one syscall. Waits for the first message
+ * unless the socket is nonblocking or MSG_DONTWAIT is set, then returns
+ * what is available right away. For UDP sockets, all datagrams are taken from
+ * PicoTCP under one acquisition of net_pico_lock.
+ */
+int net_recvmmsg(task_t* task, struct mmsg_data* data, int struct_size) {
+	vfs_file_t* fp = get_file(task, data->sockfd);
+	if(!fp) {
+		return -1;
+	}
+
+	if(!data->vlen) {
+		return 0;
+	}
+
+	vm_alloc_t vec_alloc;
+	struct mmsghdr* vec;
+	struct mapped_msg* maps[MMSG_MAX];
+	struct msghdr* msgs[MMSG_MAX];
+	size_t lens[MMSG_MAX];
+	int num = map_mmsg(task, data, &vec_alloc, &vec, maps, msgs);
+	if(num < 0) {
+		return -1;
+	}
+
+	int done = 0;
+	struct socket* sock = (struct socket*)fp->mount_instance;
+	if(!unix_is_socket(fp) && sock->dgram) {
+		done = recv_dgrams(sock, msgs, lens, num, data->flags, fp->flags);
+	} else {
+		int flags = data->flags;
+		for(; done < num; done++) {
+			lens[done] = recv_msg(task, fp, msgs[done], flags);
+			if(lens[done] == -1) {
+				break;
+			}
+
+			// End of file
+			if(!lens[done]) {
+				done++;
+				break;
+			}
+			flags |= MSG_DONTWAIT;
+		}
+	}
+
+	for(int i = 0; i < done; i++) {
+		put_msg(&vec[i].msg_hdr, msgs[i]);
+		vec[i].msg_len = lens[i];
+	}
+
+	unmap_mmsg(&vec_alloc, maps, num);
+	if(done > 0) {
+		sc_errno = 0;
+		return done;
+	}
+	return -1;
+}
+
 #endif /* ENABLE_PICOTCP */
@@ -27,7 +27,8 @@
 
 #define SOCK_SEQPACKET 5
 
-#define SOL_SOCKET 0
+// Needs to match newlib
+#define SOL_SOCKET 1
 
 #define SO_DEBUG 1
 #define SO_BROADCAST 2
@@ -43,6 +44,9 @@
 #define SO_SNDTIMEO 12
 #define SO_REUSEADDR 13
 
+// Needs to match newlib
+#define SCM_RIGHTS 1
+
 #define MSG_CTRUNC 1
 #define MSG_DONTROUTE 2
 #define MSG_EOR 4
@@ -51,6 +55,7 @@
 #define MSG_PEEK 32
 #define MSG_TRUNC 64
 #define MSG_WAITALL 128
+#define MSG_DONTWAIT 256
 
 #define AF_UNSPEC 0
 #define AF_INET 1
@@ -93,6 +98,13 @@ struct sockaddr_in {
 	char sin_zero[8];
 };
 
+#define UNIX_PATH_MAX 200
+
+struct sockaddr_un {
+	sa_family_t sun_family;
+	char sun_path[UNIX_PATH_MAX];
+};
+
 struct sockaddr_in6 {
 	sa_family_t sin6_family;
 	in_port_t sin6_port;
@@ -135,7 +147,62 @@ struct recvfrom_data {
 	socklen_t *addrlen;
 };
 
+// Keep in sync with newlib
+struct iovec {
+	void* iov_base;
+	size_t iov_len;
+};
+
+struct msghdr {
+	void* msg_name;
+	socklen_t msg_namelen;
+	struct iovec* msg_iov;
+	int msg_iovlen;
+	void* msg_control;
+	socklen_t msg_controllen;
+	int msg_flags;
+};
+
+struct cmsghdr {
+	socklen_t cmsg_len;
+	int cmsg_level;
+	int cmsg_type;
+};
+
+#define CMSG_ALIGN(len) ALIGN(len, sizeof(socklen_t))
+#define CMSG_DATA(cmsg) ((uint8_t*)(cmsg) + CMSG_ALIGN(sizeof(struct cmsghdr)))
+#define CMSG_LEN(len) (CMSG_ALIGN(sizeof(struct cmsghdr)) + (len))
+#define CMSG_SPACE(len) (CMSG_ALIGN(sizeof(struct cmsghdr)) + CMSG_ALIGN(len))
+
+// Upper limit for msg_iovlen
+#define MSG_IOV_MAX 64
+
+struct mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+};
+
+// Messages handled per sendmmsg/recvmmsg call, the rest is left for the next
+#define MMSG_MAX 64
+
+struct mmsg_data {
+	int sockfd;
+	struct mmsghdr* msgvec;
+	unsigned int vlen;
+	int flags;
+};
+
+// Only integer options are supported
+struct sockopt_data {
+	int sockfd;
+	int level;
+	int optname;
+	int value;
+};
+
 int net_vfs_close_cb(vfs_file_t* fp);
+void net_vfs_fork_cb(vfs_file_t* fp);
+void net_vfs_exit_cb(vfs_file_t* fp);
 int net_recvfrom(task_t* task, struct recvfrom_data* data, int struct_size);
 int net_socket(task_t* task, int domain, int type, int protocol);
 int net_bind(task_t* task, int sockfd, const struct sockaddr* addr,
@@ -150,3 +217,10 @@ int net_getsockname(task_t* task, int sockfd, struct sockaddr* addr,
 int net_getaddr(task_t* task, const char* host, char* result, int result_len);
 int net_getname(task_t* task, const char* ip, char* result, int result_len);
 int net_connect(task_t* task, int socket, const struct sockaddr* address, uint32_t address_len);
+int net_setsockopt(task_t* task, struct sockopt_data* data, int struct_size);
+int net_getsockopt(task_t* task, struct sockopt_data* data, int struct_size);
+int net_socketpair(task_t* task, int domain, int type, int fds[2]);
+int net_sendmsg(task_t* task, int sockfd, struct msghdr* msg, int flags);
+int net_recvmsg(task_t* task, int sockfd, struct msghdr* msg, int flags);
+int net_sendmmsg(task_t* task, struct mmsg_data* data, int struct_size);
+int net_recvmmsg(task_t* task, struct mmsg_data* data, int struct_size);
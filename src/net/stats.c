@@ -0,0 +1,275 @@
+/* stats.c: Interface and protocol statistics
+ * Copyright © 2020 Lukas Martini
+ *
+ * This file is part of Xelix.
+ *
+ * Xelix is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Xelix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Xelix.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* PicoTCP keeps no protocol counters of its own, so the ones in /sys/net/snmp
+ * are taken from the headers of the frames passing between PicoTCP and the
+ * devices. This happens in knetworkd with net_pico_lock held, so no further
+ * locking is needed.
+ */
+
+#include "stats.h"
+#include <fs/sysfs.h>
+#include <printf.h>
+#include <string.h>
+
+#ifdef CONFIG_ENABLE_PICOTCP
+
+#define ETH_HDR_LEN 14
+#define ETH_P_IP 0x0800
+#define ETH_P_ARP 0x0806
+
+#define IPPROTO_ICMP 1
+#define IPPROTO_TCP 6
+#define IPPROTO_UDP 17
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_ACK 0x10
+
+/* Outgoing TCP connections tracked to spot retransmissions. Connections that
+ * hash to the same slot replace each other, which can only cause
+ * retransmissions to be missed, not ones to be counted that weren't.
+ */
+#define TCP_FLOWS 64
+
+struct tcp_flow {
+	uint32_t saddr;
+	uint32_t daddr;
+	uint16_t sport;
+	uint16_t dport;
+
+	// Sequence number following the highest one sent so far
+	uint32_t snd_max;
+};
+
+static struct tcp_flow flows[TCP_FLOWS];
+
+static struct {
+	uint32_t arp_in;
+	uint32_t arp_out;
+	uint32_t ip_in;
+	uint32_t ip_out;
+	uint32_t ip_frags_in;
+	uint32_t ip_frags_out;
+	uint32_t icmp_in;
+	uint32_t icmp_out;
+	uint32_t tcp_in;
+	uint32_t tcp_out;
+	uint32_t tcp_active_opens;
+	uint32_t tcp_passive_opens;
+	uint32_t tcp_retrans;
+	uint32_t tcp_rsts_in;
+	uint32_t tcp_rsts_out;
+	uint32_t udp_in;
+	uint32_t udp_out;
+	uint32_t udp_no_ports;
+} snmp;
+
+static inline uint16_t get16(uint8_t* p) {
+	return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t get32(uint8_t* p) {
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// Returns true if the outgoing segment resends sequence space sent before
+static bool tcp_retransmitted(uint8_t* ip, uint8_t* tcp, size_t payload, uint8_t flags) {
+	uint32_t seq = get32(tcp + 4);
+	uint32_t end = seq + payload + !!(flags & TCP_SYN) + !!(flags & TCP_FIN);
+	if(end == seq) {
+		return false;
+	}
+
+	struct tcp_flow key = {
+		.saddr = get32(ip + 12),
+		.daddr = get32(ip + 16),
+		.sport = get16(tcp),
+		.dport = get16(tcp + 2),
+	};
+
+	uint32_t hash = (key.saddr ^ key.daddr ^ key.sport ^ (key.dport << 16)) * 2654435761U;
+	struct tcp_flow* flow = &flows[hash >> 26];
+	bool known = flow->saddr == key.saddr && flow->daddr == key.daddr
+		&& flow->sport == key.sport && flow->dport == key.dport;
+
+	// A SYN starts a new connection unless it is the same one again
+	if(!known || ((flags & TCP_SYN) && flow->snd_max != end)) {
+		*flow = key;
+		flow->snd_max = seq;
+	}
+
+	bool retrans = (int32_t)(seq - flow->snd_max) < 0;
+	if((int32_t)(end - flow->snd_max) > 0) {
+		flow->snd_max = end;
+	}
+	return retrans;
+}
+
+static void count_tcp(uint8_t* ip, uint8_t* tcp, size_t len, bool out) {
+	if(len < 20 || (tcp[12] >> 4) * 4 > len) {
+		return;
+	}
+
+	uint8_t flags = tcp[13];
+	if(!out) {
+		snmp.tcp_in++;
+		snmp.tcp_rsts_in += !!(flags & TCP_RST);
+		return;
+	}
+
+	snmp.tcp_out++;
+	snmp.tcp_rsts_out += !!(flags & TCP_RST);
+	if(tcp_retransmitted(ip, tcp, len - (tcp[12] >> 4) * 4, flags)) {
+		snmp.tcp_retrans++;
+	} else if((flags & TCP_SYN) && (flags & TCP_ACK)) {
+		snmp.tcp_passive_opens++;
+	} else if(flags & TCP_SYN) {
+		snmp.tcp_active_opens++;
+	}
+}
+
+static void count_ip(uint8_t* ip, size_t len, bool out) {
+	size_t hdr_len = (ip[0] & 0xf) * 4;
+	if(len < 20 || (ip[0] >> 4) != 4 || hdr_len < 20 || hdr_len > len) {
+		return;
+	}
+
+	out ? snmp.ip_out++ : snmp.ip_in++;
+
+	// Only the first fragment carries the transport header
+	uint16_t frag = get16(ip + 6);
+	if(frag & 0x3fff) {
+		out ? snmp.ip_frags_out++ : snmp.ip_frags_in++;
+	}
+	if(frag & 0x1fff) {
+		return;
+	}
+
+	// Frames come from the network, so the total length can't be trusted
+	uint16_t total_len = get16(ip + 2);
+	if(total_len < hdr_len) {
+		return;
+	}
+
+	uint8_t* payload = ip + hdr_len;
+	size_t payload_len = MIN(total_len, len) - hdr_len;
+	switch(ip[9]) {
+		case IPPROTO_ICMP:
+			out ? snmp.icmp_out++ : snmp.icmp_in++;
+
+			// Port unreachable, which PicoTCP sends for UDP to closed ports
+			if(out && payload_len >= 2 && payload[0] == 3 && payload[1] == 3) {
+				snmp.udp_no_ports++;
+			}
+			break;
+		case IPPROTO_TCP:
+			count_tcp(ip, payload, payload_len, out);
+			break;
+		case IPPROTO_UDP:
+			out ? snmp.udp_out++ : snmp.udp_in++;
+			break;
+	}
+}
+
+/* Count a frame that was sent or received. Frames of devices without an
+ * Ethernet header, such as the loopback device, start with the IP header.
+ */
+void net_stats_frame(uint8_t* data, size_t len, bool eth, bool out) {
+	if(eth) {
+		if(len < ETH_HDR_LEN) {
+			return;
+		}
+
+		uint16_t type = get16(data + 12);
+		if(type == ETH_P_ARP) {
+			out ? snmp.arp_out++ : snmp.arp_in++;
+			return;
+		}
+		if(type != ETH_P_IP) {
+			return;
+		}
+
+		data += ETH_HDR_LEN;
+		len -= ETH_HDR_LEN;
+	}
+
+	count_ip(data, len, out);
+}
+
+static size_t sfs_stats_read(struct vfs_callback_ctx* ctx, void* dest, size_t size) {
+	struct net_stats* stats = (struct net_stats*)ctx->fp->meta;
+	if(ctx->fp->offset) {
+		return 0;
+	}
+
+	size_t rsize = 0;
+	sysfs_printf("# rx_packets rx_bytes rx_dropped rx_errors rx_alloc_failures "
+		"rx_ring_full tx_packets tx_bytes tx_busy tx_errors\n");
+	sysfs_printf("%u %llu %u %u %u %u %u %llu %u %u\n", stats->rx_packets,
+		stats->rx_bytes, stats->rx_dropped, stats->rx_errors,
+		stats->rx_alloc_failures, stats->rx_ring_full, stats->tx_packets,
+		stats->tx_bytes, stats->tx_busy, stats->tx_errors);
+	return rsize;
+}
+
+// Uses the layout of /proc/net/snmp on Linux, a line of names and one of values
+static size_t sfs_snmp_read(struct vfs_callback_ctx* ctx, void* dest, size_t size) {
+	if(ctx->fp->offset) {
+		return 0;
+	}
+
+	size_t rsize = 0;
+	sysfs_printf("Arp: InPackets OutPackets\n");
+	sysfs_printf("Arp: %u %u\n", snmp.arp_in, snmp.arp_out);
+	sysfs_printf("Ip: InReceives OutRequests InFragments OutFragments\n");
+	sysfs_printf("Ip: %u %u %u %u\n", snmp.ip_in, snmp.ip_out, snmp.ip_frags_in,
+		snmp.ip_frags_out);
+	sysfs_printf("Icmp: InMsgs OutMsgs\n");
+	sysfs_printf("Icmp: %u %u\n", snmp.icmp_in, snmp.icmp_out);
+	sysfs_printf("Tcp: ActiveOpens PassiveOpens InSegs OutSegs RetransSegs InRsts OutRsts\n");
+	sysfs_printf("Tcp: %u %u %u %u %u %u %u\n", snmp.tcp_active_opens,
+		snmp.tcp_passive_opens, snmp.tcp_in, snmp.tcp_out, snmp.tcp_retrans,
+		snmp.tcp_rsts_in, snmp.tcp_rsts_out);
+	sysfs_printf("Udp: InDatagrams OutDatagrams NoPorts\n");
+	sysfs_printf("Udp: %u %u %u\n", snmp.udp_in, snmp.udp_out, snmp.udp_no_ports);
+	return rsize;
+}
+
+// Adds /sys/net/<name>/stats
+void net_stats_add_file(char* name, struct net_stats* stats) {
+	struct vfs_callbacks sfs_cb = {
+		.read = sfs_stats_read,
+	};
+
+	char path[40];
+	snprintf(path, 40, "net/%s/stats", name);
+	struct sysfs_file* sfp = sysfs_add_file(path, &sfs_cb);
+	sfp->meta = (void*)stats;
+}
+
+void net_stats_init(void) {
+	struct vfs_callbacks sfs_cb = {
+		.read = sfs_snmp_read,
+	};
+	sysfs_add_file("net/snmp", &sfs_cb);
+}
+
+#endif /* ENABLE_PICOTCP */
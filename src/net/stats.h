@@ -0,0 +1,58 @@
+#pragma once
+
+/* Copyright © 2020 Lukas Martini
+ *
+ * This file is part of Xelix.
+ *
+ * Xelix is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Xelix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Xelix.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Per-interface counters, exported as /sys/net/<name>/stats. The transmit
+ * side is counted by net.c around the send callback of the driver, the
+ * receive side where frames are queued and handed to PicoTCP, drivers add
+ * the errors only they can see. Like on Linux, dropped frames only show up
+ * in the drop and error counters.
+ */
+struct net_stats {
+	// Frames PicoTCP accepted
+	uint32_t rx_packets;
+	uint64_t rx_bytes;
+
+	// Frames dropped because the receive queue was full or PicoTCP refused them
+	uint32_t rx_dropped;
+
+	// Frames the device flagged as broken or that did not fit a buffer
+	uint32_t rx_errors;
+
+	// Frames lost because no packet buffer or linear copy could be allocated
+	uint32_t rx_alloc_failures;
+
+	// Times the device ran out of receive buffers and may have dropped frames
+	uint32_t rx_ring_full;
+
+	uint32_t tx_packets;
+	uint64_t tx_bytes;
+
+	// Frames the device had no room for, PicoTCP retries them later
+	uint32_t tx_busy;
+	uint32_t tx_errors;
+};
+
+void net_stats_frame(uint8_t* data, size_t len, bool eth, bool out);
+void net_stats_add_file(char* name, struct net_stats* stats);
+void net_stats_init(void);
@@ -0,0 +1,1060 @@
+/* unix.c: AF_UNIX sockets
+ * Copyright © 2020 Lukas Martini
+ *
+ * This file is part of Xelix.
+ *
+ * Xelix is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Xelix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Xelix.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Unix domain sockets don't involve PicoTCP. Sent data is copied into
+ * messages that are queued on the receiving socket. Stream sockets append
+ * small writes to the last queued message, datagram sockets keep one message
+ * per datagram. Files passed using SCM_RIGHTS travel with the message they
+ * were sent with.
+ *
+ * Sockets are only used from syscalls and from the scheduler when a task
+ * exits, both of which run with interrupts disabled, so they don't need
+ * locks. The scheduler can't free memory, so released sockets are put on a
+ * list and freed during the next syscall.
+ */
+
+#include "unix.h"
+#include <tasks/task.h>
+#include <tasks/waitqueue.h>
+#include <fs/poll.h>
+#include <mem/kmalloc.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef CONFIG_ENABLE_PICOTCP
+
+#define RCVBUF_DEFAULT 0x10000
+#define SOCKBUF_MIN 0x800
+#define SOCKBUF_MAX 0x100000
+#define BACKLOG_MAX 128
+
+// Maximum number of files passed in one message
+#define FILES_MAX 16
+
+// Stream messages get at least this much room, so later writes can be appended
+#define MSG_MIN_SIZE 0x800
+
+struct unix_msg {
+	struct unix_msg* next;
+	size_t size;
+	size_t len;
+	size_t offset;
+
+	// Passed using SCM_RIGHTS
+	vfs_file_t* files;
+	int num_files;
+
+	// Bound path of the sender of a datagram, or NULL
+	char* from;
+	uint8_t data[];
+};
+
+struct unix_sock {
+	struct unix_sock* next;
+	int refs;
+	int type;
+
+	enum {
+		UNIX_OPEN,
+		UNIX_LISTEN,
+		UNIX_CONNECTED,
+	} state;
+
+	/* Connected stream sockets point to each other, datagram sockets to the
+	 * destination set using connect(). Reset to NULL when the peer goes away.
+	 */
+	struct unix_sock* peer;
+
+	// reachable is cleared if another socket gets bound to the same path
+	char path[UNIX_PATH_MAX];
+	bool bound;
+	bool reachable;
+
+	// Connections waiting for accept(), linked through backlog_next
+	struct unix_sock* backlog;
+	struct unix_sock* backlog_next;
+	int backlog_len;
+	int backlog_max;
+
+	struct unix_msg* rx_head;
+	struct unix_msg* rx_tail;
+	size_t rx_bytes;
+	size_t rcvbuf;
+	size_t sndbuf;
+
+	struct waitqueue read_wait;
+	struct waitqueue write_wait;
+};
+
+struct iov_cursor {
+	struct iovec* iov;
+	int iovlen;
+	int index;
+	size_t offset;
+};
+
+static struct unix_sock* sockets = NULL;
+static struct unix_sock* dead = NULL;
+
+// Senders waiting for space in a datagram queue or a backlog
+static struct waitqueue space_wait;
+
+static void iov_copy_from(struct iov_cursor* cur, uint8_t* dest, size_t len) {
+	while(len && cur->index < cur->iovlen) {
+		struct iovec* iov = &cur->iov[cur->index];
+		size_t n = MIN(len, iov->iov_len - cur->offset);
+		memcpy(dest, (uint8_t*)iov->iov_base + cur->offset, n);
+		dest += n;
+		len -= n;
+		cur->offset += n;
+		if(cur->offset == iov->iov_len) {
+			cur->index++;
+			cur->offset = 0;
+		}
+	}
+}
+
+static void iov_copy_to(struct iov_cursor* cur, uint8_t* src, size_t len) {
+	while(len && cur->index < cur->iovlen) {
+		struct iovec* iov = &cur->iov[cur->index];
+		size_t n = MIN(len, iov->iov_len - cur->offset);
+		memcpy((uint8_t*)iov->iov_base + cur->offset, src, n);
+		src += n;
+		len -= n;
+		cur->offset += n;
+		if(cur->offset == iov->iov_len) {
+			cur->index++;
+			cur->offset = 0;
+		}
+	}
+}
+
+static size_t iov_total(struct msghdr* msg) {
+	size_t total = 0;
+	for(int i = 0; i < msg->msg_iovlen; i++) {
+		total += msg->msg_iov[i].iov_len;
+	}
+	return total;
+}
+
+// Returns false with EAGAIN set for nonblocking sockets and MSG_DONTWAIT
+static bool wait(vfs_file_t* fp, int flags, struct waitqueue* wq) {
+	if(fp->flags & O_NONBLOCK || flags & MSG_DONTWAIT) {
+		sc_errno = EAGAIN;
+		return false;
+	}
+
+	waitqueue_wait(wq);
+	return true;
+}
+
+static void sock_put(struct unix_sock* sock);
+
+// Drops passed files that haven't been installed in a task
+static void release_files(vfs_file_t* files, int num) {
+	for(int i = 0; i < num; i++) {
+		if(unix_is_socket(&files[i])) {
+			sock_put((struct unix_sock*)files[i].mount_instance);
+		}
+	}
+	kfree(files);
+}
+
+static void msg_free(struct unix_msg* msg) {
+	if(msg->files) {
+		release_files(msg->files, msg->num_files);
+	}
+	if(msg->from) {
+		kfree(msg->from);
+	}
+	kfree(msg);
+}
+
+static struct unix_msg* msg_new(size_t size) {
+	struct unix_msg* msg = kmalloc(sizeof(struct unix_msg) + size);
+	if(!msg) {
+		sc_errno = ENOMEM;
+		return NULL;
+	}
+
+	bzero(msg, sizeof(struct unix_msg));
+	msg->size = size;
+	return msg;
+}
+
+static void msg_enqueue(struct unix_sock* sock, struct unix_msg* msg) {
+	if(sock->rx_tail) {
+		sock->rx_tail->next = msg;
+	} else {
+		sock->rx_head = msg;
+	}
+	sock->rx_tail = msg;
+	sock->rx_bytes += msg->len;
+	waitqueue_wake(&sock->read_wait);
+}
+
+// Free sockets released since the last call, see top of file
+static void reap(void) {
+	while(dead) {
+		struct unix_sock* sock = dead;
+		dead = sock->next;
+
+		// Can release passed sockets, which end up on the list again
+		while(sock->rx_head) {
+			struct unix_msg* msg = sock->rx_head;
+			sock->rx_head = msg->next;
+			msg_free(msg);
+		}
+		kfree(sock);
+	}
+}
+
+static struct unix_sock* sock_new(int type) {
+	struct unix_sock* sock = zmalloc(sizeof(struct unix_sock));
+	if(!sock) {
+		sc_errno = ENOMEM;
+		return NULL;
+	}
+
+	sock->refs = 1;
+	sock->type = type;
+	sock->state = UNIX_OPEN;
+	sock->rcvbuf = RCVBUF_DEFAULT;
+	sock->sndbuf = RCVBUF_DEFAULT;
+	waitqueue_init(&sock->read_wait);
+	waitqueue_init(&sock->write_wait);
+
+	sock->next = sockets;
+	sockets = sock;
+	return sock;
+}
+
+// Doesn't free memory, so this can be used from the scheduler
+static void sock_put(struct unix_sock* sock) {
+	if(--sock->refs) {
+		return;
+	}
+
+	for(struct unix_sock** s = &sockets; *s; s = &(*s)->next) {
+		if(*s == sock) {
+			*s = sock->next;
+			break;
+		}
+	}
+
+	for(struct unix_sock* s = sockets; s; s = s->next) {
+		if(s->peer == sock) {
+			s->peer = NULL;
+			waitqueue_wake(&s->read_wait);
+			waitqueue_wake(&s->write_wait);
+		}
+	}
+
+	// Connections that were never accepted
+	while(sock->backlog) {
+		struct unix_sock* conn = sock->backlog;
+		sock->backlog = conn->backlog_next;
+		sock_put(conn);
+	}
+
+	waitqueue_wake(&space_wait);
+	sock->next = dead;
+	dead = sock;
+}
+
+static size_t read_cb(struct vfs_callback_ctx* ctx, void* dest, size_t size) {
+	struct iovec iov = { .iov_base = dest, .iov_len = size };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	return unix_recvmsg(ctx->task, ctx->fp, &msg, 0);
+}
+
+static size_t write_cb(struct vfs_callback_ctx* ctx, void* source, size_t size) {
+	struct iovec iov = { .iov_base = source, .iov_len = size };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	return unix_sendmsg(ctx->task, ctx->fp, &msg, 0);
+}
+
+static int poll_cb(struct vfs_callback_ctx* ctx, int events) {
+	struct unix_sock* sock = (struct unix_sock*)ctx->fp->mount_instance;
+	int ret = 0;
+
+	// A stream socket whose peer has gone away reads EOF
+	if(events & POLLIN && (sock->rx_head || sock->backlog || (sock->type == SOCK_STREAM
+		&& sock->state == UNIX_CONNECTED && !sock->peer))) {
+		ret |= POLLIN;
+	}
+
+	struct unix_sock* peer = sock->peer;
+	if(events & POLLOUT && sock->state != UNIX_LISTEN
+		&& (!peer || peer->rx_bytes < peer->rcvbuf)) {
+		ret |= POLLOUT;
+	}
+	return ret;
+}
+
+static int stat_cb(struct vfs_callback_ctx* ctx, vfs_stat_t* dest) {
+	bzero(dest, sizeof(vfs_stat_t));
+	dest->st_mode = FT_IFSOCK | S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
+	dest->st_nlink = 1;
+	dest->st_blksize = MSG_MIN_SIZE;
+	uint32_t t = time_get();
+	dest->st_atime = t;
+	dest->st_mtime = t;
+	dest->st_ctime = t;
+	return 0;
+}
+
+static vfs_file_t* new_fd(task_t* task, struct unix_sock* sock) {
+	vfs_file_t* fp = vfs_alloc_fileno(task, 3);
+	if(!fp) {
+		sc_errno = EMFILE;
+		return NULL;
+	}
+
+	fp->type = FT_IFSOCK;
+	fp->flags = O_RDWR;
+	fp->meta = AF_UNIX;
+	fp->mount_instance = (void*)sock;
+	fp->callbacks.read = read_cb;
+	fp->callbacks.write = write_cb;
+	fp->callbacks.poll = poll_cb;
+	fp->callbacks.stat = stat_cb;
+	return fp;
+}
+
+static int get_path(const struct sockaddr* addr, socklen_t addrlen, char* dest) {
+	const struct sockaddr_un* sun = (const struct sockaddr_un*)addr;
+	if(!addr || addrlen <= sizeof(sa_family_t) || sun->sun_family != AF_UNIX) {
+		sc_errno = EINVAL;
+		return -1;
+	}
+
+	size_t max = MIN(addrlen - sizeof(sa_family_t), UNIX_PATH_MAX);
+	size_t len = strnlen(sun->sun_path, max);
+	if(!len || len == UNIX_PATH_MAX) {
+		sc_errno = EINVAL;
+		return -1;
+	}
+
+	memcpy(dest, sun->sun_path, len);
+	dest[len] = 0;
+	return 0;
+}
+
+// Writes the address for path, which is truncated to *addrlen
+static void put_name(const char* path, struct sockaddr* addr, socklen_t* addrlen) {
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	size_t len = sizeof(sa_family_t);
+	if(path) {
+		strlcpy(sun.sun_path, path, UNIX_PATH_MAX);
+		len += strlen(sun.sun_path) + 1;
+	}
+
+	memcpy(addr, &sun, MIN(*addrlen, len));
+	*addrlen = len;
+}
+
+/* Find the socket bound to the path in addr. Like the socket file, it can't
+ * be reached anymore once the file has been unlinked.
+ */
+static struct unix_sock* lookup(task_t* task, const struct sockaddr* addr,
+	socklen_t addrlen, int type) {
+
+	char path[UNIX_PATH_MAX];
+	if(get_path(addr, addrlen, path) < 0 || vfs_access(task, path, W_OK) < 0) {
+		return NULL;
+	}
+
+	char* npath = vfs_normalize_path(path, task->cwd);
+	struct unix_sock* sock = sockets;
+	for(; sock; sock = sock->next) {
+		if(sock->reachable && !strcmp(sock->path, npath)) {
+			break;
+		}
+	}
+	kfree(npath);
+
+	if(!sock) {
+		sc_errno = ECONNREFUSED;
+		return NULL;
+	}
+
+	if(sock->type != type) {
+		sc_errno = EPROTOTYPE;
+		return NULL;
+	}
+
+	sc_errno = 0;
+	return sock;
+}
+
+int unix_socket(task_t* task, int type) {
+	if(type != SOCK_STREAM && type != SOCK_DGRAM) {
+		sc_errno = EPROTONOSUPPORT;
+		return -1;
+	}
+
+	reap();
+	struct unix_sock* sock = sock_new(type);
+	if(!sock) {
+		return -1;
+	}
+
+	vfs_file_t* fp = new_fd(task, sock);
+	if(!fp) {
+		sock_put(sock);
+		return -1;
+	}
+	return fp->num;
+}
+
+int unix_socketpair(task_t* task, int type, int fds[2]) {
+	if(type != SOCK_STREAM && type != SOCK_DGRAM) {
+		sc_errno = EPROTONOSUPPORT;
+		return -1;
+	}
+
+	reap();
+	struct unix_sock* sock1 = sock_new(type);
+	struct unix_sock* sock2 = sock1 ? sock_new(type) : NULL;
+	if(!sock2) {
+		if(sock1) {
+			sock_put(sock1);
+			reap();
+		}
+		return -1;
+	}
+
+	sock1->peer = sock2;
+	sock2->peer = sock1;
+	sock1->state = UNIX_CONNECTED;
+	sock2->state = UNIX_CONNECTED;
+
+	vfs_file_t* fp1 = new_fd(task, sock1);
+	vfs_file_t* fp2 = fp1 ? new_fd(task, sock2) : NULL;
+	if(!fp2) {
+		if(fp1) {
+			vfs_close(task, fp1->num);
+		} else {
+			sock_put(sock1);
+		}
+		sock_put(sock2);
+		reap();
+		return -1;
+	}
+
+	fds[0] = fp1->num;
+	fds[1] = fp2->num;
+	return 0;
+}
+
+/* The socket shows up as a file at the path. As with other systems, binding
+ * fails if the path already exists, so servers need to unlink it first.
+ */
+int unix_bind(task_t* task, vfs_file_t* fp, const struct sockaddr* addr,
+	socklen_t addrlen) {
+
+	struct unix_sock* sock = (struct unix_sock*)fp->mount_instance;
+	if(sock->bound) {
+		sc_errno = EINVAL;
+		return -1;
+	}
+
+	char path[UNIX_PATH_MAX];
+	if(get_path(addr, addrlen, path) < 0) {
+		return -1;
+	}
+
+	if(!vfs_access(task, path, F_OK)) {
+		sc_errno = EADDRINUSE;
+		return -1;
+	}
+
+	int fd = vfs_open(task, path, O_CREAT | O_WRONLY);
+	if(fd < 0) {
+		return -1;
+	}
+	vfs_close(task, fd);
+
+	char* npath = vfs_normalize_path(path, task->cwd);
+	strlcpy(sock->path, npath, UNIX_PATH_MAX);
+	kfree(npath);
+
+	// The path may have been unlinked and reused while the old socket is open
+	for(struct unix_sock* s = sockets; s; s = s->next) {
+		if(s->reachable && !strcmp(s->path, sock->path)) {
+			s->reachable = false;
+		}
+	}
+
+	sock->bound = true;
+	sock->reachable = true;
+	sc_errno = 0;
+	return 0;
+}
+
+int unix_listen(vfs_file_t* fp, int backlog) {
+	struct unix_sock* sock = (struct unix_sock*)fp->mount_instance;
+	if(sock->type != SOCK_STREAM) {
+		sc_errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	if(!sock->bound || sock->state == UNIX_CONNECTED) {
+		sc_errno = EINVAL;
+		return -1;
+	}
+
+	sock->state = UNIX_LISTEN;
+	sock->backlog_max = MAX(1, MIN(backlog, BACKLOG_MAX));
+	return 0;
+}
+
+int unix_accept(task_t* task, vfs_file_t* fp, struct sockaddr* addr,
+	socklen_t* addrlen) {
+
+	struct unix_sock* sock = (struct unix_sock*)fp->mount_instance;
+	if(sock->state != UNIX_LISTEN) {
+		sc_errno = EINVAL;
+		return -1;
+	}
+
+	reap();
+	while(!sock->backlog) {
+		if(!wait(fp, 0, &sock->read_wait)) {
+			return -1;
+		}
+	}
+
+	struct unix_sock* conn = sock->backlog;
+	vfs_file_t* conn_fp = new_fd(task, conn);
+	if(!conn_fp) {
+		return -1;
+	}
+
+	sock->backlog = conn->backlog_next;
+	sock->backlog_len--;
+	conn->backlog_next = NULL;
+	waitqueue_wake(&space_wait);
+
+	if(addr && addrlen) {
+		struct unix_sock* peer = conn->peer;
+		put_name(peer && peer->bound ? peer->path : NULL, addr, addrlen);
+	}
+	return conn_fp->num;
+}
+
+int unix_connect(task_t* task, vfs_file_t* fp, const struct sockaddr* addr,
+	socklen_t addrlen) {
+
+	struct unix_sock* sock = (struct unix_sock*)fp->mount_instance;
+	if(sock->state == UNIX_LISTEN) {
+		sc_errno = EINVAL;
+		return -1;
+	}
+
+	if(sock->type == SOCK_STREAM && sock->state == UNIX_CONNECTED) {
+		sc_errno = EISCONN;
+		return -1;
+	}
+
+	struct unix_sock* target;
+	while(1) {
+		target = lookup(task, addr, addrlen, sock->type);
+		if(!target) {
+			return -1;
+		}
+
+		// Only sets the default destination
+		if(sock->type == SOCK_DGRAM) {
+			sock->peer = target;
+			sock->state = UNIX_CONNECTED;
+			return 0;
+		}
+
+		if(target->state != UNIX_LISTEN) {
+			sc_errno = ECONNREFUSED;
+			return -1;
+		}
+
+		if(target->backlog_len < target->backlog_max) {
+			break;
+		}
+
+		if(!wait(fp, 0, &space_wait)) {
+			return -1;
+		}
+	}
+
+	// The socket accept() will return
+	struct unix_sock* conn = sock_new(SOCK_STREAM);
+	if(!conn) {
+		return -1;
+	}
+
+	conn->state = UNIX_CONNECTED;
+	conn->rcvbuf = target->rcvbuf;
+	conn->sndbuf = target->sndbuf;
+	conn->bound = true;
+	strlcpy(conn->path, target->path, UNIX_PATH_MAX);
+
+	conn->peer = sock;
+	sock->peer = conn;
+	sock->state = UNIX_CONNECTED;
+
+	struct unix_sock** tail = &target->backlog;
+	while(*tail) {
+		tail = &(*tail)->backlog_next;
+	}
+	*tail = conn;
+	target->backlog_len++;
+	waitqueue_wake(&target->read_wait);
+	return 0;
+}
+
+int unix_getname(vfs_file_t* fp, bool peer, struct sockaddr* addr, socklen_t* addrlen) {
+	struct unix_sock* sock = (struct unix_sock*)fp->mount_instance;
+	if(peer) {
+		sock = sock->peer;
+		if(!sock) {
+			sc_errno = ENOTCONN;
+			return -1;
+		}
+	}
+
+	put_name(sock->bound ? sock->path : NULL, addr, addrlen);
+	return 0;
+}
+
+// Takes the files from SCM_RIGHTS control messages
+static int get_files(task_t* task, struct msghdr* msg, vfs_file_t** files, int* num_files) {
+	uint8_t* control = (uint8_t*)msg->msg_control;
+	size_t len = msg->msg_controllen;
+	int num = 0;
+
+	for(size_t off = 0; off + sizeof(struct cmsghdr) <= len;) {
+		struct cmsghdr* cmsg = (struct cmsghdr*)(control + off);
+		if(cmsg->cmsg_len < CMSG_LEN(0) || cmsg->cmsg_len > len - off
+			|| cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+			sc_errno = EINVAL;
+			return -1;
+		}
+
+		num += (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		off += CMSG_ALIGN(cmsg->cmsg_len);
+	}
+
+	if(!num) {
+		return 0;
+	}
+
+	if(num > FILES_MAX) {
+		sc_errno = ETOOMANYREFS;
+		return -1;
+	}
+
+	*files = kmalloc(sizeof(vfs_file_t) * num);
+	if(!*files) {
+		sc_errno = ENOMEM;
+		return -1;
+	}
+
+	int i = 0;
+	for(size_t off = 0; off + sizeof(struct cmsghdr) <= len;) {
+		struct cmsghdr* cmsg = (struct cmsghdr*)(control + off);
+		int* fds = (int*)CMSG_DATA(cmsg);
+		int cnum = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+		for(int j = 0; j < cnum; j++, i++) {
+			vfs_file_t* fp = vfs_get_from_id(fds[j], task);
+			if(!fp) {
+				release_files(*files, i);
+				sc_errno = EBADF;
+				return -1;
+			}
+
+			// Passed files are copies, the same as after a fork
+			memcpy(&(*files)[i], fp, sizeof(vfs_file_t));
+			(*files)[i].refs = 1;
+			(*files)[i].dup_target = 0;
+			if(unix_is_socket(fp)) {
+				((struct unix_sock*)fp->mount_instance)->refs++;
+			}
+		}
+		off += CMSG_ALIGN(cmsg->cmsg_len);
+	}
+
+	*num_files = num;
+	return 0;
+}
+
+// Install passed files in the task, as far as the control buffer has room
+static socklen_t put_files(task_t* task, struct msghdr* msg, socklen_t controllen,
+	vfs_file_t* files, int num_files) {
+
+	int room = 0;
+	if(msg->msg_control && controllen >= CMSG_LEN(sizeof(int))) {
+		room = (controllen - CMSG_LEN(0)) / sizeof(int);
+	}
+
+	struct cmsghdr* cmsg = (struct cmsghdr*)msg->msg_control;
+	int* fds = room ? (int*)CMSG_DATA(cmsg) : NULL;
+	int num = 0;
+
+	for(; num < MIN(room, num_files); num++) {
+		vfs_file_t* fp = vfs_alloc_fileno(task, 3);
+		if(!fp) {
+			break;
+		}
+
+		uint32_t fd = fp->num;
+		memcpy(fp, &files[num], sizeof(vfs_file_t));
+		fp->num = fd;
+		fds[num] = fd;
+
+		// Now owned by the task, so release_files skips it
+		files[num].type = 0;
+	}
+
+	if(num < num_files) {
+		msg->msg_flags |= MSG_CTRUNC;
+	}
+	release_files(files, num_files);
+
+	if(!num) {
+		return 0;
+	}
+
+	cmsg->cmsg_len = CMSG_LEN(num * sizeof(int));
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	return CMSG_SPACE(num * sizeof(int));
+}
+
+static size_t send_stream(vfs_file_t* fp, struct unix_sock* sock, struct msghdr* msg,
+	int flags, vfs_file_t* files, int num_files) {
+
+	struct iov_cursor cur = { .iov = msg->msg_iov, .iovlen = msg->msg_iovlen };
+	size_t total = iov_total(msg);
+	size_t done = 0;
+
+	if(files && !total) {
+		release_files(files, num_files);
+		sc_errno = EINVAL;
+		return -1;
+	}
+
+	while(done < total) {
+		struct unix_sock* peer = sock->peer;
+		if(!peer) {
+			sc_errno = sock->state == UNIX_CONNECTED ? EPIPE : ENOTCONN;
+			break;
+		}
+
+		size_t space = peer->rcvbuf > peer->rx_bytes ? peer->rcvbuf - peer->rx_bytes : 0;
+		if(!space) {
+			if(!wait(fp, flags, &sock->write_wait)) {
+				break;
+			}
+			continue;
+		}
+
+		size_t len = MIN(space, total - done);
+		struct unix_msg* tail = peer->rx_tail;
+
+		// Data that comes with files starts a new message
+		if(!files && tail && !tail->files && tail->len < tail->size) {
+			len = MIN(len, tail->size - tail->len);
+			iov_copy_from(&cur, tail->data + tail->len, len);
+			tail->len += len;
+			peer->rx_bytes += len;
+			waitqueue_wake(&peer->read_wait);
+		} else {
+			struct unix_msg* umsg = msg_new(MAX(len, MSG_MIN_SIZE));
+			if(!umsg) {
+				break;
+			}
+
+			iov_copy_from(&cur, umsg->data, len);
+			umsg->len = len;
+			umsg->files = files;
+			umsg->num_files = num_files;
+			files = NULL;
+			msg_enqueue(peer, umsg);
+		}
+		done += len;
+	}
+
+	if(files) {
+		release_files(files, num_files);
+	}
+	return done ? done : (total ? -1 : 0);
+}
+
+static size_t send_dgram(task_t* task, vfs_file_t* fp, struct unix_sock* sock,
+	struct msghdr* msg, int flags, vfs_file_t* files, int num_files) {
+
+	size_t total = iov_total(msg);
+	struct unix_sock* target;
+
+	while(1) {
+		if(msg->msg_name) {
+			target = lookup(task, msg->msg_name, msg->msg_namelen, SOCK_DGRAM);
+		} else {
+			target = sock->peer;
+			if(!target) {
+				sc_errno = sock->state == UNIX_CONNECTED ? ECONNREFUSED : EDESTADDRREQ;
+			}
+		}
+
+		if(!target) {
+			goto fail;
+		}
+
+		if(total > target->rcvbuf) {
+			sc_errno = EMSGSIZE;
+			goto fail;
+		}
+
+		if(target->rx_bytes + total <= target->rcvbuf) {
+			break;
+		}
+
+		if(!wait(fp, flags, &space_wait)) {
+			goto fail;
+		}
+	}
+
+	struct unix_msg* umsg = msg_new(total);
+	if(!umsg) {
+		goto fail;
+	}
+
+	struct iov_cursor cur = { .iov = msg->msg_iov, .iovlen = msg->msg_iovlen };
+	iov_copy_from(&cur, umsg->data, total);
+	umsg->len = total;
+	umsg->files = files;
+	umsg->num_files = num_files;
+	if(sock->bound) {
+		umsg->from = strdup(sock->path);
+	}
+
+	msg_enqueue(target, umsg);
+	return total;
+
+fail:
+	if(files) {
+		release_files(files, num_files);
+	}
+	return -1;
+}
+
+// msg and the buffers it points to need to be mapped into kernel memory
+size_t unix_sendmsg(task_t* task, vfs_file_t* fp, struct msghdr* msg, int flags) {
+	struct unix_sock* sock = (struct unix_sock*)fp->mount_instance;
+	if(sock->state == UNIX_LISTEN) {
+		sc_errno = ENOTCONN;
+		return -1;
+	}
+
+	reap();
+	vfs_file_t* files = NULL;
+	int num_files = 0;
+	if(msg->msg_control && get_files(task, msg, &files, &num_files) < 0) {
+		return -1;
+	}
+
+	if(sock->type == SOCK_DGRAM) {
+		return send_dgram(task, fp, sock, msg, flags, files, num_files);
+	}
+	return send_stream(fp, sock, msg, flags, files, num_files);
+}
+
+size_t unix_recvmsg(task_t* task, vfs_file_t* fp, struct msghdr* msg, int flags) {
+	struct unix_sock* sock = (struct unix_sock*)fp->mount_instance;
+	bool peek = flags & MSG_PEEK;
+	socklen_t controllen = msg->msg_controllen;
+	msg->msg_controllen = 0;
+	msg->msg_flags = 0;
+
+	while(!sock->rx_head) {
+		if(sock->type == SOCK_STREAM) {
+			if(sock->state != UNIX_CONNECTED) {
+				sc_errno = ENOTCONN;
+				return -1;
+			}
+
+			// Peer is gone, EOF
+			if(!sock->peer) {
+				msg->msg_namelen = 0;
+				return 0;
+			}
+		}
+
+		if(!wait(fp, flags, &sock->read_wait)) {
+			return -1;
+		}
+	}
+
+	reap();
+	struct iov_cursor cur = { .iov = msg->msg_iov, .iovlen = msg->msg_iovlen };
+	size_t want = iov_total(msg);
+	size_t done = 0;
+	vfs_file_t* files = NULL;
+	int num_files = 0;
+
+	if(sock->type == SOCK_DGRAM) {
+		struct unix_msg* umsg = sock->rx_head;
+		done = MIN(want, umsg->len);
+		iov_copy_to(&cur, umsg->data, done);
+		if(umsg->len > done) {
+			msg->msg_flags |= MSG_TRUNC;
+		}
+
+		if(msg->msg_name) {
+			put_name(umsg->from, msg->msg_name, &msg->msg_namelen);
+		}
+
+		if(!peek) {
+			files = umsg->files;
+			num_files = umsg->num_files;
+			umsg->files = NULL;
+
+			sock->rx_head = umsg->next;
+			if(!sock->rx_head) {
+				sock->rx_tail = NULL;
+			}
+			sock->rx_bytes -= umsg->len;
+			msg_free(umsg);
+			waitqueue_wake(&space_wait);
+		}
+	} else {
+		msg->msg_namelen = 0;
+		struct unix_msg* umsg = sock->rx_head;
+		while(umsg && done < want) {
+			// Files are received with the data they were sent with, and not earlier
+			if(umsg->files && done) {
+				break;
+			}
+
+			size_t len = MIN(umsg->len - umsg->offset, want - done);
+			iov_copy_to(&cur, umsg->data + umsg->offset, len);
+			done += len;
+
+			if(peek) {
+				umsg = umsg->next;
+				continue;
+			}
+
+			if(umsg->files) {
+				files = umsg->files;
+				num_files = umsg->num_files;
+				umsg->files = NULL;
+			}
+
+			umsg->offset += len;
+			sock->rx_bytes -= len;
+			if(umsg->offset < umsg->len) {
+				break;
+			}
+
+			sock->rx_head = umsg->next;
+			if(!sock->rx_head) {
+				sock->rx_tail = NULL;
+			}
+			msg_free(umsg);
+			umsg = sock->rx_head;
+		}
+
+		if(!peek && sock->peer) {
+			waitqueue_wake(&sock->peer->write_wait);
+		}
+	}
+
+	if(files) {
+		msg->msg_controllen = put_files(task, msg, controllen, files, num_files);
+	}
+	return done;
+}
+
+int unix_setsockopt(vfs_file_t* fp, struct sockopt_data* data) {
+	struct unix_sock* sock = (struct unix_sock*)fp->mount_instance;
+	if(data->level != SOL_SOCKET) {
+		sc_errno = ENOPROTOOPT;
+		return -1;
+	}
+
+	switch(data->optname) {
+		case SO_RCVBUF:
+		case SO_SNDBUF:
+			if(data->value < SOCKBUF_MIN || data->value > SOCKBUF_MAX) {
+				sc_errno = EINVAL;
+				return -1;
+			}
+
+			if(data->optname == SO_RCVBUF) {
+				sock->rcvbuf = data->value;
+			} else {
+				sock->sndbuf = data->value;
+			}
+			return 0;
+		default:
+			sc_errno = ENOPROTOOPT;
+			return -1;
+	}
+}
+
+int unix_getsockopt(vfs_file_t* fp, struct sockopt_data* data) {
+	struct unix_sock* sock = (struct unix_sock*)fp->mount_instance;
+	if(data->level != SOL_SOCKET) {
+		sc_errno = ENOPROTOOPT;
+		return -1;
+	}
+
+	switch(data->optname) {
+		case SO_RCVBUF:
+			data->value = sock->rcvbuf;
+			return 0;
+		case SO_SNDBUF:
+			data->value = sock->sndbuf;
+			return 0;
+		default:
+			sc_errno = ENOPROTOOPT;
+			return -1;
+	}
+}
+
+int unix_close(vfs_file_t* fp) {
+	sock_put((struct unix_sock*)fp->mount_instance);
+	reap();
+	return 0;
+}
+
+// The forked task gets its own copy of the file
+void unix_fork(vfs_file_t* fp) {
+	((struct unix_sock*)fp->mount_instance)->refs++;
+}
+
+// Called by the scheduler for the sockets of exiting tasks
+void unix_exit(vfs_file_t* fp) {
+	sock_put((struct unix_sock*)fp->mount_instance);
+}
+
+#endif /* ENABLE_PICOTCP */
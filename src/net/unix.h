@@ -0,0 +1,45 @@
+#pragma once
+
+/* Copyright © 2020 Lukas Martini
+ *
+ * This file is part of Xelix.
+ *
+ * Xelix is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Xelix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Xelix. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <net/socket.h>
+#include <fs/vfs.h>
+
+// Set as vfs_file->meta for AF_UNIX sockets
+static inline bool unix_is_socket(vfs_file_t* fp) {
+	return fp && fp->type == FT_IFSOCK && fp->meta == AF_UNIX;
+}
+
+int unix_socket(task_t* task, int type);
+int unix_socketpair(task_t* task, int type, int fds[2]);
+int unix_bind(task_t* task, vfs_file_t* fp, const struct sockaddr* addr,
+	socklen_t addrlen);
+int unix_listen(vfs_file_t* fp, int backlog);
+int unix_accept(task_t* task, vfs_file_t* fp, struct sockaddr* addr,
+	socklen_t* addrlen);
+int unix_connect(task_t* task, vfs_file_t* fp, const struct sockaddr* addr,
+	socklen_t addrlen);
+int unix_getname(vfs_file_t* fp, bool peer, struct sockaddr* addr, socklen_t* addrlen);
+size_t unix_sendmsg(task_t* task, vfs_file_t* fp, struct msghdr* msg, int flags);
+size_t unix_recvmsg(task_t* task, vfs_file_t* fp, struct msghdr* msg, int flags);
+int unix_setsockopt(vfs_file_t* fp, struct sockopt_data* data);
+int unix_getsockopt(vfs_file_t* fp, struct sockopt_data* data);
+int unix_close(vfs_file_t* fp);
+void unix_fork(vfs_file_t* fp);
+void unix_exit(vfs_file_t* fp);
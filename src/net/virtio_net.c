@@ -54,13 +54,43 @@
 #define	VIRTIO_NET_F_CTRL_VLAN	(1 << 19) /* Control channel VLAN filtering */
 #define	VIRTIO_NET_F_CTRL_RX_EXTRA (1 << 20) /* Extra RX mode control support */
 
-#define FEATURES_WANT VIRTIO_NET_F_MAC
+#define FEATURES_WANT (VIRTIO_NET_F_MAC | VIRTIO_NET_F_GUEST_CSUM \
+	| VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_MRG_RXBUF | VIRTIO_RING_F_EVENT_IDX)
+
+// Header flags
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM 1
+#define VIRTIO_NET_HDR_F_DATA_VALID 2
+
+// Number of receive buffers handed to the device
+#define RX_BUFFERS 64
+
+// Maximum Ethernet frame size without FCS
+#define FRAME_SIZE 1514
+
+// Upper limit for the number of transmit slots, the ring size is used otherwise
+#define TX_SLOTS_MAX 128
+#define TX_SLOT_SIZE 2048
 
 
 static struct virtio_dev* dev = NULL;
 // FIXME
 static struct net_device* net_dev = NULL;
 
+/* Transmit slots hold the virtio header followed by the frame. They are
+ * allocated once at init and go back to the free list when the device has
+ * used them. Only accessed with interrupts disabled.
+ */
+struct tx_slot {
+	struct tx_slot* next;
+	uint8_t* buf;
+};
+
+static struct tx_slot* tx_slots = NULL;
+static struct tx_slot* tx_free = NULL;
+
+// Set when send found no free slot, so PicoTCP has a frame waiting to retry
+static bool tx_waiting = false;
+
 static uint32_t vendor_device_combos[][2] = {
 	{0x1AF4, 0x1000}, {0x1AF4, 0x1041}, {(uint32_t)NULL}
 };
@@ -72,9 +102,21 @@ struct virtio_net_hdr {
 	uint16_t gso_size;
 	uint16_t csum_start;
 	uint16_t csum_offset;
-	//uint16_t num_buffers;
+	// Only present with VIRTIO_NET_F_MRG_RXBUF or VIRTIO_F_VERSION_1
+	uint16_t num_buffers;
 };
 
+static size_t hdr_size = sizeof(struct virtio_net_hdr);
+
+// State of the received frame that is currently being put together
+static struct netbuf* rx_head = NULL;
+static struct netbuf* rx_tail = NULL;
+static uint16_t rx_pending = 0;
+
+// Receive buffers currently handed to the device
+static uint16_t rx_posted = 0;
+static bool rx_drop = false;
+
 static char* feature_flags_verbose[] = {
 	"Host CSUM",
 	"Guest CSUM",
@@ -93,60 +135,210 @@ static char* feature_flags_verbose[] = {
 	"RX mode control"
 };
 
-static int send(struct pico_device* pdev, void* data, int len) {
-	if(!(dev->status & VIRTIO_PCI_STATUS_DRIVER_OK)) {
-		return -1;
+/* Hand a packet buffer to the device for receiving. The virtio header goes
+ * into the headroom right in front of the frame, so the frame ends up where
+ * PicoTCP expects it. With mergeable buffers, frames continue at the start of
+ * the next buffers without a header.
+ */
+static bool provide_rx(struct netbuf* nb) {
+	void* buf = nb->data - hdr_size;
+	size_t len = hdr_size + netbuf_tailroom(nb);
+	int flags = VIRTQ_DESC_F_WRITE;
+	if(virtio_write(dev, QUEUE_RX1, 1, &buf, &len, &flags, nb) < 0) {
+		return false;
 	}
 
-	struct virtio_net_hdr* hdr = zmalloc(sizeof(struct virtio_net_hdr));
-	void* buf = kmalloc(len);
-	memcpy(buf, data, len);
+	rx_posted++;
+	return true;
+}
 
-	void* buffers[] = {hdr, buf};
-	size_t lengths[] = {sizeof(struct virtio_net_hdr), len};
+// Put all slots the device is done with back on the free list
+static void reclaim_tx(void) {
+	struct virtqueue* queue = &dev->queues[QUEUE_TX1];
+	for(; (uint16_t)queue->used_index != queue->used->idx; queue->used_index++) {
+		struct virtq_used_elem* el = &queue->used->ring[queue->used_index % queue->size];
+		struct tx_slot* slot = queue->data[el->id];
+		virtio_free_chain(queue, el->id);
 
-	if(virtio_write(dev, QUEUE_TX1, 2, buffers, lengths, NULL) < 0) {
+		slot->next = tx_free;
+		tx_free = slot;
+	}
+}
+
+/* PicoTCP frees the frame once send returns, so it has to be copied. It goes
+ * into a transmit slot with the header in front, which takes a single
+ * descriptor. If all slots are in flight, returning 0 makes PicoTCP keep the
+ * frame and retry it later.
+ */
+static int send(struct pico_device* pdev, void* data, int len) {
+	if(!(dev->status & VIRTIO_PCI_STATUS_DRIVER_OK) || len > FRAME_SIZE) {
 		return -1;
 	}
 
+	uint32_t flags = int_save();
+	reclaim_tx();
+
+	struct tx_slot* slot = tx_free;
+	if(!slot) {
+		/* Get an interrupt once the device has used the next slot. If it
+		 * already has, just take that one.
+		 */
+		if(!virtio_enable_cb(dev, &dev->queues[QUEUE_TX1])) {
+			tx_waiting = true;
+			int_restore(flags);
+			return 0;
+		}
+
+		reclaim_tx();
+		slot = tx_free;
+	}
+
+	tx_free = slot->next;
+	int_restore(flags);
+
+	bzero(slot->buf, hdr_size);
+	memcpy(slot->buf + hdr_size, data, len);
+
+	void* buf = slot->buf;
+	size_t buf_len = hdr_size + len;
+	if(virtio_write(dev, QUEUE_TX1, 1, &buf, &buf_len, NULL, slot) < 0) {
+		flags = int_save();
+		slot->next = tx_free;
+		tx_free = slot;
+		int_restore(flags);
+		return 0;
+	}
 	return len;
 }
 
-static void used_cb(struct virtqueue* queue, struct virtq_desc* desc, uint32_t len) {
-	if(queue->id == QUEUE_RX1) {
-		if(net_dev) {
-			net_receive(net_dev,
-				(void*)(uint32_t)(desc->addr + sizeof(struct virtio_net_hdr)),
-				len - sizeof(struct virtio_net_hdr));
+static void receive(struct netbuf* nb, uint32_t len) {
+	struct virtio_net_hdr* hdr = (struct virtio_net_hdr*)(nb->data - hdr_size);
+	bool first = !rx_pending;
+	if(first) {
+		bool merge = dev->features & VIRTIO_NET_F_MRG_RXBUF;
+		rx_pending = merge && hdr->num_buffers ? hdr->num_buffers : 1;
+		rx_drop = len <= hdr_size;
+		if(rx_drop) {
+			net_dev->stats.rx_errors++;
+		}
+	}
+	rx_pending--;
+
+	/* Refill the ring first. If the pool has run dry, the frame gets dropped
+	 * and its buffer goes right back to the device.
+	 */
+	struct netbuf* new = netbuf_alloc();
+	if(!new) {
+		provide_rx(nb);
+		if(!rx_drop) {
+			net_dev->stats.rx_alloc_failures++;
+		}
+		rx_drop = true;
+	} else if(rx_drop) {
+		provide_rx(new);
+		netbuf_put(nb);
+	} else if(first) {
+		provide_rx(new);
+		nb->len = len - hdr_size;
+		if(hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+			nb->flags |= NETBUF_F_CSUM_PARTIAL;
+			nb->csum_start = hdr->csum_start;
+			nb->csum_offset = hdr->csum_offset;
 		}
+		rx_head = rx_tail = nb;
+	} else {
+		provide_rx(new);
+		nb->data -= hdr_size;
+		nb->len = len;
+		rx_tail->frag = nb;
+		rx_tail = nb;
 	}
+
+	if(rx_pending) {
+		return;
+	}
+
+	if(rx_head && !rx_drop) {
+		net_receive(net_dev, rx_head);
+	} else if(rx_head) {
+		netbuf_put(rx_head);
+	}
+	rx_head = rx_tail = NULL;
 }
 
 static void int_handler(task_t* task, isf_t* state, int num) {
-	inb(dev->pci_dev->iobase + 0x13);
+	if(!dev->msix) {
+		virtio_read_isr(dev);
+	}
+
+	/* Transmit completions only need to be reclaimed, see send. If a frame
+	 * is waiting for a slot, knetworkd needs to retry it right away rather
+	 * than on its next timer tick.
+	 */
+	struct virtqueue* tx_queue = &dev->queues[QUEUE_TX1];
+	if(!dev->msix || tx_queue->vector == num) {
+		virtio_disable_cb(dev, tx_queue);
+		reclaim_tx();
+		if(tx_waiting && tx_free) {
+			tx_waiting = false;
+			net_wake();
+		}
+	}
 
-	for(int i = 0; i < dev->num_queues; i++) {
-		struct virtqueue* queue = &dev->queues[i];
-		queue->available->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+	// Received frames are picked up by poll
+	struct virtqueue* queue = &dev->queues[QUEUE_RX1];
+	if(!dev->msix || queue->vector == num) {
+		virtio_disable_cb(dev, queue);
+		net_schedule_poll(net_dev);
+	}
+}
 
-		for(; queue->used_index < queue->used->idx; queue->used_index++) {
-			struct virtq_used_elem* el = &queue->used->ring[queue->used_index % queue->size];
-			struct virtq_desc* desc = &queue->descriptors[el->id];
+static int poll(struct net_device* ndev, int budget) {
+	struct virtqueue* queue = &dev->queues[QUEUE_RX1];
+	int done = 0;
 
-			used_cb(queue, desc, el->len);
+	/* If the device has used up every buffer, frames that arrived in the
+	 * meantime had nowhere to go.
+	 */
+	if((uint16_t)(queue->used->idx - queue->used_index) >= rx_posted) {
+		ndev->stats.rx_ring_full++;
+	}
 
-			if(desc->flags & VIRTQ_DESC_F_WRITE) {
-				// Device write, reinsert desc into available
-				virtio_write_avail(dev, queue, el->id);
-			} else {
-				// Driver write, clean up desc
-				kfree((void*)(uint32_t)desc->addr);
-				bzero(desc, sizeof(struct virtq_desc));
+	while(done < budget) {
+		if((uint16_t)queue->used_index == queue->used->idx) {
+			/* Buffers used after completing, but before the interrupt is back
+			 * on, don't raise one, so check again afterwards.
+			 */
+			net_poll_complete(ndev);
+			if(!virtio_enable_cb(dev, queue)) {
+				break;
 			}
+
+			virtio_disable_cb(dev, queue);
+			ndev->poll_scheduled = true;
+			continue;
 		}
 
-		queue->available->flags = 0;
+		struct virtq_used_elem* el = &queue->used->ring[queue->used_index % queue->size];
+		struct netbuf* nb = queue->data[el->id];
+		virtio_free_chain(queue, el->id);
+		queue->used_index++;
+		rx_posted--;
+
+		receive(nb, el->len);
+		done++;
 	}
+	return done;
+}
+
+/* TSO segments can be up to 64 KiB, which only fit the 2 KiB receive
+ * buffers if the host can spread them over multiple ones.
+ */
+static uint64_t features_cb(uint64_t features) {
+	if(!(features & VIRTIO_NET_F_MRG_RXBUF)) {
+		features &= ~VIRTIO_NET_F_GUEST_TSO4;
+	}
+	return features;
 }
 
 static int pci_cb(pci_device_t* pci_dev) {
@@ -156,12 +348,12 @@ static int pci_cb(pci_device_t* pci_dev) {
 
 	log(LOG_INFO, "virtio_net: Discovered device %p\n", pci_dev);
 
-	dev = virtio_init_dev(pci_dev, FEATURES_WANT, 2);
+	dev = virtio_init_dev(pci_dev, FEATURES_WANT, features_cb, 2);
 	if(!dev) {
 		return 1;
 	}
 
-	log(LOG_DEBUG, "virtio_net: Negotiated features (0x%x): ", dev->features);
+	log(LOG_DEBUG, "virtio_net: Negotiated features (0x%x): ", (uint32_t)dev->features);
 	for(int i = 0; i < 16; i++) {
 		if(bit_get(dev->features, i)) {
 			// FIXME should use log
@@ -170,21 +362,58 @@ static int pci_cb(pci_device_t* pci_dev) {
 	}
 	serial_printf("\n");
 
-	dev->queues[QUEUE_TX1].available->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
-	virtio_provide_descs(dev, QUEUE_RX1, 50, 1500);
-	int_register(IRQ(dev->pci_dev->interrupt_line), int_handler, false);
+	/* Transmit interrupts stay off unless the slots run out. With event
+	 * indices, the used event never moves forward unless send asks for it.
+	 */
+	struct virtqueue* tx_queue = &dev->queues[QUEUE_TX1];
+	virtio_disable_cb(dev, tx_queue);
+	if(dev->features & VIRTIO_RING_F_EVENT_IDX) {
+		*virtq_used_event(tx_queue) = tx_queue->used_index - 1;
+	}
+
+	if(dev->modern || (dev->features & VIRTIO_NET_F_MRG_RXBUF)) {
+		hdr_size = sizeof(struct virtio_net_hdr);
+	} else {
+		hdr_size = offsetof(struct virtio_net_hdr, num_buffers);
+	}
+
+	int num_slots = MIN(tx_queue->size, TX_SLOTS_MAX);
+	tx_slots = kmalloc(sizeof(struct tx_slot) * num_slots);
+	uint8_t* slot_bufs = kmalloc_a(TX_SLOT_SIZE * num_slots);
+	for(int i = 0; i < num_slots; i++) {
+		tx_slots[i].buf = slot_bufs + i * TX_SLOT_SIZE;
+		tx_slots[i].next = tx_free;
+		tx_free = &tx_slots[i];
+	}
+
+	for(int i = 0; i < RX_BUFFERS; i++) {
+		struct netbuf* nb = netbuf_alloc();
+		if(!nb) {
+			break;
+		}
+
+		if(!provide_rx(nb)) {
+			netbuf_put(nb);
+			break;
+		}
+	}
 
 	uint8_t mac[6] = {0x52, 0x54, 0x00, 0x12, 0x34, 0x56};
 	if(dev->features & VIRTIO_NET_F_MAC) {
 		for(int i = 0; i < 6; i++) {
-			mac[i] = inb(dev->pci_dev->iobase + 0x14 + i);
+			mac[i] = virtio_cfg_read8(dev, i);
 		}
 	}
 
+	// Needs to exist before the first interrupt can schedule a poll
+	net_dev = net_add_device("vionet", mac, send, poll);
+	if(!net_dev) {
+		return 1;
+	}
+	virtio_setup_irq(dev, int_handler);
+
 	dev->status |= VIRTIO_PCI_STATUS_DRIVER_OK;
 	virtio_write_status(dev);
-
-	net_dev = net_add_device("vionet", mac, send);
 	return 0;
 }
 
@@ -0,0 +1,60 @@
+/* completion.c: Wait for events signalled from interrupt handlers
+ * Copyright © 2020 Lukas Martini
+ *
+ * This file is part of Xelix.
+ *
+ * Xelix is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Xelix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Xelix. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <tasks/completion.h>
+#include <tasks/scheduler.h>
+#include <int/int.h>
+
+/* Blocks the current task until complete() is called. The task is taken off
+ * the run queue in the meantime, so it doesn't use any CPU time polling. When
+ * called outside of a task (during boot or from a worker), this falls back
+ * to yielding until the completion is done.
+ */
+void completion_wait(struct completion* c) {
+	task_t* task = scheduler_get_current();
+
+	while(!c->done) {
+		if(task) {
+			int_disable();
+			if(c->done) {
+				break;
+			}
+
+			c->waiter_state = task->task_state;
+			c->waiter = task;
+			task->task_state = TASK_STATE_BLOCKED;
+		}
+
+		// Reenables interrupts
+		scheduler_yield();
+	}
+
+	c->waiter = NULL;
+	int_enable();
+}
+
+// Can be called from interrupt handlers
+void complete(struct completion* c) {
+	c->done = true;
+
+	task_t* task = c->waiter;
+	if(task && task->task_state == TASK_STATE_BLOCKED) {
+		task->task_state = c->waiter_state;
+	}
+}
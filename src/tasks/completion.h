@@ -0,0 +1,42 @@
+#pragma once
+
+/* Copyright © 2020 Lukas Martini
+ *
+ * This file is part of Xelix.
+ *
+ * Xelix is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Xelix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Xelix. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <tasks/task.h>
+
+/* One-shot event a task can block on, usually signalled from an interrupt
+ * handler once a device has finished a request.
+ */
+struct completion {
+	volatile bool done;
+	task_t* volatile waiter;
+	int waiter_state;
+};
+
+static inline void completion_init(struct completion* c) {
+	c->done = false;
+	c->waiter = NULL;
+}
+
+static inline bool completion_done(struct completion* c) {
+	return c->done;
+}
+
+void completion_wait(struct completion* c);
+void complete(struct completion* c);
@@ -0,0 +1,57 @@
+/* mutex.c: Sleeping locks
+ * Copyright © 2020 Lukas Martini
+ *
+ * This file is part of Xelix.
+ *
+ * Xelix is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Xelix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Xelix.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <tasks/mutex.h>
+#include <int/int.h>
+#include <bsp/timer.h>
+
+/* Waits for as long as it takes, so unlike spinlock_get, this can't fail.
+ * The time spent waiting is added to the statistics of the mutex.
+ */
+void mutex_lock(struct mutex* mutex) {
+	uint32_t flags = int_save();
+	bool contended = mutex->locked;
+	uint64_t start = 0;
+
+	if(unlikely(contended)) {
+		start = timer_get_us();
+		while(mutex->locked) {
+			waitqueue_wait(&mutex->wait);
+		}
+	}
+
+	mutex->locked = true;
+	if(mutex->stats) {
+		mutex->stats->acquisitions++;
+		if(contended) {
+			uint64_t waited = timer_get_us() - start;
+			mutex->stats->contended++;
+			mutex->stats->wait_us += waited;
+			mutex->stats->max_wait_us = MAX(mutex->stats->max_wait_us, waited);
+		}
+	}
+	int_restore(flags);
+}
+
+void mutex_unlock(struct mutex* mutex) {
+	uint32_t flags = int_save();
+	mutex->locked = false;
+	waitqueue_wake(&mutex->wait);
+	int_restore(flags);
+}
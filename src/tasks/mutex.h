@@ -0,0 +1,48 @@
+#pragma once
+
+/* Copyright © 2020 Lukas Martini
+ *
+ * This file is part of Xelix.
+ *
+ * Xelix is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Xelix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Xelix. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <tasks/waitqueue.h>
+
+// Contention statistics, can be shared between multiple mutexes
+struct mutex_stats {
+	uint32_t acquisitions;
+	uint32_t contended;
+	uint64_t wait_us;
+	uint64_t max_wait_us;
+};
+
+/* Sleeping lock for state that is used by tasks and workers. Tasks that find
+ * it taken block until it is released, workers yield. Must not be used from
+ * interrupt handlers.
+ */
+struct mutex {
+	volatile bool locked;
+	struct waitqueue wait;
+	struct mutex_stats* stats;
+};
+
+static inline void mutex_init(struct mutex* mutex, struct mutex_stats* stats) {
+	mutex->locked = false;
+	mutex->stats = stats;
+	waitqueue_init(&mutex->wait);
+}
+
+void mutex_lock(struct mutex* mutex);
+void mutex_unlock(struct mutex* mutex);
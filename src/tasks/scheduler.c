@@ -24,11 +24,19 @@
 #include <mem/kmalloc.h>
 #include <mem/i386-gdt.h>
 #include <tasks/worker.h>
+#include <bsp/timer.h>
 
 static struct scheduler_qentry* current_entry = NULL;
 struct scheduler_qentry idle_qentry;
 enum scheduler_state scheduler_state;
 
+// Set by scheduler_wakeup, makes int_dispatch run the scheduler
+volatile bool scheduler_resched = false;
+
+// Time spent in the idle worker, in us
+static uint64_t idle_us = 0;
+static uint64_t idle_start = 0;
+
 task_t* scheduler_get_current(void) {
 	return current_entry ? current_entry->task : NULL;
 }
@@ -140,6 +148,13 @@ static inline struct scheduler_qentry* find_runnable_qentry(struct scheduler_qen
 				continue;
 			}
 
+			if(qe->worker->sleeping) {
+				if(timer_get_tick() < qe->worker->sleep_until) {
+					continue;
+				}
+				qe->worker->sleeping = false;
+			}
+
 			break;
 		} else if(qe->task) {
 			task_t* task = qe->task;
@@ -156,6 +171,7 @@ static inline struct scheduler_qentry* find_runnable_qentry(struct scheduler_qen
 
 			if(task->task_state == TASK_STATE_STOPPED ||
 				task->task_state == TASK_STATE_WAITING ||
+				task->task_state == TASK_STATE_BLOCKED ||
 				task->task_state == TASK_STATE_ZOMBIE) {
 				continue;
 			}
@@ -201,6 +217,8 @@ isf_t* scheduler_select(isf_t* last_regs) {
 		return NULL;
 	}
 
+	scheduler_resched = false;
+	bool was_idle = current_entry == &idle_qentry;
 	struct scheduler_qentry* qe = find_runnable_qentry(current_entry);
 	if(qe) {
 		current_entry = qe;
@@ -210,6 +228,15 @@ isf_t* scheduler_select(isf_t* last_regs) {
 		current_entry = &idle_qentry;
 	}
 
+	if(was_idle != (current_entry == &idle_qentry)) {
+		uint64_t now = timer_get_us();
+		if(was_idle) {
+			idle_us += now - idle_start;
+		} else {
+			idle_start = now;
+		}
+	}
+
 ret:
 	if(current_entry->task) {
 		current_entry->task->task_state = TASK_STATE_RUNNING;
@@ -237,7 +264,8 @@ static size_t sfs_read(struct vfs_callback_ctx* ctx, void* dest, size_t size) {
 	do {
 		task_t* task = entry->task;
 		if(!task) {
-			sysfs_printf("-1 0 0 0 R \"%s\" 0 /dev/null\n", entry->worker->name);
+			sysfs_printf("-1 0 0 0 %c \"%s\" 0 /dev/null\n",
+				entry->worker->sleeping ? 'W' : 'R', entry->worker->name);
 			goto next;
 		}
 
@@ -255,6 +283,7 @@ static size_t sfs_read(struct vfs_callback_ctx* ctx, void* dest, size_t size) {
 			case TASK_STATE_WAITING: state = 'W'; break;
 			case TASK_STATE_SYSCALL: state = 'C'; break;
 			case TASK_STATE_SLEEPING: state = 'W'; break;
+			case TASK_STATE_BLOCKED: state = 'B'; break;
 			default: state = 'U'; break;
 		}
 
@@ -281,6 +310,30 @@ static size_t sfs_read(struct vfs_callback_ctx* ctx, void* dest, size_t size) {
 	return rsize;
 }
 
+/* Called when a worker has been woken up, usually from an interrupt handler.
+ * If the CPU is idle, switch to it right away instead of on the next tick.
+ */
+void scheduler_wakeup(void) {
+	if(current_entry == &idle_qentry) {
+		scheduler_resched = true;
+	}
+}
+
+static size_t sfs_idle_read(struct vfs_callback_ctx* ctx, void* dest, size_t size) {
+	if(ctx->fp->offset) {
+		return 0;
+	}
+
+	uint32_t flags = int_save();
+	uint64_t idle = idle_us;
+	int_restore(flags);
+
+	size_t rsize = 0;
+	sysfs_printf("# uptime_us idle_us\n");
+	sysfs_printf("%llu %llu\n", timer_get_us(), idle);
+	return rsize;
+}
+
 static void __attribute__((fastcall, noreturn)) do_idle(worker_t* worker) {
 		int_enable();
 		while(true) {
@@ -298,4 +351,9 @@ void scheduler_init(void) {
 		.read = sfs_read,
 	};
 	sysfs_add_file("tasks", &sfs_cb);
+
+	struct vfs_callbacks sfs_idle_cb = {
+		.read = sfs_idle_read,
+	};
+	sysfs_add_file("idle", &sfs_idle_cb);
 }
@@ -36,6 +36,7 @@ struct scheduler_qentry {
 };
 
 extern enum scheduler_state scheduler_state;
+extern volatile bool scheduler_resched;
 
 void scheduler_add(task_t *task);
 void scheduler_add_worker(worker_t* worker);
@@ -43,5 +44,6 @@ task_t* scheduler_find(uint32_t pid);
 void scheduler_store_isf(isf_t* last_regs);
 task_t* scheduler_get_current(void);
 void scheduler_yield(void);
+void scheduler_wakeup(void);
 isf_t* scheduler_select(isf_t* lastRegs);
 void scheduler_init(void);
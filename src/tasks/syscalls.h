@@ -28,6 +28,7 @@
 #include <fs/pipe.h>
 #include <fs/poll.h>
 #include <fs/mount.h>
+#include <block/random.h>
 #include <time.h>
 
 /* Syscall definitions
@@ -326,4 +327,70 @@ const struct syscall_definition syscall_table[] = {
 	// 53
 	{"sleep", (syscall_cb)task_sleep, 0,
 		SCA_POINTER, 0, 0, sizeof(struct timeval)},
+
+	// 54
+	{"fallocate", (syscall_cb)vfs_fallocate, 0,
+		SCA_POINTER, 0, 0, sizeof(struct vfs_fallocate_ctx)},
+
+	// 55
+	{"getrandom", (syscall_cb)block_random_getrandom, 0,
+		SCA_POINTER | SCA_SIZE_IN_1, SCA_INT, SCA_INT, 0},
+
+#ifdef CONFIG_ENABLE_PICOTCP
+	// 56
+	{"setsockopt", (syscall_cb)net_setsockopt, 0,
+		SCA_POINTER | SCA_SIZE_IN_1, SCA_INT, 0, 0},
+
+	// 57
+	{"getsockopt", (syscall_cb)net_getsockopt, 0,
+		SCA_POINTER | SCA_SIZE_IN_1, SCA_INT, 0, 0},
+
+	// 58
+	{"socketpair", (syscall_cb)net_socketpair, 0,
+		SCA_INT, SCA_INT, SCA_POINTER, sizeof(int) * 2},
+
+	// 59
+	{"sendmsg", (syscall_cb)net_sendmsg, 0,
+		SCA_INT, SCA_POINTER, SCA_INT, sizeof(struct msghdr)},
+
+	// 60
+	{"recvmsg", (syscall_cb)net_recvmsg, 0,
+		SCA_INT, SCA_POINTER, SCA_INT, sizeof(struct msghdr)},
+
+	// 61
+	{"sendmmsg", (syscall_cb)net_sendmmsg, 0,
+		SCA_POINTER | SCA_SIZE_IN_1, SCA_INT, 0, 0},
+
+	// 62
+	{"recvmmsg", (syscall_cb)net_recvmmsg, 0,
+		SCA_POINTER | SCA_SIZE_IN_1, SCA_INT, 0, 0},
+#else
+	// 56
+	{"setsockopt", NULL, 0,
+		0, 0, 0, 0},
+
+	// 57
+	{"getsockopt", NULL, 0,
+		0, 0, 0, 0},
+
+	// 58
+	{"socketpair", NULL, 0,
+		0, 0, 0, 0},
+
+	// 59
+	{"sendmsg", NULL, 0,
+		0, 0, 0, 0},
+
+	// 60
+	{"recvmsg", NULL, 0,
+		0, 0, 0, 0},
+
+	// 61
+	{"sendmmsg", NULL, 0,
+		0, 0, 0, 0},
+
+	// 62
+	{"recvmmsg", NULL, 0,
+		0, 0, 0, 0},
+#endif
 };
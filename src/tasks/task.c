@@ -29,6 +29,7 @@
 #include <fs/vfs.h>
 #include <fs/sysfs.h>
 #include <fs/pipe.h>
+#include <net/socket.h>
 #include <string.h>
 #include <errno.h>
 #include <panic.h>
@@ -213,6 +214,17 @@ void task_userland_eol(task_t* t) {
 	if(t->strace_observer && t->strace_fd) {
 		vfs_close(t->strace_observer, t->strace_fd);
 	}
+
+#ifdef CONFIG_ENABLE_PICOTCP
+	// Lets peers of unix sockets see the connection close
+	for(int i = 0; i < CONFIG_VFS_MAX_OPENFILES; i++) {
+		vfs_file_t* fp = &t->files[i];
+		if(fp->refs && !fp->dup_target && fp->type == FT_IFSOCK) {
+			net_vfs_exit_cb(fp);
+			bzero(fp, sizeof(vfs_file_t));
+		}
+	}
+#endif
 }
 
 /* Called by scheduler whenever it encounters a task with TASK_STATE_REAPED or
@@ -244,6 +256,15 @@ static task_t* _fork(task_t* to_fork, isf_t* state) {
 	memcpy(task->binary_path, to_fork->binary_path, sizeof(task->binary_path));
 	memcpy(task->files, to_fork->files, sizeof(vfs_file_t) * CONFIG_VFS_MAX_OPENFILES);
 
+#ifdef CONFIG_ENABLE_PICOTCP
+	for(int i = 0; i < CONFIG_VFS_MAX_OPENFILES; i++) {
+		vfs_file_t* fp = &task->files[i];
+		if(fp->refs && !fp->dup_target && fp->type == FT_IFSOCK) {
+			net_vfs_fork_cb(fp);
+		}
+	}
+#endif
+
 	if(vm_clone(&task->vmem, &to_fork->vmem) != 0) {
 		return NULL;
 	}
@@ -88,7 +88,10 @@ typedef struct task {
 		TASK_STATE_SLEEPING,
 
 		// Task is currently in a syscall
-		TASK_STATE_SYSCALL
+		TASK_STATE_SYSCALL,
+
+		// Task waits for a completion, see tasks/completion.c
+		TASK_STATE_BLOCKED
 	} task_state;
 
 	// Exit code in a format compatible with the waitpid() stat_loc field
@@ -0,0 +1,72 @@
+/* waitqueue.c: Block tasks until a condition changes
+ * Copyright © 2020 Lukas Martini
+ *
+ * This file is part of Xelix.
+ *
+ * Xelix is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Xelix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Xelix.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <tasks/waitqueue.h>
+#include <tasks/scheduler.h>
+#include <int/int.h>
+
+/* Blocks the current task until waitqueue_wake is called. Needs to be called
+ * with interrupts disabled, right after checking the condition, so a wakeup
+ * can't happen in between. Returns with interrupts disabled again. Callers
+ * need to check their condition again afterwards, since all waiters are woken
+ * up at once. Outside of a task, this just yields.
+ */
+void waitqueue_wait(struct waitqueue* wq) {
+	task_t* task = scheduler_get_current();
+	if(!task) {
+		scheduler_yield();
+		int_disable();
+		return;
+	}
+
+	struct waitqueue_entry entry = {
+		.next = wq->head,
+		.task = task,
+		.state = task->task_state,
+	};
+
+	wq->head = &entry;
+	task->task_state = TASK_STATE_BLOCKED;
+
+	// Reenables interrupts
+	scheduler_yield();
+	int_disable();
+
+	// Still queued if the task got running again for other reasons
+	for(struct waitqueue_entry** e = (struct waitqueue_entry**)&wq->head; *e; e = &(*e)->next) {
+		if(*e == &entry) {
+			*e = entry.next;
+			break;
+		}
+	}
+}
+
+// Wake up all waiting tasks. Can be called from interrupt handlers
+void waitqueue_wake(struct waitqueue* wq) {
+	uint32_t flags = int_save();
+	struct waitqueue_entry* entry = wq->head;
+	wq->head = NULL;
+
+	for(; entry; entry = entry->next) {
+		if(entry->task->task_state == TASK_STATE_BLOCKED) {
+			entry->task->task_state = entry->state;
+		}
+	}
+	int_restore(flags);
+}
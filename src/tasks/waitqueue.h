@@ -0,0 +1,42 @@
+#pragma once
+
+/* Copyright © 2020 Lukas Martini
+ *
+ * This file is part of Xelix.
+ *
+ * Xelix is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Xelix is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Xelix. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <tasks/task.h>
+
+struct waitqueue_entry {
+	struct waitqueue_entry* next;
+	task_t* task;
+	int state;
+};
+
+/* Tasks waiting for a condition to change, such as data becoming available
+ * on a socket. Unlike a completion, this can be waited on repeatedly and by
+ * multiple tasks.
+ */
+struct waitqueue {
+	struct waitqueue_entry* volatile head;
+};
+
+static inline void waitqueue_init(struct waitqueue* wq) {
+	wq->head = NULL;
+}
+
+void waitqueue_wait(struct waitqueue* wq);
+void waitqueue_wake(struct waitqueue* wq);
@@ -22,11 +22,15 @@
 #include <mem/vm.h>
 #include <tasks/task.h>
 #include <mem/i386-gdt.h>
+#include <tasks/scheduler.h>
+#include <int/int.h>
 
 worker_t* worker_new(char* name, void* entry) {
 	worker_t* worker = kmalloc(sizeof(worker_t));
 	worker->entry = entry;
 	worker->stopped = false;
+	worker->sleeping = false;
+	worker->wake_pending = false;
 	strlcpy(worker->name, name, VFS_NAME_MAX);
 
 	worker->state = vm_alloc(VM_KERNEL, NULL, 1, NULL, VM_RW);
@@ -68,3 +72,36 @@ int worker_exit(worker_t* worker) {
 	scheduler_yield();
 	return -1;
 }
+
+/* Sleep until worker_wake is called or until_tick is reached, whichever comes
+ * first. Wakeups that happen while the worker is running aren't lost, the
+ * next call returns right away instead. Returns true if the worker was woken
+ * up by worker_wake.
+ */
+bool worker_sleep(worker_t* worker, uint32_t until_tick) {
+	int_disable();
+	if(!worker->wake_pending) {
+		worker->sleep_until = until_tick;
+		worker->sleeping = true;
+
+		// Reenables interrupts
+		scheduler_yield();
+		int_disable();
+	}
+
+	bool woken = worker->wake_pending;
+	worker->wake_pending = false;
+	int_enable();
+	return woken;
+}
+
+// Can be called from interrupt handlers
+void worker_wake(worker_t* worker) {
+	uint32_t flags = int_save();
+	worker->wake_pending = true;
+	if(worker->sleeping) {
+		worker->sleeping = false;
+		scheduler_wakeup();
+	}
+	int_restore(flags);
+}
@@ -25,6 +25,12 @@
 typedef struct worker {
 	char name[VFS_NAME_MAX];
 	bool stopped;
+
+	// See worker_sleep
+	volatile bool sleeping;
+	volatile bool wake_pending;
+	uint32_t sleep_until;
+
 	isf_t* state;
 	void* entry;
 	void* stack;
@@ -33,3 +39,5 @@ typedef struct worker {
 worker_t* worker_new(char* name, void* entry);
 int worker_stop(worker_t* worker);
 int worker_exit(worker_t* worker);
+bool worker_sleep(worker_t* worker, uint32_t until_tick);
+void worker_wake(worker_t* worker);